@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     // Core POSIX functions: getopt, unlink, close
+#include <sys/types.h>  // Basic system data types like pid_t
+#include <sys/wait.h>   // For waitpid() and associated macros
+#include <fcntl.h>      // For open() of /dev/null and the script file
+#include <errno.h>      // Defines errno and error constants
+#include <spawn.h>      // For posix_spawn() of the shell under test
+#include <time.h>       // For clock_gettime()
+
+// cashbench - shell overhead micro-benchmarks.
+// Every trial starts the shell under test once with a generated script of
+// COMMANDS commands and times it; the shell's own startup time (measured with
+// an empty script) is subtracted, so the numbers are per-command overhead.
+
+// --- Macros ---
+#define DEFAULT_TRIALS 30      // Trials per workload
+#define DEFAULT_COMMANDS 200   // Commands per trial for -c workloads
+#define SCRIPT_COMMANDS 20000  // Lines in the generated script for the script-mode workload
+#define MAX_SHELLS 8           // Shells compared in one run
+#define PIPELINE_STAGES 8      // Stages of the N-stage pipeline workload
+
+// --- Workload Structure ---
+// One benchmark: a command repeated 'commands' times per trial
+typedef struct {
+    const char *name;    // Workload name (JSON key)
+    const char *command; // One command line of the script
+    int commands;        // Commands per trial (0 = use the -n/-c default)
+    int script_file;     // 1 to run the script as a file argument instead of -c
+} workload_t;
+
+// --- Result Structure ---
+typedef struct {
+    double p50_us;           // Median per-command latency (microseconds)
+    double p99_us;           // 99th percentile per-command latency (microseconds)
+    double commands_per_sec; // Commands per second at the median
+} result_t;
+
+// --- Globals ---
+int trials = DEFAULT_TRIALS;       // Trials per workload (-n)
+int commands = DEFAULT_COMMANDS;   // Commands per -c trial (-c)
+extern char **environ;
+
+// Built-in dispatch uses 'cd .', which every POSIX shell implements in-process.
+// echo versus echo_ext shows what a native built-in saves over spawning the binary.
+workload_t workloads[] = {
+    { "startup",  "",                                     1, 0 },
+    { "spawn",    "/bin/true",                              0, 0 },
+    { "pipe2",    "/bin/true | /bin/true",                  0, 0 },
+    { "pipeN",    "/bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true", 0, 0 },
+    { "redirect", "/bin/true > /dev/null",                  0, 0 },
+    { "builtin",  "cd .",                                   0, 0 },
+    { "echo",     "echo hello",                             0, 0 },
+    { "echo_ext", "/bin/echo hello",                        0, 0 },
+    { "test",     "[ -d / ]",                               0, 0 },
+    { "printf",   "printf '%s %d\\n' x 42",                 0, 0 },
+    { "jobs",     "/bin/true &",                            0, 0 },
+    { "script",   "cd .",                     SCRIPT_COMMANDS, 1 },
+};
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+// --- Function Prototypes ---
+double now_seconds();
+char* build_script(const workload_t *workload, int count);
+double run_trial(const char *shell, const workload_t *workload, const char *script, const char *script_path);
+int compare_doubles(const void *a, const void *b);
+double percentile(const double *sorted, int n, double p);
+void usage(const char *prog);
+
+/**
+ * @brief Monotonic time in seconds.
+ */
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Build a script holding the workload's command 'count' times, one per line.
+ * @param workload The workload.
+ * @param count Number of lines.
+ * @return Allocated script text, or NULL on allocation failure.
+ */
+char* build_script(const workload_t *workload, int count) {
+    size_t line_len = strlen(workload->command) + 1;
+    char *script = malloc(line_len * count + 1);
+    if (!script) { perror("cashbench: malloc failed for script"); return NULL; }
+    char *p = script;
+    for (int i = 0; i < count; i++) {
+        memcpy(p, workload->command, line_len - 1);
+        p += line_len - 1;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return script;
+}
+
+/**
+ * @brief Run the shell once on the script and time it.
+ * The shell's stdout/stderr go to /dev/null so terminal speed is not measured.
+ * @param shell Path of the shell under test.
+ * @param workload The workload (decides -c versus script file).
+ * @param script Script text (for -c).
+ * @param script_path Script file (for script-file workloads).
+ * @return Wall time in seconds, or -1 on failure (reported).
+ */
+double run_trial(const char *shell, const workload_t *workload, const char *script, const char *script_path) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    char *argv_c[] = { (char *)shell, "-c", (char *)script, NULL };
+    char *argv_file[] = { (char *)shell, (char *)script_path, NULL };
+    char **argv = workload->script_file ? argv_file : argv_c;
+
+    double start = now_seconds();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) { fprintf(stderr, "cashbench: cannot run %s: %s\n", shell, strerror(err)); return -1; }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) { perror("cashbench: waitpid failed"); return -1; }
+    }
+    double elapsed = now_seconds() - start;
+    if (!WIFEXITED(status)) { fprintf(stderr, "cashbench: %s died on workload %s\n", shell, workload->name); return -1; }
+    return elapsed;
+}
+
+/**
+ * @brief qsort comparator for doubles.
+ */
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Nearest-rank percentile of a sorted sample.
+ * @param sorted Sorted values.
+ * @param n Number of values.
+ * @param p Percentile (0-100).
+ * @return The percentile value.
+ */
+double percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+/**
+ * @brief Print usage.
+ */
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n trials] [-c commands] [-j] [-w workload] [shell ...]\n", prog);
+    fprintf(stderr, "  Default shell: ./cash. Example: %s ./cash /bin/bash /bin/dash\n", prog);
+    fprintf(stderr, "  Workloads:");
+    for (int i = 0; i < WORKLOAD_COUNT; i++) fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+// --- Main Function ---
+int main(int argc, char **argv) {
+    int json = 0;
+    const char *only = NULL; // Run a single workload (-w)
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:jw:h")) != -1) {
+        switch (opt) {
+            case 'n': trials = atoi(optarg); break;
+            case 'c': commands = atoi(optarg); break;
+            case 'j': json = 1; break;
+            case 'w': only = optarg; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (trials <= 0 || commands <= 0) { usage(argv[0]); return 2; }
+
+    const char *shells[MAX_SHELLS];
+    int shell_count = 0;
+    for (int i = optind; i < argc && shell_count < MAX_SHELLS; i++) shells[shell_count++] = argv[i];
+    if (shell_count == 0) shells[shell_count++] = "./cash";
+
+    // The script-mode workload reads a large file from disk
+    char script_path[] = "/tmp/cashbench.XXXXXX";
+    int script_fd = mkstemp(script_path);
+    if (script_fd < 0) { perror("cashbench: mkstemp failed"); return 1; }
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        if (!workloads[w].script_file) continue;
+        char *text = build_script(&workloads[w], workloads[w].commands);
+        if (!text || write(script_fd, text, strlen(text)) < 0) { perror("cashbench: writing script failed"); unlink(script_path); return 1; }
+        free(text);
+    }
+    close(script_fd);
+
+    double *samples = malloc(trials * sizeof(double));
+    if (!samples) { perror("cashbench: malloc failed"); unlink(script_path); return 1; }
+
+    if (json) printf("{\"trials\": %d, \"shells\": [", trials);
+    for (int s = 0; s < shell_count; s++) {
+        double startup = 0; // Median startup time, subtracted from every trial
+        if (json) printf("%s\n  {\"shell\": \"%s\", \"results\": {", s ? "," : "", shells[s]);
+        else printf("%s\n%-10s %10s %12s %12s %14s\n", shells[s], "workload", "commands", "p50 (us)", "p99 (us)", "commands/s");
+
+        int printed = 0;
+        for (int w = 0; w < WORKLOAD_COUNT; w++) {
+            const workload_t *workload = &workloads[w];
+            int is_startup = (w == 0);
+            if (only && !is_startup && strcmp(only, workload->name) != 0) continue;
+            int count = workload->commands ? workload->commands : commands;
+            char *script = build_script(workload, is_startup ? 0 : count);
+            if (!script) break;
+
+            int ok = 1;
+            for (int t = 0; t < trials; t++) {
+                double elapsed = run_trial(shells[s], workload, script, script_path);
+                if (elapsed < 0) { ok = 0; break; }
+                double net = is_startup ? elapsed : elapsed - startup;
+                samples[t] = (net > 0 ? net : 0) / count;
+            }
+            free(script);
+            if (!ok) continue;
+
+            qsort(samples, trials, sizeof(double), compare_doubles);
+            result_t result;
+            result.p50_us = percentile(samples, trials, 50) * 1e6;
+            result.p99_us = percentile(samples, trials, 99) * 1e6;
+            result.commands_per_sec = result.p50_us > 0 ? 1e6 / result.p50_us : 0;
+            if (is_startup) startup = result.p50_us / 1e6;
+
+            if (json) {
+                printf("%s\n    \"%s\": {\"commands\": %d, \"p50_us\": %.2f, \"p99_us\": %.2f, \"commands_per_sec\": %.1f}",
+                       printed++ ? "," : "", workload->name, is_startup ? 1 : count,
+                       result.p50_us, result.p99_us, result.commands_per_sec);
+            } else {
+                printf("%-10s %10d %12.2f %12.2f %14.1f\n", workload->name, is_startup ? 1 : count,
+                       result.p50_us, result.p99_us, result.commands_per_sec);
+            }
+            fflush(stdout);
+        }
+        if (json) printf("\n  }}");
+    }
+    if (json) printf("\n]}\n");
+
+    free(samples);
+    unlink(script_path);
+    return 0;
+}
@@ -1,307 +1,1857 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // For memfd_create() in glibc
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>      // For isxdigit()/tolower() in escape decoding
 #include <unistd.h>     // Core POSIX functions: fork, exec, pipe, chdir, access, ids, tty control
 #include <sys/types.h>  // Basic system data types like pid_t
 #include <sys/wait.h>   // For waitpid() and associated macros
+#include <sys/time.h>   // For timeradd()/timersub() on rusage times
+#include <sys/resource.h> // For wait4() rusage and getrusage()
+#include <time.h>       // For clock_gettime() wall-clock job timing
 #include <fcntl.h>      // For file control options used in open()
 #include <signal.h>     // For signal handling (signal(), kill())
 #include <errno.h>      // Defines errno and error constants
 #include <termios.h>    // For terminal I/O control (tcsetpgrp)
 #include <limits.h>     // Defines PATH_MAX
+#include <spawn.h>      // For posix_spawn() and spawn attributes/file actions
+#include <sys/stat.h>   // For stat() when searching $PATH
+#include <sys/file.h>   // For flock() on the history lock file
+#include <poll.h>       // For poll() in the interactive event loop
+#include <dirent.h>     // For DT_* entry types (and readdir() where getdents64 is missing)
+#include <pwd.h>        // For getpwuid(): the user name in the prompt when $USER is unset
+#ifdef __linux__
+#include <sys/signalfd.h> // For signalfd(): SIGCHLD delivered as a readable fd
+#include <sys/syscall.h>  // For SYS_getdents64 (directory listings for pathname expansion)
+#endif
+#include <sys/mman.h>   // For mmap() of the history file and memfd_create() (Linux)
 
 // --- Readline Headers ---
 #include <readline/readline.h> // For reading input with editing/history
 #include <readline/history.h>  // For history management functions
 
 // --- Macros ---
-#define MAX_INPUT 1024 // Max length of user input string
-#define MAX_ARGS 100   // Max number of arguments per command
-#define MAX_JOBS 32    // Max number of background jobs tracked
+#define JOB_TABLE_INITIAL 16 // Initial job slots/index buckets (the table grows by doubling)
 #define READ_END 0     // Index for the read end of a pipe fd array
 #define WRITE_END 1    // Index for the write end of a pipe fd array
+#define COMMAND_HASH_BUCKETS 64 // Buckets in the PATH lookup cache (`hash` built-in)
+#define SCRIPT_READ_CHUNK 65536 // Bytes read per read() call in script mode
+#define ARENA_CHUNK_SIZE 16384  // Default size of a per-line arena chunk
+#define INITIAL_ARGV_CAPACITY 8 // Argument slots a stage starts with (grows by doubling)
+#define OUTPUT_BUFFER_SIZE 4096 // Buffer of the built-in output writer (flushed with write())
+#define PIPE_READ_CHUNK 65536   // Bytes read per read() of a command's output pipe ($(...), parallel, cache)
+#define CGROUP_CPU_PERIOD_US 100000 // cpu.max period of a 'limit -c' cgroup
+#define EXPAND_MARK '\001'      // Lexer's stand-in for an unquoted '$' (result is field-split)
+#define EXPAND_MARK_QUOTED '\002' // Same, for a '$' inside double quotes or an assignment (not split)
+#define VAR_HASH_INITIAL 64     // Initial buckets of the shell variable table (grows by doubling)
+#define GLOB_MARK '\003'        // Lexer's prefix for an unquoted *, ? or [ (a pattern character)
+#define GLOB_DIRENT_BUFFER 32768 // Bytes of directory entries read per getdents64() call
+#define PARSE_INCOMPLETE -1     // Lexer/parser result: the input ends inside a construct (read more lines)
+#define FUNCTION_HASH_BUCKETS 64 // Buckets of the shell function table
+#define FUNCTION_DEPTH_MAX 1000 // Nested function calls allowed (deeper recursion is an error)
+#define CACHE_BUCKETS 256       // Buckets of the command result cache
+#define CACHE_ENTRIES_MAX 256   // Results kept in memory (least recently used go first)
+#define CACHE_BYTES_MAX (4 * 1024 * 1024) // Bytes of keys and outputs kept in memory; larger outputs are not cached
+#define CACHE_FILE_MAGIC "CASHMEMO" // First bytes of an on-disk cache entry
+#define TRACE_RING_SIZE 1024    // Trace events kept in memory (flushed to CASH_TRACE when full)
+#define TRACE_HIST_BUCKETS 40   // log2 nanosecond buckets per phase histogram (up to ~9 minutes)
+#define TRACE_NAME_MAX 32       // Bytes of the command name kept with a trace event
+#define TRACE_WRITE_CHUNK 65536 // Bytes of JSON built up per write() to the CASH_TRACE file
 
 // --- History File ---
 #define HISTORY_FILE ".cash_history" // History file name in user's home directory
+#define HISTORY_LOCK_SUFFIX ".lock"  // Lock file next to it, shared by all sessions
+#define HISTORY_LIMIT 100000         // Entries kept in memory and after compaction
+#define HISTORY_COMPACT_BYTES (16 * 1024 * 1024) // Compact once the file grows past this size
+#define TRIGRAM_BUCKETS 65536        // Posting lists of the history search index (power of 2)
+#define SEARCH_QUERY_MAX 256         // Longest Ctrl-R search string
+#define RC_FILE ".cashrc"             // Startup commands in the user's home directory
+#define STARTUP_PHASES_MAX 8          // Phases recorded by --startup-profile
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec) // Modification time with nanoseconds
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#endif
 
 // --- Job State Definitions ---
 typedef enum {
     JOB_STATE_INVALID, // Indicates the job slot is empty
     JOB_STATE_RUNNING, // Job is currently running
     JOB_STATE_STOPPED, // Job is stopped (e.g., by SIGTSTP)
+    JOB_STATE_DONE,    // Job terminated, "Done" notice not printed yet
 } job_state_t;
 
+// --- Process Structure ---
+// One process of a job (a pipeline stage)
+typedef struct {
+    pid_t pid;            // Process ID
+    char *name;           // Program name (allocated), for per-stage reports
+    int status;           // Raw wait status, valid once done is set
+    int done;             // 1 once the process has terminated and been reaped
+    int helper;           // 1 for a <(...) / >(...) feeding the job, not a stage of it
+    struct rusage usage;  // Resource usage from wait4(), valid once done is set
+} process_t;
+
+// --- Job Resource Usage ---
+// What a job cost, summed over its reaped processes
+typedef struct {
+    struct timespec started;  // When the job was created (CLOCK_MONOTONIC)
+    struct timespec finished; // When its last process was reaped
+    struct timeval utime;     // Summed user CPU time
+    struct timeval stime;     // Summed system CPU time
+    long maxrss_kb;           // Largest resident set of any process, in KB
+    long nvcsw;               // Summed voluntary context switches
+    long nivcsw;              // Summed involuntary context switches
+    int cgroup;               // 1 if the totals below were read from the job's cgroup
+    struct timeval cgroup_user;   // cpu.stat user_usec: every process in the cgroup
+    struct timeval cgroup_system; // cpu.stat system_usec
+    long long cgroup_peak_kb;     // memory.peak of the cgroup in KB, -1 if not available
+} job_usage_t;
+
 // --- Job Structure ---
-// Holds information about a background job
+// Holds information about a job (background, stopped, or the current foreground job)
 typedef struct {
-    int jid;           // Job ID (unique within the shell session)
+    int jid;           // Job ID (unique within the shell session), 0 for a foreground job
     pid_t pgid;        // Process Group ID of the job
-    job_state_t state; // Current state (Running, Stopped)
+    job_state_t state; // Current state (Running, Stopped, Done)
     char *command;     // The command string that started the job (allocated)
     int notified;      // Tracks if status change (Done/Stopped) was reported
+    int foreground;    // 1 while the shell waits on this job in the foreground
+    int timed;         // 1 if started with the 'time' prefix (report when done)
+    int queued;        // 1 while its jid is in the notice queue
+    char *cgroup;      // cgroup of a 'limit' job (allocated), removed once it finishes; NULL if none
+    job_usage_t usage; // Wall time and rusage totals
+    process_t *procs;  // Processes of the job, in pipeline order (allocated)
+    int nprocs;        // Number of processes started
+    int proc_capacity; // Allocated entries in procs
+    int nlive;         // Processes not yet reaped
+    int next_free;     // Next slot in the free list (free slots only)
+    int next_by_jid;   // Next slot in the same jid index bucket
+    int next_by_pgid;  // Next slot in the same pgid index bucket
 } job_t;
 
+// Entry of the pid -> job slot index (open addressing, pid 0 = empty)
+typedef struct {
+    pid_t pid; // Process ID (0 if the entry is empty)
+    int slot;  // Job table slot owning the process
+} pid_index_entry_t;
+
+// --- Job Table ---
+// Growable slot array with a free list, plus hash indexes by jid, pgid and pid,
+// so adding, looking up and removing a job, and mapping a reaped child back to
+// its job, are all O(1).
+typedef struct {
+    job_t *slots;      // Job slots (allocated, grows by doubling)
+    int capacity;      // Allocated slots
+    int used;          // Slots ever handed out (scans stop here)
+    int free_head;     // First free slot below 'used', or -1
+    int count;         // Jobs currently in the table
+    int *jid_index;    // Bucket heads (slot index or -1), keyed by jid
+    int *pgid_index;   // Bucket heads (slot index or -1), keyed by pgid
+    int bucket_count;  // Buckets in each index (power of two)
+    pid_index_entry_t *pid_index; // Live child pid -> slot (linear probing)
+    int pid_capacity;  // Entries in pid_index (power of two)
+    int pid_count;     // Used entries in pid_index
+    int *notices;      // Jids of jobs that finished or stopped since the last report, in order (allocated)
+    int notice_count;  // Entries in notices
+    int notice_capacity; // Allocated entries
+} job_table_t;
+
+// --- Arena Allocator ---
+// Bump allocator for everything derived from one command line (tokens, words,
+// parsed stages). Nothing is freed individually; the arena is reset after each line.
+typedef struct arena_chunk {
+    struct arena_chunk *next; // Next chunk in allocation order
+    size_t size;              // Usable bytes in data[]
+    size_t used;              // Bytes handed out so far
+    char data[];              // Chunk storage
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *first;   // First chunk (kept across resets)
+    arena_chunk_t *current; // Chunk allocations are served from
+} arena_t;
+
+// Allocation point of an arena, to release everything allocated after it
+typedef struct {
+    arena_chunk_t *chunk; // Chunk that was current (NULL if the arena was empty)
+    size_t used;          // Bytes it had handed out
+} arena_mark_t;
+
+// --- Token Definitions ---
+typedef enum {
+    TOKEN_WORD,   // A word, with quotes and escapes already removed
+    TOKEN_PIPE,   // |
+    TOKEN_LESS,   // <
+    TOKEN_GREAT,  // >
+    TOKEN_DGREAT, // >>
+    TOKEN_TLESS,  // <<< (here-string)
+    TOKEN_LESSAND,   // <&
+    TOKEN_GREATAND,  // >&
+    TOKEN_ANDGREAT,  // &>
+    TOKEN_ANDDGREAT, // &>>
+    TOKEN_AMP,    // &
+    TOKEN_SEMI,   // ;
+    TOKEN_AND_IF, // &&
+    TOKEN_OR_IF,  // ||
+    TOKEN_NEWLINE, // End of a line inside a multi-line command (acts like ';')
+    TOKEN_LPAREN, // (
+    TOKEN_RPAREN, // )
+} token_type_t;
+
+// One lexed token. Offsets point back into the source line (used for job titles).
+typedef struct {
+    token_type_t type; // Kind of token
+    char *text;        // Word text in the arena (TOKEN_WORD only, NULL otherwise)
+    int io_number;     // Descriptor written before a redirection operator (the 2 in 2>), or -1
+    int expand;        // 1 if the word text holds an EXPAND_MARK (expanded when the command runs)
+    int assign;        // 1 if the word looks like NAME=value (unquoted NAME)
+    int quoted;        // 1 if any part of the word was quoted or escapes (so it is never a keyword)
+    int start;         // Offset of the first source character
+    int end;           // Offset just past the last source character
+} token_t;
+
+// Growable token array living in the line arena
+typedef struct {
+    token_t *items; // Tokens in source order
+    int count;      // Number of tokens
+    int capacity;   // Allocated number of tokens
+} token_list_t;
+
+// Receives each chunk a command writes to its output pipe (run_piped_job)
+typedef void (*pipe_chunk_fn)(void *ctx, const char *data, size_t len);
+
+// --- Built-in Command Registry ---
+// Handler of a built-in: gets the command's argv, returns its exit status
+typedef int (*builtin_fn_t)(char **args);
+
+// One registry entry (the table is sorted by name for bsearch)
+typedef struct {
+    const char *name; // Command name
+    builtin_fn_t fn;  // Handler
+} builtin_t;
+
+// --- Redirections ---
+typedef enum {
+    REDIR_INPUT,       // [n]< file
+    REDIR_OUTPUT,      // [n]> file
+    REDIR_APPEND,      // [n]>> file
+    REDIR_BOTH,        // &> file (stdout and stderr)
+    REDIR_BOTH_APPEND, // &>> file
+    REDIR_DUP,         // [n]>&m, [n]<&m
+    REDIR_CLOSE,       // [n]>&-, [n]<&-
+    REDIR_HERESTRING,  // [n]<<< word
+} redir_type_t;
+
+// One parsed redirection, applied in source order
+typedef struct {
+    redir_type_t type; // Kind of redirection
+    int fd;            // Descriptor it changes in the command (0-9)
+    int source_fd;     // REDIR_DUP: descriptor copied onto fd
+    char *target;      // File name or here-string text (in the line arena)
+} redirect_t;
+
+// One step of applying redirections: dup2(source, fd), or close(fd) if source is -1
+typedef struct {
+    int fd;     // Descriptor in the new process
+    int source; // Descriptor to duplicate onto it, or -1 to close it
+} fd_op_t;
+
+// Redirections turned into descriptor operations. Files and here-strings are opened
+// by the shell (close-on-exec, at fd >= 10), so the same plan drives posix_spawn
+// file actions, dup2 in a forked child, or save/restore around an in-shell built-in.
+typedef struct {
+    fd_op_t *ops; // Operations in source order (in the line arena)
+    int count;    // Number of operations
+    int *opened;  // Descriptors opened by the shell for the plan
+    int nopened;  // Number of opened descriptors
+} redir_plan_t;
+
+// --- Pipeline Structures ---
+struct compound;
+
+// One stage of a pipeline: a parsed command with its own redirections
+typedef struct {
+    char **args;      // Command and arguments (NULL-terminated for exec, in the line arena)
+    int argc;         // Number of arguments in args
+    int capacity;     // Allocated slots in args (including the NULL terminator)
+    redirect_t *redirs;  // Redirections of this stage, in source order (in the line arena)
+    int nredirs;         // Number of redirections
+    int redir_capacity;  // Allocated entries in redirs
+    const builtin_t *builtin; // Resolved once by the parser; NULL for external commands
+    int expand;               // 1 if an argument, assignment or redirection target holds a $ reference
+    char **assigns;           // NAME=value words before the command name (in the line arena)
+    int nassigns;             // Number of assignments
+    int assign_capacity;      // Allocated entries in assigns
+    struct compound *compound; // if/while/for/{ }/( )/function definition instead of a simple command
+} command_t;
+
+// How a pipeline hands over to the next one in a command list
+typedef enum {
+    CONNECT_SEQ,        // ';' or end of line: the next one always runs
+    CONNECT_BACKGROUND, // '&': like ';', but the pipeline (or && / || list) runs in the background
+    CONNECT_AND,        // '&&': the next one runs if this one succeeded
+    CONNECT_OR,         // '||': the next one runs if this one failed
+} connector_t;
+
+// Resource limits of a pipeline started with the 'limit' prefix (0 = not limited)
+typedef struct {
+    int set;                 // 1 if the pipeline has a 'limit' prefix
+    long long cpu_seconds;   // -t: RLIMIT_CPU of each process
+    long long address_space; // -v: RLIMIT_AS of each process, in bytes
+    long long open_files;    // -n: RLIMIT_NOFILE of each process
+    long long memory_max;    // -m: memory.max of the job's cgroup, in bytes
+    long long cpu_percent;   // -c: cpu.max of the job's cgroup, in percent of one CPU
+    int cgroup;              // 1 if the job gets a cgroup of its own (-m, -c or -g)
+} job_limits_t;
+
+// A 'limit' pipeline being launched: what its children apply before they exec
+typedef struct {
+    const job_limits_t *limits; // The pipeline's limits
+    char *cgroup;               // Its cgroup directory (allocated) until a job takes it, or NULL
+    int procs_fd;               // That cgroup's cgroup.procs, for the children to join (-1 if none)
+} limit_launch_t;
+
+// A parsed pipeline: any number of stages joined by '|'
+typedef struct {
+    command_t *stages; // Array of stages (in the line arena, grows as needed)
+    int count;         // Number of stages in use
+    int capacity;      // Allocated number of stages
+    int background;    // 1 if this pipeline alone is followed by '&'
+    int timed;         // 1 if prefixed with 'time'
+    job_limits_t limits; // From a 'limit' prefix (limits.set is 0 without one)
+    char *command;     // Source text of the pipeline, used as the job title (in the arena)
+    connector_t next;  // Operator after the pipeline
+    char *group_command; // Source text of the && / || list this '&' backgrounds (NULL if none)
+    int expand;        // 1 if any stage needs expansion before it runs
+} pipeline_t;
+
+// A parsed command line: pipelines joined by ';', '&', '&&' and '||', in source order.
+// '&&' and '||' bind left to right with equal precedence, like in POSIX shells.
+typedef struct {
+    pipeline_t *items; // Pipelines (in the line arena, grows as needed)
+    int count;         // Number of pipelines
+    int capacity;      // Allocated pipelines
+} command_list_t;
+
+// --- Compound Commands ---
+typedef enum {
+    COMPOUND_IF,       // if cond; then body; [elif ...; | else ...;] fi
+    COMPOUND_WHILE,    // while cond; do body; done
+    COMPOUND_UNTIL,    // until cond; do body; done
+    COMPOUND_FOR,      // for name [in words]; do body; done
+    COMPOUND_GROUP,    // { body; } (also the else part of an if)
+    COMPOUND_SUBSHELL, // ( body ): runs in a forked copy of the shell
+    COMPOUND_FUNCTION, // name() compound: defines the function when it runs
+} compound_type_t;
+
+// A compound command, evaluated in the shell process on the parsed lists
+typedef struct compound {
+    compound_type_t type;    // Kind of construct
+    command_list_t cond;     // Condition (if, elif, while, until)
+    command_list_t body;     // Commands it runs
+    struct compound *orelse; // if: the elif (COMPOUND_IF) or else (COMPOUND_GROUP) part, or NULL
+    struct compound *inner;  // function: the body to run when it is called
+    char *name;              // for: loop variable; function: its name; ( ): its source text
+    char **words;            // for: words after 'in', expanded each time the loop starts
+    int nwords;              // Number of words, or -1 without 'in' (loops over "$@")
+} compound_t;
+
+// Recursive-descent parser state over the tokens of one (possibly multi-line) command
+typedef struct {
+    const char *line;           // Source text (for job titles)
+    const token_list_t *tokens; // Tokens from lex_line
+    int pos;                    // Next token to look at
+    arena_t *arena;             // Arena for everything parsed
+    int incomplete;             // 1 if the input ended inside a construct
+} parser_t;
+
+// A function defined with name() { ...; }. The body is copied into the function's own
+// arena, so it outlives the line (or script) it was defined in.
+typedef struct shell_function {
+    char *name;               // Function name (in arena)
+    compound_t *body;         // Body (in arena)
+    arena_t arena;            // Storage of the copy, freed when the function is redefined
+    int users;                // Calls in progress (a function may redefine itself)
+    int stale;                // 1 once replaced or unset (freed when users drops to 0)
+    struct shell_function *next; // Next function in the same bucket
+} shell_function_t;
+
+// Nesting seen so far in a command that goes on over several lines (continuation_scan)
+typedef struct {
+    size_t scanned;    // Characters already lexed (a quote or $( still open at the end is lexed again)
+    int depth;         // if, while, until, for, { and ( opened and not closed yet
+    int command_start; // 1 if the next word starts a command (where reserved words count)
+    int name_next;     // After for (1) or function (2): the next word is a name
+    int operator_open; // 1 if the last token was |, && or ||
+    int unbalanced;    // 1 once a closing word had nothing to close (left to the parser)
+} continuation_t;
+
+// Lines of a command that is not complete yet (if ... without its fi), kept until it is
+typedef struct {
+    char *text;  // Joined lines (allocated), NULL if nothing is pending
+    size_t len;  // Characters in text
+    size_t cap;  // Allocated size
+    continuation_t scan; // Nesting of text, so only the last line is lexed per line read
+} pending_input_t;
+
+// --- Parallel Runner ---
+// One running command of `parallel`
+typedef struct {
+    pid_t pid;    // Worker process, 0 if the slot is free
+    long index;   // Number of its input (output order with -k)
+    int out_fd;   // -k: read end of its stdout pipe, -1 once at EOF
+    int exited;   // 1 once reaped
+    int status;   // Raw wait status, valid once exited
+} parallel_worker_t;
+
+// Output of one input, kept back with -k until all earlier inputs' output is written
+typedef struct {
+    char *data;  // Buffered bytes (allocated)
+    size_t len;  // Bytes in data
+    size_t cap;  // Allocated size
+    int done;    // 1 once its command finished
+} parallel_output_t;
+
+// A `parallel` run: options, inputs and the worker pool (lives in the coordinator process)
+typedef struct {
+    char **command;   // Command template ({} is replaced by the input)
+    int ncommand;     // Words in command
+    char **inputs;    // Inputs after :::, or NULL to read lines from stdin
+    int ninputs;      // Number of inputs after :::
+    int jobs;         // Workers alive at most (-j)
+    int keep_order;   // -k: write outputs in input order
+    int halt;         // --halt: stop at the first failure
+    pid_t pgid;       // Process group of the workers (-1 if not interactive)
+    int stdin_fd;     // Stdin of the workers (/dev/null when inputs come from stdin), or -1
+    parallel_worker_t *workers; // Pool of 'jobs' slots (allocated)
+    int running;      // Slots in use
+    parallel_output_t *ring; // -k: outputs of inputs emitted .. started-1 (allocated)
+    size_t ring_cap;  // Entries in ring (power of two)
+    long started;     // Inputs started so far
+    long emitted;     // -k: inputs whose output has been written
+    int status;       // Exit status of the first failed command (0 so far)
+    int stopping;     // 1 once --halt saw a failure: start nothing more
+} parallel_t;
+
+// --- Command Result Cache ---
+// One remembered result of `cache command`: what it printed and how it exited
+typedef struct cache_entry {
+    char *key;          // argv, cwd and --env values, NUL-separated (allocated)
+    size_t key_len;     // Bytes in key
+    unsigned long hash; // hash_name() of key
+    char *output;       // Captured stdout (allocated, may be NULL when empty)
+    size_t len;         // Bytes in output
+    int status;         // Exit status
+    time_t expires;     // When it stops being valid (0 = never)
+    struct cache_entry *next;     // Next entry in the same bucket
+    struct cache_entry *lru_prev; // More recently used neighbour
+    struct cache_entry *lru_next; // Less recently used neighbour
+} cache_entry_t;
+
+// In-process LRU of command results, and the counters 'cache --stats' prints
+typedef struct {
+    cache_entry_t *buckets[CACHE_BUCKETS]; // Chained hash table
+    cache_entry_t *lru_head;  // Most recently used
+    cache_entry_t *lru_tail;  // Least recently used (evicted first)
+    int count;                // Entries
+    size_t bytes;             // Key and output bytes held
+    long hits;                // Lookups answered from the cache
+    long disk_hits;           // ... of which from the disk tier
+    long misses;              // Lookups that ran the command
+} result_cache_t;
+
+// Header of an on-disk entry, followed by the key and the output
+typedef struct {
+    char magic[8];            // CACHE_FILE_MAGIC
+    long long expires;        // time_t it expires at (0 = never)
+    int status;               // Exit status
+    unsigned key_len;         // Bytes of key after the header
+    unsigned long long out_len; // Bytes of output after the key
+} cache_file_header_t;
+
+// --- Coprocesses ---
+// A coprocess started by 'coproc NAME command': a background job whose stdin and
+// stdout stay connected to the shell through a pipe each
+typedef struct {
+    char *name;   // NAME (allocated)
+    pid_t pid;    // The process (also tracked in the job table)
+    int read_fd;  // ${NAME[0]}: reads the coprocess's stdout (close-on-exec, >= 10)
+    int write_fd; // ${NAME[1]}: writes its stdin (close-on-exec, >= 10)
+} coproc_t;
+
+// Coprocesses by name (few, so a growable array searched linearly)
+typedef struct {
+    coproc_t *items; // Coprocesses (allocated)
+    int count;       // In use
+    int capacity;    // Allocated entries
+} coproc_table_t;
+
+// --- Tracing ---
+// Phases of running a command that 'trace on' / CASH_TRACE time
+typedef enum {
+    TRACE_PARSE,    // Lexing and parsing a line
+    TRACE_EXPAND,   // Expanding a pipeline's words ($VAR, globs, $(...))
+    TRACE_SPAWN,    // posix_spawn / fork in the shell, up to the child's exec (setpgid included)
+    TRACE_TERMINAL, // tcsetpgrp handing the terminal to a job or back
+    TRACE_WAIT,     // Blocked waiting for a foreground job: the child's own run time
+    TRACE_REAP,     // Reaping children that changed state (SIGCHLD)
+    TRACE_BUILTIN,  // Running a built-in in the shell process
+    TRACE_PHASES    // Number of phases
+} trace_phase_t;
+
+// One timed phase, as kept in the ring
+typedef struct {
+    long long start_ns;        // CLOCK_MONOTONIC start
+    long long dur_ns;          // Duration
+    trace_phase_t phase;       // Which phase
+    char what[TRACE_NAME_MAX]; // Command or job it belongs to (truncated)
+} trace_event_t;
+
+// Latency histogram of one phase
+typedef struct {
+    long count;                        // Samples
+    long long total_ns;                // Sum of durations
+    long long max_ns;                  // Longest sample
+    long buckets[TRACE_HIST_BUCKETS];  // buckets[b]: samples shorter than 2^b ns (and >= 2^(b-1))
+} trace_hist_t;
+
+// Tracer state: off by default, then every phase costs two clock_gettime calls
+typedef struct {
+    int enabled;        // 1 while phases are timed
+    int fd;             // CASH_TRACE file, or -1
+    char *path;         // Its name (allocated)
+    int wrote_any;      // 1 once an event went to the file (comma placement)
+    pid_t owner;        // The shell that writes the file (forked children drop their copies)
+    trace_event_t ring[TRACE_RING_SIZE]; // Last events
+    unsigned long head;    // Events recorded so far (next slot is head % TRACE_RING_SIZE)
+    unsigned long flushed; // Events already written to the file
+    trace_hist_t hist[TRACE_PHASES];     // Per-phase latency histograms
+} trace_state_t;
+
+// --- Process Spawn Backends ---
+// How external commands are started. posix_spawn lets libc use vfork/clone,
+// avoiding a page-table copy of the whole shell; fork is kept as a fallback.
+typedef enum {
+    SPAWN_BACKEND_POSIX_SPAWN, // posix_spawnp() with file actions and attributes
+    SPAWN_BACKEND_FORK,        // Classic fork() + execvp() in the child
+} spawn_backend_t;
+
+// Standard streams, process group and environment a spawned child should get
+typedef struct {
+    int stdin_fd;  // FD to install as the child's stdin, or -1 to inherit
+    int stdout_fd; // FD to install as the child's stdout, or -1 to inherit
+    int close_fd;  // Extra FD the child must not keep (e.g. next pipe's read end), or -1
+    pid_t pgid;    // Process group to join (0 = new group led by the child), -1 = leave as is
+    char **envp;   // Environment of the new program (from command_envp)
+    const limit_launch_t *limits; // 'limit' settings the child applies before exec, or NULL
+} spawn_io_t;
+
+// --- Command Hash Entry ---
+// Caches where a command name was found on $PATH (like bash's `hash`)
+typedef struct command_hash_entry {
+    char *name;                      // Command name as typed (allocated)
+    char *path;                      // Absolute path it resolved to (allocated)
+    int hits;                        // Number of times the cached path was used
+    struct command_hash_entry *next; // Next entry in the same bucket
+} command_hash_entry_t;
+
+// --- Built-in Output Writer ---
+// Built-ins like echo/printf write through this buffer straight to an fd with
+// write(), bypassing stdio, and flush once when the command is done.
+struct word_buf;
+typedef struct {
+    int fd;                       // Destination file descriptor (stdout, possibly redirected)
+    char buf[OUTPUT_BUFFER_SIZE]; // Pending bytes
+    size_t len;                   // Bytes in buf
+    int error;                    // 1 after a failed write (reported once)
+    struct word_buf *capture;     // $(builtin): flushes append here instead of writing fd
+} output_t;
+
+// --- Script Line Reader ---
+// Buffered reader that splits a script (file or stdin) into lines without readline
+typedef struct {
+    int fd;        // Source file descriptor
+    char *buf;     // Read buffer (allocated, grows for very long lines)
+    size_t cap;    // Allocated size of buf
+    size_t len;    // Bytes of valid data in buf
+    size_t pos;    // Start of the next unread line
+    int eof;       // 1 once read() returned 0
+} line_reader_t;
+
+// --- Compiled Scripts ---
+// Parse state of one line of a cached script
+typedef enum {
+    SCRIPT_LINE_UNPARSED, // Not reached yet
+    SCRIPT_LINE_EMPTY,    // Blank or comment
+    SCRIPT_LINE_PARSED,   // list holds its commands
+    SCRIPT_LINE_ERROR     // Syntax error: parsed again (and reported) every time
+} script_line_state_t;
+
+typedef struct {
+    char *text;                // Line (inside the script's source copy)
+    command_list_t *list;      // Parsed commands (SCRIPT_LINE_PARSED)
+    script_line_state_t state; // How far the line got
+    int span;                  // Lines the command takes (more than 1 for if ... fi and the like)
+} script_line_t;
+
+// A script file with the commands parsed from it, reused by later runs (source,
+// a script sourcing a helper in a loop) while the file's mtime and size are unchanged.
+// Lines are parsed when first reached, so syntax errors show up in order.
+typedef struct compiled_script {
+    char *path;             // Path it was loaded by (allocated)
+    dev_t dev;              // Device and inode, to notice a replaced file
+    ino_t ino;
+    struct timespec mtime;  // Modification time when it was read
+    off_t size;             // Size when it was read
+    char *source;           // Whole file with newlines replaced by NULs (allocated)
+    script_line_t *lines;   // One entry per line (allocated)
+    int count;              // Lines
+    arena_t arena;          // Tokens and parsed commands of every line
+    int users;              // Runs in progress (a script may source itself)
+    int stale;              // 1 once replaced by a newer version (freed when unused)
+    struct compiled_script *next; // Next cached script
+} compiled_script_t;
+
+// --- History Store ---
+// Every accepted line is appended to the history file right away with one
+// O_APPEND write, so concurrent sessions interleave whole lines instead of
+// overwriting each other, and a killed shell loses nothing. Appends hold a
+// shared flock on the lock file; compaction holds it exclusively.
+typedef struct {
+    char *path;          // ~/.cash_history (allocated)
+    char *lock_path;     // ~/.cash_history.lock (allocated)
+    int fd;              // O_APPEND descriptor of the history file, or -1
+    int lock_fd;         // Descriptor of the lock file, or -1
+    struct stat st;      // Identity of the file fd refers to (replaced by compaction)
+    char *pending;       // Lines not yet written because the lock was busy (allocated)
+    size_t pending_len;  // Bytes in pending
+    size_t pending_cap;  // Allocated size of pending
+    off_t file_size;     // Size of the file, as far as this session knows
+    pid_t compactor;     // Background compaction child, or 0
+    int loaded;          // 1 once the file has been read into readline's history list
+} history_store_t;
+
+// --- History Search Index ---
+// Trigram index over the history entries: every 3-byte substring of an entry adds the
+// entry's id to one posting list (ids ascending). A substring search walks the shortest
+// list among the pattern's trigrams and checks only those entries, instead of all of them.
+typedef struct {
+    unsigned int *ids;     // Entry ids containing a trigram that hashes here (ascending)
+    unsigned int count;    // Ids in the list
+    unsigned int capacity; // Allocated ids
+} trigram_posting_t;
+
+typedef struct {
+    char **entries;             // History lines, oldest first (allocated)
+    int count;                  // Number of entries
+    int capacity;               // Allocated entry slots
+    trigram_posting_t *buckets; // TRIGRAM_BUCKETS posting lists (allocated on first use)
+} history_index_t;
+
+// State of an interactive Ctrl-R/Ctrl-S search
+typedef struct {
+    int active;                     // 1 while the search keymap is installed
+    int direction;                  // -1 searches older entries, +1 newer
+    char query[SEARCH_QUERY_MAX];   // Search string typed so far
+    size_t query_len;               // Bytes in query
+    int match;                      // Entry shown, or -1
+    int failed;                     // 1 if the query matches nothing in that direction
+    char *saved_line;               // Input line before the search (restored by Ctrl-G)
+    int saved_point;                // Cursor position before the search
+    Keymap saved_keymap;            // Keymap to return to
+} history_search_t;
+
+// --- Startup Profile ---
+// Time spent in each initialization phase before the first prompt (--startup-profile)
+typedef struct {
+    int enabled;                             // 1 if --startup-profile was given
+    struct timespec start;                   // When main() began
+    struct timespec last;                    // End of the previous phase
+    const char *names[STARTUP_PHASES_MAX];   // Phase names
+    double seconds[STARTUP_PHASES_MAX];      // Phase durations
+    int count;                               // Phases recorded
+} startup_profile_t;
+
+// --- Exit Statuses ---
+// Exit status of every stage of the last pipeline ($PIPESTATUS). Filled from the
+// statuses wait4() already returned while reaping the job, so no extra wait is made.
+typedef struct {
+    int *codes;    // One 0-255 status per stage, in pipeline order (allocated)
+    int count;     // Statuses recorded (0 while the current pipeline is still running)
+    int capacity;  // Allocated entries in codes
+} pipestatus_t;
+
+// Growable string in an arena, used to build expanded words
+typedef struct word_buf {
+    char *data;    // Characters (NUL-terminated once finished)
+    size_t len;    // Characters used
+    size_t cap;    // Allocated bytes
+    arena_t *arena; // Arena the buffer grows in
+} word_buf_t;
+
+// State of expanding one word: the field being built and where finished fields go
+typedef struct {
+    word_buf_t buf;   // Current field
+    int active;       // 1 once the current field exists (text, or a quoted expansion)
+    command_t *out;   // Stage receiving the fields as arguments, or NULL for one unsplit string
+    arena_t *arena;   // Arena for everything built
+} expand_state_t;
+
+// A <(command) or >(command) started while expanding a pipeline
+typedef struct {
+    pid_t pid;  // The substitution's process (0 once adopted by a job)
+    int fd;     // Shell's end of its pipe, passed as /dev/fd/N (-1 once closed)
+    char *text; // The command (in the line arena), as a process name
+} procsub_t;
+
+// --- Prompt ---
+// Parts of $PS1 that are looked at for every prompt (everything else is literal text)
+typedef enum {
+    PROMPT_TEXT,       // Literal text, with the fixed escapes (\u \h \$ ...) already resolved
+    PROMPT_CWD,        // \w: working directory, $HOME shown as ~
+    PROMPT_CWD_BASE,   // \W: last component of it
+    PROMPT_GIT_BRANCH, // \g: branch checked out (short hash when detached), empty outside a repository
+    PROMPT_STATUS,     // \?: $?
+    PROMPT_JOBS,       // \j: number of jobs
+} prompt_segment_type_t;
+
+typedef struct {
+    prompt_segment_type_t type; // What the segment shows
+    const char *text; // PROMPT_TEXT: the text (in the prompt arena)
+    size_t len;       // Its length
+} prompt_segment_t;
+
+// The parsed $PS1 and, for each dynamic segment, its value and the input it was computed from
+typedef struct {
+    char *source;               // $PS1 the segments were parsed from (allocated)
+    prompt_segment_t *segments; // Segments in order (allocated)
+    int count;                  // Segments in use
+    int capacity;               // Allocated segments
+    int needs;                  // Bit per prompt_segment_type_t that occurs
+    arena_t arena;              // Segment text and the rendered prompt
+    word_buf_t rendered;        // Last rendered prompt
+    int dirty;                  // 1 if a segment changed since it was rendered
+    unsigned long cwd_version;  // cwd_version + 1 the directory segments were computed at (0: never)
+    char cwd[PATH_MAX];         // \w
+    const char *cwd_base;       // \W (points into cwd)
+    char git_head[PATH_MAX];    // HEAD file of the repository around cwd ("" if none)
+    struct timespec git_head_mtime; // Its mtime when git_branch was read
+    off_t git_head_size;        // Its size then (-1: not read yet)
+    char git_branch[256];       // \g
+    int status;                 // \? as rendered
+    int jobs;                   // \j as rendered
+} prompt_state_t;
+
+// Substitutions of the pipelines being run; nested pipelines (a function's body) stack theirs on top
+typedef struct {
+    procsub_t *items; // Substitutions (allocated)
+    int count;        // In use
+    int capacity;     // Allocated entries
+    int base;         // First entry of the innermost pipeline
+} procsub_list_t;
+
+// --- Pathname Expansion ---
+// One entry of a directory listing
+typedef struct {
+    char *name;         // Entry name (in the line arena)
+    unsigned char type; // d_type: DT_DIR, DT_REG, DT_LNK, ... or DT_UNKNOWN
+} glob_entry_t;
+
+// A directory read for pathname expansion. Listings are kept while one pipeline is
+// expanded, so several patterns against the same directory read it only once.
+typedef struct glob_dir {
+    char *path;             // Directory as written in the pattern ("" for the cwd, "src/", "/")
+    glob_entry_t *entries;  // Entries except . and .. (grows by doubling)
+    int count;              // Entries used
+    int capacity;           // Entries allocated
+    struct glob_dir *next;  // Next cached listing
+} glob_dir_t;
+
+// Paths matched by one pattern word
+typedef struct {
+    char **paths;   // Matches (in the arena)
+    int count;      // Matches found
+    int capacity;   // Slots allocated (grows by doubling)
+    arena_t *arena; // Arena for the paths
+} glob_matches_t;
+
+#ifdef __linux__
+// Record layout of the getdents64 system call (glibc only wraps it since 2.30)
+struct glob_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// --- Shell Variables ---
+// One variable. Entries, names and values live in the variable arena; a value is
+// overwritten in place when the new one fits, so reassigning in a loop stays bounded.
+typedef struct shell_var {
+    const char *name;       // Name (not NUL-terminated: imported names point into environ)
+    size_t name_len;        // Length of name
+    char *value;            // NUL-terminated value, or NULL if unset
+    size_t value_cap;       // Bytes writable at value (0 if it points into environ)
+    int exported;           // 1 if it is passed to commands
+    struct shell_var *next; // Next variable in the same bucket
+} shell_var_t;
+
+// Variable table with the environment built from it. The envp array is only rebuilt
+// when an exported variable changed, not for every command started.
+typedef struct {
+    shell_var_t **buckets; // Hash chains (allocated)
+    int bucket_count;      // Buckets (power of two)
+    int count;             // Variables in the table
+    arena_t arena;         // Storage for entries, names and values (never reset)
+    char **envp;           // Environment for new programs (environ until first rebuilt)
+    int envp_owned;        // 1 if envp was allocated by shell_envp
+    int envp_dirty;        // 1 if an exported variable changed since envp was built
+} var_table_t;
+
+// A variable's state before a command's prefix assignment (restored after a built-in)
+typedef struct {
+    shell_var_t *var; // The variable
+    char *value;      // Previous value (copy in the line arena), or NULL if it was unset
+    int exported;     // Previous export flag
+} var_saved_t;
+
 // --- Global Job List and Shell Info ---
-job_t job_list[MAX_JOBS];      // Array to store background job information
+job_table_t job_table;         // Table of background/stopped jobs
 int next_jid = 1;              // Counter for assigning the next job ID
 pid_t cash_pgid;               // Shell's own process group ID
 int terminal_fd = STDIN_FILENO; // FD for the controlling terminal (usually stdin)
 int shell_is_interactive;      // Set to 1 if running interactively, 0 otherwise
+spawn_backend_t spawn_backend = SPAWN_BACKEND_POSIX_SPAWN; // Backend for external commands
+command_hash_entry_t *command_hash[COMMAND_HASH_BUCKETS]; // PATH lookup cache
+arena_t line_arena = { NULL, NULL }; // Per-line arena, reset after every command line
+int child_event_fd = -1;       // Readable when children changed state (signalfd or self-pipe read end)
+int child_event_pipe[2] = { -1, -1 }; // Self-pipe written by handle_sigchld (non-Linux)
+int shell_exit_requested = 0;  // Set when the interactive loop should end (EOF)
+output_t builtin_out = { STDOUT_FILENO, {0}, 0, 0, NULL }; // Output writer of the fast built-ins
+int command_subst_status = -1;      // Status of the last $(...) run while expanding a pipeline (-1: none)
+procsub_list_t procsubs;            // <(...) / >(...) processes waiting for their pipeline's job
+limit_launch_t *active_limits = NULL; // Limits of the pipeline being launched ('limit' prefix), or NULL
+prompt_state_t prompt;              // $PS1 segments and their cached values
+unsigned long cwd_version = 0;      // Bumped by every cd, so the prompt knows when to look at the directory again
+history_store_t history_store = { .fd = -1, .lock_fd = -1 }; // Persistent history of the interactive shell
+startup_profile_t startup_profile;  // Init phase timings (--startup-profile)
+history_index_t history_index;      // Substring index over the history (Ctrl-R, history -s)
+history_search_t isearch;           // Interactive Ctrl-R search in progress
+int last_status = 0;                // $?: exit status of the last pipeline
+pipestatus_t pipestatus;            // $PIPESTATUS: per-stage statuses of the last pipeline
+var_table_t vars;                   // Shell variables and the environment built from them
+const char *shell_name = "cash";    // $0
+char **positional_args = NULL;      // $1, $2, ... (NULL-terminated, points into argv)
+int positional_count = 0;           // $#
+pid_t shell_pid;                    // $$ (the main shell, also in subshells)
+pid_t last_background_pid = 0;      // $! (0 until a job has been started with '&')
+glob_dir_t *glob_cache = NULL;      // Directory listings read while expanding the current pipeline
+compiled_script_t *script_cache = NULL; // Scripts run so far (source, script mode), by path
+shell_function_t *function_table[FUNCTION_HASH_BUCKETS]; // Defined functions, by name
+int function_count = 0;             // Functions defined (0: skip the lookup for every command)
+int function_depth = 0;             // Function calls in progress
+int source_depth = 0;               // 'source' runs in progress (return is allowed in them)
+int loop_depth = 0;                 // Loops running in the current function (or at top level)
+int break_pending = 0;              // Loop levels a 'break' still has to leave
+int continue_pending = 0;           // Loop levels a 'continue' applies to (the last one continues)
+int return_pending = 0;             // 1 while a 'return' unwinds to its function or sourced script
+int return_status = 0;              // Status given to 'return'
+pending_input_t interactive_pending = { NULL, 0, 0 }; // Unfinished construct typed at the prompt
+result_cache_t result_cache;        // Results remembered by the 'cache' built-in
+trace_state_t tracer = { .fd = -1 }; // Phase timers ('trace', 'stats', CASH_TRACE)
+coproc_table_t coprocs;             // Coprocesses started with 'coproc'
 
 // --- Function Prototypes ---
 // Core Shell Logic
 void display_welcome_message();
-int parse_command(char *command_str, char **args, char **inputFile, char **outputFile);
-void execute_pipeline(char *input, const char *original_cmd_for_job);
-void execute_single_command(char **args, int background, char *inputFile, char *outputFile, const char *original_cmd);
-void handle_child_execution(char **args, char *inputFile, char *outputFile);
+int execute_pipeline(pipeline_t *pipeline);
+int execute_single_command(command_t *cmd, int background, int timed, const char *original_cmd);
+void reset_child_signals();
+void apply_child_redirections(const redir_plan_t *plan);
+void handle_child_execution(const char *path, char **args, char **envp, const redir_plan_t *plan);
 void handle_sigchld(int sig);
 
+// Process Spawning
+pid_t spawn_command(char **args, const spawn_io_t *io, const redir_plan_t *plan);
+pid_t posix_spawn_command(const char *path, char **args, const spawn_io_t *io, const redir_plan_t *plan);
+pid_t fork_command(const char *path, char **args, const spawn_io_t *io, const redir_plan_t *plan);
+pid_t fork_builtin(const command_t *cmd, const spawn_io_t *io, const redir_plan_t *plan);
+const char* spawn_backend_name(spawn_backend_t backend);
+
+// Built-in Commands
+const builtin_t* find_builtin(const char *name);
+int builtin_bg(char **args);
+int builtin_cd(char **args);
+int builtin_clear(char **args);
+int builtin_exit(char **args);
+int builtin_export(char **args);
+int builtin_fg(char **args);
+int builtin_hash(char **args);
+int builtin_history(char **args);
+int builtin_jobs(char **args);
+int builtin_spawnmode(char **args);
+int builtin_time(char **args);
+int builtin_echo(char **args);
+int builtin_printf(char **args);
+int builtin_test(char **args);
+int builtin_bracket(char **args);
+int builtin_pwd(char **args);
+int builtin_true(char **args);
+int builtin_false(char **args);
+int builtin_unset(char **args);
+int builtin_source(char **args);
+int builtin_break(char **args);
+int builtin_continue(char **args);
+int builtin_return(char **args);
+int builtin_parallel(char **args);
+int parallel_run(parallel_t *p);
+int builtin_cache(char **args);
+int builtin_trace(char **args);
+int builtin_coproc(char **args);
+int limits_prepare(const job_limits_t *limits, limit_launch_t *launch);
+void limits_adopt(job_t *job);
+void limits_release(limit_launch_t *launch);
+int limits_apply_child(const limit_launch_t *launch);
+void job_cgroup_collect(job_t *job);
+int builtin_read(char **args);
+coproc_t* coproc_find(const char *name, size_t len);
+int builtin_stats(char **args);
+long long trace_now();
+long long trace_start();
+void trace_end(trace_phase_t phase, long long start, const char *what);
+void trace_flush();
+void trace_close();
+int trace_enable(const char *path);
+char* join_words(char **words, arena_t *arena);
+cache_entry_t* result_cache_lookup(const char *key, size_t len, unsigned long hash);
+cache_entry_t* result_cache_insert(const char *key, size_t len, unsigned long hash, char *output, size_t out_len, int status, time_t expires);
+cache_entry_t* cache_disk_load(const char *key, size_t len, unsigned long hash);
+void cache_disk_store(const cache_entry_t *entry);
+int run_in_shell(const command_t *cmd, shell_function_t *fn);
+int run_in_shell_redirected(const command_t *cmd, shell_function_t *fn, const redir_plan_t *plan);
+
+// Built-in Output Writer
+void out_write(const char *data, size_t len);
+void out_puts(const char *str);
+void out_putc(char c);
+void out_flush();
+
+// Command Hash Table
+unsigned long hash_name(const char *name, size_t len);
+char* search_path(const char *name);
+command_hash_entry_t* hash_lookup_command(const char *name);
+const char* resolve_command(const char *name);
+void forget_command(const char *name);
+void flush_command_hash();
+
+// Arena Allocator
+void* arena_alloc(arena_t *arena, size_t size);
+char* arena_strndup(arena_t *arena, const char *str, size_t len);
+void arena_reset(arena_t *arena);
+arena_mark_t arena_mark(const arena_t *arena);
+void arena_release(arena_t *arena, arena_mark_t mark);
+
+// Lexer and Parser
+int lex_line(const char *line, arena_t *arena, token_list_t *tokens);
+const char* token_text(token_type_t type);
+int parse_command_list(const char *line, const token_list_t *tokens, arena_t *arena, command_list_t *list);
+int continuation_scan(continuation_t *scan, const char *text, size_t len);
+int parse_list(parser_t *ps, command_list_t *list);
+int parse_pipeline(parser_t *ps, pipeline_t *pipeline);
+int parse_stage(parser_t *ps, pipeline_t *pipeline, command_t *stage);
+int parse_redirect(parser_t *ps, pipeline_t *pipeline, command_t *stage);
+compound_t* parse_compound(parser_t *ps);
+
+// Compound Commands and Functions
+int execute_compound(const compound_t *c);
+int execute_loop(const compound_t *c);
+int execute_for(const compound_t *c);
+int control_pending();
+shell_function_t* find_function(const char *name);
+void define_function(const char *name, const compound_t *body);
+void undefine_function(const char *name);
+int call_function(shell_function_t *fn, char **args);
+compound_t* copy_compound(const compound_t *src, arena_t *arena);
+
+// Pipelines
+command_t* pipeline_add_stage(pipeline_t *pipeline, arena_t *arena);
+void command_init(command_t *cmd, arena_t *arena);
+void command_add_arg(command_t *cmd, arena_t *arena, char *arg);
+void command_add_assign(command_t *cmd, arena_t *arena, char *word);
+redirect_t* command_add_redirect(command_t *cmd, arena_t *arena);
+
+// Redirections
+int prepare_redirections(const command_t *cmd, arena_t *arena, redir_plan_t *plan);
+void release_redirections(redir_plan_t *plan);
+int open_herestring(const char *text);
+int check_arg_max(char **args, char **envp);
+int launch_pipeline(pipeline_t *pipeline, const char *original_cmd);
+int time_builtin_command(command_t *cmd, pipeline_t *pipeline);
+
+// Word Expansion
+pipeline_t* expand_pipeline(const pipeline_t *pipeline, arena_t *arena);
+char* expand_word(const char *word, arena_t *arena);
+void expand_word_fields(const char *word, arena_t *arena, command_t *out);
+int word_has_mark(const char *word);
+void word_buf_append(word_buf_t *buf, const char *str, size_t len);
+const char* expand_parameter(const char *p, expand_state_t *st, int quoted);
+const char* expand_command_subst(const char *p, expand_state_t *st, int quoted);
+int command_subst(const char *text, word_buf_t *out);
+int run_piped_job(pid_t pid, int fd, const char *title, const char *name, pipe_chunk_fn on_chunk, void *ctx);
+const char* expand_process_subst(const char *p, expand_state_t *st);
+pid_t procsub_pgid();
+void procsub_adopt(job_t *job);
+void procsub_release();
+const char* parameter_value(const char *name, size_t name_len, const char *sub, size_t sub_len, word_buf_t *scratch);
+
+// Pathname Expansion
+int glob_expand_word(const char *word, arena_t *arena, command_t *out);
+char* glob_strip_marks(char *word);
+glob_dir_t* glob_read_dir(const char *path, arena_t *arena);
+int glob_match(const char *pat, const char *pat_end, const char *name);
+
+// Shell Variables
+void vars_init();
+int is_valid_name(const char *name, size_t len);
+shell_var_t* var_lookup(const char *name, size_t len);
+shell_var_t* var_intern(const char *name, size_t len);
+void var_assign_value(shell_var_t *var, const char *value);
+void var_set(const char *name, const char *value);
+const char* var_get(const char *name);
+void var_assign_word(const char *word, int export);
+void var_export(shell_var_t *var, int exported);
+void var_unset(shell_var_t *var);
+char** shell_envp();
+char** command_envp(const command_t *cmd, arena_t *arena);
+var_saved_t* var_push_assignments(const command_t *cmd, arena_t *arena);
+void var_pop_assignments(var_saved_t *saved, int count);
+
+// Command Lists
+pipeline_t* command_list_add(command_list_t *list, arena_t *arena);
+int execute_command_list(command_list_t *list);
+int execute_and_or(command_list_t *list, int first, int last);
+int run_background_group(command_list_t *list, int first, int last);
+
 // Job Management
 void init_jobs();
-int add_job(pid_t pgid, const char* cmd, job_state_t state);
-int remove_job_by_pgid(pid_t pgid);
+int job_table_grow();
+job_t* create_job(const char *cmd, int background);
+int job_add_process(job_t *job, pid_t pid, const char *name);
+job_t* create_child_job(pid_t pid, const char *cmd, const char *name, int background);
+void job_assign_jid(job_t *job);
+void remove_job(job_t *job);
 job_t* get_job_by_jid(int jid);
 job_t* get_job_by_pgid(pid_t pgid);
-void list_jobs();
-void wait_for_job(job_t *job);
-void put_job_in_foreground(job_t *job, int cont);
+void list_jobs(int long_format);
+void print_job_usage(const job_t *job);
+void print_usage_report(const job_usage_t *usage);
+int wait_status_exit_code(int status);
+int job_exit_status(const job_t *job);
+void job_collect_pipestatus(const job_t *job);
+void pipestatus_push(int code);
+void report_signal_death(const job_t *job);
+int wait_for_job(job_t *job);
+int put_job_in_foreground(job_t *job, int cont);
 void put_job_in_background(job_t *job, int cont);
 void check_jobs_status();
+const char* prompt_render(int continuation);
+void job_queue_notice(job_t *job);
 
-// History file utility
+// Interactive Loop
+void handle_input_line(char *line);
+int job_notices_pending();
+void handle_child_event();
+
+// Child Events (SIGCHLD)
+int init_child_events();
+void drain_child_events();
+void update_process_status(pid_t pid, int status, const struct rusage *usage);
+void reap_children();
+
+// History persistence
 char* get_history_filepath();
+void history_open(const char *path);
+void history_append_line(const char *line);
+void history_flush(int block);
+void history_compact_start();
+void history_compact_child();
+void history_close();
+void history_ensure_loaded();
+void history_install_lazy_bindings();
+void history_record(const char *line);
+void run_rc_file();
+
+// History Search Index
+void history_index_add(const char *line);
+void history_index_clear();
+int history_index_search(const char *pattern, int from, int direction);
+int history_isearch_backward(int count, int key);
+int history_isearch_forward(int count, int key);
+
+// Startup profile
+void startup_phase(const char *name);
+void print_startup_profile();
+
+// Script Execution
+int execute_line(const char *line);
+int execute_continued(pending_input_t *pending, const char *line);
+void pending_input_finish(pending_input_t *pending);
+char* line_reader_next(line_reader_t *reader);
+int run_script_fd(int fd);
+int run_script_file(const char *path);
+int run_script_string(const char *script);
+compiled_script_t* script_cache_load(const char *path);
+int run_compiled_script(compiled_script_t *script);
+void script_release(compiled_script_t *script);
+
+// --- Built-in Command Table ---
+// Sorted by name: find_builtin() does a binary search, the parser resolves each
+// command once, and adding a built-in is just one more row here.
+static const builtin_t builtin_table[] = {
+    { ".",         builtin_source },
+    { "[",         builtin_bracket },
+    { "bg",        builtin_bg },
+    { "break",     builtin_break },
+    { "cache",     builtin_cache },
+    { "cd",        builtin_cd },
+    { "clear",     builtin_clear },
+    { "continue",  builtin_continue },
+    { "coproc",    builtin_coproc },
+    { "echo",      builtin_echo },
+    { "exit",      builtin_exit },
+    { "export",    builtin_export },
+    { "false",     builtin_false },
+    { "fg",        builtin_fg },
+    { "hash",      builtin_hash },
+    { "history",   builtin_history },
+    { "jobs",      builtin_jobs },
+    { "parallel",  builtin_parallel },
+    { "printf",    builtin_printf },
+    { "pwd",       builtin_pwd },
+    { "read",      builtin_read },
+    { "return",    builtin_return },
+    { "source",    builtin_source },
+    { "spawnmode", builtin_spawnmode },
+    { "stats",     builtin_stats },
+    { "test",      builtin_test },
+    { "time",      builtin_time },
+    { "trace",     builtin_trace },
+    { "true",      builtin_true },
+    { "unset",     builtin_unset },
+};
+#define BUILTIN_COUNT (sizeof(builtin_table) / sizeof(builtin_table[0]))
 
 
 // --- Job Management Functions ---
 
 /**
- * @brief Initialize the job list at shell startup.
+ * @brief Hash of a jid, pgid or pid for the job table indexes.
+ * @param key The id.
+ * @return Hash value (mask it to the table size).
+ */
+static unsigned int job_hash(unsigned int key) {
+    // Fibonacci hashing spreads consecutive ids across the buckets
+    return (key * 2654435769u) >> 8;
+}
+
+/**
+ * @brief Hash bucket for a jid or pgid in the chained indexes.
+ * @param key The jid or pgid.
+ * @return Bucket number.
+ */
+static int job_bucket(unsigned int key) {
+    return (int)(job_hash(key) & (job_table.bucket_count - 1));
+}
+
+/**
+ * @brief Initialize the job table at shell startup.
  */
 void init_jobs() {
-    for (int i = 0; i < MAX_JOBS; i++) {
-        job_list[i].state = JOB_STATE_INVALID; // Mark all slots as free
-        job_list[i].command = NULL;
-    }
+    job_table.slots = NULL;
+    job_table.capacity = job_table.used = job_table.count = 0;
+    job_table.free_head = -1;
+    job_table.jid_index = job_table.pgid_index = NULL;
+    job_table.bucket_count = 0;
+    job_table.pid_capacity = JOB_TABLE_INITIAL * 2;
+    job_table.pid_count = 0;
+    job_table.notices = NULL;
+    job_table.notice_count = job_table.notice_capacity = 0;
+    job_table.pid_index = calloc(job_table.pid_capacity, sizeof(pid_index_entry_t));
     next_jid = 1; // Reset job ID counter
+    if (!job_table.pid_index || !job_table_grow()) { perror("ca$h: job table allocation failed"); exit(EXIT_FAILURE); }
 }
 
 /**
- * @brief Find an empty slot in the job list.
- * @return Index of a free slot, or -1 if full.
+ * @brief Double the slot array and rebuild the jid/pgid indexes with twice the buckets.
+ * @return 1 on success, 0 on allocation failure.
  */
-int find_free_job_slot() {
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (job_list[i].state == JOB_STATE_INVALID) {
-            return i;
+int job_table_grow() {
+    int new_capacity = job_table.capacity ? job_table.capacity * 2 : JOB_TABLE_INITIAL;
+    // OS Concept: Memory Allocation - Grow the table instead of capping the job count.
+    job_t *new_slots = realloc(job_table.slots, new_capacity * sizeof(job_t));
+    if (!new_slots) { perror("ca$h: realloc failed for job table"); return 0; }
+    job_table.slots = new_slots;
+    job_table.capacity = new_capacity;
+
+    int *new_jid_index = malloc(new_capacity * sizeof(int));
+    int *new_pgid_index = malloc(new_capacity * sizeof(int));
+    if (!new_jid_index || !new_pgid_index) {
+        perror("ca$h: malloc failed for job index");
+        free(new_jid_index); free(new_pgid_index);
+        return 0;
+    }
+    free(job_table.jid_index);
+    free(job_table.pgid_index);
+    job_table.jid_index = new_jid_index;
+    job_table.pgid_index = new_pgid_index;
+    job_table.bucket_count = new_capacity; // Load factor stays <= 1
+    for (int i = 0; i < new_capacity; i++) { job_table.jid_index[i] = job_table.pgid_index[i] = -1; }
+
+    // Re-link every job into the new buckets (foreground jobs have no jid yet)
+    for (int i = 0; i < job_table.used; i++) {
+        job_t *job = &job_table.slots[i];
+        if (job->state == JOB_STATE_INVALID) continue;
+        if (job->jid > 0) {
+            int jb = job_bucket(job->jid);
+            job->next_by_jid = job_table.jid_index[jb];
+            job_table.jid_index[jb] = i;
+        }
+        if (job->pgid > 0) {
+            int pb = job_bucket(job->pgid);
+            job->next_by_pgid = job_table.pgid_index[pb];
+            job_table.pgid_index[pb] = i;
         }
     }
-    return -1;
+    return 1;
 }
 
 /**
- * @brief Add a new job to the list. Duplicates the command string.
- * @param pgid Process group ID of the job.
- * @param cmd Command string (will be copied).
- * @param state Initial job state (Running/Stopped).
- * @return The new Job ID (jid) or -1 on failure.
+ * @brief Take a slot from the free list, or a fresh one, growing the table if full.
+ * @return Index of a free slot, or -1 on allocation failure.
  */
-int add_job(pid_t pgid, const char* cmd, job_state_t state) {
-    if (pgid <= 0) return -1;
+int find_free_job_slot() {
+    if (job_table.free_head != -1) {
+        int slot = job_table.free_head;
+        job_table.free_head = job_table.slots[slot].next_free;
+        return slot;
+    }
+    if (job_table.used == job_table.capacity && !job_table_grow()) return -1;
+    return job_table.used++;
+}
 
+/**
+ * @brief Create a job for a command line before its processes are started.
+ * Background jobs get a jid right away; foreground jobs only get one if they stop.
+ * The returned pointer stays valid until the next create_job call.
+ * @param cmd Command string (will be copied).
+ * @param background 1 for a background job, 0 for a foreground job.
+ * @return The new job, or NULL on failure.
+ */
+job_t* create_job(const char *cmd, int background) {
+    // OS Concept: Memory Allocation - Must free this later
+    char *command = strdup(cmd ? cmd : "");
+    if (command == NULL) {
+        fprintf(stderr, "ca$h: Failed memory allocation for job command.\n");
+        return NULL;
+    }
     int slot = find_free_job_slot();
-    if (slot == -1) {
-        fprintf(stderr, "ca$h: Maximum jobs limit (%d) reached.\n", MAX_JOBS);
-        return -1;
+    if (slot == -1) { free(command); return NULL; }
+
+    job_t *job = &job_table.slots[slot];
+    job->jid = 0;
+    job->pgid = 0;
+    job->state = JOB_STATE_RUNNING;
+    job->command = command;
+    job->notified = 1; // Don't notify immediately for running
+    job->foreground = !background;
+    job->timed = 0;
+    job->queued = 0;
+    job->cgroup = NULL;
+    memset(&job->usage, 0, sizeof(job->usage));
+    // OS Concept: Monotonic Clock - Wall time that is not affected by clock changes.
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.started);
+    job->procs = NULL;
+    job->nprocs = job->proc_capacity = job->nlive = 0;
+    job_table.count++;
+    if (background) job_assign_jid(job);
+    return job;
+}
+
+/**
+ * @brief Give a job the next jid and link it into the jid index.
+ * @param job The job (must not have a jid yet).
+ */
+void job_assign_jid(job_t *job) {
+    job->jid = next_jid++;
+    int jb = job_bucket(job->jid);
+    job->next_by_jid = job_table.jid_index[jb];
+    job_table.jid_index[jb] = job - job_table.slots;
+}
+
+/**
+ * @brief Linear-probing slot of a pid in the pid index.
+ * @param pid Process ID.
+ * @return Index of the entry holding pid, or of the empty entry where it would go.
+ */
+static int pid_index_find(pid_t pid) {
+    int mask = job_table.pid_capacity - 1;
+    int i = job_hash(pid) & mask;
+    while (job_table.pid_index[i].pid != 0 && job_table.pid_index[i].pid != pid) i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ * @brief Record which job slot a child pid belongs to (grows the index past 50% load).
+ * @param pid Process ID.
+ * @param slot Job table slot.
+ * @return 1 on success, 0 on allocation failure.
+ */
+static int pid_index_insert(pid_t pid, int slot) {
+    if ((job_table.pid_count + 1) * 2 > job_table.pid_capacity) {
+        pid_index_entry_t *old = job_table.pid_index;
+        int old_capacity = job_table.pid_capacity;
+        pid_index_entry_t *grown = calloc(old_capacity * 2, sizeof(pid_index_entry_t));
+        if (!grown) { perror("ca$h: calloc failed for pid index"); return 0; }
+        job_table.pid_index = grown;
+        job_table.pid_capacity = old_capacity * 2;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].pid != 0) job_table.pid_index[pid_index_find(old[i].pid)] = old[i];
+        }
+        free(old);
     }
+    int i = pid_index_find(pid);
+    if (job_table.pid_index[i].pid == 0) job_table.pid_count++;
+    job_table.pid_index[i].pid = pid;
+    job_table.pid_index[i].slot = slot;
+    return 1;
+}
 
-    job_list[slot].jid = next_jid++;
-    job_list[slot].pgid = pgid;
-    job_list[slot].state = state;
-    // OS Concept: Memory Allocation - Must free this later
-    job_list[slot].command = strdup(cmd);
-    job_list[slot].notified = (state == JOB_STATE_RUNNING); // Don't notify immediately for running
+/**
+ * @brief Find the job slot owning a child pid.
+ * @param pid Process ID.
+ * @return Job table slot, or -1 if the pid is not tracked.
+ */
+static int pid_index_lookup(pid_t pid) {
+    int i = pid_index_find(pid);
+    return job_table.pid_index[i].pid == pid ? job_table.pid_index[i].slot : -1;
+}
 
-    if (job_list[slot].command == NULL) {
-        fprintf(stderr, "ca$h: Failed memory allocation for job command.\n");
-        job_list[slot].state = JOB_STATE_INVALID;
-        return -1;
+/**
+ * @brief Forget a reaped pid. Uses backward-shift deletion, so lookups never need tombstones.
+ * @param pid Process ID.
+ */
+static void pid_index_remove(pid_t pid) {
+    int mask = job_table.pid_capacity - 1;
+    int i = pid_index_find(pid);
+    if (job_table.pid_index[i].pid != pid) return;
+    int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (job_table.pid_index[j].pid == 0) break;
+        int home = job_hash(job_table.pid_index[j].pid) & mask;
+        // Move the entry back if its home bucket is not in the cyclic range (i, j]
+        int in_range = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!in_range) { job_table.pid_index[i] = job_table.pid_index[j]; i = j; }
+    }
+    job_table.pid_index[i].pid = 0;
+    job_table.pid_count--;
+}
+
+/**
+ * @brief Register a started process with its job. The first process sets the job's PGID.
+ * @param job The job.
+ * @param pid PID of the new process.
+ * @param name Program name (copied), shown in per-stage reports.
+ * @return 1 on success, 0 on allocation failure.
+ */
+int job_add_process(job_t *job, pid_t pid, const char *name) {
+    if (job->nprocs == job->proc_capacity) {
+        int new_capacity = job->proc_capacity ? job->proc_capacity * 2 : 4;
+        process_t *new_procs = realloc(job->procs, new_capacity * sizeof(process_t));
+        if (!new_procs) { perror("ca$h: realloc failed for job processes"); return 0; }
+        job->procs = new_procs;
+        job->proc_capacity = new_capacity;
+    }
+    char *name_copy = strdup(name ? name : "");
+    if (!name_copy) { perror("ca$h: strdup failed for process name"); return 0; }
+    int slot = job - job_table.slots;
+    if (!pid_index_insert(pid, slot)) { free(name_copy); return 0; }
+    process_t *proc = &job->procs[job->nprocs++];
+    proc->pid = pid;
+    proc->name = name_copy;
+    proc->status = 0;
+    proc->done = 0;
+    proc->helper = 0;
+    memset(&proc->usage, 0, sizeof(proc->usage));
+    job->nlive++;
+
+    if (job->pgid == 0) { // First stage leads the group
+        job->pgid = pid;
+        int pb = job_bucket(job->pgid);
+        job->next_by_pgid = job_table.pgid_index[pb];
+        job_table.pgid_index[pb] = slot;
     }
-    return job_list[slot].jid;
+    return 1;
+}
+
+/**
+ * @brief Make a job for a single child the shell has just started. If the job cannot
+ * be recorded the child is killed and reaped, so no process is left untracked.
+ * @param pid The child.
+ * @param cmd Job command string (copied).
+ * @param name Program name of the child.
+ * @param background 1 for a background job, 0 for a foreground job.
+ * @return The job, or NULL on failure (the child is gone).
+ */
+job_t* create_child_job(pid_t pid, const char *cmd, const char *name, int background) {
+    job_t *job = create_job(cmd, background);
+    if (job && job_add_process(job, pid, name)) return job;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (job) remove_job(job);
+    return NULL;
 }
 
 /**
- * @brief Find the job list index associated with a Job ID.
+ * @brief Find the job table slot associated with a Job ID (hash lookup).
  * @param jid The Job ID.
- * @return Index in job_list, or -1 if not found.
+ * @return Slot index, or -1 if not found.
  */
 int find_job_slot_by_jid(int jid) {
-     for (int i = 0; i < MAX_JOBS; i++) {
-        if (job_list[i].state != JOB_STATE_INVALID && job_list[i].jid == jid) {
-            return i;
-        }
+    for (int i = job_table.jid_index[job_bucket(jid)]; i != -1; i = job_table.slots[i].next_by_jid) {
+        if (job_table.slots[i].jid == jid) return i;
     }
     return -1;
 }
 
 /**
- * @brief Find the job list index associated with a Process Group ID.
+ * @brief Find the job table slot associated with a Process Group ID (hash lookup).
  * @param pgid The Process Group ID.
- * @return Index in job_list, or -1 if not found.
+ * @return Slot index, or -1 if not found.
  */
 int find_job_slot_by_pgid(pid_t pgid) {
-     for (int i = 0; i < MAX_JOBS; i++) {
-        if (job_list[i].state != JOB_STATE_INVALID && job_list[i].pgid == pgid) {
-            return i;
-        }
+    for (int i = job_table.pgid_index[job_bucket(pgid)]; i != -1; i = job_table.slots[i].next_by_pgid) {
+        if (job_table.slots[i].pgid == pgid) return i;
     }
     return -1;
 }
 
 /**
- * @brief Remove a job from the list using its PGID. Frees the command string memory.
- * @param pgid PGID of the job to remove.
- * @return 1 if removed, 0 if not found.
+ * @brief Unlink a slot from one hash chain.
+ * @param head Bucket head to start from.
+ * @param slot Slot to remove.
+ * @param by_jid 1 to follow next_by_jid links, 0 for next_by_pgid.
  */
-int remove_job_by_pgid(pid_t pgid) {
-     int slot = find_job_slot_by_pgid(pgid);
-    if (slot == -1) return 0;
+static void job_index_unlink(int *head, int slot, int by_jid) {
+    while (*head != -1) {
+        job_t *job = &job_table.slots[*head];
+        int *next = by_jid ? &job->next_by_jid : &job->next_by_pgid;
+        if (*head == slot) { *head = *next; return; }
+        head = next;
+    }
+}
+
+/**
+ * @brief Remove a job from the table. Frees the command string and process list,
+ * and puts the slot on the free list.
+ * @param job The job to remove.
+ */
+void remove_job(job_t *job) {
+    int slot = job - job_table.slots;
+    if (job->state == JOB_STATE_INVALID) return;
 
-    if (job_list[slot].command) {
-        // OS Concept: Memory Management - Freeing allocated memory
-        free(job_list[slot].command);
-        job_list[slot].command = NULL;
+    if (job->jid > 0) job_index_unlink(&job_table.jid_index[job_bucket(job->jid)], slot, 1);
+    if (job->pgid > 0) job_index_unlink(&job_table.pgid_index[job_bucket(job->pgid)], slot, 0);
+    for (int i = 0; i < job->nprocs; i++) {
+        if (!job->procs[i].done) pid_index_remove(job->procs[i].pid); // Never reaped (e.g. ECHILD)
+        free(job->procs[i].name);
     }
-    job_list[slot].state = JOB_STATE_INVALID; // Mark slot as free
-    job_list[slot].jid = 0;
-    job_list[slot].pgid = 0;
-    job_list[slot].notified = 0;
-    return 1;
+    job_cgroup_collect(job); // A job dropped before it finished still removes its cgroup
+    // OS Concept: Memory Management - Freeing allocated memory
+    free(job->procs);
+    job->procs = NULL;
+    free(job->command);
+    job->command = NULL;
+    job->state = JOB_STATE_INVALID; // Mark slot as free
+    job->jid = 0;
+    job->pgid = 0;
+    job->notified = 0;
+    job->nprocs = job->proc_capacity = job->nlive = 0;
+    job->next_free = job_table.free_head;
+    job_table.free_head = slot;
+    job_table.count--;
 }
 
 /**
- * @brief Get a pointer to a job using its Job ID.
+ * @brief Get a pointer to a live (running or stopped) job using its Job ID.
  * @param jid Job ID.
  * @return Pointer to job_t struct, or NULL if not found.
  */
 job_t* get_job_by_jid(int jid) {
     int slot = find_job_slot_by_jid(jid);
-    return (slot != -1) ? &job_list[slot] : NULL;
+    if (slot == -1 || job_table.slots[slot].state == JOB_STATE_DONE) return NULL;
+    return &job_table.slots[slot];
 }
 
 /**
- * @brief Get a pointer to a job using its Process Group ID.
+ * @brief Get a pointer to a live (running or stopped) job using its Process Group ID.
  * @param pgid Process Group ID.
  * @return Pointer to job_t struct, or NULL if not found.
  */
 job_t* get_job_by_pgid(pid_t pgid) {
      int slot = find_job_slot_by_pgid(pgid);
-     return (slot != -1) ? &job_list[slot] : NULL;
+     if (slot == -1 || job_table.slots[slot].state == JOB_STATE_DONE) return NULL;
+     return &job_table.slots[slot];
 }
 
 /**
- * @brief Implements the 'jobs' built-in. Displays running/stopped background jobs.
+ * @brief qsort comparator ordering job slots by jid.
  */
-void list_jobs() {
-    int found = 0;
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (job_list[i].state != JOB_STATE_INVALID) {
-            found = 1;
-            const char *state_str = (job_list[i].state == JOB_STATE_RUNNING) ? "Running" : "Stopped";
-            printf("[%d] %d %s\t%s\n",
-                   job_list[i].jid,
-                   job_list[i].pgid,
-                   state_str,
-                   job_list[i].command);
-        }
-    }
-     if (!found && shell_is_interactive) {
-          printf("No active jobs.\n");
-     }
+static int compare_job_slots(const void *a, const void *b) {
+    return job_table.slots[*(const int *)a].jid - job_table.slots[*(const int *)b].jid;
 }
 
 /**
- * @brief Checks for status changes in background jobs and prints notifications ("Done", "Stopped").
- * Called before showing the prompt. Relies on SIGCHLD handler having updated job states.
+ * @brief Implements the 'jobs' built-in. Displays running/stopped background jobs in jid order.
+ * @param long_format 1 for 'jobs -l': also show resource usage and every process of the job.
  */
-void check_jobs_status() {
-    int status_changed = 0;
-    for (int i = 0; i < MAX_JOBS; i++) {
-         // Check jobs that were marked as finished by the SIGCHLD handler
-         if (job_list[i].state == JOB_STATE_INVALID && job_list[i].command != NULL && !job_list[i].notified) {
-             if (!status_changed) printf("\n");
-             printf("[%d] Done\t%s\n", job_list[i].jid, job_list[i].command);
-             free(job_list[i].command); // Clean up the command string
-             job_list[i].command = NULL;
-             job_list[i].notified = 1; // Should already be removed, but be sure
-             job_list[i].jid = 0;
-             job_list[i].pgid = 0;
-             status_changed = 1;
-         }
-         // Check jobs marked as stopped by SIGCHLD handler or wait_for_job
-         else if (job_list[i].state == JOB_STATE_STOPPED && !job_list[i].notified) {
-              if (!status_changed) printf("\n");
-              printf("[%d] Stopped\t%s\n", job_list[i].jid, job_list[i].command);
-              job_list[i].notified = 1; // Mark as notified for this stop
-              status_changed = 1;
-         }
+void list_jobs(int long_format) {
+    // Slots are reused, so collect the live ones and sort them by jid
+    int *order = malloc((job_table.count > 0 ? job_table.count : 1) * sizeof(int));
+    if (!order) { perror("ca$h: malloc failed for jobs list"); return; }
+    int found = 0;
+    for (int i = 0; i < job_table.used && found < job_table.count; i++) {
+        job_t *job = &job_table.slots[i];
+        if (job->jid > 0 && (job->state == JOB_STATE_RUNNING || job->state == JOB_STATE_STOPPED)) order[found++] = i;
+    }
+    qsort(order, found, sizeof(int), compare_job_slots);
+
+    for (int i = 0; i < found; i++) {
+        job_t *job = &job_table.slots[order[i]];
+        const char *state_str = (job->state == JOB_STATE_RUNNING) ? "Running" : "Stopped";
+        printf("[%d] %d %s\t%s\n", job->jid, job->pgid, state_str, job->command);
+        if (long_format) print_job_usage(job);
+    }
+    free(order);
+    if (!found && shell_is_interactive) {
+        printf("No active jobs.\n");
     }
 }
 
 /**
- * @brief Waits for a specific job (identified by job struct) to change state (stop or terminate).
- * This is used when bringing a job to the foreground (`fg`).
- * @param job Pointer to the job to wait for.
+ * @brief Convert a timeval to seconds.
  */
-void wait_for_job(job_t *job) {
-    if (!job || job->pgid <= 0 || job->state == JOB_STATE_INVALID) return;
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-    int status = 0;
-    pid_t result;
+/**
+ * @brief Max RSS from an rusage, in KB (Linux reports KB, macOS bytes).
+ */
+static long rusage_maxrss_kb(const struct rusage *ru) {
+#ifdef __APPLE__
+    return ru->ru_maxrss / 1024;
+#else
+    return ru->ru_maxrss;
+#endif
+}
 
-    // OS Concept: Waiting for Process Group - Use waitpid with negative PGID.
-    // WUNTRACED: Report status if child stops (e.g., via SIGTSTP).
-    do {
-         result = waitpid(-(job->pgid), &status, WUNTRACED);
-         // Loop handles EINTR (interruption by signals like SIGCHLD)
-    } while (result < 0 && errno == EINTR);
+/**
+ * @brief Wall-clock seconds a job has run (until now if it is still running).
+ */
+static double job_wall_seconds(const job_usage_t *usage) {
+    struct timespec end = usage->finished;
+    if (end.tv_sec == 0 && end.tv_nsec == 0) clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - usage->started.tv_sec) + (end.tv_nsec - usage->started.tv_nsec) / 1e9;
+}
 
-    // OS Concept: Terminal Control - Give terminal control back to the shell.
-    if (shell_is_interactive) {
-        if (tcgetpgrp(terminal_fd) != cash_pgid) {
-            tcsetpgrp(terminal_fd, cash_pgid);
-        }
-    }
+/**
+ * @brief Print the totals a 'limit' job's cgroup recorded: CPU of the whole process
+ * tree (daemons and grandchildren too, which wait4 never sees) and its peak memory.
+ */
+static void print_cgroup_usage(FILE *out, const char *prefix, const job_usage_t *u) {
+    fprintf(out, "%suser %.3fs  sys %.3fs", prefix, timeval_seconds(u->cgroup_user), timeval_seconds(u->cgroup_system));
+    if (u->cgroup_peak_kb >= 0) fprintf(out, "  memory.peak %lldK", u->cgroup_peak_kb);
+    fputc('\n', out);
+}
 
-    // Update job status based on why waitpid returned
-    if (result > 0) {
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            remove_job_by_pgid(job->pgid); // Job finished
-        } else if (WIFSTOPPED(status)) {
-            job->state = JOB_STATE_STOPPED; // Job stopped
-            job->notified = 0; // Will be notified by check_jobs_status
+/**
+ * @brief Print a job's totals and one line per process (for 'jobs -l').
+ * CPU figures only cover processes that have already exited.
+ * @param job The job.
+ */
+void print_job_usage(const job_t *job) {
+    const job_usage_t *u = &job->usage;
+    printf("      wall %.3fs  user %.3fs  sys %.3fs  maxrss %ldK  ctxsw %ld/%ld\n",
+           job_wall_seconds(u), timeval_seconds(u->utime), timeval_seconds(u->stime),
+           u->maxrss_kb, u->nvcsw, u->nivcsw);
+    if (u->cgroup) print_cgroup_usage(stdout, "      cgroup ", u);
+    for (int i = 0; i < job->nprocs; i++) {
+        const process_t *proc = &job->procs[i];
+        if (!proc->done) {
+            printf("      %-7d %-9s %s\n", proc->pid, job->state == JOB_STATE_STOPPED ? "stopped" : "running", proc->name);
+        } else {
+            char state[16]; // How it ended: "exit N" or "signal N"
+            if (WIFSIGNALED(proc->status)) snprintf(state, sizeof(state), "signal %d", WTERMSIG(proc->status));
+            else snprintf(state, sizeof(state), "exit %d", wait_status_exit_code(proc->status));
+            printf("      %-7d %-9s %s  (user %.3fs  sys %.3fs  maxrss %ldK)\n", proc->pid, state, proc->name,
+                   timeval_seconds(proc->usage.ru_utime), timeval_seconds(proc->usage.ru_stime),
+                   rusage_maxrss_kb(&proc->usage));
         }
-    } else if (result < 0) { // Error (ECHILD means already gone)
-        if (errno != ECHILD) { perror("ca$h: waitpid error in wait_for_job"); }
-        remove_job_by_pgid(job->pgid); // Clean up job entry if wait failed
     }
 }
 
 /**
- * @brief Bring a background job to the foreground.
- * @param job The job to bring to the foreground.
- * @param cont 1 if the job should be sent SIGCONT (if stopped), 0 otherwise.
+ * @brief Print a 'time' report to stderr (like other shells, so stdout stays clean).
+ * @param usage Totals to report.
  */
-void put_job_in_foreground(job_t *job, int cont) {
-    if (!job || !shell_is_interactive || job->state == JOB_STATE_INVALID) return;
-
-    job->state = JOB_STATE_RUNNING; // Assume it will be running
-    job->notified = 1; // Don't need immediate notification
+void print_usage_report(const job_usage_t *usage) {
+    double real = job_wall_seconds(usage);
+    fprintf(stderr, "\nreal\t%dm%.3fs\n", (int)(real / 60), real - 60 * (int)(real / 60));
+    double user = timeval_seconds(usage->utime), sys = timeval_seconds(usage->stime);
+    fprintf(stderr, "user\t%dm%.3fs\n", (int)(user / 60), user - 60 * (int)(user / 60));
+    fprintf(stderr, "sys\t%dm%.3fs\n", (int)(sys / 60), sys - 60 * (int)(sys / 60));
+    fprintf(stderr, "maxrss\t%ldK\n", usage->maxrss_kb);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->nvcsw, usage->nivcsw);
+    if (usage->cgroup) print_cgroup_usage(stderr, "cgroup\t", usage);
+}
 
-    // OS Concept: Terminal Control - Give terminal to the job's group.
+/**
+ * @brief Report a finished 'time'd job: totals, plus each stage of a pipeline.
+ * @param job The finished job.
+ */
+static void report_job_time(const job_t *job) {
+    print_usage_report(&job->usage);
+    if (job->nprocs < 2) return;
+    // Per-stage breakdown, to spot the slow stage of a pipeline
+    for (int i = 0; i < job->nprocs; i++) {
+        const process_t *proc = &job->procs[i];
+        fprintf(stderr, "  %d: %-16s user %.3fs  sys %.3fs  maxrss %ldK\n", i + 1, proc->name,
+                timeval_seconds(proc->usage.ru_utime), timeval_seconds(proc->usage.ru_stime),
+                rusage_maxrss_kb(&proc->usage));
+    }
+}
+
+/**
+ * @brief How a finished job ended, for its notice: "Done", "Exit N" or the signal's description.
+ * @param job The finished job.
+ * @param buf Buffer for the "Exit N" form.
+ * @param size Size of buf.
+ * @return The text (buf or a static string).
+ */
+static const char* job_done_text(const job_t *job, char *buf, size_t size) {
+    if (job->nprocs == 0 || !job->procs[job->nprocs - 1].done) return "Done";
+    int status = job->procs[job->nprocs - 1].status;
+    if (WIFSIGNALED(status)) return strsignal(WTERMSIG(status));
+    if (WEXITSTATUS(status) == 0) return "Done";
+    snprintf(buf, size, "Exit %d", WEXITSTATUS(status));
+    return buf;
+}
+
+/**
+ * @brief Queue a job's "Done" / "Stopped" notice. Reaping queues the jobs that changed,
+ * so reporting never has to scan the job table.
+ * @param job A background job that finished, or a job that stopped.
+ */
+void job_queue_notice(job_t *job) {
+    if (job->queued || job->jid == 0) return;
+    if (job_table.notice_count == job_table.notice_capacity) {
+        int new_capacity = job_table.notice_capacity ? job_table.notice_capacity * 2 : 16;
+        int *new_notices = realloc(job_table.notices, new_capacity * sizeof(int));
+        if (!new_notices) { perror("ca$h: realloc failed for job notices"); return; }
+        job_table.notices = new_notices;
+        job_table.notice_capacity = new_capacity;
+    }
+    job_table.notices[job_table.notice_count++] = job->jid;
+    job->queued = 1;
+}
+
+/**
+ * @brief Prints notifications for background jobs that finished or stopped ("Done", "Exit N", "Stopped").
+ * Called before the prompt and whenever children change state while the user is typing.
+ * Only the queued jobs are looked at (by jid, through the hash index), and their notices
+ * go out together through the built-in output buffer: one write() for the lot.
+ * Job states are updated by reap_children/wait_for_job.
+ */
+void check_jobs_status() {
+    fflush(stdout); // Anything printf'd before goes first
+    for (int n = 0; n < job_table.notice_count; n++) {
+        int slot = find_job_slot_by_jid(job_table.notices[n]);
+        if (slot == -1) continue; // Brought to the foreground and waited for meanwhile
+        job_t *job = &job_table.slots[slot];
+        job->queued = 0;
+        char line[64];
+        // Report background jobs that finished, then free the slot
+        if (job->state == JOB_STATE_DONE && !job->foreground) {
+            char text[16];
+            int len = snprintf(line, sizeof(line), "[%d] %s\t", job->jid, job_done_text(job, text, sizeof(text)));
+            out_write(line, len);
+            out_puts(job->command);
+            out_putc('\n');
+            if (job->timed) { out_flush(); report_job_time(job); }
+            remove_job(job);
+        }
+        // Report jobs that stopped (background, or a foreground job hit by Ctrl+Z)
+        else if (job->state == JOB_STATE_STOPPED && !job->notified) {
+            int len = snprintf(line, sizeof(line), "[%d] Stopped\t", job->jid);
+            out_write(line, len);
+            out_puts(job->command);
+            out_putc('\n');
+            job->notified = 1; // Mark as notified for this stop
+        }
+    }
+    job_table.notice_count = 0;
+    out_flush();
+}
+
+/**
+ * @brief Convert a raw wait status into a shell exit status (128+N for signal N).
+ * @param status Status from wait4().
+ * @return 0-255.
+ */
+int wait_status_exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+/**
+ * @brief Exit status of a job, like a shell reports it: the last stage's status once
+ * it is done, or 128+N if the job was stopped by signal N.
+ * @param job The job.
+ * @return 0-255.
+ */
+int job_exit_status(const job_t *job) {
+    if (job->state == JOB_STATE_STOPPED) {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (!job->procs[i].done && WIFSTOPPED(job->procs[i].status)) return wait_status_exit_code(job->procs[i].status);
+        }
+        return 128 + SIGTSTP;
+    }
+    if (job->nprocs == 0 || !job->procs[job->nprocs - 1].done) return 1; // Never ran / not collected
+    return wait_status_exit_code(job->procs[job->nprocs - 1].status);
+}
+
+/**
+ * @brief Add one status to $PIPESTATUS.
+ * @param code Exit status (0-255).
+ */
+void pipestatus_push(int code) {
+    if (pipestatus.count == pipestatus.capacity) {
+        int new_capacity = pipestatus.capacity ? pipestatus.capacity * 2 : 8;
+        int *new_codes = realloc(pipestatus.codes, new_capacity * sizeof(int));
+        if (!new_codes) { perror("ca$h: realloc failed for PIPESTATUS"); return; }
+        pipestatus.codes = new_codes;
+        pipestatus.capacity = new_capacity;
+    }
+    pipestatus.codes[pipestatus.count++] = code;
+}
+
+/**
+ * @brief Set $PIPESTATUS from a finished job: one status per stage, taken from the
+ * wait statuses its processes were reaped with.
+ * @param job The finished job.
+ */
+void job_collect_pipestatus(const job_t *job) {
+    pipestatus.count = 0;
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].helper) continue;
+        pipestatus_push(job->procs[i].done ? wait_status_exit_code(job->procs[i].status) : 1);
+    }
+}
+
+/**
+ * @brief Tell the user that a foreground job was killed by a signal ("Segmentation fault
+ * (core dumped)"). Ctrl+C and broken pipes are expected, so they stay silent.
+ * @param job The finished job.
+ */
+void report_signal_death(const job_t *job) {
+    if (job->nprocs == 0 || !job->procs[job->nprocs - 1].done) return;
+    int status = job->procs[job->nprocs - 1].status;
+    if (!WIFSIGNALED(status) || WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGPIPE) return;
+#ifdef WCOREDUMP
+    int core = WCOREDUMP(status);
+#else
+    int core = 0;
+#endif
+    fflush(stdout);
+    fprintf(stderr, "%s%s\n", strsignal(WTERMSIG(status)), core ? " (core dumped)" : "");
+}
+
+/**
+ * @brief Waits until a job finishes or stops. Every child reaped meanwhile (including
+ * other jobs' processes) is dispatched through update_process_status, so nothing is lost.
+ * @param job Pointer to the job to wait for.
+ * @return The job's exit status (job_exit_status), collected before a finished job is dropped.
+ * A finished job also sets $PIPESTATUS.
+ */
+int wait_for_job(job_t *job) {
+    if (!job || job->state == JOB_STATE_INVALID) return 1;
+
+    // OS Concept: Waiting for Children - Blocking wait4 in normal context (not in a handler).
+    // WUNTRACED: Report status if a child stops (e.g., via SIGTSTP).
+    // wait4 also returns the child's resource usage, which is added to its job.
+    long long trace = trace_start();
+    while (job->state == JOB_STATE_RUNNING && job->nlive > 0) {
+        int status = 0;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            if (errno != ECHILD) { perror("ca$h: wait4 error in wait_for_job"); }
+            job->state = JOB_STATE_DONE; // Nothing left to wait for
+            break;
+        }
+        update_process_status(pid, status, &usage);
+    }
+    if (job->nlive == 0 && job->state == JOB_STATE_RUNNING) job->state = JOB_STATE_DONE;
+    trace_end(TRACE_WAIT, trace, job->command);
+
+    // OS Concept: Terminal Control - Give terminal control back to the shell.
+    if (shell_is_interactive) {
+        trace = trace_start();
+        if (tcgetpgrp(terminal_fd) != cash_pgid) {
+            tcsetpgrp(terminal_fd, cash_pgid);
+        }
+        trace_end(TRACE_TERMINAL, trace, "(shell)");
+    }
+
+    // A finished foreground job needs no notice; a stopped one is reported by check_jobs_status
+    int status = job_exit_status(job);
+    if (job->state == JOB_STATE_DONE && job->foreground) {
+        job_collect_pipestatus(job);
+        report_signal_death(job);
+        if (job->timed) report_job_time(job);
+        remove_job(job);
+    }
+    return status;
+}
+
+/**
+ * @brief Bring a job to the foreground (a new job, or a background/stopped one via `fg`).
+ * @param job The job to bring to the foreground.
+ * @param cont 1 if the job should be sent SIGCONT (if stopped), 0 otherwise.
+ * @return The job's exit status once it finished or stopped.
+ */
+int put_job_in_foreground(job_t *job, int cont) {
+    if (!job || !shell_is_interactive || job->state == JOB_STATE_INVALID) return 1;
+
+    job->state = JOB_STATE_RUNNING; // Assume it will be running
+    job->notified = 1; // Don't need immediate notification
+    job->foreground = 1;
+
+    // OS Concept: Terminal Control - Give terminal to the job's group.
+    long long trace = trace_start();
     if (tcsetpgrp(terminal_fd, job->pgid) == -1) {
          perror("ca$h: tcsetpgrp error in foreground");
     }
+    trace_end(TRACE_TERMINAL, trace, job->command);
 
     // OS Concept: Sending Signals - Send SIGCONT if job was stopped.
     if (cont) {
@@ -311,7 +1861,7 @@ void put_job_in_foreground(job_t *job, int cont) {
     }
 
     // Wait for this job to finish or stop again
-    wait_for_job(job);
+    return wait_for_job(job);
 }
 
 /**
@@ -329,6 +1879,7 @@ void put_job_in_background(job_t *job, int cont) {
 
      job->state = JOB_STATE_RUNNING;
      job->notified = 1; // Don't need immediate notification
+     job->foreground = 0;
 
      if (cont) {
          // OS Concept: Sending Signals - Resume the stopped job group.
@@ -339,62 +1890,157 @@ void put_job_in_background(job_t *job, int cont) {
      }
 }
 
-// --- Signal Handler ---
+// --- Child Event Functions (SIGCHLD) ---
 
 /**
- * @brief Handles SIGCHLD signal (sent when a child process stops or terminates).
- * Updates the status of jobs in the job list asynchronously.
+ * @brief Handles SIGCHLD on systems without signalfd. Only writes a byte to the
+ * self-pipe (async-signal-safe); the main loop reaps children in normal context.
  * @param sig The signal number received (unused).
  */
 void handle_sigchld(int sig) {
     int saved_errno = errno; // Preserve errno around async signal handling
-    pid_t pid;
-    int status;
+    char byte = 0;
+    // Non-blocking: if the pipe is full, a wakeup is already pending
+    (void)!write(child_event_pipe[WRITE_END], &byte, 1);
+    errno = saved_errno; // Restore errno
+}
 
-    // OS Concept: Non-blocking Wait - Check for any child status change without pausing.
-    // WUNTRACED: Also detect stopped children.
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        // Find the job associated with the process group of the changed child
-        pid_t job_pgid = getpgid(pid); // Note: May fail if pid exited instantly
-        job_t *job = NULL;
-
-        if (job_pgid > 0) {
-             job = get_job_by_pgid(job_pgid);
-        }
-
-        if (job) { // If it's a tracked background job
-            if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                 // Job terminated - mark for removal and notification later
-                 job->state = JOB_STATE_INVALID;
-                 job->notified = 0;
-            } else if (WIFSTOPPED(status)) {
-                 // Job stopped - update state if not already marked
-                 if (job->state != JOB_STATE_STOPPED || !job->notified) {
-                     job->state = JOB_STATE_STOPPED;
-                     job->notified = 0;
-                 }
-            }
+/**
+ * @brief Set up child_event_fd, which becomes readable whenever a child changes state.
+ * Linux: SIGCHLD is blocked and read from a signalfd. Elsewhere: a self-pipe fed by handle_sigchld.
+ * @return 1 on success, 0 on failure (reported).
+ */
+int init_child_events() {
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    // OS Concept: Signal Masking - Blocked SIGCHLD stays pending and is delivered through the fd.
+    // Children get an empty mask back (posix_spawn attribute / handle_child_execution).
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    child_event_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_event_fd < 0) { perror("ca$h: signalfd failed"); sigprocmask(SIG_UNBLOCK, &mask, NULL); return 0; }
+#else
+    // OS Concept: Self-Pipe Trick - The handler's write wakes up poll() in the main loop.
+    if (pipe(child_event_pipe) < 0) { perror("ca$h: pipe failed for SIGCHLD events"); return 0; }
+    for (int i = 0; i < 2; i++) {
+        fcntl(child_event_pipe[i], F_SETFL, fcntl(child_event_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(child_event_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    child_event_fd = child_event_pipe[READ_END];
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // Keep readline's read() calls going
+    sigaction(SIGCHLD, &sa, NULL);
+#endif
+    return 1;
+}
+
+/**
+ * @brief Consume pending SIGCHLD notifications from child_event_fd.
+ */
+void drain_child_events() {
+    if (child_event_fd < 0) return;
+#ifdef __linux__
+    struct signalfd_siginfo info[8];
+    while (read(child_event_fd, info, sizeof(info)) > 0) { }
+#else
+    char buf[64];
+    while (read(child_event_fd, buf, sizeof(buf)) > 0) { }
+#endif
+}
+
+/**
+ * @brief Apply one wait4() result to the job owning the child.
+ * The pid index maps the child back to its job even after it has exited
+ * (getpgid() would fail for an already reaped child).
+ * @param pid PID returned by wait4.
+ * @param status Raw wait status.
+ * @param usage Resource usage of the child (only meaningful once it terminated).
+ */
+void update_process_status(pid_t pid, int status, const struct rusage *usage) {
+    if (pid == history_store.compactor && !WIFSTOPPED(status)) { history_store.compactor = 0; return; }
+    int slot = pid_index_lookup(pid);
+    if (slot == -1) return; // Not a tracked job process
+    job_t *job = &job_table.slots[slot];
+
+    if (WIFSTOPPED(status)) {
+        // Job stopped: a foreground job becomes a numbered background job
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].pid == pid) { job->procs[i].status = status; break; }
+        }
+        if (job->jid == 0) job_assign_jid(job);
+        job->state = JOB_STATE_STOPPED;
+        job->notified = 0;
+        job->foreground = 0;
+        job_queue_notice(job);
+        return;
+    }
+
+    // Terminated (exited or killed by a signal)
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid == pid) {
+            job->procs[i].status = status;
+            job->procs[i].done = 1;
+            job->procs[i].usage = *usage;
+            break;
         }
-        // If job is NULL, it might be a foreground process that we handle elsewhere,
-        // or a process that terminated very quickly.
     }
+    // OS Concept: Resource Accounting - CPU time and context switches add up over the
+    // stages; the peak RSS of a job is the largest of its processes.
+    job_usage_t *total = &job->usage;
+    timeradd(&total->utime, &usage->ru_utime, &total->utime);
+    timeradd(&total->stime, &usage->ru_stime, &total->stime);
+    if (rusage_maxrss_kb(usage) > total->maxrss_kb) total->maxrss_kb = rusage_maxrss_kb(usage);
+    total->nvcsw += usage->ru_nvcsw;
+    total->nivcsw += usage->ru_nivcsw;
 
-    // ECHILD means no children left, which is fine. Other errors are unexpected.
-    if (pid < 0 && errno != ECHILD) {
-       // Avoid stdio in handlers: perror("ca$h: waitpid error in SIGCHLD handler");
+    pid_index_remove(pid);
+    job->nlive--;
+    if (job->nlive == 0) {
+        job->state = JOB_STATE_DONE;
+        job->notified = 0;
+        clock_gettime(CLOCK_MONOTONIC, &total->finished);
+        job_cgroup_collect(job);
+        // Nobody prints notices in non-interactive mode, so finished background jobs go right away
+        if (!job->foreground && !shell_is_interactive) {
+            if (job->timed) report_job_time(job);
+            remove_job(job);
+        } else if (!job->foreground) {
+            job_queue_notice(job);
+        }
     }
+}
 
-    errno = saved_errno; // Restore errno
+/**
+ * @brief Reap every child that has changed state, without blocking. Runs in normal
+ * context (main loop or before a script line), never inside a signal handler.
+ */
+void reap_children() {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    // OS Concept: Non-blocking Wait - Check for any child status change without pausing.
+    // WUNTRACED: Also detect stopped children.
+    long long trace = trace_start();
+    int reaped = 0;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+        update_process_status(pid, status, &usage);
+        reaped++;
+    }
+    if (reaped) trace_end(TRACE_REAP, trace, NULL); // Calls that found nothing are not a phase
 }
 
-// --- History File Path Helper ---
+// --- History Persistence Functions ---
 /**
  * @brief Construct the full path for the history file (~/.cash_history).
  * @return Allocated string with the path (must be freed), or NULL.
  */
 char* get_history_filepath() {
     // OS Concept: Environment Variables - Accessing user's home directory.
-    char *home_dir = getenv("HOME");
+    const char *home_dir = var_get("HOME");
     if (!home_dir) {
         fprintf(stderr, "ca$h: Cannot find HOME directory for history file.\n");
         return NULL;
@@ -410,483 +2056,6826 @@ char* get_history_filepath() {
     return filepath;
 }
 
+/**
+ * @brief Open the history file for appending and the lock file next to it.
+ * Without them the shell still works; history is just not saved.
+ * @param path History file path (ownership passes to the store).
+ */
+void history_open(const char *path) {
+    history_store.path = (char *)path;
+    size_t len = strlen(path) + sizeof(HISTORY_LOCK_SUFFIX);
+    history_store.lock_path = malloc(len);
+    if (!history_store.lock_path) { perror("ca$h: malloc failed for history lock path"); return; }
+    snprintf(history_store.lock_path, len, "%s%s", path, HISTORY_LOCK_SUFFIX);
 
-// --- Main Function ---
-int main() {
-    char input_buffer[MAX_INPUT]; // Mutable buffer for parsing command line
-    char original_input_for_job[MAX_INPUT]; // For storing job titles cleanly
-    char *line_read = NULL; // Buffer allocated by readline()
-    char *history_filepath = NULL;
+    // OS Concept: File I/O - O_APPEND makes every write() land atomically at the end of
+    // the file, even with several sessions writing to it at once.
+    history_store.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    history_store.lock_fd = open(history_store.lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (history_store.fd < 0 || history_store.lock_fd < 0 || fstat(history_store.fd, &history_store.st) < 0) {
+        fprintf(stderr, "ca$h: history will not be saved: %s\n", strerror(errno));
+        history_close();
+        return;
+    }
+    history_store.file_size = history_store.st.st_size;
+    if (history_store.file_size > HISTORY_COMPACT_BYTES) history_compact_start();
+}
 
-    init_jobs(); // Initialize job control structures
+/**
+ * @brief Read the history file into readline's list the first time it is needed.
+ * The file is mmap'd and only its last HISTORY_LIMIT lines are added, so the cost no
+ * longer grows with the file, and no prompt waits for it unless history is used.
+ * Lines from other sessions that were appended since startup are picked up too.
+ */
+void history_ensure_loaded() {
+    if (history_store.loaded || !history_store.path) return;
+    history_store.loaded = 1;
+    history_flush(0); // Lines typed so far are in the file (or still pending, re-added below)
 
-    // --- Shell Initialization ---
-    terminal_fd = STDIN_FILENO;
-    // OS Concept: TTY Detection - Is the shell connected to a terminal?
-    shell_is_interactive = isatty(terminal_fd);
+    // OS Concept: Memory-Mapped Files - Map the file instead of reading it in a loop.
+    int fd = open(history_store.path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char *text = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) { perror("ca$h: mmap failed for history"); text = NULL; }
+    }
+    if (fd >= 0) close(fd);
 
-    if (shell_is_interactive) {
-        // OS Concept: Process Groups & Terminal Control - Take control of the terminal.
-        // Loop until shell is in the foreground process group
-        while (tcgetpgrp(terminal_fd) != (cash_pgid = getpgrp())) {
-            kill(-cash_pgid, SIGKILL); // Safety kill if started in background
-        }
-        // Set shell's process group as the terminal's foreground group
-        cash_pgid = getpgrp();
-        if (tcsetpgrp(terminal_fd, cash_pgid) == -1) {
-            perror("ca$h: Couldn't grab control of terminal");
-            shell_is_interactive = 0; // Fallback to non-interactive?
-        }
-
-        // OS Concept: Signal Handling - Shell ignores job control/interrupt signals.
-        signal(SIGINT, SIG_IGN);  // Ctrl+C
-        signal(SIGQUIT, SIG_IGN); // Ctrl+backslash
-        signal(SIGTSTP, SIG_IGN); // Ctrl+Z
-        signal(SIGTTIN, SIG_IGN); // Background read attempt
-        signal(SIGTTOU, SIG_IGN); // Background write attempt
-        signal(SIGCHLD, handle_sigchld); // Handle child status changes
-
-        // Initialize command history
-        history_filepath = get_history_filepath();
-        if (history_filepath) {
-            // OS Concept: File I/O - Reading history from file.
-            read_history(history_filepath);
-            stifle_history(1000); // Limit history size (optional)
+    clear_history(); // Drop this session's lines: the file (or pending) has them in order
+    history_index_clear();
+    if (text) {
+        size_t len = st.st_size, start = len, lines = 0;
+        if (start > 0 && text[start - 1] == '\n') start--;
+        while (start > 0) {
+            if (text[start - 1] == '\n' && ++lines == HISTORY_LIMIT) break;
+            start--;
         }
-    } else {
-         printf("ca$h: Warning: Not running interactively. Job control/History disabled.\n");
+        char *entry = NULL;
+        size_t entry_cap = 0;
+        while (start < len) {
+            const char *end = memchr(text + start, '\n', len - start);
+            size_t entry_len = (end ? (size_t)(end - text) : len) - start;
+            if (entry_len + 1 > entry_cap) {
+                entry_cap = entry_len + 64;
+                char *new_entry = realloc(entry, entry_cap);
+                if (!new_entry) break;
+                entry = new_entry;
+            }
+            memcpy(entry, text + start, entry_len); // add_history wants a C string
+            entry[entry_len] = '\0';
+            if (entry_len > 0) history_record(entry);
+            start += entry_len + 1;
+        }
+        free(entry);
+        munmap(text, st.st_size);
+    }
+    for (size_t i = 0; i < history_store.pending_len; ) {
+        char *end = memchr(history_store.pending + i, '\n', history_store.pending_len - i);
+        *end = '\0'; // Every pending line ends in '\n'; restore it after the copy
+        history_record(history_store.pending + i);
+        *end = '\n';
+        i = end - history_store.pending + 1;
     }
+    using_history(); // Recall starts again from the newest entry
+}
 
-    display_welcome_message();
+// Readline commands that look at the history list load it first
+#define LAZY_HISTORY_COMMAND(name, fn) \
+    static int name(int count, int key) { history_ensure_loaded(); return fn(count, key); }
+LAZY_HISTORY_COMMAND(lazy_previous_history, rl_get_previous_history)
+LAZY_HISTORY_COMMAND(lazy_next_history, rl_get_next_history)
+LAZY_HISTORY_COMMAND(lazy_beginning_of_history, rl_beginning_of_history)
+LAZY_HISTORY_COMMAND(lazy_history_search_backward, rl_history_search_backward)
+LAZY_HISTORY_COMMAND(lazy_history_search_forward, rl_history_search_forward)
+LAZY_HISTORY_COMMAND(lazy_noninc_reverse_search, rl_noninc_reverse_search)
+LAZY_HISTORY_COMMAND(lazy_yank_last_arg, rl_yank_last_arg)
 
-    // --- Main Shell Loop ---
-    while(1) {
-        if (shell_is_interactive) {
-             check_jobs_status(); // Report background job status changes
+/**
+ * @brief Rebind every key that runs a history command to a wrapper that loads the
+ * history first, and the incremental searches to the indexed search.
+ * Call after readline has set up its keymaps (arrow keys included).
+ */
+void history_install_lazy_bindings() {
+    static const struct { rl_command_func_t *original; rl_command_func_t *lazy; } commands[] = {
+        { rl_get_previous_history,    lazy_previous_history },
+        { rl_get_next_history,        lazy_next_history },
+        { rl_beginning_of_history,    lazy_beginning_of_history },
+        { rl_reverse_search_history,  history_isearch_backward },
+        { rl_forward_search_history,  history_isearch_forward },
+        { rl_history_search_backward, lazy_history_search_backward },
+        { rl_history_search_forward,  lazy_history_search_forward },
+        { rl_noninc_reverse_search,   lazy_noninc_reverse_search },
+        { rl_yank_last_arg,           lazy_yank_last_arg },
+    };
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        char **keyseqs = rl_invoking_keyseqs(commands[i].original);
+        if (!keyseqs) continue;
+        for (int k = 0; keyseqs[k]; k++) {
+            rl_bind_keyseq(keyseqs[k], commands[i].lazy);
+            free(keyseqs[k]);
         }
+        free(keyseqs);
+    }
+}
 
-        // Free memory from previous readline call
-        if (line_read) {
-            // OS Concept: Memory Management - Freeing readline's buffer.
-            free(line_read);
-            line_read = NULL;
-        }
+/**
+ * @brief Add a line to readline's history list and to the search index.
+ * @param line The line.
+ */
+void history_record(const char *line) {
+    add_history(line);
+    history_index_add(line);
+}
 
-        // OS Concept: Input Reading - Use readline for interactive input.
-        line_read = readline("ca$h> ");
+// --- History Search Index Functions ---
 
-        // Handle EOF (Ctrl+D) or readline error
-        if (line_read == NULL) {
-            printf("\nClosing ca$h...\n");
-            break;
-        }
+/**
+ * @brief Posting list a trigram belongs to.
+ * @param p At least three bytes.
+ */
+static trigram_posting_t* trigram_bucket(const char *p) {
+    unsigned int key = ((unsigned char)p[0] << 16) | ((unsigned char)p[1] << 8) | (unsigned char)p[2];
+    return &history_index.buckets[(key * 2654435769u) >> 16 & (TRIGRAM_BUCKETS - 1)];
+}
 
-        // Skip empty input lines (just Enter or whitespace)
-        char *trimmed_line = line_read + strspn(line_read, " \t\n\r");
-        if (*trimmed_line == '\0') {
-            continue;
+/**
+ * @brief Add the trigrams of entry 'id' to the index.
+ */
+static void history_index_insert(int id) {
+    const char *line = history_index.entries[id];
+    size_t len = strlen(line);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        trigram_posting_t *list = trigram_bucket(line + i);
+        if (list->count > 0 && list->ids[list->count - 1] == (unsigned int)id) continue; // Already listed
+        if (list->count == list->capacity) {
+            unsigned int new_capacity = list->capacity ? list->capacity * 2 : 4;
+            unsigned int *new_ids = realloc(list->ids, new_capacity * sizeof(unsigned int));
+            if (!new_ids) { perror("ca$h: realloc failed for history index"); return; }
+            list->ids = new_ids;
+            list->capacity = new_capacity;
         }
+        list->ids[list->count++] = id;
+    }
+}
 
-        // Add non-empty line to history (if interactive)
-        if (shell_is_interactive && line_read && *line_read) {
-             add_history(line_read);
-        }
+/**
+ * @brief Append a history line to the index. Once the index holds twice HISTORY_LIMIT
+ * entries (readline has forgotten the older ones), it drops them and re-indexes the rest.
+ * @param line The line (copied).
+ */
+void history_index_add(const char *line) {
+    if (!history_index.buckets) {
+        history_index.buckets = calloc(TRIGRAM_BUCKETS, sizeof(trigram_posting_t));
+        if (!history_index.buckets) { perror("ca$h: calloc failed for history index"); return; }
+    }
+    if (history_index.count >= 2 * HISTORY_LIMIT) {
+        int drop = history_index.count - HISTORY_LIMIT;
+        for (int i = 0; i < drop; i++) free(history_index.entries[i]);
+        memmove(history_index.entries, history_index.entries + drop, HISTORY_LIMIT * sizeof(char *));
+        history_index.count = HISTORY_LIMIT;
+        for (int b = 0; b < TRIGRAM_BUCKETS; b++) history_index.buckets[b].count = 0;
+        for (int i = 0; i < history_index.count; i++) history_index_insert(i);
+    }
+    if (history_index.count == history_index.capacity) {
+        int new_capacity = history_index.capacity ? history_index.capacity * 2 : 256;
+        char **new_entries = realloc(history_index.entries, new_capacity * sizeof(char *));
+        if (!new_entries) { perror("ca$h: realloc failed for history index"); return; }
+        history_index.entries = new_entries;
+        history_index.capacity = new_capacity;
+    }
+    char *copy = strdup(line);
+    if (!copy) { perror("ca$h: strdup failed for history index"); return; }
+    history_index.entries[history_index.count] = copy;
+    history_index_insert(history_index.count++);
+}
 
-        // Prepare command for execution
-        // 1. Store original (cleaned) command for job list title
-        strncpy(original_input_for_job, line_read, MAX_INPUT - 1);
-        original_input_for_job[MAX_INPUT - 1] = '\0';
-        char *end_job_title = original_input_for_job + strlen(original_input_for_job) - 1;
-        while (end_job_title >= original_input_for_job && strchr(" \t\n\r&", *end_job_title)) { *end_job_title-- = '\0'; }
+/**
+ * @brief Empty the index (posting list memory is kept for re-use).
+ */
+void history_index_clear() {
+    for (int i = 0; i < history_index.count; i++) free(history_index.entries[i]);
+    history_index.count = 0;
+    if (history_index.buckets) {
+        for (int b = 0; b < TRIGRAM_BUCKETS; b++) history_index.buckets[b].count = 0;
+    }
+}
 
-        // 2. Copy to mutable buffer for parsing (strtok modifies)
-        strncpy(input_buffer, line_read, MAX_INPUT - 1);
-        input_buffer[MAX_INPUT - 1] = '\0';
+/**
+ * @brief Find the nearest entry containing a pattern, starting next to an entry.
+ * @param pattern Substring to look for (non-empty).
+ * @param from Entry to start beside (excluded); history_index.count or -1 for the ends.
+ * @param direction -1 for older entries, +1 for newer.
+ * @return Matching entry id, or -1.
+ */
+int history_index_search(const char *pattern, int from, int direction) {
+    size_t len = strlen(pattern);
+    if (len < 3 || !history_index.buckets) {
+        // Too short for a trigram: the nearest match is usually close anyway
+        for (int id = from + direction; id >= 0 && id < history_index.count; id += direction) {
+            if (strstr(history_index.entries[id], pattern)) return id;
+        }
+        return -1;
+    }
+    // Every match contains all of the pattern's trigrams: scan the rarest one's list
+    trigram_posting_t *shortest = trigram_bucket(pattern);
+    for (size_t i = 1; i + 3 <= len; i++) {
+        trigram_posting_t *list = trigram_bucket(pattern + i);
+        if (list->count < shortest->count) shortest = list;
+    }
+    // Binary search for the first listed id past 'from' in the search direction
+    int lo = 0, hi = shortest->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ((int)shortest->ids[mid] < from + (direction > 0)) lo = mid + 1; else hi = mid;
+    }
+    for (int k = direction > 0 ? lo : lo - 1; k >= 0 && k < (int)shortest->count; k += direction) {
+        int id = shortest->ids[k];
+        if (strstr(history_index.entries[id], pattern)) return id; // Drop hash collisions
+    }
+    return -1;
+}
 
-        // Execute the command line (handles pipes, jobs, etc.)
-        execute_pipeline(input_buffer, original_input_for_job);
+/**
+ * @brief Show the search prompt and the current match (or the failure) on the input line.
+ */
+static void history_search_display() {
+    rl_message("(%s%s-i-search)`%s': ", isearch.failed ? "failed " : "",
+               isearch.direction < 0 ? "reverse" : "forward", isearch.query);
+    if (isearch.match >= 0) {
+        const char *entry = history_index.entries[isearch.match];
+        rl_replace_line(entry, 0);
+        const char *hit = isearch.query_len ? strstr(entry, isearch.query) : NULL;
+        rl_point = hit ? (int)(hit - entry) : 0;
     }
+    rl_redisplay();
+}
 
-    // --- Shell Exit ---
-    if (line_read) { free(line_read); } // Free last input line
+/**
+ * @brief Search again from the current match with the current query.
+ * @param include_current 1 if the current match may be kept (the query just grew).
+ */
+static void history_search_update(int include_current) {
+    if (isearch.query_len == 0) { isearch.failed = 0; history_search_display(); return; }
+    int from = isearch.match >= 0 ? isearch.match
+             : (isearch.direction < 0 ? history_index.count : -1);
+    if (include_current && isearch.match >= 0) from -= isearch.direction;
+    int found = history_index_search(isearch.query, from, isearch.direction);
+    isearch.failed = (found < 0);
+    if (found < 0) rl_ding();
+    else isearch.match = found;
+    history_search_display();
+}
 
-    // Save history to file
-    if (shell_is_interactive && history_filepath) {
-        // OS Concept: File I/O - Writing history to file.
-        write_history(history_filepath);
-        free(history_filepath); // Free the path string
-    }
+/**
+ * @brief Leave search mode; the shown match stays on the input line.
+ */
+static void history_search_end() {
+    rl_set_keymap(isearch.saved_keymap);
+    isearch.active = 0;
+    free(isearch.saved_line);
+    isearch.saved_line = NULL;
+    rl_clear_message();
+}
 
-    // Clean up any remaining job command strings
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (job_list[i].command != NULL) { free(job_list[i].command); }
+// Search keymap commands: typing extends the query, Ctrl-R/Ctrl-S jump to the next
+// match, Backspace shortens the query, Ctrl-G restores the line, any other key ends
+// the search and then does its usual job (Enter runs the match, arrows move).
+static int history_search_insert(int count, int key) {
+    if (isearch.query_len + 1 < SEARCH_QUERY_MAX) {
+        isearch.query[isearch.query_len++] = key;
+        isearch.query[isearch.query_len] = '\0';
     }
+    history_search_update(1);
+    return 0;
+}
 
-    printf("ca$h closed.\n");
+static int history_search_backspace(int count, int key) {
+    if (isearch.query_len > 0) isearch.query[--isearch.query_len] = '\0';
+    isearch.match = -1; // Search the shorter query again from the newest/oldest end
+    history_search_update(1);
     return 0;
 }
 
+static int history_search_again(int count, int key) {
+    isearch.direction = (key == CTRL('S')) ? 1 : -1;
+    history_search_update(0);
+    return 0;
+}
 
-// --- Core Shell Helper Functions ---
+static int history_search_abort(int count, int key) {
+    rl_replace_line(isearch.saved_line ? isearch.saved_line : "", 0);
+    rl_point = isearch.saved_point;
+    history_search_end();
+    rl_redisplay();
+    return 0;
+}
 
-/**
- * @brief Display the shell's welcome banner.
- */
-void display_welcome_message() {
-    printf("\n");
-    printf(" ██████╗ █████╗ ███████╗██╗  ██╗\n");
-    printf("██╔════╝██╔══██╗██╔════╝██║  ██║\n");
-    printf("██║     ███████║███████╗███████║\n");
-    printf("██║     ██╔══██║╚════██║██╔══██║\n");
-    printf("╚██████╗██║  ██║███████║██║  ██║\n");
-    printf(" ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═╝\n");
-    printf("\n");
-    printf("Welcome to ca$h - A simple shell by Rajin Khan!\n");
-    printf("Demonstrates specific OS Concepts: Process Creation (fork), Program Execution (execvp),\n");
-    printf("Waiting (waitpid), Background Jobs (&), File I/O Redirection (<, >),\n");
-    printf("IPC via Pipes (|), Signal Handling (SIGCHLD), Job Control (jobs, fg, bg),\n");
-    printf("History & Editing (readline)\n");
-    printf("Type 'exit' to quit.\n\n");
+static int history_search_exit(int count, int key) {
+    history_search_end();
+    rl_execute_next(key); // Run the key in the normal keymap
+    return 0;
 }
 
 /**
- * @brief Parse a command string into arguments, handling simple redirection.
- * Modifies the input command_str using strtok.
- * @param command_str The command string to parse (will be modified).
- * @param args Output array for arguments.
- * @param inputFile Output pointer for input redirection filename.
- * @param outputFile Output pointer for output redirection filename.
- * @return 1 if a command was found, 0 on syntax error or empty command.
- */
-int parse_command(char *command_str, char **args, char **inputFile, char **outputFile) {
-    int i = 0;
-    *inputFile = NULL;
-    *outputFile = NULL;
-    args[0] = NULL; // Initialize to NULL
-
-    // Check for empty string after initial whitespace
-    char* trimmed_cmd = command_str + strspn(command_str, " \t\n\r\a");
-    if (*trimmed_cmd == '\0') { return 0; }
-
-    // OS Concept: String Tokenization - Breaking input into words.
-    char *token = strtok(command_str, " \t\n\r\a");
-    while (token != NULL && i < MAX_ARGS - 1) {
-        // OS Concept: Shell Syntax Parsing - Recognizing special characters.
-        if (strcmp(token, "<") == 0) { // Input redirection
-            token = strtok(NULL, " \t\n\r\a");
-            if (token == NULL || strchr("<>|&", token[0])) { // Basic check for invalid filename
-                fprintf(stderr, "ca$h: syntax error near redirection `<'\n"); args[0] = NULL; return 0;
-            }
-            *inputFile = token;
-        } else if (strcmp(token, ">") == 0) { // Output redirection
-            token = strtok(NULL, " \t\n\r\a");
-            if (token == NULL || strchr("<>|&", token[0])) { // Basic check
-                fprintf(stderr, "ca$h: syntax error near redirection `>'\n"); args[0] = NULL; return 0;
-            }
-            *outputFile = token;
-        } else { // Normal argument
-            args[i++] = token;
+ * @brief Start an indexed incremental search (replaces readline's linear one).
+ * @param direction -1 for Ctrl-R (older), +1 for Ctrl-S (newer).
+ */
+static int history_isearch_start(int direction) {
+    static Keymap search_keymap = NULL;
+    if (!search_keymap) {
+        search_keymap = rl_make_bare_keymap();
+        for (int key = 0; key < KEYMAP_SIZE; key++) {
+            rl_command_func_t *fn = (key >= 32 && key != 127) ? history_search_insert : history_search_exit;
+            rl_bind_key_in_map(key, fn, search_keymap);
         }
-        token = strtok(NULL, " \t\n\r\a"); // Get next token
+        rl_bind_key_in_map(127, history_search_backspace, search_keymap);
+        rl_bind_key_in_map(CTRL('H'), history_search_backspace, search_keymap);
+        rl_bind_key_in_map(CTRL('R'), history_search_again, search_keymap);
+        rl_bind_key_in_map(CTRL('S'), history_search_again, search_keymap);
+        rl_bind_key_in_map(CTRL('G'), history_search_abort, search_keymap);
     }
-    args[i] = NULL; // Null-terminate argument list for execvp
+    history_ensure_loaded();
+    isearch.active = 1;
+    isearch.direction = direction;
+    isearch.query[0] = '\0';
+    isearch.query_len = 0;
+    isearch.match = -1;
+    isearch.failed = 0;
+    isearch.saved_line = rl_copy_text(0, rl_end);
+    isearch.saved_point = rl_point;
+    isearch.saved_keymap = rl_get_keymap();
+    rl_set_keymap(search_keymap);
+    history_search_display();
+    return 0;
+}
 
-    // Check for redirection without a command word
-    if (args[0] == NULL && (*inputFile != NULL || *outputFile != NULL)) {
-        fprintf(stderr, "ca$h: syntax error: redirection without command\n"); return 0;
-    }
+int history_isearch_backward(int count, int key) { return history_isearch_start(-1); }
+int history_isearch_forward(int count, int key) { return history_isearch_start(1); }
 
-    return (args[0] != NULL); // Success if a command word was found
-}
+// --- Startup Profile Functions ---
 
 /**
- * @brief Code executed only by the child process after fork.
- * Sets up redirection, resets signal handlers, and executes the command.
- * Does not return if execvp succeeds.
- * @param args Command and arguments array.
- * @param inputFile Filename for input redirection (or NULL).
- * @param outputFile Filename for output redirection (or NULL).
+ * @brief Record that the named init phase just finished (no-op without --startup-profile).
+ * @param name Phase name (static string).
  */
-void handle_child_execution(char **args, char *inputFile, char *outputFile) {
-    // OS Concept: Signal Handling - Child resets ignored signals to default behavior.
-    signal(SIGINT, SIG_DFL); signal(SIGQUIT, SIG_DFL); signal(SIGTSTP, SIG_DFL);
-    signal(SIGTTIN, SIG_DFL); signal(SIGTTOU, SIG_DFL); signal(SIGCHLD, SIG_DFL);
+void startup_phase(const char *name) {
+    if (!startup_profile.enabled || startup_profile.count == STARTUP_PHASES_MAX) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_profile.names[startup_profile.count] = name;
+    startup_profile.seconds[startup_profile.count++] = (now.tv_sec - startup_profile.last.tv_sec)
+                                                       + (now.tv_nsec - startup_profile.last.tv_nsec) / 1e9;
+    startup_profile.last = now;
+}
 
-    int fd_in = -1, fd_out = -1;
-    // OS Concept: File I/O & File Descriptors - Open files for redirection.
-    if (inputFile != NULL) {
-        fd_in = open(inputFile, O_RDONLY);
-        if (fd_in < 0) { perror("ca$h: Failed to open input file"); exit(EXIT_FAILURE); }
-        // OS Concept: File Descriptor Manipulation - Redirect stdin (fd 0).
-        if (dup2(fd_in, STDIN_FILENO) < 0) { perror("ca$h: Failed input redirection (dup2)"); close(fd_in); exit(EXIT_FAILURE); }
-        close(fd_in); // Close original fd
-    }
-    if (outputFile != NULL) {
-        // Create/overwrite file for output, with standard permissions (rw-r--r--)
-        fd_out = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd_out < 0) { perror("ca$h: Failed to open output file"); exit(EXIT_FAILURE); }
-        // OS Concept: File Descriptor Manipulation - Redirect stdout (fd 1).
-        if (dup2(fd_out, STDOUT_FILENO) < 0) { perror("ca$h: Failed output redirection (dup2)"); close(fd_out); exit(EXIT_FAILURE); }
-        close(fd_out); // Close original fd
+/**
+ * @brief Print the recorded phases and the time to the first prompt (to stderr).
+ */
+void print_startup_profile() {
+    if (!startup_profile.enabled) return;
+    double total = (startup_profile.last.tv_sec - startup_profile.start.tv_sec)
+                   + (startup_profile.last.tv_nsec - startup_profile.start.tv_nsec) / 1e9;
+    for (int i = 0; i < startup_profile.count; i++) {
+        fprintf(stderr, "startup: %-10s %8.3f ms\n", startup_profile.names[i], startup_profile.seconds[i] * 1e3);
     }
+    fprintf(stderr, "startup: %-10s %8.3f ms\n", "total", total * 1e3);
+}
 
-    // OS Concept: Program Execution - Replace child process with the new command.
-    if (execvp(args[0], args) == -1) {
-        // execvp only returns on error
-        fprintf(stderr, "ca$h: Command not found or execution failed: %s\n", args[0]);
-        exit(EXIT_FAILURE); // Child MUST exit if exec fails
+/**
+ * @brief Record an accepted line: queue it and try to append it right away.
+ * @param line The line (without newline).
+ */
+void history_append_line(const char *line) {
+    if (history_store.fd < 0) return;
+    size_t len = strlen(line);
+    if (history_store.pending_len + len + 1 > history_store.pending_cap) {
+        size_t new_cap = history_store.pending_cap ? history_store.pending_cap : 256;
+        while (new_cap < history_store.pending_len + len + 1) new_cap *= 2;
+        char *new_pending = realloc(history_store.pending, new_cap);
+        if (!new_pending) { perror("ca$h: realloc failed for history"); return; }
+        history_store.pending = new_pending;
+        history_store.pending_cap = new_cap;
     }
+    memcpy(history_store.pending + history_store.pending_len, line, len);
+    history_store.pending[history_store.pending_len + len] = '\n';
+    history_store.pending_len += len + 1;
+    history_flush(0);
 }
 
 /**
- * @brief Executes a single command (part of execute_pipeline logic).
- * Handles built-ins and external commands (fork, exec, job setup).
- * @param args Command and arguments.
- * @param background 1 if job should run in background, 0 for foreground.
- * @param inputFile Input redirection file (or NULL).
- * @param outputFile Output redirection file (or NULL).
- * @param original_cmd The original command string (for job title).
+ * @brief Write the queued lines to the history file in one append.
+ * @param block 0 at the prompt: if a compaction holds the lock, keep the lines queued
+ * for the next call instead of waiting. 1 at exit: wait for the lock.
  */
-void execute_single_command(char **args, int background, char *inputFile, char *outputFile, const char *original_cmd) {
-    if (args[0] == NULL) return; // Safety check
+void history_flush(int block) {
+    if (history_store.fd < 0 || history_store.pending_len == 0) return;
+    // OS Concept: Advisory File Locking - Shared for appenders, exclusive for compaction.
+    if (flock(history_store.lock_fd, LOCK_SH | (block ? 0 : LOCK_NB)) < 0) return;
 
-    // --- Handle Built-in Commands ---
-    // These modify the shell's state directly, no fork needed.
-    if (strcmp(args[0], "exit") == 0) { exit(0); } // Exit handled in main loop for history saving
-    if (strcmp(args[0], "cd") == 0) {
-        // OS Concept: Process State - Change shell's current working directory.
-        if (inputFile || outputFile) { fprintf(stderr, "ca$h: warning: redirection does not apply to built-in 'cd'\n"); }
-        const char *dir = args[1];
-        if (dir == NULL) { dir = getenv("HOME"); if (!dir) {fprintf(stderr, "ca$h: cd: HOME not set\n"); return;} }
-        else if (args[2] != NULL) { fprintf(stderr, "ca$h: cd: too many arguments\n"); return; }
-        if (chdir(dir) != 0) { perror("ca$h: cd failed"); } // chdir system call
-        return;
-    }
-     if (strcmp(args[0], "clear") == 0) {
-         if (inputFile || outputFile) { fprintf(stderr, "ca$h: warning: redirection does not apply to 'clear'\n"); }
-         system("clear"); // Forks a subshell to run /usr/bin/clear
-         return;
-     }
-    // Job Control Built-ins
-    if (strcmp(args[0], "jobs") == 0) { if (shell_is_interactive) check_jobs_status(); list_jobs(); return; }
-    if (strcmp(args[0], "fg") == 0) {
-         if (!shell_is_interactive) { fprintf(stderr, "ca$h: fg: No job control.\n"); return; }
-         if (args[1] == NULL || args[1][0] != '%') { fprintf(stderr, "ca$h: fg: Usage: fg %%<job_id>\n"); return; }
-         int jid = atoi(&args[1][1]); if (jid <= 0) { fprintf(stderr, "ca$h: fg: Invalid job ID: %s\n", args[1]); return; }
-         job_t *job = get_job_by_jid(jid); if (!job) { fprintf(stderr, "ca$h: fg: No such job: %d\n", jid); return; }
-         printf("%s\n", job->command);
-         put_job_in_foreground(job, job->state == JOB_STATE_STOPPED);
-         return;
+    // A compaction may have renamed a new file into place: append to that one instead
+    struct stat st;
+    if (stat(history_store.path, &st) < 0 || st.st_ino != history_store.st.st_ino || st.st_dev != history_store.st.st_dev) {
+        int fd = open(history_store.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd >= 0 && fstat(fd, &history_store.st) == 0) {
+            close(history_store.fd);
+            history_store.fd = fd;
+            history_store.file_size = history_store.st.st_size;
+        } else if (fd >= 0) {
+            close(fd);
+        }
     }
-     if (strcmp(args[0], "bg") == 0) {
-         if (!shell_is_interactive) { fprintf(stderr, "ca$h: bg: No job control.\n"); return; }
-         if (args[1] == NULL || args[1][0] != '%') { fprintf(stderr, "ca$h: bg: Usage: bg %%<job_id>\n"); return; }
-         int jid = atoi(&args[1][1]); if (jid <= 0) { fprintf(stderr, "ca$h: bg: Invalid job ID: %s\n", args[1]); return; }
-         job_t *job = get_job_by_jid(jid); if (!job) { fprintf(stderr, "ca$h: bg: No such job: %d\n", jid); return; }
-         printf("[%d] %s &\n", job->jid, job->command);
-         put_job_in_background(job, 1);
-         return;
+
+    size_t done = 0;
+    while (done < history_store.pending_len) {
+        ssize_t n = write(history_store.fd, history_store.pending + done, history_store.pending_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("ca$h: writing history failed"); break; }
+        done += n;
     }
+    flock(history_store.lock_fd, LOCK_UN);
+    history_store.file_size += done;
+    memmove(history_store.pending, history_store.pending + done, history_store.pending_len - done);
+    history_store.pending_len -= done;
 
-    // --- Handle External Commands ---
-    // OS Concept: Process Creation - Create a child process.
-    pid_t pid = fork();
-    if (pid < 0) { perror("ca$h: Fork failed"); return; }
+    if (!block && history_store.file_size > HISTORY_COMPACT_BYTES) history_compact_start();
+}
 
-    if (pid == 0) { // Child Process
-        // OS Concept: Process Groups - Child joins/creates its own group for job control.
-        if (shell_is_interactive) {
-             if (setpgid(0, 0) < 0) { perror("ca$h: child setpgid failed"); exit(EXIT_FAILURE); }
-        }
-        handle_child_execution(args, inputFile, outputFile); // Sets up IO, signals, then execs
-    } else { // Parent Process
-        pid_t child_pgid = pid; // Assume child becomes group leader with its own PID
-        if (shell_is_interactive) {
-            // OS Concept: Process Group Management - Parent sets child's PGID (carefully handles races)
-            if (setpgid(pid, pid) < 0 && errno != EACCES && errno != ESRCH) {
-                perror("ca$h: parent setpgid failed"); // Problem if parent couldn't set it
-                 child_pgid = getpgid(pid); // Try to recover PGID child might have set
-                 if (child_pgid < 0) { perror("ca$h: parent getpgid failed"); return; }
-            } else if (errno == EACCES || errno == ESRCH){ // Child set it first or exited
-                 child_pgid = getpgid(pid); // Try to get it
-                 if (child_pgid < 0 && errno == ESRCH) { child_pgid = pid; } // Exited: use PID for wait
-                 else if (child_pgid < 0) { perror("ca$h: parent getpgid failed"); return; }
-            } else { child_pgid = pid; } // Success or harmless error
-        }
-
-        if (background) { // Background job
-             if (shell_is_interactive && child_pgid > 0) {
-                 // OS Concept: Job Tracking - Add job to the shell's list.
-                 int jid = add_job(child_pgid, original_cmd, JOB_STATE_RUNNING);
-                 if (jid > 0) { printf("[%d] %d\n", jid, child_pgid); } // Print job info
-             }
-             // Parent does NOT wait for background jobs. SIGCHLD handler cleans up.
-        } else { // Foreground job
-             if (shell_is_interactive && child_pgid > 0) {
-                 // OS Concept: Foreground Job Management - Use temporary struct for waiting logic.
-                 char *cmd_copy = strdup(original_cmd ? original_cmd : "");
-                 if (!cmd_copy) {perror("ca$h: strdup failed for fg job"); return;}
-                 job_t fg_job = { .jid = 0, .pgid = child_pgid, .state = JOB_STATE_RUNNING, .command = cmd_copy };
-                 put_job_in_foreground(&fg_job, 0); // Gives terminal control and waits
-                 free(cmd_copy); // Free the temporary copy
-             } else {
-                 // Non-interactive shell: Simple blocking wait
-                 waitpid(pid, NULL, 0);
-             }
-        }
-    }
-}
-
-
-/**
- * @brief Execute a command line, handling pipes and background execution.
- * @param input The command line string (will be modified by parsing).
- * @param original_cmd_for_job The original, unmodified command string for job titles.
- */
-void execute_pipeline(char *input, const char *original_cmd_for_job) {
-    char *args1[MAX_ARGS], *args2[MAX_ARGS];
-    char *inputFile1 = NULL, *outputFile1 = NULL;
-    char *inputFile2 = NULL, *outputFile2 = NULL;
-    int background = 0;
-    char *pipe_pos = NULL;
-    char *cmd1_str = NULL;
-    char *cmd2_str = NULL;
-    pid_t pipeline_pgid = 0; // PGID for the entire pipeline
-
-    // Check for & at the end for background execution
-    char *end = input + strlen(input) - 1;
-    while (end >= input && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) { *end-- = '\0'; } // Trim trailing whitespace
-    if (end >= input && *end == '&') { background = 1; *end-- = '\0'; // Found &
-         while (end >= input && (*end == ' ' || *end == '\t')) { *end-- = '\0'; } // Trim space before &
-    }
-    if (input[strspn(input, " \t\n\r")] == '\0') { return; } // Ignore empty line after trimming &
-
-    // Check if first command is a built-in that cannot be piped
-    char temp_input_check[MAX_INPUT]; strncpy(temp_input_check, input, MAX_INPUT - 1); temp_input_check[MAX_INPUT - 1] = '\0';
-    char *first_cmd_token = strtok(temp_input_check, " \t\n\r\a|");
-    int is_builtin = 0;
-    if (first_cmd_token) {
-        if (strcmp(first_cmd_token, "jobs") == 0 || strcmp(first_cmd_token, "fg") == 0 ||
-            strcmp(first_cmd_token, "bg") == 0 || strcmp(first_cmd_token, "exit") == 0 ||
-            strcmp(first_cmd_token, "cd") == 0 || strcmp(first_cmd_token, "clear") == 0 ) {
-            is_builtin = 1;
-        }
-    }
-
-    // Find pipe symbol
-    pipe_pos = strchr(input, '|');
-
-    // If it's a known built-in AND there's no pipe, handle as single command
-    if (is_builtin && pipe_pos == NULL) {
-        // Need to parse the original input again as strtok modified temp_input_check
-        if (!parse_command(input, args1, &inputFile1, &outputFile1)) return;
-        if (args1[0] == NULL) return;
-        execute_single_command(args1, background, inputFile1, outputFile1, original_cmd_for_job);
-        return;
+/**
+ * @brief Start a background child that trims the history file to its last HISTORY_LIMIT
+ * lines (a no-op if it holds fewer). The prompt never waits for it; the shell reaps
+ * it like any other child.
+ */
+void history_compact_start() {
+    if (history_store.compactor > 0) return;
+    pid_t pid = fork();
+    if (pid < 0) { perror("ca$h: fork failed for history compaction"); return; }
+    if (pid == 0) {
+        history_compact_child();
+        _exit(0);
     }
+    history_store.compactor = pid;
+    history_store.file_size = 0; // Don't start another one before it finishes
+}
 
-    if (pipe_pos == NULL) {
-        // --- No Pipe ---
-        cmd1_str = input;
-        if (!parse_command(cmd1_str, args1, &inputFile1, &outputFile1)) return;
-        if (args1[0] == NULL) return;
-        execute_single_command(args1, background, inputFile1, outputFile1, original_cmd_for_job);
-
-    } else {
-        // --- Pipe Found ---
-        if (is_builtin) { fprintf(stderr, "ca$h: Error: Builtin command '%s' cannot be piped.\n", first_cmd_token); return; }
-
-        *pipe_pos = '\0'; // Split string at pipe
-        cmd1_str = input;
-        cmd2_str = pipe_pos + 1;
-
-        // Check for empty commands around the pipe
-        if (cmd1_str[strspn(cmd1_str, " \t\n\r")] == '\0') { fprintf(stderr, "ca$h: syntax error: missing command before pipe `|'\n"); return; }
-        if (cmd2_str[strspn(cmd2_str, " \t\n\r")] == '\0') { fprintf(stderr, "ca$h: syntax error: missing command after pipe `|'\n"); return; }
-
-        // Parse the two commands
-        int parse1_ok = parse_command(cmd1_str, args1, &inputFile1, &outputFile1);
-        int parse2_ok = parse_command(cmd2_str, args2, &inputFile2, &outputFile2);
-        if (!parse1_ok || !parse2_ok || args1[0] == NULL || args2[0] == NULL) return; // Parse error occurred
-
-        // Warn about ignored redirection within a pipe
-        if (outputFile1 != NULL) fprintf(stderr, "ca$h: warning: output redirection ('>') ignored for command preceding pipe.\n");
-        if (inputFile2 != NULL) fprintf(stderr, "ca$h: warning: input redirection ('<') ignored for command succeeding pipe.\n");
-
-        // OS Concept: Inter-Process Communication (IPC) - Create a pipe.
-        int pipefd[2];
-        if (pipe(pipefd) == -1) { perror("ca$h: Pipe creation failed"); return; }
-
-        pid_t pid1, pid2;
-
-        // --- Fork Child 1 (Left side of pipe) ---
-        pid1 = fork();
-        if (pid1 < 0) { perror("ca$h: Fork failed (child 1)"); close(pipefd[READ_END]); close(pipefd[WRITE_END]); return; }
-
-        if (pid1 == 0) { // Child 1 Code
-             // OS Concept: Process Groups - Child 1 becomes leader of pipeline group.
-             if (shell_is_interactive) { if (setpgid(0, 0) < 0) { perror("ca$h: setpgid failed child 1"); exit(EXIT_FAILURE); } }
-             // OS Concept: Pipe Redirection - Connect pipe write end to stdout.
-             close(pipefd[READ_END]); // Close unused read end
-             if (dup2(pipefd[WRITE_END], STDOUT_FILENO) < 0) { perror("ca$h: dup2 failed child 1"); close(pipefd[WRITE_END]); exit(EXIT_FAILURE); }
-             close(pipefd[WRITE_END]); // Close original write end
-             handle_child_execution(args1, inputFile1, NULL); // Output goes to pipe
-        }
-        pipeline_pgid = pid1; // PGID for the pipeline is the first child's PID
-
-
-        // --- Fork Child 2 (Right side of pipe) ---
-        pid2 = fork();
-         if (pid2 < 0) { // Fork failed for second child
-             perror("ca$h: Fork failed (child 2)"); close(pipefd[READ_END]); close(pipefd[WRITE_END]);
-             // Clean up first child if fork failed
-             if (pipeline_pgid > 0 && shell_is_interactive) kill(-pipeline_pgid, SIGKILL);
-             waitpid(pid1, NULL, 0);
-             return;
-         }
-         if (pid2 == 0) { // Child 2 Code
-             // OS Concept: Process Groups - Child 2 joins the pipeline group.
-             if (shell_is_interactive) { if (setpgid(0, pipeline_pgid) < 0) { perror("ca$h: setpgid failed child 2"); exit(EXIT_FAILURE); } }
-             // OS Concept: Pipe Redirection - Connect pipe read end to stdin.
-             close(pipefd[WRITE_END]); // Close unused write end
-             if (dup2(pipefd[READ_END], STDIN_FILENO) < 0) { perror("ca$h: dup2 failed child 2"); close(pipefd[READ_END]); exit(EXIT_FAILURE); }
-             close(pipefd[READ_END]); // Close original read end
-             handle_child_execution(args2, NULL, outputFile2); // Input comes from pipe
-         }
+/**
+ * @brief Body of the compaction child. Under the exclusive lock, copies the tail of the
+ * file to a temporary file in the same directory and renames it over the original,
+ * so readers always see either the old or the new file, never a partial one.
+ */
+void history_compact_child() {
+    // OS Concept: Advisory File Locking - flock() locks belong to the open file
+    // description, and the inherited lock_fd shares the shell's: a LOCK_SH there would
+    // just convert this lock. Its own open() makes the shell's appends wait for it.
+    close(history_store.lock_fd);
+    int lock_fd = open(history_store.lock_path, O_RDWR | O_CLOEXEC);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) return;
+    int fd = open(history_store.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return;
+    char *text = malloc(st.st_size);
+    if (!text) return;
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = read(fd, text + len, st.st_size - len);
+        if (n <= 0) break;
+        len += n;
+    }
+    close(fd);
 
-        // --- Parent Process (after both forks) ---
-        // OS Concept: File Descriptor Management - Parent closes its copies of pipe ends.
-        close(pipefd[READ_END]);
-        close(pipefd[WRITE_END]);
+    // Walk back over the last HISTORY_LIMIT lines (another session may already have compacted)
+    size_t start = len;
+    long lines = 0;
+    if (start > 0 && text[start - 1] == '\n') start--;
+    while (start > 0) {
+        if (text[start - 1] == '\n' && ++lines == HISTORY_LIMIT) break;
+        start--;
+    }
+    if (start == 0) return;
+
+    size_t tmp_len = strlen(history_store.path) + 8;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path) return;
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX", history_store.path);
+    int tmp_fd = mkstemp(tmp_path);
+    if (tmp_fd < 0) return;
+    size_t done = start;
+    while (done < len) {
+        ssize_t n = write(tmp_fd, text + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    // OS Concept: Atomic Rename - Make the new file durable, then swap it in.
+    if (done == len && fsync(tmp_fd) == 0 && close(tmp_fd) == 0 && rename(tmp_path, history_store.path) == 0) return;
+    unlink(tmp_path);
+}
+
+/**
+ * @brief Write any queued lines (waiting for the lock) and close the history store.
+ */
+void history_close() {
+    history_flush(1);
+    if (history_store.fd >= 0) close(history_store.fd);
+    if (history_store.lock_fd >= 0) close(history_store.lock_fd);
+    history_store.fd = history_store.lock_fd = -1;
+    free(history_store.pending);
+    history_store.pending = NULL;
+    history_store.pending_len = history_store.pending_cap = 0;
+}
+
+
+// --- Script Execution Functions ---
+
+/**
+ * @brief A syntax error was reported. A non-interactive shell stops there with status 2,
+ * like other shells, instead of running the rest of the script; at the prompt the
+ * next line is read as usual.
+ */
+static void syntax_error_stop() {
+    last_status = 2;
+    if (shell_is_interactive) return;
+    fflush(stdout);
+    out_flush();
+    exit(2);
+}
+
+/**
+ * @brief Run one command line: lex it once into the line arena, parse the tokens, execute.
+ * Shared by the interactive loop and script mode.
+ * @param line The command line (not modified; may hold several lines joined by '\n').
+ * @return 0, or PARSE_INCOMPLETE if the command goes on in the next line (nothing ran).
+ */
+int execute_line(const char *line) {
+    token_list_t tokens;
+    command_list_t list;
+    arena_mark_t mark = arena_mark(&line_arena); // Not the start of the arena under `source`
+
+    long long trace = trace_start();
+    int parsed = lex_line(line, &line_arena, &tokens);
+    if (parsed == 1) parsed = parse_command_list(line, &tokens, &line_arena, &list);
+    trace_end(TRACE_PARSE, trace, line);
+    if (parsed == 1) {
+        // Execute the whole ';' / '&&' / '||' list from the one parse
+        execute_command_list(&list);
+    } else if (parsed == 0) {
+        syntax_error_stop(); // Already reported
+    }
+    arena_release(&line_arena, mark); // Everything parsed from this line dies here
+    return parsed == PARSE_INCOMPLETE ? PARSE_INCOMPLETE : 0;
+}
+
+/**
+ * @brief Add a line to the unfinished command, growing the buffer by doubling.
+ * @return 1 on success, 0 if out of memory (reported; the pending command is dropped).
+ */
+static int pending_input_append(pending_input_t *pending, const char *line) {
+    size_t len = strlen(line);
+    if (pending->len + len + 2 > pending->cap) {
+        size_t cap = pending->cap ? pending->cap * 2 : 256;
+        while (cap < pending->len + len + 2) cap *= 2;
+        char *text = realloc(pending->text, cap);
+        if (!text) {
+            perror("ca$h: realloc failed for input");
+            free(pending->text);
+            *pending = (pending_input_t){ NULL, 0, 0 };
+            return 0;
+        }
+        if (!pending->text) text[0] = '\0';
+        pending->text = text;
+        pending->cap = cap;
+    }
+    if (pending->len) pending->text[pending->len++] = '\n';
+    memcpy(pending->text + pending->len, line, len + 1);
+    pending->len += len;
+    return 1;
+}
+
+/**
+ * @brief Run a line that may start or continue a multi-line command (if ... fi,
+ * a function body, a trailing '|' or '&&', an open quote). Lines are collected
+ * until the command is complete, then it is parsed and run as a whole.
+ * @param pending Lines collected so far.
+ * @param line The next line.
+ * @return PARSE_INCOMPLETE while more lines are needed, 0 once something ran.
+ */
+int execute_continued(pending_input_t *pending, const char *line) {
+    if (!pending->text) {
+        if (execute_line(line) != PARSE_INCOMPLETE) return 0;
+        if (!pending_input_append(pending, line)) return 0;
+        continuation_scan(&pending->scan, pending->text, pending->len);
+        return PARSE_INCOMPLETE;
+    }
+    if (!pending_input_append(pending, line)) return 0;
+    // Parse the whole command only once the new line may have completed it
+    if (!continuation_scan(&pending->scan, pending->text, pending->len)) return PARSE_INCOMPLETE;
+    if (execute_line(pending->text) == PARSE_INCOMPLETE) return PARSE_INCOMPLETE;
+    free(pending->text);
+    *pending = (pending_input_t){ NULL, 0, 0 };
+    return 0;
+}
+
+/**
+ * @brief The input ended: drop an unfinished command, reporting it as a syntax error.
+ * @param pending Lines collected so far.
+ */
+void pending_input_finish(pending_input_t *pending) {
+    if (!pending->text) return;
+    fprintf(stderr, "ca$h: syntax error: unexpected end of file\n");
+    free(pending->text);
+    *pending = (pending_input_t){ NULL, 0, 0 };
+    syntax_error_stop();
+}
+
+/**
+ * @brief Return the next line from a script, reading the source in large chunks.
+ * The newline is replaced by '\0' in place, so no per-line copy is made.
+ * @param reader The line reader.
+ * @return Pointer to the line inside the reader's buffer (valid until the next call), or NULL at EOF.
+ */
+char* line_reader_next(line_reader_t *reader) {
+    while (1) {
+        // Hand out a complete line if one is already buffered
+        char *start = reader->buf + reader->pos;
+        char *newline = memchr(start, '\n', reader->len - reader->pos);
+        if (newline) {
+            *newline = '\0';
+            reader->pos = (newline - reader->buf) + 1;
+            return start;
+        }
+        if (reader->eof) {
+            if (reader->pos == reader->len) return NULL;
+            // Last line without a trailing newline
+            reader->buf[reader->len] = '\0';
+            reader->pos = reader->len;
+            return start;
+        }
+
+        // Move the partial line to the front, growing the buffer if it is full
+        if (reader->pos > 0) {
+            memmove(reader->buf, start, reader->len - reader->pos);
+            reader->len -= reader->pos;
+            reader->pos = 0;
+        }
+        if (reader->cap - reader->len < SCRIPT_READ_CHUNK + 1) {
+            size_t new_cap = reader->cap ? reader->cap * 2 : SCRIPT_READ_CHUNK * 2;
+            char *new_buf = realloc(reader->buf, new_cap);
+            if (!new_buf) { perror("ca$h: realloc failed for script buffer"); return NULL; }
+            reader->buf = new_buf;
+            reader->cap = new_cap;
+        }
+
+        // OS Concept: File I/O - Bulk read, one syscall per chunk instead of per line.
+        ssize_t n = read(reader->fd, reader->buf + reader->len, reader->cap - reader->len - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("ca$h: read error in script");
+            reader->eof = 1;
+        } else if (n == 0) {
+            reader->eof = 1;
+        } else {
+            reader->len += n;
+        }
+    }
+}
+
+/**
+ * @brief Execute every line read from a file descriptor (non-interactive mode).
+ * @param fd Script source (file or stdin).
+ * @return Exit status for the shell: that of the last command ($?).
+ */
+int run_script_fd(int fd) {
+    line_reader_t reader = { .fd = fd, .buf = NULL, .cap = 0, .len = 0, .pos = 0, .eof = 0 };
+    pending_input_t pending = { NULL, 0, 0 };
+    char *line;
+    while ((line = line_reader_next(&reader)) != NULL) {
+        execute_continued(&pending, line); // Blank lines and '#' comments (including '#!') lex to nothing
+    }
+    pending_input_finish(&pending);
+    free(reader.buf);
+    return last_status;
+}
+
+/**
+ * @brief Execute a script file (`cash script.cash`). It goes through the script
+ * cache like `source`, so a script that sources itself parses each line once.
+ * @param path Path to the script.
+ * @return Exit status for the shell (127 if the script cannot be opened).
+ */
+int run_script_file(const char *path) {
+    compiled_script_t *script = script_cache_load(path);
+    if (!script) return 127;
+    return run_compiled_script(script);
+}
+
+/**
+ * @brief Find a script in the cache, (re)reading it if it is new or changed on disk.
+ * The key is the path plus device, inode, mtime and size, so checking a cached
+ * script costs one stat() and no read.
+ * @param path Path of the script.
+ * @return The cached script, or NULL if it cannot be read (reported).
+ */
+compiled_script_t* script_cache_load(const char *path) {
+    struct stat st;
+    // OS Concept: File Metadata - stat() tells whether the cached parse is still valid.
+    if (stat(path, &st) < 0) { fprintf(stderr, "ca$h: %s: %s\n", path, strerror(errno)); return NULL; }
+    compiled_script_t **link = &script_cache;
+    for (; *link; link = &(*link)->next) {
+        compiled_script_t *script = *link;
+        if (strcmp(script->path, path) != 0) continue;
+        if (script->dev == st.st_dev && script->ino == st.st_ino && script->size == st.st_size &&
+            script->mtime.tv_sec == STAT_MTIME(st).tv_sec && script->mtime.tv_nsec == STAT_MTIME(st).tv_nsec) {
+            return script;
+        }
+        // Changed on disk: drop it (or let the run still using it free it)
+        *link = script->next;
+        script->stale = 1;
+        if (script->users == 0) script_release(script);
+        break;
+    }
+
+    // O_CLOEXEC: commands run by the script must not inherit the script fd
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ca$h: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    // OS Concept: File I/O - Read the whole file up front, sized by fstat().
+    size_t cap = st.st_size + 1, len = 0;
+    char *source = malloc(cap);
+    if (!source) { perror("ca$h: malloc failed for script"); close(fd); return NULL; }
+    while (1) {
+        if (len + 1 == cap) { // Grew since fstat()
+            char *bigger = realloc(source, cap * 2);
+            if (!bigger) { perror("ca$h: realloc failed for script"); free(source); close(fd); return NULL; }
+            source = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, source + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { fprintf(stderr, "ca$h: %s: %s\n", path, strerror(errno)); free(source); close(fd); return NULL; }
+        if (n == 0) break;
+        len += n;
+    }
+    close(fd);
+    source[len] = '\0';
+
+    compiled_script_t *script = calloc(1, sizeof(compiled_script_t));
+    if (!script) { perror("ca$h: calloc failed for script"); free(source); return NULL; }
+    script->source = source;
+    int count = 0;
+    for (size_t i = 0; i < len; i++) count += (source[i] == '\n');
+    if (len > 0 && source[len - 1] != '\n') count++; // Last line without a newline
+    script->lines = calloc(count ? count : 1, sizeof(script_line_t));
+    script->path = strdup(path);
+    if (!script->lines || !script->path) { perror("ca$h: calloc failed for script"); script_release(script); return NULL; }
+    char *line = source, *end = source + len;
+    for (int i = 0; i < count; i++) {
+        char *newline = memchr(line, '\n', end - line);
+        if (newline) *newline = '\0';
+        script->lines[i].text = line; // state is SCRIPT_LINE_UNPARSED (0) from calloc
+        line = newline ? newline + 1 : end;
+    }
+    script->count = count;
+    script->dev = st.st_dev;
+    script->ino = st.st_ino;
+    script->mtime = STAT_MTIME(st);
+    script->size = st.st_size;
+    script->next = script_cache;
+    script_cache = script;
+    return script;
+}
+
+/**
+ * @brief Run a cached script. Each line is lexed and parsed into the script's arena
+ * the first time it is reached; later runs execute the stored commands directly.
+ * Expansion still happens per run (in the line arena), so $?, $1 and globs are fresh.
+ * @param script The script (from script_cache_load).
+ * @return Exit status: that of the last command ($?).
+ */
+int run_compiled_script(compiled_script_t *script) {
+    script->users++;
+    arena_mark_t mark = arena_mark(&line_arena);
+    for (int i = 0; i < script->count && !control_pending(); i += script->lines[i].span) {
+        script_line_t *line = &script->lines[i];
+        if (line->state == SCRIPT_LINE_UNPARSED) {
+            token_list_t tokens;
+            command_list_t list;
+            // A command that goes on (if ... fi, a function) takes the following lines
+            // too: put their newlines back, one line at a time until its nesting says it
+            // may be complete, then parse the whole span again
+            int parsed, end = i;
+            continuation_t scan = { 0 };
+            long long trace = trace_start();
+            while (1) {
+                arena_mark_t attempt = arena_mark(&script->arena);
+                parsed = lex_line(line->text, &script->arena, &tokens);
+                if (parsed == 1) parsed = parse_command_list(line->text, &tokens, &script->arena, &list);
+                if (parsed != PARSE_INCOMPLETE || end + 1 >= script->count) break;
+                arena_release(&script->arena, attempt);
+                do {
+                    script->lines[++end].text[-1] = '\n'; // Lines are contiguous in the source
+                    size_t len = script->lines[end].text + strlen(script->lines[end].text) - line->text;
+                    if (continuation_scan(&scan, line->text, len)) break;
+                } while (end + 1 < script->count);
+            }
+            line->span = end - i + 1;
+            trace_end(TRACE_PARSE, trace, line->text);
+            if (parsed == 1) {
+                line->list = arena_alloc(&script->arena, sizeof(command_list_t));
+                *line->list = list;
+                line->state = list.count ? SCRIPT_LINE_PARSED : SCRIPT_LINE_EMPTY;
+            } else {
+                if (parsed == PARSE_INCOMPLETE) fprintf(stderr, "ca$h: %s: syntax error: unexpected end of file\n", script->path);
+                line->state = SCRIPT_LINE_ERROR;
+                syntax_error_stop(); // Already reported
+                continue;
+            }
+        } else if (line->state == SCRIPT_LINE_ERROR) {
+            // Report it again, like the first time
+            if (execute_line(line->text) == PARSE_INCOMPLETE) fprintf(stderr, "ca$h: %s: syntax error: unexpected end of file\n", script->path);
+            syntax_error_stop();
+            continue;
+        }
+        if (line->state == SCRIPT_LINE_PARSED) {
+            execute_command_list(line->list);
+            arena_release(&line_arena, mark); // Expansions and redirection plans of this line
+        }
+    }
+    script->users--;
+    int status = last_status;
+    if (script->stale && script->users == 0) script_release(script);
+    return status;
+}
+
+/**
+ * @brief Free a script that is no longer cached.
+ * @param script The script.
+ */
+void script_release(compiled_script_t *script) {
+    arena_reset(&script->arena);
+    free(script->arena.first);
+    free(script->source);
+    free(script->lines);
+    free(script->path);
+    free(script);
+}
+
+/**
+ * @brief Execute a command string (`cash -c '...'`), one command per line.
+ * @param script The command string.
+ * @return Exit status for the shell: that of the last command ($?).
+ */
+int run_script_string(const char *script) {
+    char *copy = strdup(script);
+    if (!copy) { perror("ca$h: strdup failed for -c string"); return 1; }
+    pending_input_t pending = { NULL, 0, 0 };
+    char *line = copy;
+    while (line) {
+        char *newline = strchr(line, '\n');
+        if (newline) *newline = '\0';
+        execute_continued(&pending, line);
+        line = newline ? newline + 1 : NULL;
+    }
+    pending_input_finish(&pending);
+    free(copy);
+    return last_status;
+}
+
+/**
+ * @brief Run ~/.cashrc, if there is one, before the first prompt.
+ */
+void run_rc_file() {
+    const char *home_dir = var_get("HOME");
+    if (!home_dir) return;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", home_dir, RC_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) fprintf(stderr, "ca$h: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    run_script_fd(fd);
+    close(fd);
+}
+
+// --- Prompt Functions ---
+
+/**
+ * @brief Parse $PS1 into segments. Escapes whose value never changes while the shell
+ * runs (\u, \h, \$, \n, \e, \[ \], \\) are resolved here, into the literal text around
+ * them; only \w, \W, \g, \? and \j stay as segments that are looked at per prompt.
+ * @param source The $PS1 value.
+ */
+static void prompt_parse(const char *source) {
+    free(prompt.source);
+    prompt.source = strdup(source);
+    prompt.count = 0;
+    prompt.needs = 0;
+    arena_reset(&prompt.arena); // The old segments and rendering go with it
+    prompt.rendered = (word_buf_t){ NULL, 0, 0, &prompt.arena };
+    word_buf_t text = { NULL, 0, 0, &prompt.arena };
+    char host[256];
+    for (const char *p = source; ; p++) {
+        prompt_segment_type_t type = PROMPT_TEXT;
+        const char *literal = NULL;
+        if (*p == '\\' && p[1]) {
+            switch (*++p) {
+                case 'w': type = PROMPT_CWD; break;
+                case 'W': type = PROMPT_CWD_BASE; break;
+                case 'g': type = PROMPT_GIT_BRANCH; break;
+                case '?': type = PROMPT_STATUS; break;
+                case 'j': type = PROMPT_JOBS; break;
+                case 'u': {
+                    const char *user = var_get("USER");
+                    const struct passwd *pw = user ? NULL : getpwuid(geteuid());
+                    literal = user ? user : pw ? pw->pw_name : "";
+                    break;
+                }
+                case 'h': case 'H': // Short host name (up to the first '.'), or the full one
+                    if (gethostname(host, sizeof(host) - 1) != 0) host[0] = '\0';
+                    host[sizeof(host) - 1] = '\0';
+                    if (*p == 'h') host[strcspn(host, ".")] = '\0';
+                    literal = host;
+                    break;
+                case '$': literal = geteuid() == 0 ? "#" : "$"; break;
+                case 'n': literal = "\n"; break;
+                case 'e': literal = "\033"; break;
+                case 'a': literal = "\a"; break;
+                case '[': literal = "\001"; break; // RL_PROMPT_START_IGNORE: not counted in the width
+                case ']': literal = "\002"; break; // RL_PROMPT_END_IGNORE
+                case '\\': literal = "\\"; break;
+                default: word_buf_append(&text, p - 1, 2); continue; // Unknown escapes stay as written
+            }
+        }
+        if (literal) { word_buf_append(&text, literal, strlen(literal)); continue; }
+        if (type == PROMPT_TEXT && *p) { word_buf_append(&text, p, 1); continue; }
+        // The text so far ends here: a dynamic segment or the end of $PS1 follows
+        if (prompt.count + 2 > prompt.capacity) {
+            int capacity = prompt.capacity ? prompt.capacity * 2 : 8;
+            prompt_segment_t *segments = realloc(prompt.segments, capacity * sizeof(prompt_segment_t));
+            if (!segments) { perror("ca$h: realloc failed for prompt"); break; }
+            prompt.segments = segments;
+            prompt.capacity = capacity;
+        }
+        if (text.len) prompt.segments[prompt.count++] = (prompt_segment_t){ PROMPT_TEXT, text.data, text.len };
+        text = (word_buf_t){ NULL, 0, 0, &prompt.arena };
+        if (type == PROMPT_TEXT) break; // End of $PS1
+        prompt.segments[prompt.count++] = (prompt_segment_t){ type, NULL, 0 };
+        prompt.needs |= 1 << type;
+    }
+    prompt.dirty = 1;
+}
 
-        // Parent ensures child 2 joins the group (handle potential races)
-        if (shell_is_interactive) {
-            if (setpgid(pid2, pipeline_pgid) < 0 && errno != EACCES && errno != ESRCH) {
-                perror("ca$h: parent setpgid for child 2 failed");
+/**
+ * @brief Find the git HEAD file for a directory: the .git directory of it or one of its
+ * parents, or the gitdir a .git file points at (worktrees, submodules).
+ * @param dir Working directory.
+ * @param head Output path of HEAD ("" outside a repository).
+ */
+static void prompt_find_git_head(const char *dir, char *head, size_t size) {
+    char path[PATH_MAX - 16]; // Room for "/.git/HEAD" after it
+    head[0] = '\0';
+    if (strlen(dir) >= sizeof(path)) return;
+    memcpy(path, dir, strlen(dir) + 1);
+    while (1) {
+        char candidate[PATH_MAX - 8];
+        snprintf(candidate, sizeof(candidate), "%s/.git", strcmp(path, "/") == 0 ? "" : path);
+        struct stat st;
+        if (stat(candidate, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) { snprintf(head, size, "%s/HEAD", candidate); return; }
+            char line[PATH_MAX];
+            FILE *f = fopen(candidate, "r"); // "gitdir: <path>"
+            if (f && fgets(line, sizeof(line), f) && strncmp(line, "gitdir: ", 8) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                if (line[8] == '/') snprintf(head, size, "%s/HEAD", line + 8);
+                else snprintf(head, size, "%s/%s/HEAD", strcmp(path, "/") == 0 ? "" : path, line + 8);
             }
+            if (f) fclose(f);
+            return;
+        }
+        char *slash = strrchr(path, '/');
+        if (!slash || slash == path) { if (strcmp(path, "/") == 0) return; strcpy(path, "/"); continue; }
+        *slash = '\0';
+    }
+}
+
+/**
+ * @brief Bring the cached cwd and git segments up to date. The directory is only looked
+ * at again after a cd (cwd_version), the branch only when .git/HEAD's mtime or size
+ * changed: one stat() per prompt inside a repository, none elsewhere.
+ */
+static void prompt_refresh_location() {
+    if ((prompt.needs & ((1 << PROMPT_CWD) | (1 << PROMPT_CWD_BASE) | (1 << PROMPT_GIT_BRANCH))) &&
+        prompt.cwd_version != cwd_version + 1) {
+        prompt.cwd_version = cwd_version + 1; // +1: version 0 has never been looked at
+        char dir[PATH_MAX];
+        if (!getcwd(dir, sizeof(dir))) snprintf(dir, sizeof(dir), "?");
+        const char *home = var_get("HOME");
+        size_t home_len = home ? strlen(home) : 0;
+        if (home_len > 1 && strncmp(dir, home, home_len) == 0 && (dir[home_len] == '/' || dir[home_len] == '\0')) {
+            snprintf(prompt.cwd, sizeof(prompt.cwd), "~%s", dir + home_len);
+        } else {
+            snprintf(prompt.cwd, sizeof(prompt.cwd), "%s", dir);
+        }
+        const char *base = strrchr(prompt.cwd, '/');
+        prompt.cwd_base = (base && base[1]) ? base + 1 : prompt.cwd;
+        if (prompt.needs & (1 << PROMPT_GIT_BRANCH)) {
+            prompt_find_git_head(dir, prompt.git_head, sizeof(prompt.git_head));
+            prompt.git_head_size = -1;
+            prompt.git_branch[0] = '\0';
+        }
+        prompt.dirty = 1;
+    }
+    if (!(prompt.needs & (1 << PROMPT_GIT_BRANCH)) || !prompt.git_head[0]) return;
+
+    struct stat st;
+    if (stat(prompt.git_head, &st) < 0) memset(&st, 0, sizeof(st));
+    if (STAT_MTIME(st).tv_sec == prompt.git_head_mtime.tv_sec && STAT_MTIME(st).tv_nsec == prompt.git_head_mtime.tv_nsec &&
+        st.st_size == prompt.git_head_size) return;
+    prompt.git_head_mtime = STAT_MTIME(st);
+    prompt.git_head_size = st.st_size;
+    prompt.git_branch[0] = '\0';
+    char line[256] = "";
+    int fd = open(prompt.git_head, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, line, sizeof(line) - 1);
+        line[n > 0 ? n : 0] = '\0';
+        close(fd);
+    }
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "ref: refs/heads/", 16) == 0) snprintf(prompt.git_branch, sizeof(prompt.git_branch), "%s", line + 16);
+    else if (line[0]) snprintf(prompt.git_branch, sizeof(prompt.git_branch), "%.7s", line); // Detached HEAD: short hash
+    prompt.dirty = 1;
+}
+
+/**
+ * @brief The prompt to show: $PS2 (default "> ") while a construct is unfinished, else
+ * $PS1 rendered from its segments (default "ca$h> "). Every segment caches its value
+ * and the input it came from; the string is only rebuilt when one of them changed,
+ * so an unchanged prompt costs a few comparisons.
+ * @param continuation 1 for the continuation prompt.
+ * @return The prompt (static storage, valid until the next call).
+ */
+const char* prompt_render(int continuation) {
+    if (continuation) {
+        const char *ps2 = var_get("PS2");
+        return ps2 ? ps2 : "> ";
+    }
+    const char *ps1 = var_get("PS1");
+    if (!ps1) return "ca$h> ";
+    if (!prompt.source || strcmp(prompt.source, ps1) != 0) prompt_parse(ps1);
+    prompt_refresh_location();
+    if ((prompt.needs & (1 << PROMPT_STATUS)) && prompt.status != last_status) { prompt.status = last_status; prompt.dirty = 1; }
+    if ((prompt.needs & (1 << PROMPT_JOBS)) && prompt.jobs != job_table.count) { prompt.jobs = job_table.count; prompt.dirty = 1; }
+    if (!prompt.dirty) return prompt.rendered.data;
+
+    prompt.rendered.len = 0;
+    word_buf_append(&prompt.rendered, "", 0);
+    char number[16];
+    for (int i = 0; i < prompt.count; i++) {
+        const prompt_segment_t *seg = &prompt.segments[i];
+        const char *value = NULL;
+        switch (seg->type) {
+            case PROMPT_TEXT: word_buf_append(&prompt.rendered, seg->text, seg->len); continue;
+            case PROMPT_CWD: value = prompt.cwd; break;
+            case PROMPT_CWD_BASE: value = prompt.cwd_base; break;
+            case PROMPT_GIT_BRANCH: value = prompt.git_branch; break;
+            case PROMPT_STATUS: snprintf(number, sizeof(number), "%d", prompt.status); value = number; break;
+            case PROMPT_JOBS: snprintf(number, sizeof(number), "%d", prompt.jobs); value = number; break;
         }
+        word_buf_append(&prompt.rendered, value, strlen(value));
+    }
+    prompt.dirty = 0;
+    return prompt.rendered.data;
+}
+
+// --- Interactive Loop Functions ---
+
+/**
+ * @brief Readline callback, called with each complete input line (or NULL on EOF).
+ * Runs the line, then reports job status changes before readline redraws the prompt.
+ * @param line The line read (allocated by readline, freed here), or NULL on EOF.
+ */
+void handle_input_line(char *line) {
+    // Handle EOF (Ctrl+D) or readline error
+    if (line == NULL) {
+        pending_input_finish(&interactive_pending);
+        printf("\nClosing ca$h...\n");
+        rl_callback_handler_remove();
+        shell_exit_requested = 1;
+        return;
+    }
+
+    // Skip empty input lines (just Enter or whitespace)
+    char *trimmed_line = line + strspn(line, " \t\n\r");
+    if (*trimmed_line != '\0') {
+        history_record(line); // Add non-empty line to history and its search index
+        history_append_line(line); // Persist it now, not at exit
+        // Execute the command line (handles pipes, jobs, etc.); an unfinished
+        // if / while / function asks for the rest with the continuation prompt
+        execute_continued(&interactive_pending, line);
+    }
+    // OS Concept: Memory Management - Freeing readline's buffer.
+    free(line);
+
+    reap_children();
+    check_jobs_status(); // Report background job status changes
+    rl_set_prompt(prompt_render(interactive_pending.text != NULL)); // After the notices: \j counts what is left
+}
+
+/**
+ * @brief Check whether any job has a status change that check_jobs_status would print.
+ * @return 1 if a notice is pending, 0 otherwise.
+ */
+int job_notices_pending() {
+    for (int n = 0; n < job_table.notice_count; n++) {
+        int slot = find_job_slot_by_jid(job_table.notices[n]);
+        if (slot == -1) continue;
+        const job_t *job = &job_table.slots[slot];
+        if (job->state == JOB_STATE_DONE && !job->foreground) return 1;
+        if (job->state == JOB_STATE_STOPPED && !job->notified) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle a child event while the user is at the prompt: reap the children and
+ * print "Done"/"Stopped" notices right away, then redraw the prompt and the partial input.
+ */
+void handle_child_event() {
+    drain_child_events();
+    reap_children();
+    if (!job_notices_pending()) return;
+
+    // Move the half-typed line out of the way, print the notices, then restore it
+    int saved_point = rl_point;
+    char *saved_line = rl_copy_text(0, rl_end);
+    rl_save_prompt();
+    rl_replace_line("", 0);
+    rl_redisplay();
+
+    check_jobs_status();
+
+    rl_restore_prompt();
+    rl_set_prompt(prompt_render(interactive_pending.text != NULL)); // Finished jobs change \j
+    rl_replace_line(saved_line ? saved_line : "", 0);
+    rl_point = saved_point;
+    rl_forced_update_display();
+    free(saved_line);
+}
+
+// --- Main Function ---
+int main(int argc, char **argv) {
+    char *history_filepath = NULL;
 
-        // Handle foreground/background for the pipeline
-        if (background) {
-            if (shell_is_interactive && pipeline_pgid > 0) {
-                 int jid = add_job(pipeline_pgid, original_cmd_for_job, JOB_STATE_RUNNING);
-                 if (jid > 0) printf("[%d] %d\n", jid, pipeline_pgid); // Report pipeline PGID
+    if (argc > 1 && strcmp(argv[1], "--startup-profile") == 0) {
+        startup_profile.enabled = 1;
+        clock_gettime(CLOCK_MONOTONIC, &startup_profile.start);
+        startup_profile.last = startup_profile.start;
+        argv[1] = argv[0]; // Drop the option
+        argc--; argv++;
+    }
+
+    init_jobs(); // Initialize job control structures
+    vars_init(); // Shell variables, starting with the exported environment
+    shell_pid = getpid();
+
+    // Allow picking the spawn backend up front (e.g. CASH_SPAWN=fork for comparisons)
+    const char *spawn_env = var_get("CASH_SPAWN");
+    if (spawn_env && strcmp(spawn_env, "fork") == 0) { spawn_backend = SPAWN_BACKEND_FORK; }
+    // CASH_TRACE=file: time every phase from the start and write Chrome trace events
+    const char *trace_env = var_get("CASH_TRACE");
+    if (trace_env && *trace_env) trace_enable(trace_env);
+
+    // --- Non-interactive Modes ---
+    // `cash -c 'cmds'` and `cash script.cash` never touch readline, the prompt,
+    // history or the terminal; they run each line through the same execute_pipeline path.
+    shell_is_interactive = 0;
+    if (argc > 1) {
+        if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) { fprintf(stderr, "ca$h: -c: option requires an argument\n"); return 2; }
+            if (argc > 3) { // cash -c 'cmds' name args...: $0 is name, $1... the args
+                shell_name = argv[3];
+                positional_args = argv + 4;
+                positional_count = argc - 4;
             }
-        } else { // Foreground pipeline
-             if (shell_is_interactive && pipeline_pgid > 0) {
-                  // Wait for the entire pipeline process group
-                  char *cmd_copy = strdup(original_cmd_for_job ? original_cmd_for_job : "");
-                  if (!cmd_copy) {perror("ca$h: strdup failed for fg pipeline"); return;}
-                  job_t fg_job = { .jid = 0, .pgid = pipeline_pgid, .state = JOB_STATE_RUNNING, .command = cmd_copy };
-                  put_job_in_foreground(&fg_job, 0);
-                  free(cmd_copy);
-             } else { // Non-interactive: Wait for both children individually
-                  waitpid(pid1, NULL, 0);
-                  waitpid(pid2, NULL, 0);
-             }
+            return run_script_string(argv[2]);
+        }
+        shell_name = argv[1]; // cash script args...: $0 is the script
+        positional_args = argv + 2;
+        positional_count = argc - 2;
+        return run_script_file(argv[1]);
+    }
+
+    // --- Shell Initialization ---
+    terminal_fd = STDIN_FILENO;
+    // OS Concept: TTY Detection - Is the shell connected to a terminal?
+    // If not, stdin is a script (e.g. `cmds | cash`): read it in bulk instead of through readline.
+    if (!isatty(terminal_fd)) {
+        return run_script_fd(STDIN_FILENO);
+    }
+    shell_is_interactive = 1;
+
+    // OS Concept: Process Groups & Terminal Control - Take control of the terminal.
+    // Loop until shell is in the foreground process group
+    while (tcgetpgrp(terminal_fd) != (cash_pgid = getpgrp())) {
+        kill(-cash_pgid, SIGKILL); // Safety kill if started in background
+    }
+    // Set shell's process group as the terminal's foreground group
+    cash_pgid = getpgrp();
+    if (tcsetpgrp(terminal_fd, cash_pgid) == -1) {
+        perror("ca$h: Couldn't grab control of terminal");
+        shell_is_interactive = 0; // Fallback to non-interactive?
+    }
+    startup_phase("tty");
+
+    // OS Concept: Signal Handling - Shell ignores job control/interrupt signals.
+    signal(SIGINT, SIG_IGN);  // Ctrl+C
+    signal(SIGQUIT, SIG_IGN); // Ctrl+backslash
+    signal(SIGTSTP, SIG_IGN); // Ctrl+Z
+    signal(SIGTTIN, SIG_IGN); // Background read attempt
+    signal(SIGTTOU, SIG_IGN); // Background write attempt
+    // Child status changes arrive on child_event_fd (signalfd or self-pipe), never reaped in a handler
+    init_child_events();
+    startup_phase("signals");
+
+    // Initialize command history: only open the file here, it is read on first use
+    history_filepath = get_history_filepath();
+    if (history_filepath) {
+        stifle_history(HISTORY_LIMIT);
+        history_open(history_filepath);
+    }
+    startup_phase("history");
+
+    run_rc_file();
+    startup_phase("rc file");
+
+    display_welcome_message();
+
+    // --- Main Shell Loop ---
+    // OS Concept: I/O Multiplexing - poll() waits on the terminal and on child events
+    // together, so background jobs are reported as soon as they finish, even mid-line.
+    rl_change_environment = 0; // LINES/COLUMNS must not go through setenv behind the variable table
+    rl_initialize();
+    history_install_lazy_bindings(); // Keymaps (arrow keys included) are set up now
+    startup_phase("readline");
+    print_startup_profile();
+    rl_callback_handler_install(prompt_render(0), handle_input_line);
+    while (!shell_exit_requested) {
+        struct pollfd fds[2];
+        fds[0].fd = terminal_fd;    fds[0].events = POLLIN; fds[0].revents = 0;
+        fds[1].fd = child_event_fd; fds[1].events = POLLIN; fds[1].revents = 0;
+        if (poll(fds, child_event_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("ca$h: poll failed");
+            rl_callback_handler_remove();
+            break;
         }
+        if (child_event_fd >= 0 && (fds[1].revents & POLLIN)) { handle_child_event(); }
+        // OS Concept: Input Reading - Feed readline one keystroke at a time.
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) { rl_callback_read_char(); }
+    }
+
+    // --- Shell Exit ---
+    // History was appended line by line; just write what is still queued
+    if (history_filepath) {
+        history_close();
+        free(history_store.lock_path);
+        free(history_filepath); // Free the path string
+    }
+
+    // Clean up any remaining jobs
+    for (int i = 0; i < job_table.used; i++) {
+        remove_job(&job_table.slots[i]);
+    }
+
+    printf("ca$h closed.\n");
+    return 0;
+}
+
+
+// --- Core Shell Helper Functions ---
+
+/**
+ * @brief Display the shell's welcome banner.
+ */
+void display_welcome_message() {
+    printf("\n");
+    printf(" ██████╗ █████╗ ███████╗██╗  ██╗\n");
+    printf("██╔════╝██╔══██╗██╔════╝██║  ██║\n");
+    printf("██║     ███████║███████╗███████║\n");
+    printf("██║     ██╔══██║╚════██║██╔══██║\n");
+    printf("╚██████╗██║  ██║███████║██║  ██║\n");
+    printf(" ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═╝\n");
+    printf("\n");
+    printf("Welcome to ca$h - A simple shell by Rajin Khan!\n");
+    printf("Demonstrates specific OS Concepts: Process Creation (fork), Program Execution (execvp),\n");
+    printf("Waiting (waitpid), Background Jobs (&), File I/O Redirection (<, >),\n");
+    printf("IPC via Pipes (|), Signal Handling (SIGCHLD), Job Control (jobs, fg, bg),\n");
+    printf("History & Editing (readline)\n");
+    printf("Type 'exit' to quit.\n\n");
+}
+
+// --- Arena Allocator Functions ---
+
+/**
+ * @brief Allocate memory from an arena (8-byte aligned). Never returns NULL.
+ * @param arena The arena.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, valid until the next arena_reset.
+ */
+void* arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_chunk_t *chunk = arena->current;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // OS Concept: Memory Allocation - One malloc per chunk, not per object.
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+        arena_chunk_t *new_chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!new_chunk) { perror("ca$h: malloc failed for arena"); exit(EXIT_FAILURE); }
+        new_chunk->next = NULL;
+        new_chunk->size = chunk_size;
+        new_chunk->used = 0;
+        if (chunk) { chunk->next = new_chunk; } else { arena->first = new_chunk; }
+        arena->current = chunk = new_chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/**
+ * @brief Copy a string of known length into an arena.
+ * @param arena The arena.
+ * @param str Source characters (need not be NUL-terminated).
+ * @param len Number of characters to copy.
+ * @return NUL-terminated copy.
+ */
+char* arena_strndup(arena_t *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Release everything allocated from an arena. The first chunk is kept,
+ * so the next short command line allocates nothing from malloc.
+ * @param arena The arena.
+ */
+void arena_reset(arena_t *arena) {
+    if (arena->first == NULL) return;
+    arena_chunk_t *chunk = arena->first->next;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+/**
+ * @brief Remember the current allocation point of an arena.
+ * @param arena The arena.
+ * @return Mark for arena_release.
+ */
+arena_mark_t arena_mark(const arena_t *arena) {
+    arena_mark_t mark = { arena->current, arena->current ? arena->current->used : 0 };
+    return mark;
+}
+
+/**
+ * @brief Release everything allocated after a mark, keeping what came before it.
+ * Lets a sourced script reset the line arena per line without freeing the line
+ * that ran `source`. Releasing the mark of an empty arena is arena_reset.
+ * @param arena The arena.
+ * @param mark Mark from arena_mark.
+ */
+void arena_release(arena_t *arena, arena_mark_t mark) {
+    if (mark.chunk == NULL) { arena_reset(arena); return; }
+    arena_chunk_t *chunk = mark.chunk->next;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    mark.chunk->next = NULL;
+    mark.chunk->used = mark.used;
+    arena->current = mark.chunk;
+}
+
+// --- Lexer and Parser Functions ---
+
+/**
+ * @brief Append a token to a token list, growing it inside the arena.
+ * @param tokens The token list.
+ * @param arena Arena the list lives in.
+ * @return Pointer to the new (uninitialized) token.
+ */
+static token_t* token_list_push(token_list_t *tokens, arena_t *arena) {
+    if (tokens->count == tokens->capacity) {
+        int new_capacity = tokens->capacity ? tokens->capacity * 2 : 16;
+        token_t *new_items = arena_alloc(arena, new_capacity * sizeof(token_t));
+        if (tokens->count) memcpy(new_items, tokens->items, tokens->count * sizeof(token_t));
+        tokens->items = new_items;
+        tokens->capacity = new_capacity;
+    }
+    return &tokens->items[tokens->count++];
+}
+
+/**
+ * @brief Printable form of an operator token (for syntax error messages).
+ * @param type Token type.
+ * @return Static string.
+ */
+const char* token_text(token_type_t type) {
+    switch (type) {
+        case TOKEN_PIPE:   return "|";
+        case TOKEN_LESS:   return "<";
+        case TOKEN_GREAT:  return ">";
+        case TOKEN_DGREAT: return ">>";
+        case TOKEN_TLESS:  return "<<<";
+        case TOKEN_LESSAND:   return "<&";
+        case TOKEN_GREATAND:  return ">&";
+        case TOKEN_ANDGREAT:  return "&>";
+        case TOKEN_ANDDGREAT: return "&>>";
+        case TOKEN_AMP:    return "&";
+        case TOKEN_SEMI:   return ";";
+        case TOKEN_AND_IF: return "&&";
+        case TOKEN_OR_IF:  return "||";
+        case TOKEN_NEWLINE: return "newline";
+        case TOKEN_LPAREN: return "(";
+        case TOKEN_RPAREN: return ")";
+        default:           return "word";
+    }
+}
+
+/**
+ * @brief Find the ')' that closes a command substitution, skipping quoted text,
+ * escapes and nested parentheses, so "$(echo ')')" and $(f $(g)) end in the right place.
+ * @param p Points at the '(' after the '$'.
+ * @return Pointer to the closing ')', or NULL if the text ends first.
+ */
+static const char* subst_end(const char *p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '\\') {
+            if (!*++p) return NULL;
+        } else if (*p == '\'') {
+            if (!(p = strchr(p + 1, '\''))) return NULL;
+        } else if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) if (*p == '\\' && p[1]) p++;
+            if (!*p) return NULL;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief If this '$' starts a parameter reference ($?, $1, ${...}, $NAME) or a command
+ * substitution, write it with the '$' replaced by a mark. A one-character name ($$, $?)
+ * is copied along with it, so the next '$' of "$$x" is not taken for a reference of its
+ * own. $(command) is copied as written, up to its ')', and run when the word is expanded.
+ * @param p Source position (at the '$'); advanced past what was written.
+ * @param out Output position; advanced.
+ * @param mark EXPAND_MARK or EXPAND_MARK_QUOTED.
+ * @return 1 if a reference was written, 0 if the '$' is literal (nothing written),
+ * PARSE_INCOMPLETE if a $( is not closed yet.
+ */
+static int lex_reference(const char **p, char **out, char mark) {
+    const char *s = *p;
+    if (s[0] != '$') return 0;
+    if (s[1] == '(') {
+        const char *close = subst_end(s + 1);
+        if (!close) return PARSE_INCOMPLETE; // Goes on in the next line
+        *(*out)++ = mark;
+        memcpy(*out, s + 1, close - s);
+        *out += close - s;
+        *p = close + 1;
+        return 1;
+    }
+    int special = s[1] && strchr("?$#@*!0123456789", s[1]) != NULL;
+    if (!special && s[1] != '{' && s[1] != '_' && !isalpha((unsigned char)s[1])) return 0;
+    *(*out)++ = mark;
+    if (special) *(*out)++ = s[1];
+    *p = s + 1 + special;
+    return 1;
+}
+
+/**
+ * @brief Does a process substitution, <(...) or >(...), start here?
+ */
+static int lex_process_subst(const char *p) {
+    return (*p == '<' || *p == '>') && p[1] == '(';
+}
+
+/**
+ * @brief Does a word start with an assignment (NAME=, with NAME unquoted)?
+ * @param p Start of the word in the source.
+ */
+static int lex_assignment(const char *p) {
+    if (*p != '_' && !isalpha((unsigned char)*p)) return 0;
+    while (*p == '_' || isalnum((unsigned char)*p)) p++;
+    return *p == '=';
+}
+
+/**
+ * @brief Split a command into tokens in a single pass. Handles 'single quotes',
+ * "double quotes" (where backslash only escapes \, ", $ and `), backslash escapes and # comments.
+ * The text may span several lines: newlines become TOKEN_NEWLINE, and a quote or a
+ * trailing backslash left open at the end asks the caller for the next line.
+ * Word text is written unquoted into one arena block sized for the whole line,
+ * so lexing costs one allocation and no further copies of the line. A '$' that is
+ * not single-quoted or escaped and starts a reference ($?, ${...}, $NAME) is written as
+ * EXPAND_MARK (unquoted: the result is split into fields) or EXPAND_MARK_QUOTED (in
+ * double quotes or a NAME=value word), so expansion knows which dollars are live
+ * without re-lexing. Likewise an unquoted *, ? or [ (one with a closing ']' in the
+ * same word) is prefixed with GLOB_MARK, so "*.c" and \*.c stay literal.
+ * @param line The command line (not modified).
+ * @param arena Arena receiving tokens and word text.
+ * @param tokens Output token list.
+ * @return 1 on success, PARSE_INCOMPLETE if a quote is still open at the end.
+ */
+int lex_line(const char *line, arena_t *arena, token_list_t *tokens) {
+    tokens->items = NULL;
+    tokens->count = tokens->capacity = 0;
+
+    // Word text is never longer than its source, so all words plus their NULs fit in 2*len+1
+    size_t line_len = strlen(line);
+    char *out = arena_alloc(arena, 2 * line_len + 1);
+    const char *p = line;
+    int ref; // Result of lex_reference
+
+    while (1) {
+        p += strspn(p, " \t\r");
+        if (p[0] == '\\' && p[1] == '\n') { p += 2; continue; } // Line continuation
+        if (*p == '#') p += strcspn(p, "\n"); // Comment up to the end of the line
+        if (*p == '\0') break;
+
+        token_t *tok = token_list_push(tokens, arena);
+        tok->start = p - line;
+        tok->text = NULL;
+        tok->io_number = -1;
+        tok->expand = 0;
+        tok->assign = 0;
+        tok->quoted = 0;
+
+        // A single digit glued to '<' or '>' names the descriptor (2>, 0<&-)
+        if (*p >= '0' && *p <= '9' && (p[1] == '<' || p[1] == '>') && p[2] != '(') { tok->io_number = *p - '0'; p++; }
+
+        // OS Concept: Shell Syntax Parsing - Recognizing operators (longest match first).
+        // <(cmd) and >(cmd) start a word (process substitution), not a redirection.
+        switch (lex_process_subst(p) ? 0 : *p) {
+            case '|': if (p[1] == '|') { tok->type = TOKEN_OR_IF; p += 2; } else { tok->type = TOKEN_PIPE; p++; } break;
+            case '&':
+                if (p[1] == '&') { tok->type = TOKEN_AND_IF; p += 2; }
+                else if (p[1] == '>' && p[2] == '>') { tok->type = TOKEN_ANDDGREAT; p += 3; }
+                else if (p[1] == '>') { tok->type = TOKEN_ANDGREAT; p += 2; }
+                else { tok->type = TOKEN_AMP; p++; }
+                break;
+            case ';': tok->type = TOKEN_SEMI; p++; break;
+            case '\n': tok->type = TOKEN_NEWLINE; p++; break;
+            case '(': tok->type = TOKEN_LPAREN; p++; break;
+            case ')': tok->type = TOKEN_RPAREN; p++; break;
+            case '<':
+                if (p[1] == '<' && p[2] == '<') { tok->type = TOKEN_TLESS; p += 3; }
+                else if (p[1] == '&') { tok->type = TOKEN_LESSAND; p += 2; }
+                else { tok->type = TOKEN_LESS; p++; }
+                break;
+            case '>':
+                if (p[1] == '>') { tok->type = TOKEN_DGREAT; p += 2; }
+                else if (p[1] == '&') { tok->type = TOKEN_GREATAND; p += 2; }
+                else { tok->type = TOKEN_GREAT; p++; }
+                break;
+            default:
+                // A word runs until unquoted whitespace or an operator character
+                tok->type = TOKEN_WORD;
+                tok->text = out;
+                tok->assign = lex_assignment(p);
+                while (*p && (!strchr(" \t\r\n|&;<>()", *p) || lex_process_subst(p))) {
+                    if (*p == '\\') { // Backslash: next character is literal
+                        p++;
+                        if (*p == '\0') return PARSE_INCOMPLETE; // Continued on the next line
+                        if (*p == '\n') { p++; continue; }
+                        tok->quoted = 1;
+                        *out++ = *p++;
+                    } else if (*p == '\'') { // Single quotes: everything literal
+                        const char *close = strchr(p + 1, '\'');
+                        if (!close) return PARSE_INCOMPLETE; // The quote goes on on the next line
+                        memcpy(out, p + 1, close - p - 1);
+                        out += close - p - 1;
+                        p = close + 1;
+                        tok->quoted = 1;
+                    } else if (*p == '"') { // Double quotes: backslash only escapes \ " $ ` and newline
+                        p++;
+                        while (*p && *p != '"') {
+                            if (*p == '\\' && p[1] == '\n') { p += 2; continue; }
+                            if (*p == '\\' && p[1] && strchr("\"\\$`", p[1])) p++;
+                            else if ((ref = lex_reference(&p, &out, EXPAND_MARK_QUOTED)) != 0) {
+                                if (ref == PARSE_INCOMPLETE) return PARSE_INCOMPLETE;
+                                tok->expand = 1;
+                                continue;
+                            }
+                            *out++ = *p++;
+                        }
+                        if (*p != '"') return PARSE_INCOMPLETE;
+                        p++;
+                        tok->quoted = 1;
+                    } else if (lex_process_subst(p)) { // Copied as written, up to its ')', and run when the word is expanded
+                        const char *close = subst_end(p + 1);
+                        if (!close) return PARSE_INCOMPLETE;
+                        *out++ = EXPAND_MARK;
+                        memcpy(out, p, close + 1 - p);
+                        out += close + 1 - p;
+                        p = close + 1;
+                        tok->expand = 1;
+                    } else if ((ref = lex_reference(&p, &out, tok->assign ? EXPAND_MARK_QUOTED : EXPAND_MARK)) != 0) {
+                        if (ref == PARSE_INCOMPLETE) return PARSE_INCOMPLETE;
+                        tok->expand = 1; // Expanded when the command runs
+                    } else if (*p == '*' || *p == '?' || (*p == '[' && memchr(p + 1, ']', strcspn(p + 1, " \t\r\n|&;<>()")))) {
+                        *out++ = GLOB_MARK; // Pattern character: the word is globbed when the command runs
+                        *out++ = *p++;
+                        tok->expand = 1;
+                    } else {
+                        *out++ = *p++;
+                    }
+                }
+                *out++ = '\0';
+                break;
+        }
+        tok->end = p - line;
+    }
+    return 1;
+}
+
+/**
+ * @brief Next token, or NULL at the end of the input.
+ */
+static const token_t* parser_peek(const parser_t *ps) {
+    return ps->pos < ps->tokens->count ? &ps->tokens->items[ps->pos] : NULL;
+}
+
+/**
+ * @brief Is this token the reserved word kw? Only an unquoted word is (so "if" and
+ * \fi are ordinary arguments), and callers only ask at the start of a command.
+ */
+static int is_keyword(const token_t *tok, const char *kw) {
+    return tok && tok->type == TOKEN_WORD && !tok->quoted && !tok->expand && strcmp(tok->text, kw) == 0;
+}
+
+/**
+ * @brief Does this token end the list it follows (then, elif, else, fi, do, done, }, ))?
+ */
+static int is_list_terminator(const token_t *tok) {
+    static const char *const words[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+    if (tok && tok->type == TOKEN_RPAREN) return 1;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (is_keyword(tok, words[i])) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Report a syntax error at a token. At the end of the input nothing is printed:
+ * the construct is just incomplete, and the caller reads another line.
+ * @return 0, for `return parser_error(...)`.
+ */
+static int parser_error(parser_t *ps, const token_t *tok) {
+    if (!tok) { ps->incomplete = 1; return 0; }
+    fprintf(stderr, "ca$h: syntax error near unexpected token `%s'\n", tok->type == TOKEN_WORD ? tok->text : token_text(tok->type));
+    return 0;
+}
+
+/**
+ * @brief Consume the reserved word kw, or report what is there instead.
+ * @return 1 if it was there.
+ */
+static int parser_expect(parser_t *ps, const char *kw) {
+    const token_t *tok = parser_peek(ps);
+    if (!is_keyword(tok, kw)) return parser_error(ps, tok);
+    ps->pos++;
+    return 1;
+}
+
+/**
+ * @brief Skip newlines (allowed before a command, after | && || and around keywords).
+ */
+static void parser_skip_newlines(parser_t *ps) {
+    while (ps->pos < ps->tokens->count && ps->tokens->items[ps->pos].type == TOKEN_NEWLINE) ps->pos++;
+}
+
+/**
+ * @brief Parse the whole command (one line, or several for an if/while/for/function).
+ * A '&' after a single pipeline backgrounds it; after an && / || list it backgrounds
+ * the whole list. A trailing ';' or '&' is allowed; a trailing '&&', '|' or an open
+ * construct means the command goes on on the next line.
+ * @param line The source text (for job titles).
+ * @param tokens Tokens produced by lex_line.
+ * @param arena Arena for the list.
+ * @param list Output list (empty for a blank line or a comment).
+ * @return 1 on success, 0 on a syntax error (reported), PARSE_INCOMPLETE if more
+ * lines are needed.
+ */
+int parse_command_list(const char *line, const token_list_t *tokens, arena_t *arena, command_list_t *list) {
+    parser_t ps = { line, tokens, 0, arena, 0 };
+    int ok = parse_list(&ps, list);
+    if (ps.incomplete) return PARSE_INCOMPLETE;
+    if (!ok) return 0;
+    if (ps.pos < tokens->count) return parser_error(&ps, parser_peek(&ps)); // A stray fi, done, ) ...
+    return 1;
+}
+
+/**
+ * @brief Follow the nesting of a command that goes on over several lines, lexing only
+ * what was added since the last call, so a long if ... fi or function body is parsed
+ * once when it can be complete instead of again for every line. A quoted word or $(
+ * that spans lines is lexed again from its first line. The parser still decides: it
+ * may ask for more lines, and a syntax error inside an open construct is reported
+ * once the construct is closed or the input ends.
+ * @param scan State kept with the text (zeroed when the command starts).
+ * @param text The command so far, lines joined by '\n'.
+ * @param len Length of text.
+ * @return 1 if the command should be parsed now, 0 if it certainly goes on.
+ */
+int continuation_scan(continuation_t *scan, const char *text, size_t len) {
+    token_list_t tokens;
+    arena_mark_t mark = arena_mark(&line_arena);
+    // Unlexed text always starts a line, and a newline separates commands
+    if (lex_line(text + scan->scanned, &line_arena, &tokens) == PARSE_INCOMPLETE) {
+        arena_release(&line_arena, mark);
+        return 0;
+    }
+    scan->scanned = len;
+    scan->command_start = 1;
+    for (int i = 0; i < tokens.count; i++) {
+        const token_t *tok = &tokens.items[i];
+        int start = scan->command_start;
+        scan->command_start = 0;
+        scan->operator_open = 0;
+        switch (tok->type) {
+            case TOKEN_WORD:
+                if (scan->name_next) { scan->command_start = scan->name_next == 2; scan->name_next = 0; break; }
+                if (!start) break;
+                if (is_keyword(tok, "if") || is_keyword(tok, "while") || is_keyword(tok, "until") || is_keyword(tok, "{")) {
+                    scan->depth++;
+                    scan->command_start = 1;
+                } else if (is_keyword(tok, "for")) {
+                    scan->depth++;
+                    scan->name_next = 1;
+                } else if (is_keyword(tok, "function")) {
+                    scan->name_next = 2;
+                } else if (is_keyword(tok, "fi") || is_keyword(tok, "done") || is_keyword(tok, "}")) {
+                    if (--scan->depth < 0) scan->unbalanced = 1;
+                } else if (is_keyword(tok, "then") || is_keyword(tok, "else") || is_keyword(tok, "elif") ||
+                           is_keyword(tok, "do") || is_keyword(tok, "time")) {
+                    scan->command_start = 1;
+                }
+                break;
+            case TOKEN_LPAREN:
+                scan->depth++;
+                scan->command_start = 1;
+                break;
+            case TOKEN_RPAREN:
+                if (--scan->depth < 0) scan->unbalanced = 1;
+                scan->command_start = i > 0 && tokens.items[i - 1].type == TOKEN_LPAREN; // name() { ... }
+                break;
+            case TOKEN_PIPE:
+            case TOKEN_AND_IF:
+            case TOKEN_OR_IF:
+                scan->operator_open = 1;
+                scan->command_start = 1;
+                break;
+            case TOKEN_SEMI:
+            case TOKEN_AMP:
+            case TOKEN_NEWLINE:
+                scan->command_start = 1;
+                break;
+            default: // A redirection: its target is not a command
+                break;
+        }
+    }
+    arena_release(&line_arena, mark);
+    return scan->unbalanced || (scan->depth <= 0 && !scan->operator_open && !scan->name_next);
+}
+
+/**
+ * @brief Parse pipelines joined by ';', newline, '&', '&&' and '||' until the end of the
+ * input or a reserved word that closes the enclosing construct (left for the caller).
+ * @param ps Parser state.
+ * @param list Output list (may end up empty).
+ * @return 1 on success, 0 on a syntax error or incomplete input.
+ */
+int parse_list(parser_t *ps, command_list_t *list) {
+    list->items = NULL;
+    list->count = list->capacity = 0;
+    int group_start = ps->pos; // First token of the current && / || list
+    int group_first = 0;       // Its first pipeline in list->items
+
+    parser_skip_newlines(ps);
+    group_start = ps->pos;
+    while (1) {
+        const token_t *tok = parser_peek(ps);
+        if (!tok || is_list_terminator(tok)) break;
+
+        pipeline_t *pipeline = command_list_add(list, ps->arena);
+        if (!parse_pipeline(ps, pipeline)) return 0;
+        tok = parser_peek(ps);
+        if (!tok) break;
+        switch (tok->type) {
+            case TOKEN_AND_IF:
+            case TOKEN_OR_IF:
+                pipeline->next = (tok->type == TOKEN_AND_IF) ? CONNECT_AND : CONNECT_OR;
+                ps->pos++;
+                parser_skip_newlines(ps);
+                tok = parser_peek(ps);
+                if (!tok || is_list_terminator(tok)) return parser_error(ps, tok); // Needs a command
+                continue;
+            case TOKEN_AMP:
+                pipeline->next = CONNECT_BACKGROUND;
+                if (list->count - 1 == group_first) { pipeline->background = 1; }
+                else {
+                    int group_end = ps->tokens->items[ps->pos - 1].end;
+                    int start = ps->tokens->items[group_start].start;
+                    pipeline->group_command = arena_strndup(ps->arena, ps->line + start, group_end - start);
+                }
+                break;
+            case TOKEN_SEMI:
+            case TOKEN_NEWLINE:
+                break;
+            default:
+                if (is_list_terminator(tok)) return 1;
+                return parser_error(ps, tok);
+        }
+        ps->pos++;
+        parser_skip_newlines(ps);
+        group_first = list->count;
+        group_start = ps->pos;
+    }
+    return 1;
+}
+
+/**
+ * @brief Parse a size for 'limit': a number of bytes with an optional K, M, G or T
+ * suffix (powers of 1024).
+ * @return The size, or -1 if the text is not one.
+ */
+static long long limit_parse_size(const char *text) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0 || errno) return -1;
+    const char *units = "KMGT", *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (*end && (!unit || end[1] != '\0')) return -1;
+    for (int i = unit ? (int)(unit - units) + 1 : 0; i > 0; i--) {
+        if (value > LLONG_MAX / 1024) return -1;
+        value *= 1024;
+    }
+    return value;
+}
+
+/**
+ * @brief Parse the options of a 'limit' prefix (the word 'limit' already consumed).
+ * The values must be written literally: they are checked here, once, not per run.
+ * @param ps Parser state (at the first option).
+ * @param limits Output limits.
+ * @return 1 on success, 0 on a syntax error (reported).
+ */
+static int parse_limits(parser_t *ps, job_limits_t *limits) {
+    limits->set = 1;
+    const token_t *tok;
+    while ((tok = parser_peek(ps)) && tok->type == TOKEN_WORD && !tok->quoted && tok->text[0] == '-') {
+        char option = tok->text[1];
+        ps->pos++;
+        if (strcmp(tok->text, "--") == 0) break;
+        if (strcmp(tok->text, "-g") == 0) { limits->cgroup = 1; continue; }
+        const token_t *arg = parser_peek(ps);
+        if (tok->text[2] != '\0' || !strchr("tvnmc", option) || !arg || arg->type != TOKEN_WORD) {
+            fprintf(stderr, "ca$h: limit: Usage: limit [-t SECONDS] [-v SIZE] [-n FILES] [-m SIZE] [-c PERCENT] [-g] command\n");
+            return 0;
+        }
+        if (arg->expand) { fprintf(stderr, "ca$h: limit: -%c: value must be written literally\n", option); return 0; }
+        ps->pos++;
+        long long value = (option == 'v' || option == 'm') ? limit_parse_size(arg->text) : -1;
+        if (option != 'v' && option != 'm') {
+            char *end;
+            value = strtoll(arg->text, &end, 10);
+            if (end == arg->text || *end != '\0' || value < 0) value = -1;
+        }
+        if (value <= 0) { fprintf(stderr, "ca$h: limit: -%c: invalid value `%s'\n", option, arg->text); return 0; }
+        switch (option) {
+            case 't': limits->cpu_seconds = value; break;
+            case 'v': limits->address_space = value; break;
+            case 'n': limits->open_files = value; break;
+            case 'm': limits->memory_max = value; limits->cgroup = 1; break;
+            case 'c': limits->cpu_percent = value; limits->cgroup = 1; break;
+        }
+    }
+    tok = parser_peek(ps);
+    if (!tok || (tok->type != TOKEN_WORD && tok->type != TOKEN_LPAREN)) return parser_error(ps, tok);
+    return 1;
+}
+
+/**
+ * @brief Parse a pipeline: stages joined by '|', optionally prefixed by 'time'
+ * and / or 'limit OPTIONS'.
+ * @param ps Parser state (at the first token of the pipeline).
+ * @param pipeline Output pipeline.
+ * @return 1 on success, 0 on a syntax error or incomplete input.
+ */
+int parse_pipeline(parser_t *ps, pipeline_t *pipeline) {
+    pipeline->stages = NULL;
+    pipeline->count = pipeline->capacity = 0;
+    pipeline->background = 0;
+    pipeline->timed = 0;
+    memset(&pipeline->limits, 0, sizeof(pipeline->limits));
+    pipeline->command = NULL;
+    pipeline->next = CONNECT_SEQ;
+    pipeline->group_command = NULL;
+    pipeline->expand = 0;
+
+    // 'time' and 'limit OPTIONS' are prefixes for the whole pipeline, not commands of their own
+    while (ps->pos + 1 < ps->tokens->count) {
+        const token_t *tok = parser_peek(ps);
+        token_type_t next = ps->tokens->items[ps->pos + 1].type;
+        if (next != TOKEN_WORD && next != TOKEN_LPAREN) break;
+        if (!pipeline->timed && is_keyword(tok, "time")) { pipeline->timed = 1; ps->pos++; continue; }
+        if (pipeline->limits.set || !is_keyword(tok, "limit")) break;
+        ps->pos++;
+        if (!parse_limits(ps, &pipeline->limits)) return 0;
+    }
+    int first = ps->pos;
+
+    while (1) {
+        command_t *stage = pipeline_add_stage(pipeline, ps->arena);
+        if (!parse_stage(ps, pipeline, stage)) return 0;
+        const token_t *tok = parser_peek(ps);
+        if (!tok || tok->type != TOKEN_PIPE) break;
+        ps->pos++;
+        parser_skip_newlines(ps); // `a |` continues on the next line
+    }
+
+    // Job title: source text of the pipeline without the trailing '&'
+    int title_start = ps->tokens->items[first].start;
+    int title_end = ps->tokens->items[ps->pos - 1].end;
+    pipeline->command = arena_strndup(ps->arena, ps->line + title_start, title_end - title_start);
+    return 1;
+}
+
+/**
+ * @brief Parse one stage: a simple command (words become arguments, NAME=value words
+ * before the name become assignments, redirection operators take the next word), or
+ * a compound command or function definition followed by its redirections.
+ * @param ps Parser state.
+ * @param pipeline The pipeline the stage belongs to.
+ * @param stage Output stage (already added to the pipeline).
+ * @return 1 on success, 0 on a syntax error or incomplete input.
+ */
+int parse_stage(parser_t *ps, pipeline_t *pipeline, command_t *stage) {
+    const token_t *tok = parser_peek(ps);
+    if (!tok) return parser_error(ps, tok);
+
+    // Compound commands, and name() / function name definitions
+    int is_function = is_keyword(tok, "function") ||
+        (tok->type == TOKEN_WORD && !tok->quoted && is_valid_name(tok->text, strlen(tok->text)) &&
+         ps->pos + 2 < ps->tokens->count && ps->tokens->items[ps->pos + 1].type == TOKEN_LPAREN &&
+         ps->tokens->items[ps->pos + 2].type == TOKEN_RPAREN);
+    if (is_function || tok->type == TOKEN_LPAREN || is_keyword(tok, "if") || is_keyword(tok, "while") ||
+        is_keyword(tok, "until") || is_keyword(tok, "for") || is_keyword(tok, "{")) {
+        stage->compound = parse_compound(ps);
+        if (!stage->compound) return 0;
+        while ((tok = parser_peek(ps)) && tok->type >= TOKEN_LESS && tok->type <= TOKEN_ANDDGREAT) {
+            if (!parse_redirect(ps, pipeline, stage)) return 0;
+        }
+        return 1;
+    }
+    if (is_list_terminator(tok)) return parser_error(ps, tok); // `a | fi`
+
+    int start = ps->pos;
+    while ((tok = parser_peek(ps))) {
+        if (tok->type == TOKEN_WORD) {
+            // NAME=value words before the command name are assignments, not arguments
+            if (tok->assign && stage->argc == 0) command_add_assign(stage, ps->arena, tok->text);
+            else command_add_arg(stage, ps->arena, tok->text);
+            if (tok->expand) stage->expand = pipeline->expand = 1;
+            ps->pos++;
+        } else if (tok->type >= TOKEN_LESS && tok->type <= TOKEN_ANDDGREAT) {
+            if (!parse_redirect(ps, pipeline, stage)) return 0;
+        } else {
+            break;
+        }
+    }
+    if (ps->pos == start) { // Nothing usable here: `| |`, `;;`, `&& )` ...
+        if (tok && tok->type == TOKEN_PIPE) { fprintf(stderr, "ca$h: syntax error: missing command before pipe `|'\n"); return 0; }
+        return parser_error(ps, tok);
+    }
+    if (stage->args[0] == NULL && stage->nassigns == 0) { fprintf(stderr, "ca$h: syntax error: redirection without command\n"); return 0; }
+    stage->builtin = stage->args[0] ? find_builtin(stage->args[0]) : NULL;
+    return 1;
+}
+
+/**
+ * @brief Parse a redirection operator and the word after it into a stage.
+ * @param ps Parser state (at the operator).
+ * @param pipeline The pipeline (its expand flag is set if the word needs expansion).
+ * @param stage The stage receiving the redirection.
+ * @return 1 on success, 0 on a syntax error or incomplete input.
+ */
+int parse_redirect(parser_t *ps, pipeline_t *pipeline, command_t *stage) {
+    const token_t *tok = &ps->tokens->items[ps->pos];
+    const token_t *target = ps->pos + 1 < ps->tokens->count ? &ps->tokens->items[ps->pos + 1] : NULL;
+    if (!target || target->type != TOKEN_WORD) {
+        fprintf(stderr, "ca$h: syntax error near redirection `%s'\n", token_text(tok->type));
+        return 0;
+    }
+    ps->pos += 2; // Consume the operator and the filename / fd / text
+    if (target->expand) stage->expand = pipeline->expand = 1;
+    char *word = target->text;
+    int is_input = (tok->type == TOKEN_LESS || tok->type == TOKEN_TLESS || tok->type == TOKEN_LESSAND);
+    redirect_t *redir = command_add_redirect(stage, ps->arena);
+    redir->fd = tok->io_number >= 0 ? tok->io_number : (is_input ? STDIN_FILENO : STDOUT_FILENO);
+    redir->source_fd = -1;
+    redir->target = word;
+    switch (tok->type) {
+        case TOKEN_LESS:      redir->type = REDIR_INPUT; break;
+        case TOKEN_GREAT:     redir->type = REDIR_OUTPUT; break;
+        case TOKEN_DGREAT:    redir->type = REDIR_APPEND; break;
+        case TOKEN_TLESS:     redir->type = REDIR_HERESTRING; break;
+        case TOKEN_ANDGREAT:  redir->type = REDIR_BOTH; break;
+        case TOKEN_ANDDGREAT: redir->type = REDIR_BOTH_APPEND; break;
+        default: // <& and >&: a descriptor number, '-' to close, or (>& only) a file for both streams
+            if (strcmp(word, "-") == 0) { redir->type = REDIR_CLOSE; }
+            else if (word[0] && strspn(word, "0123456789") == strlen(word) && strlen(word) < 10) { redir->type = REDIR_DUP; redir->source_fd = atoi(word); }
+            else if (target->expand) { redir->type = REDIR_DUP; } // >&${CO[1]}: the number is known once expanded
+            else if (tok->type == TOKEN_GREATAND && tok->io_number < 0) { redir->type = REDIR_BOTH; }
+            else { fprintf(stderr, "ca$h: %s: ambiguous redirect\n", word); return 0; }
+    }
+    return 1;
+}
+
+/**
+ * @brief Parse a list that must not be empty (if/while conditions, loop bodies).
+ */
+static int parse_nonempty_list(parser_t *ps, command_list_t *list) {
+    if (!parse_list(ps, list)) return 0;
+    if (list->count == 0) return parser_error(ps, parser_peek(ps));
+    return 1;
+}
+
+/**
+ * @brief Parse the rest of an if after its 'if' or 'elif': condition, then-part and
+ * the elif / else parts, up to and including the 'fi'.
+ */
+static compound_t* parse_if_rest(parser_t *ps, compound_t *c) {
+    c->type = COMPOUND_IF;
+    if (!parse_nonempty_list(ps, &c->cond) || !parser_expect(ps, "then") || !parse_nonempty_list(ps, &c->body)) return NULL;
+    const token_t *tok = parser_peek(ps);
+    if (is_keyword(tok, "elif")) {
+        ps->pos++;
+        c->orelse = arena_alloc(ps->arena, sizeof(compound_t));
+        memset(c->orelse, 0, sizeof(compound_t));
+        return parse_if_rest(ps, c->orelse) ? c : NULL; // The innermost part consumes the 'fi'
+    }
+    if (is_keyword(tok, "else")) {
+        ps->pos++;
+        c->orelse = arena_alloc(ps->arena, sizeof(compound_t));
+        memset(c->orelse, 0, sizeof(compound_t));
+        c->orelse->type = COMPOUND_GROUP;
+        if (!parse_nonempty_list(ps, &c->orelse->body)) return NULL;
+    }
+    return parser_expect(ps, "fi") ? c : NULL;
+}
+
+/**
+ * @brief Parse a compound command or a function definition.
+ * @param ps Parser state (at if, while, until, for, {, ( or the function name).
+ * @return The construct, or NULL on a syntax error or incomplete input.
+ */
+compound_t* parse_compound(parser_t *ps) {
+    compound_t *c = arena_alloc(ps->arena, sizeof(compound_t));
+    memset(c, 0, sizeof(compound_t));
+    const token_t *tok = parser_peek(ps);
+    ps->pos++;
+
+    if (tok->type == TOKEN_LPAREN) {
+        c->type = COMPOUND_SUBSHELL;
+        int start = tok->start;
+        if (!parse_nonempty_list(ps, &c->body)) return NULL;
+        tok = parser_peek(ps);
+        if (!tok || tok->type != TOKEN_RPAREN) { parser_error(ps, tok); return NULL; }
+        ps->pos++;
+        c->name = arena_strndup(ps->arena, ps->line + start, tok->end - start); // Job title
+        return c;
+    }
+    if (is_keyword(tok, "if")) return parse_if_rest(ps, c);
+    if (is_keyword(tok, "while") || is_keyword(tok, "until")) {
+        c->type = is_keyword(tok, "while") ? COMPOUND_WHILE : COMPOUND_UNTIL;
+        if (!parse_nonempty_list(ps, &c->cond) || !parser_expect(ps, "do") ||
+            !parse_nonempty_list(ps, &c->body) || !parser_expect(ps, "done")) return NULL;
+        return c;
+    }
+    if (is_keyword(tok, "{")) {
+        c->type = COMPOUND_GROUP;
+        if (!parse_nonempty_list(ps, &c->body) || !parser_expect(ps, "}")) return NULL;
+        return c;
+    }
+    if (is_keyword(tok, "for")) {
+        c->type = COMPOUND_FOR;
+        tok = parser_peek(ps);
+        if (!tok || tok->type != TOKEN_WORD || tok->quoted || !is_valid_name(tok->text, strlen(tok->text))) {
+            parser_error(ps, tok);
+            return NULL;
+        }
+        c->name = tok->text;
+        ps->pos++;
+        parser_skip_newlines(ps);
+        c->nwords = -1;
+        if (is_keyword(parser_peek(ps), "in")) {
+            ps->pos++;
+            int first = ps->pos;
+            while ((tok = parser_peek(ps)) && tok->type == TOKEN_WORD) ps->pos++;
+            c->nwords = ps->pos - first;
+            c->words = arena_alloc(ps->arena, (c->nwords + 1) * sizeof(char *));
+            for (int i = 0; i < c->nwords; i++) c->words[i] = ps->tokens->items[first + i].text;
+            c->words[c->nwords] = NULL;
+            if (!tok || (tok->type != TOKEN_SEMI && tok->type != TOKEN_NEWLINE)) { parser_error(ps, tok); return NULL; }
+            ps->pos++;
+        } else if ((tok = parser_peek(ps)) && tok->type == TOKEN_SEMI) {
+            ps->pos++;
+        }
+        parser_skip_newlines(ps);
+        if (!parser_expect(ps, "do") || !parse_nonempty_list(ps, &c->body) || !parser_expect(ps, "done")) return NULL;
+        return c;
+    }
+
+    // Function definition: name() compound, function name compound, function name() compound
+    c->type = COMPOUND_FUNCTION;
+    if (is_keyword(tok, "function")) {
+        tok = parser_peek(ps);
+        if (!tok || tok->type != TOKEN_WORD || !is_valid_name(tok->text, strlen(tok->text))) { parser_error(ps, tok); return NULL; }
+        ps->pos++;
+        if (ps->pos + 1 < ps->tokens->count && ps->tokens->items[ps->pos].type == TOKEN_LPAREN &&
+            ps->tokens->items[ps->pos + 1].type == TOKEN_RPAREN) ps->pos += 2;
+    } else {
+        ps->pos += 2; // The ( )
+    }
+    c->name = tok->text;
+    parser_skip_newlines(ps);
+    const token_t *body = parser_peek(ps);
+    if (!(body && (body->type == TOKEN_LPAREN || is_keyword(body, "{") || is_keyword(body, "if") ||
+                   is_keyword(body, "while") || is_keyword(body, "until") || is_keyword(body, "for")))) {
+        parser_error(ps, body);
+        return NULL;
+    }
+    c->inner = parse_compound(ps);
+    return c->inner ? c : NULL;
+}
+
+/**
+ * @brief bsearch comparator: command name against a registry entry.
+ */
+static int compare_builtin_name(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const builtin_t *)entry)->name);
+}
+
+/**
+ * @brief Look up a built-in in the registry.
+ * @param name Command name.
+ * @return The registry entry, or NULL if name is not a built-in.
+ */
+const builtin_t* find_builtin(const char *name) {
+    return bsearch(name, builtin_table, BUILTIN_COUNT, sizeof(builtin_t), compare_builtin_name);
+}
+
+/**
+ * @brief Reset the signals the shell ignores to their defaults and unblock SIGCHLD.
+ * Called in forked children before they run a command.
+ */
+void reset_child_signals() {
+    // OS Concept: Signal Handling - Child resets ignored signals to default behavior.
+    signal(SIGINT, SIG_DFL); signal(SIGQUIT, SIG_DFL); signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL); signal(SIGTTOU, SIG_DFL); signal(SIGCHLD, SIG_DFL);
+    // The shell keeps SIGCHLD blocked for its signalfd; the new program starts unmasked
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+}
+
+/**
+ * @brief Apply a redirection plan in a forked child. Exits the child on failure.
+ * @param plan Prepared redirections (NULL for none).
+ */
+void apply_child_redirections(const redir_plan_t *plan) {
+    if (!plan) return;
+    // OS Concept: File Descriptor Manipulation - Apply dup2/close in source order.
+    for (int i = 0; i < plan->count; i++) {
+        const fd_op_t *op = &plan->ops[i];
+        if (op->source < 0) { close(op->fd); continue; }
+        if (op->source != op->fd && dup2(op->source, op->fd) < 0) {
+            fprintf(stderr, "ca$h: %d: %s\n", op->source, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Code executed only by the child process after fork.
+ * Sets up redirection, resets signal handlers, and executes the command.
+ * Does not return if the exec succeeds.
+ * @param path Resolved path of the program (from resolve_command).
+ * @param args Command and arguments array.
+ * @param envp Environment for the program.
+ * @param plan Prepared redirections (NULL for none).
+ */
+void handle_child_execution(const char *path, char **args, char **envp, const redir_plan_t *plan) {
+    reset_child_signals();
+    apply_child_redirections(plan);
+
+    // OS Concept: Program Execution - Replace child process with the new command.
+    // The shell already resolved the path, so no $PATH walk happens here.
+    execve(path, args, envp);
+    // A stale cache entry (binary moved) falls back to a full $PATH search
+    if (errno == ENOENT && strchr(args[0], '/') == NULL) {
+        extern char **environ;
+        environ = envp; // execvp takes the environment from environ
+        execvp(args[0], args);
+    }
+    // exec only returns on error
+    fprintf(stderr, "ca$h: Command not found or execution failed: %s\n", args[0]);
+    exit(errno == ENOENT ? 127 : 126); // Child MUST exit if exec fails
+}
+
+/**
+ * @brief Executes a single command (part of execute_pipeline logic).
+ * Built-ins, functions and compound commands run in the shell process; external
+ * commands, ( ) subshells and backgrounded functions / compounds are started as a job.
+ * @param cmd The command (builtin already resolved by the parser).
+ * @param background 1 if job should run in background, 0 for foreground.
+ * @param timed 1 to report the job's resource usage when it finishes ('time' prefix).
+ * @param original_cmd The original command string (for job title).
+ * @return Exit status: the built-in's or the job's, 0 for a background job,
+ * 127 if the command could not be started, 1 if a redirection failed.
+ */
+int execute_single_command(command_t *cmd, int background, int timed, const char *original_cmd) {
+    char **args = cmd->args;
+    if (args[0] == NULL && cmd->nassigns == 0 && !cmd->compound) return 0; // Safety check
+
+    // --- Handle Built-in Commands ---
+    // These modify the shell's state directly, no fork needed.
+    redir_plan_t plan;
+    if (!prepare_redirections(cmd, &line_arena, &plan)) return 1;
+    if (args[0] == NULL && !cmd->compound) { // Only assignments (A=1 >file): they stay in the shell
+        for (int i = 0; i < cmd->nassigns; i++) var_assign_word(cmd->assigns[i], 0);
+        release_redirections(&plan);
+        return command_subst_status >= 0 ? command_subst_status : 0; // x=$(false) fails
+    }
+    // Functions come before built-ins of the same name
+    shell_function_t *fn = (args[0] && function_count) ? find_function(args[0]) : NULL;
+    // ( list ), and a function or compound with '&', need a forked copy of the shell
+    int subshell = (cmd->compound && (background || cmd->compound->type == COMPOUND_SUBSHELL)) || (fn && background) ||
+                   (active_limits && (cmd->builtin || fn || cmd->compound)); // Limits apply to a process, not the shell
+    if (!subshell && (cmd->builtin || fn || cmd->compound)) {
+        // A=1 builtin: the values only last while the built-in runs
+        var_saved_t *saved = cmd->nassigns ? var_push_assignments(cmd, &line_arena) : NULL;
+        int status = run_in_shell_redirected(cmd, fn, &plan);
+        if (saved) var_pop_assignments(saved, cmd->nassigns);
+        release_redirections(&plan);
+        return status;
+    }
+
+    // --- Handle External Commands ---
+    // OS Concept: Process Creation - Start the child (posix_spawn or fork backend).
+    // The child creates/leads its own process group for job control.
+    spawn_io_t io = { .stdin_fd = -1, .stdout_fd = -1, .close_fd = -1, .pgid = shell_is_interactive ? procsub_pgid() : -1,
+                      .envp = command_envp(cmd, &line_arena), .limits = active_limits };
+    pid_t pid = subshell ? fork_builtin(cmd, &io, &plan) : spawn_command(args, &io, &plan);
+    release_redirections(&plan); // The child has its own copies now
+    procsub_release();
+    if (pid < 0) { return 127; }
+
+    // OS Concept: Job Tracking - Every child belongs to a job, so reaping it always
+    // finds its owner (foreground jobs too, which only get a jid if they stop).
+    job_t *job = create_job(original_cmd, background);
+    if (job) { procsub_adopt(job); limits_adopt(job); }
+    if (!job || !job_add_process(job, pid, args[0] ? args[0] : "")) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if (job) { job->foreground = 1; wait_for_job(job); } // Drops the job
+        return 1;
+    }
+    job->timed = timed;
+
+    if (background) { // Background job
+         last_background_pid = pid;
+         if (shell_is_interactive) { printf("[%d] %d\n", job->jid, job->pgid); } // Print job info
+         // Parent does NOT wait for background jobs; they are reaped from the event loop.
+         return 0;
+    } else if (shell_is_interactive) { // Foreground job
+         return put_job_in_foreground(job, 0); // Gives terminal control and waits
+    }
+    return wait_for_job(job); // Non-interactive shell: blocking wait, no terminal handover
+}
+
+// --- Compound Command and Function Functions ---
+
+/**
+ * @brief Is a break, continue or return unwinding? Lists stop running their
+ * remaining commands until the loop or function it targets takes it.
+ */
+int control_pending() {
+    return break_pending || continue_pending || return_pending;
+}
+
+/**
+ * @brief After one pass of a loop body: consume a pending break / continue aimed at
+ * this loop, and tell whether the loop has to stop.
+ * @param status Exit status of the pass.
+ * @return 1 to leave the loop.
+ */
+static int loop_should_stop(int status) {
+    if (shell_is_interactive && status == 128 + SIGINT) return 1;
+    if (return_pending) return 1;
+    if (break_pending) { break_pending--; return 1; }
+    if (continue_pending) { continue_pending--; return continue_pending > 0; } // `continue 2` stops this loop
+    return 0;
+}
+
+/**
+ * @brief Run a compound command in the shell process.
+ * @param c The construct.
+ * @return Its exit status: that of the last command it ran (0 if an if ran no branch).
+ */
+int execute_compound(const compound_t *c) {
+    switch (c->type) {
+        case COMPOUND_IF:
+            for (; c; c = c->orelse) {
+                if (c->type == COMPOUND_GROUP) return execute_command_list((command_list_t *)&c->body); // else
+                int status = execute_command_list((command_list_t *)&c->cond);
+                if (control_pending()) return status;
+                if (status == 0) return execute_command_list((command_list_t *)&c->body);
+            }
+            return 0;
+        case COMPOUND_WHILE:
+        case COMPOUND_UNTIL:
+            return execute_loop(c);
+        case COMPOUND_FOR:
+            return execute_for(c);
+        case COMPOUND_GROUP:
+            return execute_command_list((command_list_t *)&c->body);
+        case COMPOUND_SUBSHELL: { // A function body: start it as a job like a ( ) command
+            command_t cmd;
+            command_init(&cmd, &line_arena);
+            cmd.compound = (compound_t *)c;
+            return execute_single_command(&cmd, 0, 0, c->name);
+        }
+        case COMPOUND_FUNCTION:
+            define_function(c->name, c->inner);
+            return 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Run a while / until loop. Everything a pass allocates in the line arena
+ * (expanded words, redirection plans) is released before the next one, so a loop
+ * runs in constant memory however many times it goes round.
+ * @param c The loop.
+ * @return Exit status of the last body pass (0 if the body never ran).
+ */
+int execute_loop(const compound_t *c) {
+    int status = 0;
+    arena_mark_t mark = arena_mark(&line_arena);
+    loop_depth++;
+    while (1) {
+        int cond = execute_command_list((command_list_t *)&c->cond);
+        if (control_pending() || (shell_is_interactive && cond == 128 + SIGINT)) {
+            loop_should_stop(cond); // A break / continue in the condition still targets this loop
+            break;
+        }
+        if ((cond == 0) != (c->type == COMPOUND_WHILE)) break;
+        status = execute_command_list((command_list_t *)&c->body);
+        arena_release(&line_arena, mark);
+        if (loop_should_stop(status)) break;
+    }
+    loop_depth--;
+    arena_release(&line_arena, mark);
+    return status;
+}
+
+/**
+ * @brief Run a for loop. The words are expanded once, when the loop starts
+ * (`for f in *.c` lists the directory once), then each pass sets the variable.
+ * @param c The loop.
+ * @return Exit status of the last body pass (0 if there were no words).
+ */
+int execute_for(const compound_t *c) {
+    command_t words;
+    command_init(&words, &line_arena);
+    if (c->nwords < 0) { // No 'in': the positional parameters
+        for (int i = 0; i < positional_count; i++) command_add_arg(&words, &line_arena, positional_args[i]);
+    } else {
+        glob_cache = NULL; // Listings from an earlier command may be out of date
+        for (int i = 0; i < c->nwords; i++) {
+            if (word_has_mark(c->words[i])) expand_word_fields(c->words[i], &line_arena, &words);
+            else command_add_arg(&words, &line_arena, c->words[i]);
+        }
+    }
+
+    int status = 0;
+    arena_mark_t mark = arena_mark(&line_arena); // The words stay, each pass is released
+    loop_depth++;
+    for (int i = 0; i < words.argc; i++) {
+        var_set(c->name, words.args[i]);
+        status = execute_command_list((command_list_t *)&c->body);
+        arena_release(&line_arena, mark);
+        if (loop_should_stop(status)) break;
+    }
+    loop_depth--;
+    return status;
+}
+
+/**
+ * @brief Look up a function by name.
+ * @return The function, or NULL if none is defined.
+ */
+shell_function_t* find_function(const char *name) {
+    for (shell_function_t *fn = function_table[hash_name(name, strlen(name)) % FUNCTION_HASH_BUCKETS]; fn; fn = fn->next) {
+        if (strcmp(fn->name, name) == 0) return fn;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Free a function that was replaced or unset, unless a call is still running it.
+ */
+static void function_release(shell_function_t *fn) {
+    fn->stale = 1;
+    if (fn->users > 0) return; // call_function frees it once the last call returns
+    arena_reset(&fn->arena);
+    free(fn->arena.first);
+    free(fn);
+}
+
+/**
+ * @brief Remove a function from the table (unset -f); nothing happens if it is not defined.
+ * @param name Function name.
+ */
+void undefine_function(const char *name) {
+    shell_function_t **link = &function_table[hash_name(name, strlen(name)) % FUNCTION_HASH_BUCKETS];
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) != 0) continue;
+        shell_function_t *fn = *link;
+        *link = fn->next;
+        function_count--;
+        function_release(fn);
+        return;
+    }
+}
+
+/**
+ * @brief Define (or redefine) a function. The body is deep-copied into the function's
+ * own arena: the one it was parsed into belongs to the line or script it came from.
+ * @param name Function name.
+ * @param body The compound command it runs.
+ */
+void define_function(const char *name, const compound_t *body) {
+    shell_function_t *fn = calloc(1, sizeof(shell_function_t));
+    if (!fn) { perror("ca$h: calloc failed for function"); return; }
+    fn->name = arena_strndup(&fn->arena, name, strlen(name));
+    fn->body = copy_compound(body, &fn->arena);
+    undefine_function(name);
+    unsigned long b = hash_name(name, strlen(name)) % FUNCTION_HASH_BUCKETS;
+    fn->next = function_table[b];
+    function_table[b] = fn;
+    function_count++;
+}
+
+/**
+ * @brief Call a function in the shell process: its arguments become $1... while it
+ * runs, and 'return' ends it.
+ * @param fn The function.
+ * @param args Function name and arguments.
+ * @return Its exit status (that of 'return n', or of the last command it ran).
+ */
+int call_function(shell_function_t *fn, char **args) {
+    if (function_depth >= FUNCTION_DEPTH_MAX) {
+        fprintf(stderr, "ca$h: %s: maximum function nesting level exceeded (%d)\n", args[0], FUNCTION_DEPTH_MAX);
+        return 1;
+    }
+    char **saved_args = positional_args;
+    int saved_count = positional_count;
+    int saved_loop_depth = loop_depth; // break in the function cannot leave the caller's loop
+    positional_args = args + 1;
+    positional_count = 0;
+    while (args[1 + positional_count]) positional_count++;
+    loop_depth = 0;
+    function_depth++;
+    fn->users++;
+
+    int status = execute_compound(fn->body);
+    if (return_pending) { return_pending = 0; status = return_status; }
+
+    fn->users--;
+    function_depth--;
+    loop_depth = saved_loop_depth;
+    positional_args = saved_args;
+    positional_count = saved_count;
+    if (fn->stale && fn->users == 0) function_release(fn);
+    return status;
+}
+
+static void copy_command_list(command_list_t *dst, const command_list_t *src, arena_t *arena);
+
+/**
+ * @brief Copy an array of strings into an arena.
+ * @param count Number of strings (the copy gets a NULL after them if terminate is set).
+ */
+static char** copy_words(char **src, int count, int terminate, arena_t *arena) {
+    if (!src) return NULL;
+    char **dst = arena_alloc(arena, (count + terminate) * sizeof(char *));
+    for (int i = 0; i < count; i++) dst[i] = arena_strndup(arena, src[i], strlen(src[i]));
+    if (terminate) dst[count] = NULL;
+    return dst;
+}
+
+/**
+ * @brief Copy one stage into an arena.
+ */
+static void copy_command(command_t *dst, const command_t *src, arena_t *arena) {
+    *dst = *src;
+    dst->capacity = src->argc + 1;
+    dst->args = copy_words(src->args, src->argc, 1, arena);
+    dst->assigns = copy_words(src->assigns, src->nassigns, 0, arena);
+    dst->assign_capacity = src->nassigns;
+    if (src->nredirs) {
+        dst->redirs = arena_alloc(arena, src->nredirs * sizeof(redirect_t));
+        for (int i = 0; i < src->nredirs; i++) {
+            dst->redirs[i] = src->redirs[i];
+            dst->redirs[i].target = arena_strndup(arena, src->redirs[i].target, strlen(src->redirs[i].target));
+        }
+    }
+    dst->redir_capacity = src->nredirs;
+    dst->compound = src->compound ? copy_compound(src->compound, arena) : NULL;
+}
+
+/**
+ * @brief Copy a command list (its pipelines and their stages) into an arena.
+ */
+static void copy_command_list(command_list_t *dst, const command_list_t *src, arena_t *arena) {
+    dst->count = dst->capacity = src->count;
+    dst->items = src->count ? arena_alloc(arena, src->count * sizeof(pipeline_t)) : NULL;
+    for (int i = 0; i < src->count; i++) {
+        const pipeline_t *from = &src->items[i];
+        pipeline_t *to = &dst->items[i];
+        *to = *from;
+        to->capacity = from->count;
+        to->stages = arena_alloc(arena, from->count * sizeof(command_t));
+        for (int s = 0; s < from->count; s++) copy_command(&to->stages[s], &from->stages[s], arena);
+        to->command = from->command ? arena_strndup(arena, from->command, strlen(from->command)) : NULL;
+        to->group_command = from->group_command ? arena_strndup(arena, from->group_command, strlen(from->group_command)) : NULL;
+    }
+}
+
+/**
+ * @brief Deep-copy a compound command into an arena (for function bodies).
+ * @param src The construct.
+ * @param arena Destination arena.
+ * @return The copy.
+ */
+compound_t* copy_compound(const compound_t *src, arena_t *arena) {
+    compound_t *c = arena_alloc(arena, sizeof(compound_t));
+    *c = *src;
+    copy_command_list(&c->cond, &src->cond, arena);
+    copy_command_list(&c->body, &src->body, arena);
+    c->orelse = src->orelse ? copy_compound(src->orelse, arena) : NULL;
+    c->inner = src->inner ? copy_compound(src->inner, arena) : NULL;
+    c->name = src->name ? arena_strndup(arena, src->name, strlen(src->name)) : NULL;
+    c->words = src->nwords > 0 ? copy_words(src->words, src->nwords, 1, arena) : NULL;
+    return c;
+}
+
+// --- Built-in Command Functions ---
+
+/**
+ * @brief Implements 'exit [n]' (n defaults to $?). History is saved by the interactive loop on EOF only.
+ */
+int builtin_exit(char **args) {
+    int status = last_status;
+    if (args[1] != NULL) {
+        char *end;
+        long value = strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0') { fprintf(stderr, "ca$h: exit: %s: numeric argument required\n", args[1]); status = 2; }
+        else status = value & 255;
+    }
+    exit(status);
+}
+
+/**
+ * @brief Implements 'cd [dir]' (HOME if no directory is given).
+ * @return 0 on success, 1 on failure.
+ */
+int builtin_cd(char **args) {
+    // OS Concept: Process State - Change shell's current working directory.
+    const char *dir = args[1];
+    if (dir == NULL) { dir = var_get("HOME"); if (!dir) {fprintf(stderr, "ca$h: cd: HOME not set\n"); return 1;} }
+    else if (args[2] != NULL) { fprintf(stderr, "ca$h: cd: too many arguments\n"); return 1; }
+    char old_dir[PATH_MAX];
+    int have_old = getcwd(old_dir, sizeof(old_dir)) != NULL;
+    if (chdir(dir) != 0) { perror("ca$h: cd failed"); return 1; } // chdir system call
+    char new_dir[PATH_MAX];
+    if (have_old) var_set("OLDPWD", old_dir);
+    if (getcwd(new_dir, sizeof(new_dir))) var_set("PWD", new_dir);
+    cwd_version++;
+    return 0;
+}
+
+/**
+ * @brief Implements 'source file [args]' (also '.'): run a script in this shell.
+ * The parsed script is cached, so sourcing the same file again does not re-parse it.
+ * @return Status of the script's last command, 1 if it cannot be read.
+ */
+int builtin_source(char **args) {
+    if (args[1] == NULL) { fprintf(stderr, "ca$h: %s: filename argument required\n", args[0]); return 2; }
+    compiled_script_t *script = script_cache_load(args[1]);
+    if (!script) return 1;
+    // Arguments after the file name replace $1... while it runs
+    char **saved_args = positional_args;
+    int saved_count = positional_count;
+    if (args[2] != NULL) {
+        positional_args = args + 2;
+        positional_count = 0;
+        while (args[2 + positional_count]) positional_count++;
+    }
+    source_depth++;
+    int status = run_compiled_script(script);
+    source_depth--;
+    if (return_pending) { return_pending = 0; status = return_status; } // 'return' ends the file
+    positional_args = saved_args;
+    positional_count = saved_count;
+    return status;
+}
+
+/**
+ * @brief Parse the optional loop count of break / continue.
+ * @return The count (at least 1, at most the number of enclosing loops), or 0 on error (reported).
+ */
+static int loop_control_count(char **args) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "ca$h: %s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 0;
+    }
+    long n = 1;
+    if (args[1] != NULL) {
+        char *end;
+        n = strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0' || n < 1) {
+            fprintf(stderr, "ca$h: %s: %s: loop count out of range\n", args[0], args[1]);
+            return 0;
+        }
+    }
+    return n > loop_depth ? loop_depth : n;
+}
+
+/**
+ * @brief Implements 'break [n]': leave the n innermost loops.
+ */
+int builtin_break(char **args) {
+    int n = loop_control_count(args);
+    if (!n) return 1;
+    break_pending = n;
+    return 0;
+}
+
+/**
+ * @brief Implements 'continue [n]': start the next pass of the n-th enclosing loop.
+ */
+int builtin_continue(char **args) {
+    int n = loop_control_count(args);
+    if (!n) return 1;
+    continue_pending = n;
+    return 0;
+}
+
+/**
+ * @brief Implements 'return [n]' (n defaults to $?): leave the function or sourced file.
+ */
+int builtin_return(char **args) {
+    if (function_depth == 0 && source_depth == 0) {
+        fprintf(stderr, "ca$h: return: can only `return' from a function or sourced script\n");
+        return 1;
+    }
+    int status = last_status;
+    if (args[1] != NULL) {
+        char *end;
+        long value = strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0') { fprintf(stderr, "ca$h: return: %s: numeric argument required\n", args[1]); status = 2; }
+        else status = value & 255;
+    }
+    return_status = status;
+    return_pending = 1;
+    return status;
+}
+
+/**
+ * @brief Implements 'clear'.
+ */
+int builtin_clear(char **args) {
+    int status = system("clear"); // Forks a subshell to run /usr/bin/clear
+    return (status == -1 || !WIFEXITED(status)) ? 1 : WEXITSTATUS(status);
+}
+
+/**
+ * @brief Implements 'jobs [-l]'.
+ */
+int builtin_jobs(char **args) {
+    int long_format = args[1] != NULL && strcmp(args[1], "-l") == 0;
+    if (args[1] != NULL && !long_format) { fprintf(stderr, "ca$h: jobs: Usage: jobs [-l]\n"); return 2; }
+    reap_children();
+    if (shell_is_interactive) check_jobs_status();
+    list_jobs(long_format);
+    return 0;
+}
+
+/**
+ * @brief Implements 'history' (list entries) and 'history -s pattern' (entries
+ * containing pattern, found through the trigram index).
+ */
+int builtin_history(char **args) {
+    const char *pattern = NULL;
+    if (args[1] != NULL) {
+        if (strcmp(args[1], "-s") != 0 || args[2] == NULL || args[3] != NULL) {
+            fprintf(stderr, "ca$h: history: Usage: history [-s pattern]\n");
+            return 2;
+        }
+        pattern = args[2];
+    }
+    history_ensure_loaded();
+    if (pattern && *pattern == '\0') pattern = NULL; // Everything matches
+    int found = 0;
+    char number[16];
+    for (int id = pattern ? history_index_search(pattern, -1, 1) : 0;
+         id >= 0 && id < history_index.count;
+         id = pattern ? history_index_search(pattern, id, 1) : id + 1) {
+        snprintf(number, sizeof(number), "%5d  ", id + 1);
+        out_puts(number);
+        out_puts(history_index.entries[id]);
+        out_putc('\n');
+        found = 1;
+    }
+    return (pattern && !found) ? 1 : 0;
+}
+
+/**
+ * @brief Implements a bare 'time' (the prefix form is handled by the parser).
+ */
+int builtin_time(char **args) {
+    return 0; // Nothing to measure
+}
+
+/**
+ * @brief Parse the %<job_id> argument of fg/bg and look the job up.
+ * @param name Built-in name, for messages.
+ * @param args Command and arguments.
+ * @return The job, or NULL (reported).
+ */
+static job_t* builtin_job_arg(const char *name, char **args) {
+    if (!shell_is_interactive) { fprintf(stderr, "ca$h: %s: No job control.\n", name); return NULL; }
+    if (args[1] == NULL || args[1][0] != '%') { fprintf(stderr, "ca$h: %s: Usage: %s %%<job_id>\n", name, name); return NULL; }
+    int jid = atoi(&args[1][1]); if (jid <= 0) { fprintf(stderr, "ca$h: %s: Invalid job ID: %s\n", name, args[1]); return NULL; }
+    reap_children(); // A job that already finished is not resumable
+    job_t *job = get_job_by_jid(jid); if (!job) { fprintf(stderr, "ca$h: %s: No such job: %d\n", name, jid); return NULL; }
+    return job;
+}
+
+/**
+ * @brief Implements 'fg %<job_id>'.
+ */
+int builtin_fg(char **args) {
+    job_t *job = builtin_job_arg("fg", args);
+    if (!job) return 1;
+    printf("%s\n", job->command);
+    return put_job_in_foreground(job, job->state == JOB_STATE_STOPPED);
+}
+
+/**
+ * @brief Implements 'bg %<job_id>'.
+ */
+int builtin_bg(char **args) {
+    job_t *job = builtin_job_arg("bg", args);
+    if (!job) return 1;
+    printf("[%d] %s &\n", job->jid, job->command);
+    put_job_in_background(job, 1);
+    return 0;
+}
+
+/**
+ * @brief Run a command that needs no new process: a compound command, a call of a
+ * function, or a built-in.
+ * @param cmd The command.
+ * @param fn The function it calls, or NULL.
+ * @return Its exit status.
+ */
+int run_in_shell(const command_t *cmd, shell_function_t *fn) {
+    // A ( ) subshell only gets here in the child forked for it
+    if (cmd->compound && cmd->compound->type == COMPOUND_SUBSHELL) return execute_command_list(&cmd->compound->body);
+    if (cmd->compound) return execute_compound(cmd->compound);
+    if (fn) return call_function(fn, cmd->args);
+    long long trace = trace_start();
+    int status = cmd->builtin->fn(cmd->args);
+    trace_end(TRACE_BUILTIN, trace, cmd->args[0]);
+    return status;
+}
+
+/**
+ * @brief Run a built-in, function or compound command in the shell process with its
+ * redirections applied by saving and restoring the affected fds around it, instead
+ * of forking (`while ...; done < file` keeps one redirection for the whole loop).
+ * @param cmd The command.
+ * @param fn The function it calls, or NULL.
+ * @param plan Prepared redirections.
+ * @return Its exit status, or 1 if a redirection failed (reported).
+ */
+int run_in_shell_redirected(const command_t *cmd, shell_function_t *fn, const redir_plan_t *plan) {
+    // Older built-ins print through stdio and the fast ones through builtin_out:
+    // flushing both around every built-in keeps their output in order
+    fflush(stdout);
+    if (plan->count == 0) {
+        int status = run_in_shell(cmd, fn);
+        fflush(stdout);
+        out_flush();
+        return status;
+    }
+
+    // OS Concept: File Descriptor Manipulation - Keep copies of the fds the plan changes
+    // (close-on-exec and above the low fds) so they can be put back afterwards.
+    int saved[10], changed[10] = { 0 }, status = 1;
+    for (int i = 0; i < plan->count; i++) {
+        int fd = plan->ops[i].fd;
+        if (changed[fd]) continue;
+        changed[fd] = 1;
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10); // -1 if fd was not open: close it again afterwards
+    }
+    for (int i = 0; i < plan->count; i++) {
+        const fd_op_t *op = &plan->ops[i];
+        if (op->source < 0) { close(op->fd); continue; }
+        if (op->source != op->fd && dup2(op->source, op->fd) < 0) {
+            fprintf(stderr, "ca$h: %d: %s\n", op->source, strerror(errno));
+            goto restore_fds;
+        }
+    }
+    status = run_in_shell(cmd, fn);
+
+restore_fds:
+    // Flush everything written to the redirected fds before switching back
+    fflush(stdout);
+    out_flush();
+    for (int fd = 0; fd < 10; fd++) {
+        if (!changed[fd]) continue;
+        if (saved[fd] != -1) { dup2(saved[fd], fd); close(saved[fd]); }
+        else { close(fd); }
+    }
+    return status;
+}
+
+// --- Built-in Output Writer Functions ---
+
+/**
+ * @brief Write all pending output of the fast built-ins with write().
+ */
+void out_flush() {
+    if (builtin_out.capture) { // Inside $(...): keep the bytes instead
+        word_buf_append(builtin_out.capture, builtin_out.buf, builtin_out.len);
+        builtin_out.len = 0;
+        return;
+    }
+    size_t done = 0;
+    while (done < builtin_out.len) {
+        ssize_t n = write(builtin_out.fd, builtin_out.buf + done, builtin_out.len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (!builtin_out.error) perror("ca$h: write error");
+            builtin_out.error = 1;
+            break;
+        }
+        done += n;
+    }
+    builtin_out.len = 0;
+}
+
+/**
+ * @brief Append bytes to the built-in output buffer (flushing when it fills).
+ * @param data Bytes to write.
+ * @param len Number of bytes.
+ */
+void out_write(const char *data, size_t len) {
+    while (len > 0) {
+        if (builtin_out.len == OUTPUT_BUFFER_SIZE) out_flush();
+        size_t room = OUTPUT_BUFFER_SIZE - builtin_out.len;
+        size_t n = len < room ? len : room;
+        memcpy(builtin_out.buf + builtin_out.len, data, n);
+        builtin_out.len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Append a C string to the built-in output buffer.
+ */
+void out_puts(const char *str) {
+    out_write(str, strlen(str));
+}
+
+/**
+ * @brief Append one character to the built-in output buffer.
+ */
+void out_putc(char c) {
+    if (builtin_out.len == OUTPUT_BUFFER_SIZE) out_flush();
+    builtin_out.buf[builtin_out.len++] = c;
+}
+
+// --- Fast Built-in Functions (echo, printf, test, pwd, true, false) ---
+// Hot script commands run natively instead of costing a spawn + execve each.
+
+/**
+ * @brief Write one backslash escape (\n, \t, \0nnn, ...) as used by echo -e and printf.
+ * @param p Points just after the backslash; advanced past the escape.
+ * @param octal_needs_zero 1 for echo (\0nnn), 0 for a printf format (\nnn).
+ * @return 0 normally, 1 for \c (stop all output).
+ */
+static int out_escape(const char **p, int octal_needs_zero) {
+    const char *s = *p;
+    char c = *s++;
+    switch (c) {
+        case 'a': out_putc('\a'); break;
+        case 'b': out_putc('\b'); break;
+        case 'c': *p = s; return 1;
+        case 'e': out_putc('\033'); break;
+        case 'f': out_putc('\f'); break;
+        case 'n': out_putc('\n'); break;
+        case 'r': out_putc('\r'); break;
+        case 't': out_putc('\t'); break;
+        case 'v': out_putc('\v'); break;
+        case '\\': out_putc('\\'); break;
+        case '\0': out_putc('\\'); s--; break; // Trailing backslash
+        case 'x': { // \xHH
+            int value = 0, digits = 0;
+            while (digits < 2 && isxdigit((unsigned char)*s)) {
+                value = value * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (tolower((unsigned char)*s) - 'a' + 10));
+                s++; digits++;
+            }
+            if (digits) out_putc((char)value);
+            else { out_putc('\\'); out_putc('x'); }
+            break;
+        }
+        default:
+            if (c >= '0' && c <= '7' && (c == '0' || !octal_needs_zero)) {
+                int value = 0, digits = 0;
+                if (c != '0' || !octal_needs_zero) { value = c - '0'; digits = 1; }
+                while (digits < 3 && *s >= '0' && *s <= '7') { value = value * 8 + (*s++ - '0'); digits++; }
+                out_putc((char)value);
+            } else {
+                out_putc('\\'); out_putc(c);
+            }
+    }
+    *p = s;
+    return 0;
+}
+
+/**
+ * @brief Implements 'echo [-neE] [arg ...]'.
+ */
+int builtin_echo(char **args) {
+    int newline = 1, escapes = 0, i = 1;
+    // Leading option words made only of n/e/E letters, like bash
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *opt = args[i] + 1;
+        if (strspn(opt, "neE") != strlen(opt)) break;
+        for (; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else if (*opt == 'e') escapes = 1;
+            else escapes = 0;
+        }
+    }
+    for (int first = i; args[i]; i++) {
+        if (i > first) out_putc(' ');
+        if (!escapes) { out_puts(args[i]); continue; }
+        for (const char *p = args[i]; *p; ) {
+            if (*p != '\\') { out_putc(*p++); continue; }
+            p++;
+            if (out_escape(&p, 1)) return 0; // \c: no further output, not even the newline
+        }
+    }
+    if (newline) out_putc('\n');
+    return 0;
+}
+
+/**
+ * @brief Implements 'printf format [arg ...]'. Supports %s %b %c %d %i %u %o %x %X
+ * %e %f %g %% with flags, width and precision; the format is reused until all
+ * arguments are consumed, as POSIX requires.
+ * @return 0 on success, 1 if an argument was not a valid number.
+ */
+int builtin_printf(char **args) {
+    if (args[1] == NULL) { fprintf(stderr, "ca$h: printf: Usage: printf format [arguments]\n"); return 2; }
+    const char *format = args[1];
+    char **arg = &args[2];
+    int status = 0;
+
+    do {
+        char **pass_start = arg;
+        for (const char *p = format; *p; ) {
+            if (*p == '\\') { p++; if (out_escape(&p, 0)) return status; continue; }
+            if (*p != '%') { out_putc(*p++); continue; }
+            if (p[1] == '%') { out_putc('%'); p += 2; continue; }
+
+            // Copy the conversion spec (flags, width, precision) for snprintf
+            char spec[32];
+            size_t spec_len = 0;
+            spec[spec_len++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && spec_len < sizeof(spec) - 4) spec[spec_len++] = *p++;
+            char conv = *p ? *p++ : '\0';
+            const char *value = *arg ? *arg++ : NULL; // Missing arguments act as "" / 0
+            char buf[512];
+            int n = 0;
+
+            switch (conv) {
+                case 's': case 'c': case 'b': {
+                    const char *str = value ? value : "";
+                    if (conv == 'b') { // %b: argument with echo -e escapes
+                        for (const char *q = str; *q; ) {
+                            if (*q != '\\') { out_putc(*q++); continue; }
+                            q++;
+                            if (out_escape(&q, 1)) return status;
+                        }
+                        continue;
+                    }
+                    if (conv == 'c') { spec[spec_len++] = 'c'; spec[spec_len] = '\0'; n = snprintf(buf, sizeof(buf), spec, str[0]); break; }
+                    spec[spec_len++] = 's'; spec[spec_len] = '\0';
+                    int needed = snprintf(NULL, 0, spec, str);
+                    if (needed >= (int)sizeof(buf)) { // Long string: format into a temporary
+                        char *big = malloc(needed + 1);
+                        if (!big) { perror("ca$h: printf"); return 1; }
+                        snprintf(big, needed + 1, spec, str);
+                        out_write(big, needed);
+                        free(big);
+                        continue;
+                    }
+                    n = snprintf(buf, sizeof(buf), spec, str);
+                    break;
+                }
+                case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': {
+                    char *end = NULL;
+                    long long number = 0;
+                    if (value && value[0] == '\'' && value[1]) number = (unsigned char)value[1]; // 'c -> char code
+                    else if (value && *value) {
+                        errno = 0;
+                        number = strtoll(value, &end, 0);
+                        if (*end || errno) { fprintf(stderr, "ca$h: printf: %s: invalid number\n", value); status = 1; }
+                    }
+                    spec[spec_len++] = 'l'; spec[spec_len++] = 'l';
+                    spec[spec_len++] = (conv == 'i') ? 'd' : conv; spec[spec_len] = '\0';
+                    n = snprintf(buf, sizeof(buf), spec, number);
+                    break;
+                }
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                    char *end = NULL;
+                    double number = 0;
+                    if (value && *value) {
+                        number = strtod(value, &end);
+                        if (*end) { fprintf(stderr, "ca$h: printf: %s: invalid number\n", value); status = 1; }
+                    }
+                    spec[spec_len++] = conv; spec[spec_len] = '\0';
+                    n = snprintf(buf, sizeof(buf), spec, number);
+                    break;
+                }
+                default:
+                    fprintf(stderr, "ca$h: printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+                    return 1;
+            }
+            if (n > 0) out_write(buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+        }
+        if (arg == pass_start) break; // Format consumed no arguments: don't loop forever
+    } while (*arg);
+    return status;
+}
+
+/**
+ * @brief Is this word a binary operator of test?
+ */
+static int test_is_binary_op(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++) if (strcmp(op, ops[i]) == 0) return 1;
+    return 0;
+}
+
+/**
+ * @brief Is this word a unary (file or string) operator of test?
+ */
+static int test_is_unary_op(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghLnprsSuwxz", op[1]) != NULL;
+}
+
+/**
+ * @brief Parse an integer operand of test.
+ * @return 1 if word is a valid integer (stored in value), 0 otherwise (reported).
+ */
+static int test_integer(const char *word, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(word, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (*word == '\0' || *end || errno) { fprintf(stderr, "ca$h: test: %s: integer expression expected\n", word); return 0; }
+    return 1;
+}
+
+/**
+ * @brief Evaluate a unary test operator.
+ * @return 1 if true, 0 if false.
+ */
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
+    // OS Concept: File Metadata - One stat() answers the remaining file tests.
+    if (stat(arg, &st) != 0) return 0;
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Evaluate a binary test operator.
+ * @return 1 if true, 0 if false, -1 on error (reported).
+ */
+static int test_binary(const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(left, right) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(left, right) > 0;
+    if (op[1] == 'n' || op[1] == 'o' || strcmp(op, "-ef") == 0) { // File comparisons
+        struct stat a, b;
+        int have_a = stat(left, &a) == 0, have_b = stat(right, &b) == 0;
+        if (strcmp(op, "-ef") == 0) return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (strcmp(op, "-nt") == 0) return have_a && (!have_b || a.st_mtime > b.st_mtime);
+        return have_b && (!have_a || a.st_mtime < b.st_mtime); // -ot
+    }
+    long long a, b;
+    if (!test_integer(left, &a) || !test_integer(right, &b)) return -1;
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b; // -ge
+}
+
+// Recursive-descent state of one test expression
+typedef struct {
+    char **argv; // Operands (without the command name and the closing ']')
+    int argc;    // Number of operands
+    int pos;     // Next operand
+    int error;   // 1 after a syntax or integer error (reported)
+} test_state_t;
+
+static int test_or(test_state_t *t);
+
+/**
+ * @brief primary: '(' expr ')' | '!' primary | unary-op word | word binary-op word | word
+ */
+static int test_primary(test_state_t *t) {
+    if (t->pos >= t->argc) { fprintf(stderr, "ca$h: test: argument expected\n"); t->error = 1; return 0; }
+    const char *word = t->argv[t->pos];
+    // A binary operator after the word wins, so `[ -n = -n ]` compares strings
+    if (t->pos + 2 < t->argc && test_is_binary_op(t->argv[t->pos + 1])) {
+        int result = test_binary(word, t->argv[t->pos + 1], t->argv[t->pos + 2]);
+        t->pos += 3;
+        if (result < 0) { t->error = 1; return 0; }
+        return result;
+    }
+    if (strcmp(word, "!") == 0 && t->pos + 1 < t->argc) { t->pos++; return !test_primary(t); }
+    if (strcmp(word, "(") == 0 && t->pos + 1 < t->argc) {
+        t->pos++;
+        int result = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            if (!t->error) fprintf(stderr, "ca$h: test: `)' expected\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return result;
+    }
+    if (test_is_unary_op(word) && t->pos + 1 < t->argc) {
+        t->pos += 2;
+        return test_unary(word, t->argv[t->pos - 1]);
+    }
+    t->pos++;
+    return word[0] != '\0'; // Single word: true if non-empty
+}
+
+/**
+ * @brief and: primary ('-a' primary)*
+ */
+static int test_and(test_state_t *t) {
+    int result = test_primary(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        int right = test_primary(t);
+        result = result && right;
+    }
+    return result;
+}
+
+/**
+ * @brief or: and ('-o' and)*
+ */
+static int test_or(test_state_t *t) {
+    int result = test_and(t);
+    while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        int right = test_and(t);
+        result = result || right;
+    }
+    return result;
+}
+
+/**
+ * @brief Evaluate test operands.
+ * @return 0 if the expression is true, 1 if false, 2 on error (like other shells).
+ */
+static int test_evaluate(char **argv, int argc) {
+    if (argc == 0) return 1; // No expression is false
+    test_state_t t = { argv, argc, 0, 0 };
+    int result = test_or(&t);
+    if (!t.error && t.pos < t.argc) { fprintf(stderr, "ca$h: test: %s: unexpected operator\n", t.argv[t.pos]); t.error = 1; }
+    if (t.error) return 2;
+    return result ? 0 : 1;
+}
+
+/**
+ * @brief Implements 'test expr'.
+ */
+int builtin_test(char **args) {
+    int argc = 0;
+    while (args[argc + 1]) argc++;
+    return test_evaluate(args + 1, argc);
+}
+
+/**
+ * @brief Implements '[ expr ]'.
+ */
+int builtin_bracket(char **args) {
+    int argc = 0;
+    while (args[argc + 1]) argc++;
+    if (argc == 0 || strcmp(args[argc], "]") != 0) { fprintf(stderr, "ca$h: [: missing `]'\n"); return 2; }
+    return test_evaluate(args + 1, argc - 1);
+}
+
+/**
+ * @brief Implements 'pwd'.
+ */
+int builtin_pwd(char **args) {
+    char cwd[PATH_MAX];
+    // OS Concept: Process State - Ask the kernel for the current working directory.
+    if (getcwd(cwd, sizeof(cwd)) == NULL) { perror("ca$h: pwd"); return 1; }
+    out_puts(cwd);
+    out_putc('\n');
+    return 0;
+}
+
+/**
+ * @brief Implements 'true'.
+ */
+int builtin_true(char **args) {
+    return 0;
+}
+
+/**
+ * @brief Implements 'false'.
+ */
+int builtin_false(char **args) {
+    return 1;
+}
+
+// --- Process Spawning Functions ---
+
+/**
+ * @brief Name of a spawn backend as accepted by the 'spawnmode' built-in.
+ * @param backend The backend.
+ * @return Static name string.
+ */
+const char* spawn_backend_name(spawn_backend_t backend) {
+    return (backend == SPAWN_BACKEND_FORK) ? "fork" : "posix_spawn";
+}
+
+/**
+ * @brief Start an external command with the configured backend.
+ * Falls back to fork() if posix_spawn is unavailable on this system.
+ * @param args Command and arguments array.
+ * @param io Standard stream and process group setup for the child.
+ * @param plan Prepared redirections.
+ * @return PID of the child, or -1 on failure (error already reported).
+ */
+pid_t spawn_command(char **args, const spawn_io_t *io, const redir_plan_t *plan) {
+    if (!check_arg_max(args, io->envp)) return -1;
+    long long trace = trace_start();
+
+    // OS Concept: Program Lookup - Resolve the name against $PATH once, in the shell.
+    const char *path = resolve_command(args[0]);
+    if (path == NULL) {
+        fprintf(stderr, "ca$h: Command not found or execution failed: %s\n", args[0]);
+        return -1;
+    }
+    pid_t pid = -2;
+    if (spawn_backend == SPAWN_BACKEND_POSIX_SPAWN) pid = posix_spawn_command(path, args, io, plan);
+    if (pid == -2) pid = fork_command(path, args, io, plan); // -2: backend not usable here, use fork instead
+    trace_end(TRACE_SPAWN, trace, args[0]);
+    return pid;
+}
+
+/**
+ * @brief posix_spawn backend. Expresses the pipe dup2s and the redirection plan
+ * applied by handle_child_execution as file actions, and the setpgid/SIG_DFL
+ * resets as spawn attributes, so libc can start the child without copying the shell.
+ * @param path Resolved path of the program (from resolve_command).
+ * @param args Command and arguments array.
+ * @param io Standard stream and process group setup for the child.
+ * @param plan Prepared redirections.
+ * @return PID of the child, -1 on failure (reported), -2 if posix_spawn is not supported.
+ */
+pid_t posix_spawn_command(const char *path, char **args, const spawn_io_t *io, const redir_plan_t *plan) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid = -1;
+
+    if (io->limits) return -2; // setrlimit and the cgroup move have to happen in the child
+    if (posix_spawn_file_actions_init(&actions) != 0) return -2;
+    if (posix_spawnattr_init(&attr) != 0) { posix_spawn_file_actions_destroy(&actions); return -2; }
+
+    // OS Concept: Pipe Redirection - Install pipe ends as stdin/stdout, then drop the originals.
+    if (io->stdin_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, io->stdin_fd, STDIN_FILENO);
+        if (io->stdin_fd != STDIN_FILENO) posix_spawn_file_actions_addclose(&actions, io->stdin_fd);
+    }
+    if (io->stdout_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, io->stdout_fd, STDOUT_FILENO);
+        if (io->stdout_fd != STDOUT_FILENO) posix_spawn_file_actions_addclose(&actions, io->stdout_fd);
+    }
+    if (io->close_fd != -1) posix_spawn_file_actions_addclose(&actions, io->close_fd);
+
+    // OS Concept: File I/O Redirection - The shell already opened the files (close-on-exec,
+    // so no other child inherits them); the child only dup2s them, after the pipes.
+    for (int i = 0; plan && i < plan->count; i++) {
+        const fd_op_t *op = &plan->ops[i];
+        if (op->source < 0) posix_spawn_file_actions_addclose(&actions, op->fd);
+        else if (op->source != op->fd) posix_spawn_file_actions_adddup2(&actions, op->source, op->fd);
+    }
+
+    // OS Concept: Signal Handling - Reset the signals the shell ignores/handles to SIG_DFL.
+    sigset_t default_signals, empty_mask;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT); sigaddset(&default_signals, SIGQUIT); sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGTTIN); sigaddset(&default_signals, SIGTTOU); sigaddset(&default_signals, SIGCHLD);
+    sigemptyset(&empty_mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+
+    // OS Concept: Process Groups - Child joins/creates its group before exec.
+    if (io->pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, io->pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // OS Concept: Program Execution - Create the process and exec in one call.
+    // The path comes from the hash table, so posix_spawn (not spawnp) skips the $PATH walk.
+    int err = posix_spawn(&pid, path, &actions, &attr, args, io->envp);
+    if (err == ENOENT && strchr(args[0], '/') == NULL) {
+        // Stale cache entry (binary moved or removed): forget it and look it up again
+        forget_command(args[0]);
+        path = resolve_command(args[0]);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, args, io->envp) : ENOENT;
+    }
+    if (err == ENOSYS) { pid = -2; }
+    else if (err == EBADF) { // A '>&N' named a descriptor that is not open
+        fprintf(stderr, "ca$h: %s: bad file descriptor in redirection\n", args[0]);
+        pid = -1;
+    } else if (err != 0) {
+        fprintf(stderr, "ca$h: Command not found or execution failed: %s\n", args[0]);
+        pid = -1;
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
+/**
+ * @brief fork backend. The child wires up its streams and process group, then
+ * runs handle_child_execution (redirection, signal reset, exec).
+ * @param path Resolved path of the program (from resolve_command).
+ * @param args Command and arguments array.
+ * @param io Standard stream and process group setup for the child.
+ * @param plan Prepared redirections.
+ * @return PID of the child, or -1 on failure (error already reported).
+ */
+pid_t fork_command(const char *path, char **args, const spawn_io_t *io, const redir_plan_t *plan) {
+    // OS Concept: Process Creation - Create a child process.
+    pid_t pid = fork();
+    if (pid < 0) { perror("ca$h: Fork failed"); return -1; }
+
+    if (pid == 0) { // Child Process
+        // OS Concept: Process Groups - Child joins/creates its group for job control.
+        if (io->pgid >= 0) {
+            if (setpgid(0, io->pgid) < 0) { perror("ca$h: child setpgid failed"); exit(EXIT_FAILURE); }
+        }
+        if (!limits_apply_child(io->limits)) exit(EXIT_FAILURE);
+        // OS Concept: Pipe Redirection - Connect pipe ends to stdin/stdout.
+        if (io->stdin_fd != -1 && io->stdin_fd != STDIN_FILENO) {
+            if (dup2(io->stdin_fd, STDIN_FILENO) < 0) { perror("ca$h: dup2 failed for pipe input"); exit(EXIT_FAILURE); }
+            close(io->stdin_fd);
+        }
+        if (io->stdout_fd != -1 && io->stdout_fd != STDOUT_FILENO) {
+            if (dup2(io->stdout_fd, STDOUT_FILENO) < 0) { perror("ca$h: dup2 failed for pipe output"); exit(EXIT_FAILURE); }
+            close(io->stdout_fd);
+        }
+        if (io->close_fd != -1) close(io->close_fd);
+        handle_child_execution(path, args, io->envp, plan); // Sets up IO, signals, then execs
+    }
+
+    // Parent Process: also set the PGID to close the race with the child
+    if (io->pgid >= 0) {
+        pid_t target_pgid = io->pgid ? io->pgid : pid;
+        if (setpgid(pid, target_pgid) < 0 && errno != EACCES && errno != ESRCH) {
+            perror("ca$h: parent setpgid failed");
+        }
+    }
+    return pid;
+}
+
+/**
+ * @brief fork a child that runs a built-in, function or compound command as one stage
+ * of a pipeline (or as a subshell). The child gets the same stream/process group setup
+ * as fork_command, then exits with the command's status. Changes it makes (cd, A=1, ...)
+ * stay in the child.
+ * @param cmd The stage: a built-in, function call, compound, or only assignments (exits 0).
+ * @param io Standard stream and process group setup for the child.
+ * @param plan Prepared redirections.
+ * @return PID of the child, or -1 on failure (error already reported).
+ */
+pid_t fork_builtin(const command_t *cmd, const spawn_io_t *io, const redir_plan_t *plan) {
+    fflush(stdout); // Don't let the child flush the shell's pending output a second time
+    long long trace = trace_start();
+    pid_t pid = fork();
+    if (pid < 0) { perror("ca$h: Fork failed"); return -1; }
+
+    if (pid == 0) { // Child Process
+        if (io->pgid >= 0) {
+            if (setpgid(0, io->pgid) < 0) { perror("ca$h: child setpgid failed"); exit(EXIT_FAILURE); }
+        }
+        if (!limits_apply_child(io->limits)) _exit(EXIT_FAILURE);
+        if (io->stdin_fd != -1 && io->stdin_fd != STDIN_FILENO) { dup2(io->stdin_fd, STDIN_FILENO); close(io->stdin_fd); }
+        if (io->stdout_fd != -1 && io->stdout_fd != STDOUT_FILENO) { dup2(io->stdout_fd, STDOUT_FILENO); close(io->stdout_fd); }
+        if (io->close_fd != -1) close(io->close_fd);
+        reset_child_signals();
+        apply_child_redirections(plan);
+        shell_is_interactive = 0; // A pipeline stage has no job control (fg/bg refuse)
+        for (int i = 0; i < cmd->nassigns; i++) var_assign_word(cmd->assigns[i], cmd->argc > 0);
+        shell_function_t *fn = cmd->argc && function_count ? find_function(cmd->args[0]) : NULL;
+        int status = (cmd->argc || cmd->compound) ? run_in_shell(cmd, fn) : 0;
+        fflush(stdout);
+        out_flush();
+        _exit(status);
+    }
+
+    // Parent Process: also set the PGID to close the race with the child
+    if (io->pgid >= 0) {
+        pid_t target_pgid = io->pgid ? io->pgid : pid;
+        if (setpgid(pid, target_pgid) < 0 && errno != EACCES && errno != ESRCH) {
+            perror("ca$h: parent setpgid failed");
+        }
+    }
+    trace_end(TRACE_SPAWN, trace, cmd->argc ? cmd->args[0] : "(subshell)");
+    return pid;
+}
+
+/**
+ * @brief Implements the 'spawnmode' built-in: show or select the spawn backend.
+ * @param args args[1] is "posix_spawn", "fork" or NULL to print the current backend.
+ * @return 0 on success, 2 on a usage error.
+ */
+int builtin_spawnmode(char **args) {
+    if (args[1] == NULL) { printf("%s\n", spawn_backend_name(spawn_backend)); return 0; }
+    if (args[2] != NULL) { fprintf(stderr, "ca$h: spawnmode: too many arguments\n"); return 2; }
+    if (strcmp(args[1], "posix_spawn") == 0) { spawn_backend = SPAWN_BACKEND_POSIX_SPAWN; }
+    else if (strcmp(args[1], "fork") == 0) { spawn_backend = SPAWN_BACKEND_FORK; }
+    else { fprintf(stderr, "ca$h: spawnmode: Usage: spawnmode [posix_spawn|fork]\n"); return 2; }
+    return 0;
+}
+
+// --- Command Hash Table Functions ---
+
+/**
+ * @brief FNV-1a hash of a name of known length.
+ *
+ * The one hash behind the command hash, the function table, the variable
+ * table and the $(...) result cache.
+ * @param name Characters to hash (need not be NUL-terminated).
+ * @param len Number of characters.
+ * @return Hash value.
+ */
+unsigned long hash_name(const char *name, size_t len) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Walk the $PATH directories looking for an executable regular file.
+ * @param name Command name (no '/').
+ * @return Allocated absolute path (must be freed), or NULL if not found.
+ */
+char* search_path(const char *name) {
+    const char *path_env = var_get("PATH");
+    if (path_env == NULL) path_env = "/usr/local/bin:/usr/bin:/bin";
+
+    char candidate[PATH_MAX];
+    const char *dir = path_env;
+    while (1) {
+        const char *colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+        // An empty $PATH entry means the current directory
+        int len = (dir_len == 0) ? snprintf(candidate, sizeof(candidate), "./%s", name)
+                                 : snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)dir_len, dir, name);
+        if (len > 0 && len < (int)sizeof(candidate)) {
+            // OS Concept: File Metadata - stat() and access() probe each candidate.
+            struct stat st;
+            if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+                return strdup(candidate);
+            }
+        }
+        if (!colon) break;
+        dir = colon + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find a command in the hash table, searching $PATH and adding it on a miss.
+ * Setting or unsetting PATH empties the table (var_assign_value).
+ * @param name Command name (no '/').
+ * @return The table entry, or NULL if the command is not on $PATH.
+ */
+command_hash_entry_t* hash_lookup_command(const char *name) {
+    unsigned long bucket = hash_name(name, strlen(name)) % COMMAND_HASH_BUCKETS;
+    for (command_hash_entry_t *entry = command_hash[bucket]; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) return entry;
+    }
+
+    // Miss: search $PATH once and remember the result
+    char *path = search_path(name);
+    if (path == NULL) return NULL;
+    command_hash_entry_t *entry = malloc(sizeof(command_hash_entry_t));
+    if (entry) entry->name = strdup(name);
+    if (!entry || !entry->name) {
+        perror("ca$h: malloc failed for command hash entry");
+        free(entry); free(path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 0;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return entry;
+}
+
+/**
+ * @brief Resolve a command name to the path to exec, using the hash table.
+ * @param name Command name (args[0]); names containing '/' are used as-is.
+ * @return Path to exec (owned by the table or by args), or NULL if not found.
+ */
+const char* resolve_command(const char *name) {
+    if (strchr(name, '/') != NULL) return name;
+    command_hash_entry_t *entry = hash_lookup_command(name);
+    if (entry == NULL) return NULL;
+    entry->hits++;
+    return entry->path;
+}
+
+/**
+ * @brief Remove one command from the hash table (e.g. its cached path went stale).
+ * @param name Command name.
+ */
+void forget_command(const char *name) {
+    command_hash_entry_t **link = &command_hash[hash_name(name, strlen(name)) % COMMAND_HASH_BUCKETS];
+    while (*link) {
+        command_hash_entry_t *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name); free(entry->path); free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * @brief Empty the command hash table (`hash -r`, or $PATH changed).
+ */
+void flush_command_hash() {
+    for (int i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+        command_hash_entry_t *entry = command_hash[i];
+        while (entry) {
+            command_hash_entry_t *next = entry->next;
+            free(entry->name); free(entry->path); free(entry);
+            entry = next;
+        }
+        command_hash[i] = NULL;
+    }
+}
+
+/**
+ * @brief Implements the 'hash' built-in.
+ * `hash` lists cached commands, `hash -r` flushes the table, `hash name...` looks names up.
+ * @param args Command and arguments.
+ * @return 0 on success, 1 if a name was not found, 2 on a usage error.
+ */
+int builtin_hash(char **args) {
+    if (args[1] == NULL) {
+        int found = 0;
+        for (int i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+            for (command_hash_entry_t *entry = command_hash[i]; entry; entry = entry->next) {
+                if (!found) printf("hits\tcommand\n");
+                printf("%4d\t%s\n", entry->hits, entry->path);
+                found = 1;
+            }
+        }
+        if (!found) printf("ca$h: hash: hash table empty\n");
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        if (args[2] != NULL) { fprintf(stderr, "ca$h: hash: Usage: hash [-r] [name ...]\n"); return 2; }
+        flush_command_hash();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strchr(args[i], '/') != NULL) continue; // Paths are never hashed
+        forget_command(args[i]); // Re-search, like bash does for an explicit `hash name`
+        if (hash_lookup_command(args[i]) == NULL) { fprintf(stderr, "ca$h: hash: %s: not found\n", args[i]); status = 1; }
+    }
+    return status;
+}
+
+/**
+ * @brief Append an empty stage to a pipeline, growing the stage array in the arena.
+ * @param pipeline The pipeline to extend.
+ * @param arena Arena the stages live in.
+ * @return Pointer to the new stage.
+ */
+command_t* pipeline_add_stage(pipeline_t *pipeline, arena_t *arena) {
+    if (pipeline->count == pipeline->capacity) {
+        int new_capacity = pipeline->capacity ? pipeline->capacity * 2 : 4;
+        command_t *new_stages = arena_alloc(arena, new_capacity * sizeof(command_t));
+        if (pipeline->count) memcpy(new_stages, pipeline->stages, pipeline->count * sizeof(command_t));
+        pipeline->stages = new_stages;
+        pipeline->capacity = new_capacity;
+    }
+    command_t *stage = &pipeline->stages[pipeline->count++];
+    command_init(stage, arena);
+    return stage;
+}
+
+/**
+ * @brief Initialize an empty command (argv with its first slots in the arena).
+ * @param cmd The command.
+ * @param arena Arena its arrays live in.
+ */
+void command_init(command_t *cmd, arena_t *arena) {
+    cmd->capacity = INITIAL_ARGV_CAPACITY;
+    cmd->args = arena_alloc(arena, cmd->capacity * sizeof(char *));
+    cmd->args[0] = NULL;
+    cmd->argc = 0;
+    cmd->redirs = NULL;
+    cmd->nredirs = cmd->redir_capacity = 0;
+    cmd->builtin = NULL;
+    cmd->expand = 0;
+    cmd->assigns = NULL;
+    cmd->nassigns = cmd->assign_capacity = 0;
+    cmd->compound = NULL;
+}
+
+/**
+ * @brief Append an argument to a stage, doubling its argv inside the arena when full.
+ * Short commands fit in the initial slots, which come from the arena's reused first chunk.
+ * @param cmd The stage.
+ * @param arena Arena the argv lives in.
+ * @param arg Argument string (already in the arena).
+ */
+void command_add_arg(command_t *cmd, arena_t *arena, char *arg) {
+    if (cmd->argc + 1 >= cmd->capacity) { // Keep room for the NULL terminator
+        int new_capacity = cmd->capacity * 2;
+        char **new_args = arena_alloc(arena, new_capacity * sizeof(char *));
+        memcpy(new_args, cmd->args, cmd->argc * sizeof(char *));
+        cmd->args = new_args;
+        cmd->capacity = new_capacity;
+    }
+    cmd->args[cmd->argc++] = arg;
+    cmd->args[cmd->argc] = NULL; // Keep NULL-terminated for exec
+}
+
+/**
+ * @brief Append a prefix assignment (NAME=value) to a command, growing the list in the arena.
+ * @param cmd The command.
+ * @param arena Arena the list lives in.
+ * @param word The assignment word (already in the arena).
+ */
+void command_add_assign(command_t *cmd, arena_t *arena, char *word) {
+    if (cmd->nassigns == cmd->assign_capacity) {
+        int new_capacity = cmd->assign_capacity ? cmd->assign_capacity * 2 : 4;
+        char **new_assigns = arena_alloc(arena, new_capacity * sizeof(char *));
+        if (cmd->nassigns) memcpy(new_assigns, cmd->assigns, cmd->nassigns * sizeof(char *));
+        cmd->assigns = new_assigns;
+        cmd->assign_capacity = new_capacity;
+    }
+    cmd->assigns[cmd->nassigns++] = word;
+}
+
+/**
+ * @brief Append a redirection to a command, growing the list in the arena.
+ * @param cmd The command.
+ * @param arena Arena the list lives in.
+ * @return Pointer to the new (uninitialized) redirection.
+ */
+redirect_t* command_add_redirect(command_t *cmd, arena_t *arena) {
+    if (cmd->nredirs == cmd->redir_capacity) {
+        int new_capacity = cmd->redir_capacity ? cmd->redir_capacity * 2 : 4;
+        redirect_t *new_redirs = arena_alloc(arena, new_capacity * sizeof(redirect_t));
+        if (cmd->nredirs) memcpy(new_redirs, cmd->redirs, cmd->nredirs * sizeof(redirect_t));
+        cmd->redirs = new_redirs;
+        cmd->redir_capacity = new_capacity;
+    }
+    return &cmd->redirs[cmd->nredirs++];
+}
+
+// --- Redirection Functions ---
+
+/**
+ * @brief Move a descriptor opened for a redirection to fd >= 10 (close-on-exec),
+ * so it can never collide with the 0-9 descriptors the plan assigns.
+ * @param fd Freshly opened descriptor (closed by this call).
+ * @return The new descriptor, or -1 on failure.
+ */
+static int move_fd_high(int fd) {
+    if (fd < 0) return -1;
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return high;
+}
+
+/**
+ * @brief Make a readable descriptor holding a here-string and a trailing newline.
+ * Linux: an in-memory file from memfd_create (any size, no disk). Elsewhere: a pipe;
+ * text that does not fit in the pipe buffer is fed by a small writer child.
+ * @param text The here-string.
+ * @return Descriptor positioned at the start of the text, or -1 on failure (reported).
+ */
+int open_herestring(const char *text) {
+    size_t len = strlen(text);
+#ifdef __linux__
+    // OS Concept: Anonymous Memory Files - A file with no name on any filesystem.
+    int memfd = memfd_create("cash-herestring", MFD_CLOEXEC);
+    if (memfd >= 0) {
+        if (write(memfd, text, len) != (ssize_t)len || write(memfd, "\n", 1) != 1 || lseek(memfd, 0, SEEK_SET) < 0) {
+            perror("ca$h: here-string");
+            close(memfd);
+            return -1;
+        }
+        return memfd;
+    }
+    if (errno != ENOSYS) { perror("ca$h: memfd_create failed for here-string"); return -1; }
+#endif
+    // OS Concept: Inter-Process Communication (IPC) - Feed the text through a pipe.
+    int pipefd[2];
+    if (pipe(pipefd) < 0) { perror("ca$h: pipe failed for here-string"); return -1; }
+    fcntl(pipefd[READ_END], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[WRITE_END], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[WRITE_END], F_SETFL, O_NONBLOCK);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(pipefd[WRITE_END], text + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done == len && write(pipefd[WRITE_END], "\n", 1) == 1) {
+        close(pipefd[WRITE_END]);
+        return pipefd[READ_END];
+    }
+    // Pipe buffer full: let a child write the rest while the command reads
+    pid_t writer = fork();
+    if (writer < 0) { perror("ca$h: fork failed for here-string"); close(pipefd[0]); close(pipefd[1]); return -1; }
+    if (writer == 0) {
+        close(pipefd[READ_END]);
+        fcntl(pipefd[WRITE_END], F_SETFL, 0);
+        while (done < len) {
+            ssize_t n = write(pipefd[WRITE_END], text + done, len - done);
+            if (n <= 0) _exit(1);
+            done += n;
+        }
+        _exit(write(pipefd[WRITE_END], "\n", 1) == 1 ? 0 : 1);
+    }
+    close(pipefd[WRITE_END]);
+    return pipefd[READ_END];
+}
+
+/**
+ * @brief Turn a command's redirections into a plan of descriptor operations,
+ * opening the files and here-strings they need in the shell.
+ * @param cmd The command.
+ * @param arena Arena for the operation list.
+ * @param plan Output plan (release it with release_redirections).
+ * @return 1 on success, 0 on failure (reported; nothing left open).
+ */
+int prepare_redirections(const command_t *cmd, arena_t *arena, redir_plan_t *plan) {
+    plan->count = plan->nopened = 0;
+    plan->ops = NULL;
+    plan->opened = NULL;
+    if (cmd->nredirs == 0) return 1;
+
+    plan->ops = arena_alloc(arena, 2 * cmd->nredirs * sizeof(fd_op_t)); // &> needs two
+    plan->opened = arena_alloc(arena, cmd->nredirs * sizeof(int));
+    for (int i = 0; i < cmd->nredirs; i++) {
+        const redirect_t *redir = &cmd->redirs[i];
+        int fd = -1;
+        // OS Concept: File I/O & File Descriptors - Open each target once, in the shell.
+        switch (redir->type) {
+            case REDIR_INPUT:       fd = open(redir->target, O_RDONLY); break;
+            case REDIR_OUTPUT:
+            case REDIR_BOTH:        fd = open(redir->target, O_WRONLY | O_CREAT | O_TRUNC, 0644); break;
+            case REDIR_APPEND:
+            case REDIR_BOTH_APPEND: fd = open(redir->target, O_WRONLY | O_CREAT | O_APPEND, 0644); break;
+            case REDIR_HERESTRING:
+                fd = open_herestring(redir->target);
+                if (fd < 0) { release_redirections(plan); return 0; }
+                break;
+            case REDIR_DUP: {
+                int source = redir->source_fd;
+                if (source < 0) { // The expanded word: a number or '-'
+                    const char *word = redir->target;
+                    if (strcmp(word, "-") != 0 && (!word[0] || strspn(word, "0123456789") != strlen(word) || strlen(word) >= 10)) {
+                        fprintf(stderr, "ca$h: %s: ambiguous redirect\n", word);
+                        release_redirections(plan);
+                        return 0;
+                    }
+                    source = word[0] == '-' ? -1 : atoi(word);
+                }
+                plan->ops[plan->count++] = (fd_op_t){ redir->fd, source };
+                continue;
+            }
+            case REDIR_CLOSE:
+                plan->ops[plan->count++] = (fd_op_t){ redir->fd, -1 };
+                continue;
+        }
+        fd = move_fd_high(fd);
+        if (fd < 0) {
+            fprintf(stderr, "ca$h: %s: %s\n", redir->type == REDIR_HERESTRING ? "here-string" : redir->target, strerror(errno));
+            release_redirections(plan);
+            return 0;
+        }
+        plan->opened[plan->nopened++] = fd;
+        if (redir->type == REDIR_BOTH || redir->type == REDIR_BOTH_APPEND) {
+            plan->ops[plan->count++] = (fd_op_t){ STDOUT_FILENO, fd };
+            plan->ops[plan->count++] = (fd_op_t){ STDERR_FILENO, STDOUT_FILENO };
+        } else {
+            plan->ops[plan->count++] = (fd_op_t){ redir->fd, fd };
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Close the descriptors the shell opened for a plan (the child keeps its copies).
+ * @param plan The plan.
+ */
+void release_redirections(redir_plan_t *plan) {
+    for (int i = 0; i < plan->nopened; i++) close(plan->opened[i]);
+    plan->nopened = 0;
+}
+
+/**
+ * @brief Check that argv plus the environment fit in the kernel's ARG_MAX before
+ * starting a process, so an oversized command fails with a clear message.
+ * @param args Command and arguments.
+ * @param envp Environment the command will get.
+ * @return 1 if the command fits, 0 if it is too long (reported).
+ */
+int check_arg_max(char **args, char **envp) {
+    static long arg_max = 0;
+    if (arg_max == 0) {
+        // OS Concept: System Limits - Query ARG_MAX once (depends on the stack rlimit on Linux).
+        arg_max = sysconf(_SC_ARG_MAX);
+        if (arg_max <= 0) arg_max = -1; // Unknown: skip the check
+    }
+    if (arg_max < 0) return 1;
+
+    // The kernel counts every string with its NUL plus one pointer per entry
+    size_t total = 0;
+    for (char **arg = args; *arg; arg++) total += strlen(*arg) + 1 + sizeof(char *);
+    for (char **env = envp; env && *env; env++) total += strlen(*env) + 1 + sizeof(char *);
+    if (total > (size_t)arg_max) {
+        fprintf(stderr, "ca$h: %s: argument list too long (%zu bytes, limit %ld)\n", args[0], total, arg_max);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Start every stage of a multi-stage pipeline in one process group.
+ * Creates the N-1 pipes between stages one at a time, so each child only ever
+ * holds the read end of the previous pipe and both ends of the next one, and
+ * closes all of them after wiring up stdin/stdout. Per-stage redirections are
+ * applied after the pipe ends, so they override the pipe like in other shells.
+ * @param pipeline The parsed pipeline (at least two stages).
+ * @param original_cmd The original command string (for job title).
+ * @return Exit status of the last stage (0 in the background, 1 if it could not start).
+ */
+int launch_pipeline(pipeline_t *pipeline, const char *original_cmd) {
+    pid_t pipeline_pgid = 0; // PGID for the entire pipeline (first child's PID)
+    int prev_read = -1;      // Read end of the pipe feeding the current stage
+    // OS Concept: Job Tracking - The job records every stage's pid as it starts.
+    job_t *job = create_job(original_cmd, pipeline->background);
+    if (!job) return 1;
+    job->timed = pipeline->timed;
+    procsub_adopt(job); // Substitutions in the stages' words lead the group
+    limits_adopt(job);
+    pipeline_pgid = job->pgid;
+
+    for (int i = 0; i < pipeline->count; i++) {
+        int pipefd[2] = { -1, -1 };
+        int is_last = (i == pipeline->count - 1);
+
+        // OS Concept: Inter-Process Communication (IPC) - Create a pipe to the next stage.
+        if (!is_last && pipe(pipefd) == -1) {
+            perror("ca$h: Pipe creation failed");
+            if (prev_read != -1) close(prev_read);
+            goto abort_pipeline;
+        }
+
+        // OS Concept: Process Creation - One child per stage, first stage leads the group.
+        // Stdin comes from the previous pipe, stdout goes to the next one.
+        command_t *stage = &pipeline->stages[i];
+        spawn_io_t io = {
+            .stdin_fd = prev_read,
+            .stdout_fd = is_last ? -1 : pipefd[WRITE_END],
+            .close_fd = is_last ? -1 : pipefd[READ_END], // Only the next stage reads from it
+            .pgid = shell_is_interactive ? pipeline_pgid : -1,
+            .envp = command_envp(stage, &line_arena),
+            .limits = active_limits,
+        };
+        redir_plan_t plan;
+        pid_t pid = -1;
+        if (prepare_redirections(stage, &line_arena, &plan)) {
+            int in_shell = stage->builtin || stage->argc == 0 || (function_count && find_function(stage->args[0]));
+            pid = in_shell ? fork_builtin(stage, &io, &plan) : spawn_command(stage->args, &io, &plan);
+            release_redirections(&plan);
+        }
+        if (pid < 0) {
+            if (prev_read != -1) close(prev_read);
+            if (!is_last) { close(pipefd[READ_END]); close(pipefd[WRITE_END]); }
+            goto abort_pipeline;
+        }
+
+        // --- Parent Process ---
+        if (pipeline_pgid == 0) { pipeline_pgid = pid; }
+        if (!job_add_process(job, pid, stage->argc ? stage->args[0] : "")) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            if (prev_read != -1) close(prev_read);
+            if (!is_last) { close(pipefd[READ_END]); close(pipefd[WRITE_END]); }
+            goto abort_pipeline;
+        }
+
+        // OS Concept: File Descriptor Management - Parent closes pipe ends it no longer needs.
+        if (prev_read != -1) close(prev_read);
+        if (!is_last) {
+            close(pipefd[WRITE_END]);
+            prev_read = pipefd[READ_END];
+        }
+    }
+
+    procsub_release(); // Every stage has its copies
+
+    // Handle foreground/background for the pipeline
+    if (pipeline->background) {
+        last_background_pid = job->procs[job->nprocs - 1].pid;
+        if (shell_is_interactive) printf("[%d] %d\n", job->jid, job->pgid); // Report pipeline PGID
+        return 0;
+    } else if (shell_is_interactive) { // Foreground pipeline
+        return put_job_in_foreground(job, 0); // Waits until every stage is reaped (or the job stops)
+    }
+    return wait_for_job(job); // Non-interactive: no terminal handover
+
+abort_pipeline:
+    // Clean up the stages that were already started, then drop the job
+    // (no notice, and no $PIPESTATUS from a pipeline that never ran)
+    for (int i = 0; i < job->nprocs; i++) {
+        if (!job->procs[i].done) { kill(job->procs[i].pid, SIGKILL); waitpid(job->procs[i].pid, NULL, 0); }
+    }
+    remove_job(job);
+    return 1;
+}
+
+/**
+ * @brief Run a built-in under 'time'. Built-ins run inside the shell, so the report
+ * is the change in the shell's own rusage while it ran.
+ * @param cmd The built-in command.
+ * @param pipeline The pipeline it belongs to (for the job title).
+ * @return The built-in's exit status.
+ */
+int time_builtin_command(command_t *cmd, pipeline_t *pipeline) {
+    job_usage_t usage;
+    struct rusage before, after;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &usage.started);
+
+    int status = execute_single_command(cmd, pipeline->background, 0, pipeline->command);
+
+    clock_gettime(CLOCK_MONOTONIC, &usage.finished);
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &usage.utime);
+    timersub(&after.ru_stime, &before.ru_stime, &usage.stime);
+    usage.maxrss_kb = rusage_maxrss_kb(&after);
+    usage.nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    usage.nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    print_usage_report(&usage);
+    return status;
+}
+
+/**
+ * @brief Execute a parsed pipeline, handling built-ins, pipes and background execution.
+ * Sets $? and $PIPESTATUS: a foreground job fills in one status per stage while it is
+ * reaped; anything else (built-in, background job, failure to start) records one status.
+ * @param pipeline The parsed pipeline (from parse_pipeline).
+ * @return Exit status of the pipeline.
+ */
+int execute_pipeline(pipeline_t *pipeline) {
+    command_subst_status = -1;
+    // 'limit': set up before expansion, so <(...) processes are limited too
+    limit_launch_t launch, *saved_limits = active_limits;
+    active_limits = NULL;
+    if (pipeline->limits.set) {
+        if (!limits_prepare(&pipeline->limits, &launch)) {
+            active_limits = saved_limits;
+            pipestatus.count = 0;
+            pipestatus_push(1);
+            return last_status = 1;
+        }
+        active_limits = &launch;
+    }
+    int procsub_base = procsubs.base;
+    procsubs.base = procsubs.count;
+    if (pipeline->expand) {
+        long long trace = trace_start();
+        pipeline = expand_pipeline(pipeline, &line_arena);
+        trace_end(TRACE_EXPAND, trace, pipeline->command);
+        // The command must inherit the /dev/fd/N paths it was given
+        for (int i = procsubs.base; i < procsubs.count; i++) fcntl(procsubs.items[i].fd, F_SETFD, 0);
+    }
+    pipestatus.count = 0; // Refilled by wait_for_job once a foreground job finishes
+
+    int status;
+    if (pipeline->count == 1) {
+        // --- No Pipe --- (built-ins are handled here too)
+        command_t *cmd = &pipeline->stages[0];
+        if (pipeline->timed && (cmd->builtin || cmd->compound) && !active_limits) status = time_builtin_command(cmd, pipeline);
+        else status = execute_single_command(cmd, pipeline->background, pipeline->timed, pipeline->command);
+    } else {
+        // --- Pipe Found --- (built-in stages run in forked children)
+        status = launch_pipeline(pipeline, pipeline->command);
+    }
+    if (pipestatus.count == 0) pipestatus_push(status);
+    last_status = status;
+    procsub_release(); // A built-in used them in the shell; processes no job adopted are reaped untracked
+    procsubs.count = procsubs.base;
+    procsubs.base = procsub_base;
+    if (active_limits) limits_release(active_limits);
+    active_limits = saved_limits;
+    return status;
+}
+
+// --- Word Expansion Functions ---
+
+/**
+ * @brief Make room for len more characters (and a NUL) in a word buffer, doubling it
+ * inside the arena when full.
+ * @return Where the next characters go.
+ */
+static char* word_buf_reserve(word_buf_t *buf, size_t len) {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap * 2 : 64;
+        while (new_cap < buf->len + len + 1) new_cap *= 2;
+        char *new_data = arena_alloc(buf->arena, new_cap);
+        if (buf->len) memcpy(new_data, buf->data, buf->len);
+        buf->data = new_data;
+        buf->cap = new_cap;
+    }
+    return buf->data + buf->len;
+}
+
+/**
+ * @brief Append characters to a word buffer (kept NUL-terminated).
+ */
+void word_buf_append(word_buf_t *buf, const char *str, size_t len) {
+    word_buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+/**
+ * @brief Append a number to a word buffer.
+ */
+static void word_buf_append_int(word_buf_t *buf, long value) {
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%ld", value);
+    word_buf_append(buf, digits, n);
+}
+
+/**
+ * @brief Does a word hold a reference that still has to be expanded?
+ */
+int word_has_mark(const char *word) {
+    return strpbrk(word, "\001\002\003") != NULL;
+}
+
+/**
+ * @brief Copy a pipeline with every $ reference expanded, right before it runs, so
+ * `false; echo $?` sees the status of false. The parsed pipeline is left untouched;
+ * stages without references are copied as they are.
+ * @param pipeline The parsed pipeline.
+ * @param arena Arena for the copy (the line arena).
+ * @return The expanded copy.
+ */
+pipeline_t* expand_pipeline(const pipeline_t *pipeline, arena_t *arena) {
+    glob_cache = NULL; // Listings from an earlier command may be stale (touch x; ls *)
+    pipeline_t *copy = arena_alloc(arena, sizeof(pipeline_t));
+    *copy = *pipeline;
+    copy->expand = 0;
+    copy->stages = arena_alloc(arena, pipeline->count * sizeof(command_t));
+    memcpy(copy->stages, pipeline->stages, pipeline->count * sizeof(command_t));
+    for (int i = 0; i < copy->count; i++) {
+        const command_t *src = &pipeline->stages[i];
+        command_t *stage = &copy->stages[i];
+        if (!src->expand) continue;
+        stage->expand = 0;
+        // Unquoted references may expand to several arguments, or to none
+        stage->capacity = src->argc + 1 > INITIAL_ARGV_CAPACITY ? src->argc + 1 : INITIAL_ARGV_CAPACITY;
+        stage->args = arena_alloc(arena, stage->capacity * sizeof(char *));
+        stage->args[0] = NULL;
+        stage->argc = 0;
+        for (int a = 0; a < src->argc; a++) {
+            if (word_has_mark(src->args[a])) expand_word_fields(src->args[a], arena, stage);
+            else command_add_arg(stage, arena, src->args[a]);
+        }
+        if (src->nassigns) {
+            stage->assigns = arena_alloc(arena, src->nassigns * sizeof(char *));
+            for (int a = 0; a < src->nassigns; a++) {
+                stage->assigns[a] = word_has_mark(src->assigns[a]) ? expand_word(src->assigns[a], arena) : src->assigns[a];
+            }
+            stage->assign_capacity = src->nassigns;
+        }
+        if (src->nredirs) {
+            stage->redirs = arena_alloc(arena, src->nredirs * sizeof(redirect_t));
+            memcpy(stage->redirs, src->redirs, src->nredirs * sizeof(redirect_t));
+            for (int r = 0; r < stage->nredirs; r++) {
+                if (word_has_mark(stage->redirs[r].target)) stage->redirs[r].target = expand_word(stage->redirs[r].target, arena);
+            }
+            stage->redir_capacity = src->nredirs;
+        }
+        // The command name itself may have been a reference
+        if (stage->args[0] != src->args[0]) stage->builtin = stage->args[0] ? find_builtin(stage->args[0]) : NULL;
+    }
+    return copy;
+}
+
+/**
+ * @brief Finish the current field and add it to the output arguments.
+ */
+static void expand_end_field(expand_state_t *st) {
+    if (!st->active) return;
+    if (!st->buf.data) word_buf_append(&st->buf, "", 0);
+    // A field with pattern characters becomes the matching paths; with no match it stays as written
+    if (!memchr(st->buf.data, GLOB_MARK, st->buf.len) || glob_expand_word(st->buf.data, st->arena, st->out) == 0) {
+        command_add_arg(st->out, st->arena, glob_strip_marks(st->buf.data));
+    }
+    st->buf = (word_buf_t){ NULL, 0, 0, st->arena };
+    st->active = 0;
+}
+
+/**
+ * @brief Append the value of an unquoted reference, splitting it into fields at $IFS
+ * characters (default space, tab, newline). Runs of IFS whitespace count as one
+ * separator and are dropped at the ends; other IFS characters each end a field.
+ */
+static void expand_split_append(expand_state_t *st, const char *value) {
+    const char *ifs = var_get("IFS");
+    if (!ifs) ifs = " \t\n";
+    const char *p = value;
+    while (*p) {
+        size_t run = strcspn(p, ifs);
+        if (run) {
+            // Pattern characters in an unquoted value are live too (F='*.c'; ls $F)
+            for (const char *end = p + run; p < end; ) {
+                size_t plain = strcspn(p, "*?[");
+                if (plain > (size_t)(end - p)) plain = end - p;
+                word_buf_append(&st->buf, p, plain);
+                p += plain;
+                if (p < end) { word_buf_append(&st->buf, "\003", 1); word_buf_append(&st->buf, p++, 1); }
+            }
+            st->active = 1;
+            continue;
+        }
+        if (*p == ' ' || *p == '\t' || *p == '\n') { expand_end_field(st); p++; continue; }
+        st->active = 1; // A non-whitespace separator ends a field even if it is empty
+        expand_end_field(st);
+        p++;
+    }
+}
+
+/**
+ * @brief Expand the references in a word, using st for the output.
+ */
+static void expand_into(const char *word, expand_state_t *st) {
+    const char *p = word;
+    while (*p) {
+        if (*p == EXPAND_MARK || *p == EXPAND_MARK_QUOTED) {
+            int quoted = (*p == EXPAND_MARK_QUOTED) || st->out == NULL;
+            if (p[1] == '<' || p[1] == '>') p = expand_process_subst(p + 1, st);
+            else p = p[1] == '(' ? expand_command_subst(p + 1, st, quoted) : expand_parameter(p + 1, st, quoted);
+            continue;
+        }
+        size_t len = strcspn(p, "\001\002");
+        word_buf_append(&st->buf, p, len);
+        st->active = 1;
+        p += len;
+    }
+}
+
+/**
+ * @brief Expand a word into one string: references are replaced, nothing is split
+ * or globbed (assignment values, redirection targets, ${NAME:-word} defaults).
+ * @param word Word text from the lexer.
+ * @param arena Arena for the result.
+ * @return The expanded word.
+ */
+char* expand_word(const char *word, arena_t *arena) {
+    expand_state_t st = { { NULL, 0, 0, arena }, 0, NULL, arena };
+    expand_into(word, &st);
+    if (!st.buf.data) word_buf_append(&st.buf, "", 0);
+    return glob_strip_marks(st.buf.data);
+}
+
+/**
+ * @brief Expand a word into arguments of a stage. Unquoted references are split into
+ * fields; a word that expands to nothing unquoted adds no argument at all.
+ * @param word Word text from the lexer.
+ * @param arena Arena for the results.
+ * @param out Stage receiving the arguments.
+ */
+void expand_word_fields(const char *word, arena_t *arena, command_t *out) {
+    expand_state_t st = { { NULL, 0, 0, arena }, 0, out, arena };
+    expand_into(word, &st);
+    expand_end_field(&st);
+}
+
+/**
+ * @brief Expand one reference: $?, $1, $NAME, ${NAME}, ${NAME[subscript]}, ${#NAME},
+ * ${NAME:-word} or ${NAME-word}. "$@" gives one field per positional parameter.
+ * A malformed reference is kept literally, '$' included.
+ * @param p Points just after the '$'.
+ * @param st Expansion state.
+ * @param quoted 1 if the result must not be split.
+ * @return Pointer past the reference.
+ */
+const char* expand_parameter(const char *p, expand_state_t *st, int quoted) {
+    const char *start = p;
+    int braced = (*p == '{'), length = 0;
+    if (braced) {
+        p++;
+        if (*p == '#' && p[1] != '}') { length = 1; p++; } // ${#NAME}, but ${#} is $#
+    }
+    const char *name = p;
+    if (*p && strchr("?$#@*!", *p)) p++;
+    else if (isdigit((unsigned char)*p)) { p++; if (braced) while (isdigit((unsigned char)*p)) p++; }
+    else if (*p == '_' || isalpha((unsigned char)*p)) { while (*p == '_' || isalnum((unsigned char)*p)) p++; }
+    size_t name_len = p - name;
+
+    const char *sub = NULL, *alt = NULL;
+    size_t sub_len = 0, alt_len = 0;
+    int alt_if_empty = 0;
+    if (braced && name_len > 0) {
+        if (*p == GLOB_MARK && p[1] == '[') p++; // Unquoted ${NAME[1]}: the lexer took [ for a pattern
+        if (*p == '[') {
+            const char *close = strchr(p + 1, ']');
+            if (close) { sub = p + 1; sub_len = close - sub; p = close + 1; }
+            if (sub && sub_len > 1 && *sub == GLOB_MARK) { sub++; sub_len--; } // ${NAME[*]}
+        }
+        if (!length && (*p == '-' || (p[0] == ':' && p[1] == '-'))) {
+            alt_if_empty = (*p == ':');
+            p += alt_if_empty + 1;
+            alt = p;
+            for (int depth = 0; *p && (*p != '}' || depth > 0); p++) { // Skip nested ${...}
+                if (*p == '{') depth++;
+                else if (*p == '}') depth--;
+            }
+            alt_len = p - alt;
+        }
+        if (*p == '}') p++;
+        else name_len = 0; // Not a well-formed ${...}
+    }
+    if (name_len == 0) {
+        word_buf_append(&st->buf, "$", 1);
+        st->active = 1;
+        return start;
+    }
+
+    // "$@": every positional parameter becomes a field of its own
+    if (quoted && st->out && name_len == 1 && *name == '@' && !length && !alt) {
+        for (int i = 0; i < positional_count; i++) {
+            if (i > 0) expand_end_field(st);
+            word_buf_append(&st->buf, positional_args[i], strlen(positional_args[i]));
+            st->active = 1;
+        }
+        return p;
+    }
+
+    word_buf_t scratch = { NULL, 0, 0, st->arena };
+    const char *value = parameter_value(name, name_len, sub, sub_len, &scratch);
+    if (alt && (value == NULL || (alt_if_empty && *value == '\0'))) {
+        value = expand_word(arena_strndup(st->arena, alt, alt_len), st->arena);
+    }
+    if (value == NULL) value = "";
+    if (length) {
+        scratch = (word_buf_t){ NULL, 0, 0, st->arena };
+        word_buf_append_int(&scratch, strlen(value));
+        value = scratch.data;
+    }
+    if (quoted) {
+        word_buf_append(&st->buf, value, strlen(value));
+        st->active = 1; // "$EMPTY" is still an (empty) argument
+    } else {
+        expand_split_append(st, value);
+    }
+    return p;
+}
+
+/**
+ * @brief Value of a parameter: a special one ($? $$ $# $! $0 $1... $@ $*), PIPESTATUS
+ * (${PIPESTATUS[@]} is every element, space-separated) or a shell variable.
+ * @param name Parameter name (not NUL-terminated).
+ * @param name_len Length of name.
+ * @param sub Subscript inside [...], or NULL.
+ * @param sub_len Length of sub.
+ * @param scratch Buffer for values that have to be formatted.
+ * @return The value, or NULL if the parameter is unset.
+ */
+const char* parameter_value(const char *name, size_t name_len, const char *sub, size_t sub_len, word_buf_t *scratch) {
+    int all = sub && sub_len == 1 && (sub[0] == '@' || sub[0] == '*');
+    long index = 0;
+    if (sub && !all) {
+        if (sub_len == 0 || sub_len > 9 || strspn(sub, "0123456789") < sub_len) return NULL;
+        index = atol(sub);
+    }
+
+    if (isdigit((unsigned char)name[0])) {
+        long n = strtol(name, NULL, 10);
+        if (n == 0) return shell_name;
+        return n <= positional_count ? positional_args[n - 1] : NULL;
+    }
+    if (name_len == 1 && strchr("?$#!@*", name[0])) {
+        switch (name[0]) {
+            case '?': word_buf_append_int(scratch, last_status); break;
+            case '$': word_buf_append_int(scratch, shell_pid); break;
+            case '#': word_buf_append_int(scratch, positional_count); break;
+            case '!':
+                if (last_background_pid == 0) return NULL;
+                word_buf_append_int(scratch, last_background_pid);
+                break;
+            default: // $@ and $* outside "$@": the parameters joined by spaces
+                for (int i = 0; i < positional_count; i++) {
+                    if (i > 0) word_buf_append(scratch, " ", 1);
+                    word_buf_append(scratch, positional_args[i], strlen(positional_args[i]));
+                }
+                if (!scratch->data) return "";
+        }
+        return scratch->data;
+    }
+    if (name_len == 10 && strncmp(name, "PIPESTATUS", 10) == 0) {
+        if (!all) {
+            if (index >= pipestatus.count) return NULL;
+            word_buf_append_int(scratch, pipestatus.codes[index]);
+            return scratch->data;
+        }
+        for (int i = 0; i < pipestatus.count; i++) {
+            if (i > 0) word_buf_append(scratch, " ", 1);
+            word_buf_append_int(scratch, pipestatus.codes[i]);
+        }
+        return scratch->data ? scratch->data : "";
+    }
+    // A coprocess: ${NAME[0]} reads its output, ${NAME[1]} writes its input
+    const coproc_t *co = (sub && coprocs.count) ? coproc_find(name, name_len) : NULL;
+    if (co) {
+        if (all) { word_buf_append_int(scratch, co->read_fd); word_buf_append(scratch, " ", 1); word_buf_append_int(scratch, co->write_fd); }
+        else if (index <= 1) word_buf_append_int(scratch, index ? co->write_fd : co->read_fd);
+        return scratch->data;
+    }
+    // A plain variable acts as an array of one element
+    if (index > 0) return NULL;
+    shell_var_t *var = var_lookup(name, name_len);
+    return var ? var->value : NULL;
+}
+
+// --- Command Substitution Functions ---
+
+/**
+ * @brief Can $(...) run this built-in in place and keep its output? True for the fast
+ * built-ins (echo, printf, test, [, pwd, true, false), which only write through
+ * builtin_out and change nothing in the shell, and for cache, which writes hits and
+ * misses through builtin_out and has to run here for its results to be remembered.
+ */
+static int builtin_is_fast(const builtin_t *builtin) {
+    if (!builtin) return 0;
+    builtin_fn_t fn = builtin->fn;
+    return fn == builtin_echo || fn == builtin_printf || fn == builtin_test || fn == builtin_bracket ||
+           fn == builtin_pwd || fn == builtin_true || fn == builtin_false || fn == builtin_cache;
+}
+
+/**
+ * @brief Run a started child as a foreground job while reading its stdout pipe,
+ * PIPE_READ_CHUNK bytes per read(), and hand each chunk to a callback as it arrives.
+ * Ctrl-C and Ctrl-Z reach the child and not the shell; a Ctrl-Z ends the reading
+ * and leaves it as a stopped job.
+ * @param pid The child writing the pipe.
+ * @param fd Read end of the pipe (closed here).
+ * @param title Job title.
+ * @param name Program name of the child.
+ * @param on_chunk Called with each chunk read.
+ * @param ctx Passed to on_chunk.
+ * @return The child's exit status, 128 + SIGTSTP if it was stopped, or -1 if it
+ * could not be tracked as a job (it was killed).
+ */
+int run_piped_job(pid_t pid, int fd, const char *title, const char *name, pipe_chunk_fn on_chunk, void *ctx) {
+    job_t *job = create_child_job(pid, title, name, 0);
+    if (!job) { close(fd); return -1; }
+    // OS Concept: Terminal Control - The command owns the terminal while it runs
+    if (shell_is_interactive) tcsetpgrp(terminal_fd, job->pgid);
+
+    static char chunk[PIPE_READ_CHUNK];
+    int stopped = 0;
+    while (1) {
+        // OS Concept: I/O Multiplexing - Also watch SIGCHLD, so a Ctrl-Z is noticed
+        struct pollfd fds[2] = { { .fd = fd, .events = POLLIN }, { .fd = child_event_fd, .events = POLLIN } };
+        if (poll(fds, child_event_fd >= 0 ? 2 : 1, -1) < 0) { if (errno == EINTR) continue; break; }
+        if (fds[1].revents) {
+            drain_child_events();
+            reap_children();
+            if (job->state == JOB_STATE_STOPPED) { stopped = 1; break; }
+        }
+        if (!fds[0].revents) continue;
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        on_chunk(ctx, chunk, n);
+    }
+    close(fd);
+    if (stopped) { // Left as a stopped job; the caller keeps what it got so far
+        if (shell_is_interactive) tcsetpgrp(terminal_fd, cash_pgid);
+        return 128 + SIGTSTP;
+    }
+    return shell_is_interactive ? put_job_in_foreground(job, 0) : wait_for_job(job);
+}
+
+/**
+ * @brief run_piped_job callback of $(...): append the chunk to the word buffer.
+ */
+static void command_subst_chunk(void *ctx, const char *data, size_t len) {
+    word_buf_append(ctx, data, len);
+}
+
+/**
+ * @brief Run the command of a $(...) and append its output to a buffer. A single fast
+ * built-in (`$(pwd)`, `$(printf ...)`, `$(cache ...)`) runs in the shell with builtin_out writing into
+ * the buffer: no fork, no pipe. A single external command is spawned with its stdout
+ * on a pipe; anything else (lists, pipelines, other built-ins, functions) runs in a
+ * forked copy of the shell, so `$(cd /; exit 1)` changes nothing here.
+ * @param text The command, as written between the parentheses.
+ * @param out Buffer receiving the output (not NUL-terminated if nothing was written).
+ * @return The command's exit status (2 on a syntax error).
+ */
+int command_subst(const char *text, word_buf_t *out) {
+    token_list_t tokens;
+    command_list_t list;
+    int parsed = lex_line(text, &line_arena, &tokens);
+    if (parsed == 1) parsed = parse_command_list(text, &tokens, &line_arena, &list);
+    if (parsed != 1) {
+        if (parsed == PARSE_INCOMPLETE) fprintf(stderr, "ca$h: syntax error: unexpected end of command substitution\n");
+        return 2;
+    }
+    if (list.count == 0) return 0;
+
+    // One simple command whose name is known before expansion: candidates for a shortcut
+    pipeline_t *pipeline = &list.items[0];
+    command_t *stage = NULL;
+    if (list.count == 1 && pipeline->count == 1 && !pipeline->background && !pipeline->timed && pipeline->next != CONNECT_BACKGROUND) {
+        stage = &pipeline->stages[0];
+        if (stage->compound || stage->nassigns || stage->nredirs || !stage->args[0] || word_has_mark(stage->args[0]) ||
+            (function_count && find_function(stage->args[0])) || (stage->builtin && !builtin_is_fast(stage->builtin))) stage = NULL;
+        for (int i = 0; stage && i < stage->argc; i++) {
+            if (strstr(stage->args[i], "\001<(") || strstr(stage->args[i], "\001>(")) stage = NULL; // <(...) needs a pipeline's job
+        }
+    }
+    if (stage && pipeline->expand) {
+        pipeline = expand_pipeline(pipeline, &line_arena);
+        stage = &pipeline->stages[0];
+    }
+    out_flush(); // Output still pending belongs to the terminal, not to the substitution
+    if (stage && stage->builtin) {
+        builtin_out.capture = out;
+        int status = stage->builtin->fn(stage->args);
+        out_flush();
+        builtin_out.capture = NULL;
+        return status;
+    }
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0) { perror("ca$h: pipe failed for command substitution"); return 1; }
+    fcntl(pipefd[READ_END], F_SETFD, FD_CLOEXEC);
+    spawn_io_t io = { .stdin_fd = -1, .stdout_fd = pipefd[WRITE_END], .close_fd = pipefd[READ_END],
+                      .pgid = shell_is_interactive ? 0 : -1, .envp = shell_envp() };
+    pid_t pid;
+    if (stage) {
+        pid = spawn_command(stage->args, &io, NULL);
+    } else { // The whole list as a subshell
+        compound_t subshell = { .type = COMPOUND_SUBSHELL, .body = list, .name = (char *)text };
+        command_t cmd;
+        command_init(&cmd, &line_arena);
+        cmd.compound = &subshell;
+        pid = fork_builtin(&cmd, &io, NULL);
+    }
+    close(pipefd[WRITE_END]);
+    if (pid < 0) { close(pipefd[READ_END]); return 127; }
+    int status = run_piped_job(pid, pipefd[READ_END], text, stage ? stage->args[0] : text, command_subst_chunk, out);
+    return status < 0 ? 1 : status;
+}
+
+/**
+ * @brief Expand $(command): run it and substitute its output with trailing newlines
+ * removed. Quoted, the output is read straight into the field being built and trimmed
+ * there; unquoted, it is split into fields (and globbed) like $NAME. NUL bytes are
+ * dropped, as they cannot be part of an argument.
+ * @param p Points at the '(' after the mark.
+ * @param st Expansion state.
+ * @param quoted 1 if the result must not be split.
+ * @return Pointer past the closing ')'.
+ */
+const char* expand_command_subst(const char *p, expand_state_t *st, int quoted) {
+    const char *close = subst_end(p);
+    if (!close) { // Cannot come from the lexer; keep it literally
+        word_buf_append(&st->buf, "$", 1);
+        st->active = 1;
+        return p;
+    }
+    char *text = arena_strndup(st->arena, p + 1, close - p - 1);
+    word_buf_t scratch = { NULL, 0, 0, st->arena };
+    word_buf_t *out = quoted ? &st->buf : &scratch;
+    size_t start = out->len;
+    command_subst_status = command_subst(text, out);
+
+    // Trim in place: drop NULs, then the trailing newlines
+    if (out->data) {
+        char *from = out->data + start, *end = out->data + out->len, *to = memchr(from, '\0', end - from);
+        if (to) {
+            for (from = to; from < end; from++) if (*from) *to++ = *from;
+            out->len = to - out->data;
+        }
+        while (out->len > start && out->data[out->len - 1] == '\n') out->len--;
+        out->data[out->len] = '\0';
+    }
+    if (quoted) st->active = 1; // "$(true)" is still an (empty) argument
+    else if (scratch.data) expand_split_append(st, scratch.data);
+    return close + 1;
+}
+
+// --- Process Substitution Functions ---
+
+/**
+ * @brief Expand <(command) or >(command): start the command on a pipe and substitute
+ * /dev/fd/N, the shell's end of it, so `diff <(sort a) <(sort b)` streams both sorts
+ * through the kernel instead of temp files. The command runs in a forked copy of the
+ * shell, like $(...), but is not waited for here: the command using the path is
+ * spawned with the descriptor, and its job adopts the substitution (procsub_adopt).
+ * The first substitution of a pipeline leads a new process group and the pipeline's
+ * stages join it, so Ctrl-C and Ctrl-Z reach the whole thing at once.
+ * @param p Points at the '<' or '>' after the mark.
+ * @param st Expansion state.
+ * @return Pointer past the closing ')'.
+ */
+const char* expand_process_subst(const char *p, expand_state_t *st) {
+    const char *end = subst_end(p + 1);
+    st->active = 1;
+    if (!end) { word_buf_append(&st->buf, p, 1); return p + 1; } // Cannot come from the lexer
+    int reading = (*p == '<'); // <(cmd): the shell's end reads the command's stdout
+    char *text = arena_strndup(st->arena, p + 2, end - p - 2);
+
+    token_list_t tokens;
+    command_list_t list;
+    int parsed = lex_line(text, &line_arena, &tokens);
+    if (parsed == 1) parsed = parse_command_list(text, &tokens, &line_arena, &list);
+    if (parsed != 1) {
+        if (parsed == PARSE_INCOMPLETE) fprintf(stderr, "ca$h: syntax error: unexpected end of process substitution\n");
+        return end + 1;
+    }
+    if (procsubs.count == procsubs.capacity) {
+        int capacity = procsubs.capacity ? procsubs.capacity * 2 : 4;
+        procsub_t *items = realloc(procsubs.items, capacity * sizeof(procsub_t));
+        if (!items) { perror("ca$h: realloc failed for process substitution"); return end + 1; }
+        procsubs.items = items;
+        procsubs.capacity = capacity;
+    }
+
+    // OS Concept: Inter-Process Communication - The shell's end stays close-on-exec until
+    // the command that uses it runs, so substitutions started later do not inherit it
+    int pipefd[2];
+    if (pipe(pipefd) < 0) { perror("ca$h: pipe failed for process substitution"); return end + 1; }
+    int child_end = reading ? pipefd[WRITE_END] : pipefd[READ_END];
+    int shell_end = move_fd_high(reading ? pipefd[READ_END] : pipefd[WRITE_END]);
+    if (shell_end < 0) { perror("ca$h: fcntl failed for process substitution"); close(child_end); return end + 1; }
+    pid_t pgid = procsub_pgid();
+    spawn_io_t io = { .stdin_fd = reading ? -1 : child_end, .stdout_fd = reading ? child_end : -1, .close_fd = shell_end,
+                      .pgid = shell_is_interactive ? pgid : -1, .envp = shell_envp(), .limits = active_limits };
+    compound_t subshell = { .type = COMPOUND_SUBSHELL, .body = list, .name = text };
+    command_t cmd;
+    command_init(&cmd, &line_arena);
+    cmd.compound = &subshell;
+    out_flush();
+    pid_t pid = fork_builtin(&cmd, &io, NULL);
+    close(child_end);
+    if (pid < 0) { close(shell_end); return end + 1; }
+
+    procsub_t *ps = &procsubs.items[procsubs.count++];
+    ps->pid = pid;
+    ps->fd = shell_end;
+    ps->text = text;
+    char path[32];
+    int len = snprintf(path, sizeof(path), "/dev/fd/%d", shell_end);
+    word_buf_append(&st->buf, path, len);
+    return end + 1;
+}
+
+/**
+ * @brief Process group the current pipeline's substitutions and stages share: that of
+ * its first substitution, or 0 when it has none yet (the next child leads a new one).
+ */
+pid_t procsub_pgid() {
+    for (int i = procsubs.base; i < procsubs.count; i++) {
+        if (procsubs.items[i].pid <= 0) continue;
+        pid_t pgid = getpgid(procsubs.items[i].pid);
+        return pgid > 0 ? pgid : 0; // The leader may already be gone
+    }
+    return 0;
+}
+
+/**
+ * @brief Track the current pipeline's substitutions as helper processes of the job
+ * about to run it (before its stages, so the job's group is theirs). The job then
+ * finishes once they have too, and their statuses stay out of $PIPESTATUS.
+ * @param job The job.
+ */
+void procsub_adopt(job_t *job) {
+    for (int i = procsubs.base; i < procsubs.count; i++) {
+        procsub_t *ps = &procsubs.items[i];
+        if (ps->pid <= 0 || !job_add_process(job, ps->pid, ps->text)) continue;
+        job->procs[job->nprocs - 1].helper = 1;
+        ps->pid = 0;
+    }
+}
+
+/**
+ * @brief Close the shell's ends of the current pipeline's substitutions once the
+ * commands using them have their own copies (or, for a built-in, have finished).
+ * The substitutions see end of input or a closed reader and exit.
+ */
+void procsub_release() {
+    for (int i = procsubs.base; i < procsubs.count; i++) {
+        if (procsubs.items[i].fd >= 0) close(procsubs.items[i].fd);
+        procsubs.items[i].fd = -1;
+    }
+}
+
+// --- Pathname Expansion Functions ---
+
+/**
+ * @brief Remove the GLOB_MARKs from a word (in place), leaving the text as written.
+ * @param word The word.
+ * @return The same word.
+ */
+char* glob_strip_marks(char *word) {
+    char *out = strchr(word, GLOB_MARK);
+    if (!out) return word;
+    for (const char *p = out; *p; p++) {
+        if (*p != GLOB_MARK) *out++ = *p;
+    }
+    *out = '\0';
+    return word;
+}
+
+/**
+ * @brief Match one character against a [...] set (ranges a-z, leading ! or ^ negates,
+ * a leading ] is literal).
+ * @param p First character after the '['.
+ * @param end End of the pattern component.
+ * @param c Character to test.
+ * @param matched Set to 1 if c is in the set (0 otherwise).
+ * @return Characters consumed up to and including the ']', or 0 if there is none
+ * (the '[' is then an ordinary character).
+ */
+static int glob_bracket(const char *p, const char *end, unsigned char c, int *matched) {
+    const char *s = p;
+    int negate = 0, found = 0, first = 1;
+    if (s < end && (*s == '!' || *s == '^')) { negate = 1; s++; }
+    while (s < end) {
+        if (*s == GLOB_MARK) { s++; continue; } // A marked * or ? inside a set is literal
+        if (*s == ']' && !first) {
+            *matched = found != negate;
+            return s + 1 - p;
+        }
+        unsigned char lo = *s++, hi = lo;
+        first = 0;
+        if (s + 1 < end && *s == '-' && s[1] != ']') {
+            s++;
+            if (*s == GLOB_MARK && s + 1 < end) s++;
+            hi = *s++;
+        }
+        if (c >= lo && c <= hi) found = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Does a pattern component hold a live wildcard (marked * or ?, or a marked [
+ * with its closing ])? Components without one are plain names, no listing needed.
+ */
+static int glob_has_pattern(const char *pat, const char *end) {
+    int matched;
+    for (const char *p = pat; p + 1 < end; p++) {
+        if (*p != GLOB_MARK) continue;
+        if (p[1] != '[' || glob_bracket(p + 2, end, 0, &matched)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Match a name against one path component of a pattern. Only characters
+ * preceded by GLOB_MARK are special: * (any run), ? (one character) and [...].
+ * Backtracking only returns to the last *, so matching is linear for usual patterns.
+ * @param pat Start of the component.
+ * @param pat_end End of the component.
+ * @param name Directory entry name.
+ * @return 1 if the name matches.
+ */
+int glob_match(const char *pat, const char *pat_end, const char *name) {
+    const char *star_pat = NULL, *star_name = NULL;
+    while (*name) {
+        if (pat < pat_end && *pat == GLOB_MARK && pat + 1 < pat_end) {
+            if (pat[1] == '*') { pat += 2; star_pat = pat; star_name = name; continue; }
+            if (pat[1] == '?') { pat += 2; name++; continue; }
+            int matched = 0, len = glob_bracket(pat + 2, pat_end, (unsigned char)*name, &matched);
+            if (len && matched) { pat += 2 + len; name++; continue; }
+            if (!len && *name == '[') { pat += 2; name++; continue; } // Unclosed: a literal '['
+        } else if (pat < pat_end && *pat == *name) {
+            pat++; name++;
+            continue;
+        }
+        if (!star_pat) return 0;
+        pat = star_pat; // Let the last * take one more character
+        name = ++star_name;
+    }
+    while (pat + 1 < pat_end && pat[0] == GLOB_MARK && pat[1] == '*') pat += 2;
+    return pat == pat_end;
+}
+
+/**
+ * @brief Append an entry to a directory listing, doubling it inside the arena when full.
+ */
+static void glob_dir_add(glob_dir_t *dir, const char *name, unsigned char type, arena_t *arena) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+    if (dir->count == dir->capacity) {
+        int new_capacity = dir->capacity ? dir->capacity * 2 : 64;
+        glob_entry_t *new_entries = arena_alloc(arena, new_capacity * sizeof(glob_entry_t));
+        if (dir->count) memcpy(new_entries, dir->entries, dir->count * sizeof(glob_entry_t));
+        dir->entries = new_entries;
+        dir->capacity = new_capacity;
+    }
+    glob_entry_t *entry = &dir->entries[dir->count++];
+    entry->name = arena_strndup(arena, name, strlen(name));
+    entry->type = type;
+}
+
+/**
+ * @brief Listing of a directory, read at most once while a pipeline is expanded
+ * (`ls *.log *.gz` in a spool directory reads it once, not once per pattern).
+ * Linux: getdents64 straight into a large buffer, so a directory of 100k entries
+ * costs a few dozen system calls and no per-entry libc work. Elsewhere: readdir.
+ * @param path Directory as written in the pattern, with its trailing '/' ("" for the cwd).
+ * @param arena Arena for the listing (the line arena).
+ * @return The listing (empty if the directory cannot be read).
+ */
+glob_dir_t* glob_read_dir(const char *path, arena_t *arena) {
+    for (glob_dir_t *dir = glob_cache; dir; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) return dir;
+    }
+    glob_dir_t *dir = arena_alloc(arena, sizeof(glob_dir_t));
+    dir->path = arena_strndup(arena, path, strlen(path));
+    dir->entries = NULL;
+    dir->count = dir->capacity = 0;
+    dir->next = glob_cache;
+    glob_cache = dir;
+
+    // OS Concept: Directory I/O - A directory is read as a file of entries; O_DIRECTORY
+    // makes openat fail on anything else, so "file.c/*" simply matches nothing.
+    int fd = openat(AT_FDCWD, *path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return dir; // Missing or unreadable: no matches, like other shells
+#ifdef __linux__
+    static union { char bytes[GLOB_DIRENT_BUFFER]; struct glob_dirent64 align; } buffer;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer.bytes, sizeof(buffer.bytes))) > 0) {
+        for (long offset = 0; offset < n; ) {
+            struct glob_dirent64 *entry = (struct glob_dirent64 *)(buffer.bytes + offset);
+            glob_dir_add(dir, entry->d_name, entry->d_type, arena);
+            offset += entry->d_reclen;
+        }
+    }
+    close(fd);
+#else
+    DIR *stream = fdopendir(fd);
+    if (!stream) { close(fd); return dir; }
+    for (struct dirent *entry; (entry = readdir(stream)) != NULL; ) {
+        glob_dir_add(dir, entry->d_name, entry->d_type, arena);
+    }
+    closedir(stream);
+#endif
+    return dir;
+}
+
+/**
+ * @brief Is a listed entry a directory? Uses d_type when the filesystem provides it.
+ * @param path Path of the entry.
+ * @param entry The entry.
+ * @param follow 1 to count symlinks to directories (not done by **, which could loop).
+ */
+static int glob_is_dir(const char *path, const glob_entry_t *entry, int follow) {
+    if (entry->type == DT_DIR) return 1;
+    if (entry->type != DT_UNKNOWN && (entry->type != DT_LNK || !follow)) return 0;
+    struct stat st;
+    return fstatat(AT_FDCWD, path, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Record a matching path.
+ */
+static void glob_add_match(glob_matches_t *m, const char *path, size_t len) {
+    if (m->count == m->capacity) {
+        int new_capacity = m->capacity ? m->capacity * 2 : 16;
+        char **new_paths = arena_alloc(m->arena, new_capacity * sizeof(char *));
+        if (m->count) memcpy(new_paths, m->paths, m->count * sizeof(char *));
+        m->paths = new_paths;
+        m->capacity = new_capacity;
+    }
+    m->paths[m->count++] = arena_strndup(m->arena, path, len);
+}
+
+/**
+ * @brief Append a name to the path buffer.
+ * @return New length, or 0 if it would not fit in PATH_MAX.
+ */
+static size_t glob_path_append(char *path, size_t len, const char *name, size_t name_len) {
+    if (len + name_len + 2 > PATH_MAX) return 0;
+    memcpy(path + len, name, name_len);
+    path[len + name_len] = '\0';
+    return len + name_len;
+}
+
+/**
+ * @brief Match the rest of a pattern below a directory, one component at a time.
+ * Plain components are appended without reading anything; only components with
+ * wildcards list their directory. A ** component matches any number of directories.
+ * @param m Matches found so far.
+ * @param path Buffer (PATH_MAX) holding the directory reached so far.
+ * @param len Length of path.
+ * @param pat Rest of the pattern.
+ */
+static void glob_walk(glob_matches_t *m, char *path, size_t len, const char *pat) {
+    while (*pat == '/') { // Separators are kept as written
+        if (!(len = glob_path_append(path, len, "/", 1))) return;
+        pat++;
+    }
+    if (*pat == '\0') { if (len) glob_add_match(m, path, len); return; }
+    const char *end = strchr(pat, '/');
+    if (!end) end = pat + strlen(pat);
+    int last = (*end == '\0');
+
+    if (!glob_has_pattern(pat, end)) { // Plain name: no listing, just check it exists at the end
+        size_t new_len = len;
+        for (const char *p = pat; p < end; p++) {
+            if (*p != GLOB_MARK && !(new_len = glob_path_append(path, new_len, p, 1))) return;
+        }
+        struct stat st;
+        if (!last) glob_walk(m, path, new_len, end);
+        else if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0) glob_add_match(m, path, new_len);
+        path[len] = '\0';
+        return;
+    }
+
+    int globstar = (end - pat == 4 && pat[0] == GLOB_MARK && pat[1] == '*' && pat[2] == GLOB_MARK && pat[3] == '*');
+    if (globstar && !last) glob_walk(m, path, len, end + 1); // ** matching no directory at all
+
+    glob_dir_t *dir = glob_read_dir(path, m->arena);
+    for (int i = 0; i < dir->count; i++) {
+        const glob_entry_t *entry = &dir->entries[i];
+        // Wildcards never match a leading '.'; the pattern has to spell it out
+        if (entry->name[0] == '.' && pat[0] != '.') continue;
+        if (!globstar && !glob_match(pat, end, entry->name)) continue;
+        size_t new_len = glob_path_append(path, len, entry->name, strlen(entry->name));
+        if (!new_len) continue;
+        if (globstar) {
+            if (last) glob_add_match(m, path, new_len); // Trailing **: every file and directory
+            if (glob_is_dir(path, entry, 0) && (new_len = glob_path_append(path, new_len, "/", 1))) {
+                glob_walk(m, path, new_len, pat);
+            }
+        } else if (last) {
+            glob_add_match(m, path, new_len);
+        } else if (glob_is_dir(path, entry, 1)) {
+            glob_walk(m, path, new_len, end);
+        }
+        path[len] = '\0';
+    }
+}
+
+/**
+ * @brief qsort comparator for matched paths.
+ */
+static int glob_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @brief Pathname expansion of one field: *, ?, [...] and ** are matched against the
+ * file system and the sorted matches become arguments.
+ * @param word The field, with GLOB_MARKs on its live pattern characters.
+ * @param arena Arena for listings and matches (the line arena).
+ * @param out Stage receiving the matches.
+ * @return Number of matches added (0: the caller keeps the word as written).
+ */
+int glob_expand_word(const char *word, arena_t *arena, command_t *out) {
+    if (!glob_has_pattern(word, word + strlen(word))) return 0;
+    glob_matches_t m = { NULL, 0, 0, arena };
+    char path[PATH_MAX];
+    path[0] = '\0';
+    glob_walk(&m, path, 0, word);
+    if (m.count == 0) return 0;
+    qsort(m.paths, m.count, sizeof(char *), glob_compare);
+    for (int i = 0; i < m.count; i++) command_add_arg(out, arena, m.paths[i]);
+    return m.count;
+}
+
+// --- Shell Variable Functions ---
+
+/**
+ * @brief Is this a valid variable name ([A-Za-z_][A-Za-z0-9_]*)?
+ * @param name Characters (need not be NUL-terminated).
+ * @param len Number of characters.
+ */
+int is_valid_name(const char *name, size_t len) {
+    if (len == 0 || (name[0] != '_' && !isalpha((unsigned char)name[0]))) return 0;
+    for (size_t i = 1; i < len; i++) {
+        if (name[i] != '_' && !isalnum((unsigned char)name[i])) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Double the bucket array of the variable table and re-link every variable.
+ */
+static void vars_grow() {
+    int new_count = vars.bucket_count ? vars.bucket_count * 2 : VAR_HASH_INITIAL;
+    shell_var_t **new_buckets = calloc(new_count, sizeof(shell_var_t *));
+    if (!new_buckets) { perror("ca$h: calloc failed for variable table"); exit(EXIT_FAILURE); }
+    for (int i = 0; i < vars.bucket_count; i++) {
+        shell_var_t *var = vars.buckets[i];
+        while (var) {
+            shell_var_t *next = var->next;
+            unsigned long b = hash_name(var->name, var->name_len) & (new_count - 1);
+            var->next = new_buckets[b];
+            new_buckets[b] = var;
+            var = next;
+        }
+    }
+    free(vars.buckets);
+    vars.buckets = new_buckets;
+    vars.bucket_count = new_count;
+}
+
+/**
+ * @brief Import the process environment as exported variables at startup. Names and
+ * values keep pointing into environ (nothing is copied until a variable changes), and
+ * environ itself serves as envp until an exported variable changes.
+ */
+void vars_init() {
+    extern char **environ;
+    vars_grow();
+    for (char **env = environ; env && *env; env++) {
+        const char *eq = strchr(*env, '=');
+        if (!eq || !is_valid_name(*env, eq - *env)) continue;
+        shell_var_t *var = var_intern(*env, eq - *env);
+        var->value = (char *)eq + 1;
+        var->value_cap = 0;
+        var->exported = 1;
+    }
+    vars.envp = environ;
+    vars.envp_owned = 0;
+    vars.envp_dirty = 0;
+}
+
+/**
+ * @brief Find a variable.
+ * @param name Name (need not be NUL-terminated).
+ * @param len Length of name.
+ * @return The variable (possibly unset), or NULL if it was never created.
+ */
+shell_var_t* var_lookup(const char *name, size_t len) {
+    unsigned long b = hash_name(name, len) & (vars.bucket_count - 1);
+    for (shell_var_t *var = vars.buckets[b]; var; var = var->next) {
+        if (var->name_len == len && memcmp(var->name, name, len) == 0) return var;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find a variable, creating it (unset, not exported) if it does not exist.
+ * @param name Name (need not be NUL-terminated; copied into the variable arena if new).
+ * @param len Length of name.
+ * @return The variable.
+ */
+shell_var_t* var_intern(const char *name, size_t len) {
+    shell_var_t *var = var_lookup(name, len);
+    if (var) return var;
+    if (vars.count >= vars.bucket_count) vars_grow(); // Keep chains short
+    var = arena_alloc(&vars.arena, sizeof(shell_var_t));
+    var->name = arena_strndup(&vars.arena, name, len);
+    var->name_len = len;
+    var->value = NULL;
+    var->value_cap = 0;
+    var->exported = 0;
+    unsigned long b = hash_name(name, len) & (vars.bucket_count - 1);
+    var->next = vars.buckets[b];
+    vars.buckets[b] = var;
+    vars.count++;
+    return var;
+}
+
+/**
+ * @brief Give a variable a new value, reusing its storage if the value fits.
+ * Marks the environment for rebuilding if the variable is exported, and empties the
+ * command hash table if it is PATH.
+ * @param var The variable.
+ * @param value New value (copied), or NULL to unset it.
+ */
+void var_assign_value(shell_var_t *var, const char *value) {
+    if (var->exported) vars.envp_dirty = 1;
+    if (var->name_len == 4 && memcmp(var->name, "PATH", 4) == 0) flush_command_hash(); // Paths found under the old $PATH
+    if (value == NULL) { var->value = NULL; return; }
+    size_t len = strlen(value);
+    if (len + 1 > var->value_cap) {
+        // OS Concept: Memory Allocation - Grow geometrically, so a variable that keeps
+        // changing in a loop settles into one block of the arena.
+        size_t cap = var->value_cap ? var->value_cap * 2 : 16;
+        while (cap < len + 1) cap *= 2;
+        var->value = arena_alloc(&vars.arena, cap);
+        var->value_cap = cap;
+    }
+    memmove(var->value, value, len + 1);
+}
+
+/**
+ * @brief Set a variable by name (created if needed; the export flag is kept).
+ * @param name NUL-terminated name.
+ * @param value New value (copied).
+ */
+void var_set(const char *name, const char *value) {
+    var_assign_value(var_intern(name, strlen(name)), value);
+}
+
+/**
+ * @brief Value of a variable.
+ * @param name NUL-terminated name.
+ * @return The value, or NULL if the variable is unset.
+ */
+const char* var_get(const char *name) {
+    shell_var_t *var = var_lookup(name, strlen(name));
+    return var ? var->value : NULL;
+}
+
+/**
+ * @brief Apply a NAME=value word.
+ * @param word The (expanded) assignment word.
+ * @param export 1 to also export the variable.
+ */
+void var_assign_word(const char *word, int export) {
+    const char *eq = strchr(word, '=');
+    shell_var_t *var = var_intern(word, eq - word);
+    if (export) var_export(var, 1);
+    var_assign_value(var, eq + 1);
+}
+
+/**
+ * @brief Set or clear a variable's export flag.
+ * @param var The variable.
+ * @param exported 1 to export it, 0 to stop exporting it.
+ */
+void var_export(shell_var_t *var, int exported) {
+    if (var->exported != exported && var->value) vars.envp_dirty = 1;
+    var->exported = exported;
+}
+
+/**
+ * @brief Unset a variable (its entry stays, for reuse if it is set again).
+ * @param var The variable.
+ */
+void var_unset(shell_var_t *var) {
+    var_assign_value(var, NULL);
+    var->exported = 0;
+}
+
+/**
+ * @brief Environment for new programs. Rebuilt from the exported variables only if one
+ * of them changed since the last call: one allocation holds the array and the strings.
+ * @return NULL-terminated NAME=value array.
+ */
+char** shell_envp() {
+    if (!vars.envp_dirty) return vars.envp;
+    size_t count = 0, bytes = 0;
+    for (int i = 0; i < vars.bucket_count; i++) {
+        for (shell_var_t *var = vars.buckets[i]; var; var = var->next) {
+            if (!var->exported || !var->value) continue;
+            count++;
+            bytes += var->name_len + strlen(var->value) + 2;
+        }
+    }
+    char **envp = malloc((count + 1) * sizeof(char *) + bytes);
+    if (!envp) { perror("ca$h: malloc failed for environment"); return vars.envp; }
+    char *text = (char *)(envp + count + 1);
+    size_t n = 0;
+    for (int i = 0; i < vars.bucket_count; i++) {
+        for (shell_var_t *var = vars.buckets[i]; var; var = var->next) {
+            if (!var->exported || !var->value) continue;
+            envp[n++] = text;
+            memcpy(text, var->name, var->name_len);
+            text += var->name_len;
+            *text++ = '=';
+            size_t len = strlen(var->value) + 1;
+            memcpy(text, var->value, len);
+            text += len;
+        }
+    }
+    envp[n] = NULL;
+    if (vars.envp_owned) free(vars.envp);
+    vars.envp = envp;
+    vars.envp_owned = 1;
+    vars.envp_dirty = 0;
+    return envp;
+}
+
+/**
+ * @brief Environment for one external command: the shell's, plus its prefix
+ * assignments (A=1 cmd), which replace variables of the same name.
+ * @param cmd The command.
+ * @param arena Arena for a one-off array (only built if there are assignments).
+ * @return NULL-terminated NAME=value array.
+ */
+char** command_envp(const command_t *cmd, arena_t *arena) {
+    char **base = shell_envp();
+    if (cmd->nassigns == 0) return base;
+    size_t count = 0;
+    while (base[count]) count++;
+    char **envp = arena_alloc(arena, (count + cmd->nassigns + 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t name_len = strcspn(base[i], "=");
+        int replaced = 0;
+        for (int a = 0; a < cmd->nassigns && !replaced; a++) {
+            replaced = strncmp(cmd->assigns[a], base[i], name_len) == 0 && cmd->assigns[a][name_len] == '=';
+        }
+        if (!replaced) envp[n++] = base[i];
+    }
+    for (int a = 0; a < cmd->nassigns; a++) envp[n++] = cmd->assigns[a];
+    envp[n] = NULL;
+    return envp;
+}
+
+/**
+ * @brief Apply a built-in's prefix assignments (exported while it runs), remembering
+ * what they replace.
+ * @param cmd The command.
+ * @param arena Arena for the saved values.
+ * @return Saved state for var_pop_assignments.
+ */
+var_saved_t* var_push_assignments(const command_t *cmd, arena_t *arena) {
+    var_saved_t *saved = arena_alloc(arena, cmd->nassigns * sizeof(var_saved_t));
+    for (int i = 0; i < cmd->nassigns; i++) {
+        const char *word = cmd->assigns[i];
+        shell_var_t *var = var_intern(word, strchr(word, '=') - word);
+        saved[i].var = var;
+        saved[i].value = var->value ? arena_strndup(arena, var->value, strlen(var->value)) : NULL;
+        saved[i].exported = var->exported;
+        var_assign_word(word, 1);
+    }
+    return saved;
+}
+
+/**
+ * @brief Undo var_push_assignments, in reverse order (A=1 A=2 restores the original A).
+ */
+void var_pop_assignments(var_saved_t *saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        var_assign_value(saved[i].var, saved[i].value);
+        var_export(saved[i].var, saved[i].exported);
+    }
+}
+
+/**
+ * @brief Implements 'export [NAME[=value] ...]' and 'export -p' (list exported variables).
+ * @return 0, or 1 if a name was not valid.
+ */
+int builtin_export(char **args) {
+    if (args[1] == NULL || (strcmp(args[1], "-p") == 0 && args[2] == NULL)) {
+        // Collect and sort, so the listing does not depend on hash order
+        shell_var_t **list = malloc((vars.count > 0 ? vars.count : 1) * sizeof(shell_var_t *));
+        if (!list) { perror("ca$h: export"); return 1; }
+        int n = 0;
+        for (int i = 0; i < vars.bucket_count; i++) {
+            for (shell_var_t *var = vars.buckets[i]; var; var = var->next) {
+                if (var->exported) list[n++] = var;
+            }
+        }
+        for (int i = 1; i < n; i++) { // Insertion sort: environments are small
+            shell_var_t *var = list[i];
+            int j = i - 1;
+            while (j >= 0) {
+                size_t len = list[j]->name_len < var->name_len ? list[j]->name_len : var->name_len;
+                int cmp = memcmp(list[j]->name, var->name, len);
+                if (cmp < 0 || (cmp == 0 && list[j]->name_len <= var->name_len)) break;
+                list[j + 1] = list[j];
+                j--;
+            }
+            list[j + 1] = var;
+        }
+        for (int i = 0; i < n; i++) {
+            out_puts("export ");
+            out_write(list[i]->name, list[i]->name_len);
+            if (list[i]->value) {
+                out_puts("=\"");
+                for (const char *v = list[i]->value; *v; v++) {
+                    if (strchr("\"\\$`", *v)) out_putc('\\');
+                    out_putc(*v);
+                }
+                out_putc('"');
+            }
+            out_putc('\n');
+        }
+        free(list);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        const char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!is_valid_name(args[i], len)) { fprintf(stderr, "ca$h: export: `%s': not a valid identifier\n", args[i]); status = 1; continue; }
+        if (eq) var_assign_word(args[i], 1);
+        else var_export(var_intern(args[i], len), 1);
+    }
+    return status;
+}
+
+/**
+ * @brief Implements 'unset NAME ...' and 'unset -f NAME ...' (functions).
+ * @return 0, or 1 if a name was not valid.
+ */
+int builtin_unset(char **args) {
+    int status = 0;
+    if (args[1] && strcmp(args[1], "-f") == 0) {
+        for (int i = 2; args[i]; i++) undefine_function(args[i]);
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        if (!is_valid_name(args[i], strlen(args[i]))) { fprintf(stderr, "ca$h: unset: `%s': not a valid identifier\n", args[i]); status = 1; continue; }
+        shell_var_t *var = var_lookup(args[i], strlen(args[i]));
+        if (var) var_unset(var);
+    }
+    return status;
+}
+
+// --- Parallel Runner Functions ---
+
+/**
+ * @brief Write a whole buffer to a descriptor, retrying short writes.
+ * @return 1 on success, 0 on a write error.
+ */
+static int parallel_write(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Output entry of an input that has been started and not written yet (-k).
+ * Entries live in a ring indexed by input number that doubles when it is full.
+ */
+static parallel_output_t* parallel_output(parallel_t *p, long index) {
+    return &p->ring[index & (p->ring_cap - 1)];
+}
+
+/**
+ * @brief Make room in the output ring for one more started input (-k).
+ * @return 1 on success, 0 on allocation failure (reported).
+ */
+static int parallel_ring_reserve(parallel_t *p) {
+    if ((size_t)(p->started - p->emitted) < p->ring_cap) return 1;
+    size_t cap = p->ring_cap ? p->ring_cap * 2 : 64;
+    parallel_output_t *ring = calloc(cap, sizeof(parallel_output_t));
+    if (!ring) { perror("ca$h: parallel: calloc failed for output buffers"); return 0; }
+    for (long i = p->emitted; i < p->started; i++) ring[i & (cap - 1)] = *parallel_output(p, i);
+    free(p->ring);
+    p->ring = ring;
+    p->ring_cap = cap;
+    return 1;
+}
+
+/**
+ * @brief Write every finished output that is next in input order (-k). The oldest
+ * running input has nothing buffered: its output goes straight to stdout as it comes.
+ */
+static void parallel_emit_ready(parallel_t *p) {
+    while (p->emitted < p->started) {
+        parallel_output_t *out = parallel_output(p, p->emitted);
+        if (out->len) parallel_write(STDOUT_FILENO, out->data, out->len);
+        out->len = 0;
+        if (!out->done) break; // Now the oldest input: it streams from here on
+        free(out->data);
+        memset(out, 0, sizeof(*out));
+        p->emitted++;
+    }
+}
+
+/**
+ * @brief Start the command for one input in a free worker slot. Every {} in the
+ * command is replaced by the input; without any {} the input is added as the last argument.
+ * @param p The run.
+ * @param worker Free slot.
+ * @param input The input.
+ * @return 1 if the worker started, 0 if it could not (reported).
+ */
+static int parallel_start(parallel_t *p, parallel_worker_t *worker, const char *input) {
+    arena_mark_t mark = arena_mark(&line_arena); // The argv only lives until the child has it
+    command_t cmd;
+    command_init(&cmd, &line_arena);
+    int substituted = 0;
+    for (int i = 0; i < p->ncommand; i++) {
+        const char *word = p->command[i], *brace = strstr(word, "{}");
+        if (!brace) { command_add_arg(&cmd, &line_arena, (char *)word); continue; }
+        word_buf_t buf = { NULL, 0, 0, &line_arena };
+        for (; brace; word = brace + 2, brace = strstr(word, "{}")) {
+            word_buf_append(&buf, word, brace - word);
+            word_buf_append(&buf, input, strlen(input));
+        }
+        word_buf_append(&buf, word, strlen(word));
+        command_add_arg(&cmd, &line_arena, buf.data);
+        substituted = 1;
+    }
+    if (!substituted) command_add_arg(&cmd, &line_arena, arena_strndup(&line_arena, input, strlen(input)));
+    cmd.builtin = find_builtin(cmd.args[0]);
+
+    int pipefd[2] = { -1, -1 };
+    if (p->keep_order) {
+        if (!parallel_ring_reserve(p)) { arena_release(&line_arena, mark); return 0; }
+        if (pipe(pipefd) < 0) { perror("ca$h: parallel: pipe failed"); arena_release(&line_arena, mark); return 0; }
+        fcntl(pipefd[READ_END], F_SETFD, FD_CLOEXEC); // Later workers must not hold it
+    }
+    spawn_io_t io = { .stdin_fd = p->stdin_fd, .stdout_fd = pipefd[WRITE_END], .close_fd = pipefd[READ_END],
+                      .pgid = p->pgid, .envp = shell_envp() };
+    // Built-ins and functions run in a forked copy of the shell, like pipeline stages
+    int in_shell = cmd.builtin || (function_count && find_function(cmd.args[0]));
+    pid_t pid = in_shell ? fork_builtin(&cmd, &io, NULL) : spawn_command(cmd.args, &io, NULL);
+    arena_release(&line_arena, mark);
+    if (pipefd[WRITE_END] != -1) close(pipefd[WRITE_END]);
+    if (pid < 0) {
+        if (pipefd[READ_END] != -1) close(pipefd[READ_END]);
+        return 0;
+    }
+    worker->pid = pid;
+    worker->index = p->started++;
+    worker->out_fd = pipefd[READ_END];
+    worker->exited = 0;
+    return 1;
+}
+
+/**
+ * @brief A worker exited and its output is closed: record its status and free the slot.
+ */
+static void parallel_finish(parallel_t *p, parallel_worker_t *worker) {
+    if (p->keep_order) {
+        parallel_output(p, worker->index)->done = 1;
+        parallel_emit_ready(p);
+    }
+    int code = wait_status_exit_code(worker->status);
+    if (code != 0 && p->status == 0) p->status = code;
+    if (code != 0 && p->halt) p->stopping = 1;
+    worker->pid = 0;
+    p->running--;
+}
+
+/**
+ * @brief Read what a worker wrote to its pipe (-k). The oldest running input writes
+ * through; the others are buffered until their turn.
+ * @return 1 while the pipe is open, 0 at EOF.
+ */
+static int parallel_read_output(parallel_t *p, parallel_worker_t *worker) {
+    static char chunk[PIPE_READ_CHUNK];
+    ssize_t n = read(worker->out_fd, chunk, sizeof(chunk));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 1;
+    if (n <= 0) { close(worker->out_fd); worker->out_fd = -1; return 0; }
+    if (worker->index == p->emitted) { parallel_write(STDOUT_FILENO, chunk, n); return 1; }
+    parallel_output_t *out = parallel_output(p, worker->index);
+    if (out->len + n > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 4096;
+        while (cap < out->len + n) cap *= 2;
+        char *data = realloc(out->data, cap);
+        if (!data) { perror("ca$h: parallel: realloc failed for output"); return 1; }
+        out->data = data;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, chunk, n);
+    out->len += n;
+    return 1;
+}
+
+/**
+ * @brief The worker pool, run by the coordinator process: keeps up to p->jobs
+ * commands alive and starts the next input whenever SIGCHLD (child_event_fd)
+ * reports that one has finished.
+ * @param p The run.
+ * @return 0 if every command succeeded, else the exit status of the first that failed.
+ */
+int parallel_run(parallel_t *p) {
+    line_reader_t reader = { .fd = STDIN_FILENO, .buf = NULL, .cap = 0, .len = 0, .pos = 0, .eof = 0 };
+    p->workers = calloc(p->jobs, sizeof(parallel_worker_t));
+    struct pollfd *fds = calloc(p->jobs + 1, sizeof(struct pollfd));
+    if (!p->workers || !fds) { perror("ca$h: parallel: calloc failed"); return 1; }
+    int next_input = 0, inputs_left = 1;
+
+    while (1) {
+        // Fill the free slots
+        for (int i = 0; i < p->jobs && inputs_left && !p->stopping; i++) {
+            if (p->workers[i].pid) continue;
+            const char *input = p->inputs ? (next_input < p->ninputs ? p->inputs[next_input++] : NULL)
+                                          : line_reader_next(&reader);
+            if (!input) { inputs_left = 0; break; }
+            if (parallel_start(p, &p->workers[i], input)) p->running++;
+            else if (p->status == 0) { p->status = 1; if (p->halt) p->stopping = 1; }
+        }
+        if (p->running == 0) break;
+        if (p->stopping) { // --halt: stop the others too
+            for (int i = 0; i < p->jobs; i++) {
+                if (p->workers[i].pid && !p->workers[i].exited) kill(p->workers[i].pid, SIGTERM);
+            }
+        }
+
+        // OS Concept: I/O Multiplexing - Sleep until a child exits or writes output
+        int nfds = 0;
+        if (child_event_fd >= 0) fds[nfds++] = (struct pollfd){ .fd = child_event_fd, .events = POLLIN };
+        for (int i = 0; i < p->jobs; i++) {
+            if (p->workers[i].pid && p->workers[i].out_fd >= 0) fds[nfds++] = (struct pollfd){ .fd = p->workers[i].out_fd, .events = POLLIN };
+        }
+        if (poll(fds, nfds, child_event_fd >= 0 ? -1 : 100) < 0 && errno != EINTR) { perror("ca$h: parallel: poll failed"); break; }
+        drain_child_events();
+
+        for (int i = 0; i < p->jobs; i++) {
+            parallel_worker_t *worker = &p->workers[i];
+            if (!worker->pid || worker->out_fd < 0) continue;
+            for (int f = 0; f < nfds; f++) {
+                if (fds[f].fd == worker->out_fd && fds[f].revents) { parallel_read_output(p, worker); break; }
+            }
+        }
+        // OS Concept: Non-blocking Wait - Reap every worker that has exited
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < p->jobs; i++) {
+                if (p->workers[i].pid == pid) { p->workers[i].exited = 1; p->workers[i].status = status; break; }
+            }
+        }
+        for (int i = 0; i < p->jobs; i++) {
+            parallel_worker_t *worker = &p->workers[i];
+            if (!worker->pid || !worker->exited) continue;
+            while (worker->out_fd >= 0 && parallel_read_output(p, worker)) { } // Rest of its output
+            parallel_finish(p, worker);
+        }
+    }
+    if (p->keep_order) parallel_emit_ready(p);
+    free(reader.buf);
+    free(fds);
+    return p->status;
+}
+
+/**
+ * @brief Join words with single spaces (job titles of commands a built-in starts).
+ * @param words NULL-terminated words.
+ * @param arena Arena for the result.
+ * @return The joined string.
+ */
+char* join_words(char **words, arena_t *arena) {
+    size_t len = 0;
+    for (char **word = words; *word; word++) len += strlen(*word) + 1;
+    char *text = arena_alloc(arena, len + 1), *t = text;
+    *t = '\0';
+    for (char **word = words; *word; word++) t += sprintf(t, "%s%s", word == words ? "" : " ", *word);
+    return text;
+}
+
+/**
+ * @brief Implements 'parallel [-j N] [-k] [--halt] command [args] [::: input ...]':
+ * run the command once per input (the words after :::, or else the lines of stdin)
+ * with at most N running at a time (default: the online CPUs). -k writes the outputs
+ * in input order; --halt stops everything at the first failure. The pool runs in one
+ * coordinator process, so the whole run is a single job (one entry in `jobs`, one
+ * Ctrl-Z / Ctrl-C for all of it) and never fills the job table.
+ * @return 0 if every command succeeded, else the status of the first failure (2: usage).
+ */
+int builtin_parallel(char **args) {
+    parallel_t p;
+    memset(&p, 0, sizeof(p));
+    p.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (p.jobs < 1) p.jobs = 1;
+    p.stdin_fd = -1;
+
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) { i++; break; }
+        if (strcmp(args[i], "-k") == 0) { p.keep_order = 1; continue; }
+        if (strcmp(args[i], "--halt") == 0) { p.halt = 1; continue; }
+        if (strncmp(args[i], "-j", 2) == 0) {
+            const char *value = args[i][2] ? args[i] + 2 : args[++i];
+            char *end;
+            long n = value ? strtol(value, &end, 10) : 0;
+            if (!value || *value == '\0' || *end != '\0' || n < 1) {
+                fprintf(stderr, "ca$h: parallel: -j: %s: invalid number of jobs\n", value ? value : "(missing)");
+                return 2;
+            }
+            p.jobs = n;
+            continue;
+        }
+        fprintf(stderr, "ca$h: parallel: %s: invalid option\n", args[i]);
+        fprintf(stderr, "ca$h: parallel: Usage: parallel [-j N] [-k] [--halt] command [args] [::: input ...]\n");
+        return 2;
+    }
+    p.command = args + i;
+    while (args[i] && strcmp(args[i], ":::") != 0) i++;
+    p.ncommand = args + i - p.command;
+    if (p.ncommand == 0) {
+        fprintf(stderr, "ca$h: parallel: Usage: parallel [-j N] [-k] [--halt] command [args] [::: input ...]\n");
+        return 2;
+    }
+    if (args[i]) { // ::: input ...
+        p.inputs = args + i + 1;
+        while (p.inputs[p.ninputs]) p.ninputs++;
+    }
+
+    char *title = join_words(args, &line_arena); // Job title: the command line as typed
+
+    // OS Concept: Process Creation - A coordinator process owns the workers: it leads
+    // their process group, so the run is stopped, resumed or interrupted as one job.
+    int interactive = shell_is_interactive;
+    fflush(stdout);
+    out_flush();
+    pid_t pid = fork();
+    if (pid < 0) { perror("ca$h: parallel: fork failed"); return 1; }
+    if (pid == 0) {
+        if (interactive && setpgid(0, 0) < 0) { perror("ca$h: child setpgid failed"); _exit(EXIT_FAILURE); }
+        // Ctrl-C / Ctrl-Z act on the coordinator too; SIGCHLD stays on child_event_fd
+        signal(SIGINT, SIG_DFL); signal(SIGQUIT, SIG_DFL); signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL); signal(SIGTTOU, SIG_DFL);
+        shell_is_interactive = 0;
+        if (child_event_fd < 0) init_child_events(); // Scripts have no SIGCHLD fd yet
+        p.pgid = interactive ? getpid() : -1;
+        if (!p.inputs) { // Workers must not eat the input lines
+            p.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        _exit(parallel_run(&p));
+    }
+    if (interactive && setpgid(pid, pid) < 0 && errno != EACCES && errno != ESRCH) perror("ca$h: parent setpgid failed");
+
+    job_t *job = create_child_job(pid, title, "parallel", 0);
+    if (!job) return 1;
+    return interactive ? put_job_in_foreground(job, 0) : wait_for_job(job);
+}
+
+// --- Command Result Cache Functions ---
+
+/**
+ * @brief Unlink an entry from its bucket and the LRU list, and free it.
+ */
+static void result_cache_remove(cache_entry_t *entry) {
+    cache_entry_t **link = &result_cache.buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next; else result_cache.lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev; else result_cache.lru_tail = entry->lru_prev;
+    result_cache.count--;
+    result_cache.bytes -= entry->key_len + entry->len;
+    free(entry->key);
+    free(entry->output);
+    free(entry);
+}
+
+/**
+ * @brief Put an entry at the most recently used end of the LRU list.
+ */
+static void result_cache_touch(cache_entry_t *entry) {
+    if (result_cache.lru_head == entry) return;
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev; else if (result_cache.lru_tail == entry) result_cache.lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = result_cache.lru_head;
+    if (result_cache.lru_head) result_cache.lru_head->lru_prev = entry;
+    result_cache.lru_head = entry;
+    if (!result_cache.lru_tail) result_cache.lru_tail = entry;
+}
+
+/**
+ * @brief Find a live entry (an expired one is dropped on the way).
+ * @param key Key bytes.
+ * @param len Key length.
+ * @param hash hash_name() of the key.
+ * @return The entry, or NULL.
+ */
+cache_entry_t* result_cache_lookup(const char *key, size_t len, unsigned long hash) {
+    for (cache_entry_t *entry = result_cache.buckets[hash % CACHE_BUCKETS]; entry; entry = entry->next) {
+        if (entry->hash != hash || entry->key_len != len || memcmp(entry->key, key, len) != 0) continue;
+        if (entry->expires && entry->expires <= time(NULL)) { result_cache_remove(entry); return NULL; }
+        result_cache_touch(entry);
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Store a result, evicting least recently used entries past CACHE_ENTRIES_MAX
+ * or CACHE_BYTES_MAX. Takes ownership of output.
+ * @return The entry, or NULL if the result was too large or memory ran out (output freed).
+ */
+cache_entry_t* result_cache_insert(const char *key, size_t len, unsigned long hash, char *output, size_t out_len, int status, time_t expires) {
+    if (len + out_len > CACHE_BYTES_MAX) { free(output); return NULL; }
+    cache_entry_t *old = NULL;
+    for (cache_entry_t *entry = result_cache.buckets[hash % CACHE_BUCKETS]; entry && !old; entry = entry->next) {
+        if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0) old = entry;
+    }
+    if (old) result_cache_remove(old);
+    while (result_cache.lru_tail && (result_cache.count >= CACHE_ENTRIES_MAX || result_cache.bytes + len + out_len > CACHE_BYTES_MAX)) {
+        result_cache_remove(result_cache.lru_tail);
+    }
+
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    char *key_copy = malloc(len);
+    if (!entry || !key_copy) { perror("ca$h: cache: malloc failed"); free(entry); free(key_copy); free(output); return NULL; }
+    memcpy(key_copy, key, len);
+    entry->key = key_copy;
+    entry->key_len = len;
+    entry->hash = hash;
+    entry->output = output;
+    entry->len = out_len;
+    entry->status = status;
+    entry->expires = expires;
+    unsigned long b = hash % CACHE_BUCKETS;
+    entry->next = result_cache.buckets[b];
+    result_cache.buckets[b] = entry;
+    result_cache.count++;
+    result_cache.bytes += len + out_len;
+    result_cache_touch(entry);
+    return entry;
+}
+
+/**
+ * @brief Path of the on-disk entry for a key: $XDG_CACHE_HOME/cash/<hash>
+ * ($HOME/.cache/cash without XDG_CACHE_HOME). Creates the directory if needed.
+ * @param path Output buffer (PATH_MAX).
+ * @param hash hash_name() of the key.
+ * @return 1 on success, 0 if there is no usable cache directory.
+ */
+static int cache_disk_path(char *path, unsigned long hash) {
+    const char *base = var_get("XDG_CACHE_HOME"), *home = var_get("HOME");
+    int n;
+    if (base && *base) n = snprintf(path, PATH_MAX, "%s/cash", base);
+    else if (home) n = snprintf(path, PATH_MAX, "%s/.cache/cash", home);
+    else return 0;
+    if (n <= 0 || n >= PATH_MAX - 32) return 0;
+    // mkdir -p: each missing level, owner-only for the last one
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) return 0;
+    snprintf(path + n, PATH_MAX - n, "/%016lx", hash);
+    return 1;
+}
+
+/**
+ * @brief Load an entry from the disk tier into memory, if one exists for the key,
+ * belongs to it (the full key is stored and compared) and has not expired.
+ * @return The entry (now also in memory), or NULL.
+ */
+cache_entry_t* cache_disk_load(const char *key, size_t len, unsigned long hash) {
+    char path[PATH_MAX];
+    if (!cache_disk_path(path, hash)) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    cache_file_header_t header;
+    char *buf = NULL;
+    cache_entry_t *entry = NULL;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.key_len != len || header.out_len > CACHE_BYTES_MAX) goto done;
+    if (header.expires && header.expires <= (long long)time(NULL)) { unlink(path); goto done; }
+    buf = malloc(len + header.out_len + 1);
+    if (!buf) goto done;
+    size_t want = len + header.out_len, got = 0;
+    while (got < want) {
+        ssize_t n = read(fd, buf + got, want - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto done;
+        got += n;
+    }
+    if (memcmp(buf, key, len) != 0) goto done; // Another key with the same hash
+    memmove(buf, buf + len, header.out_len); // The output becomes the buffer
+    entry = result_cache_insert(key, len, hash, buf, header.out_len, header.status, header.expires);
+    buf = NULL; // Owned (or freed) by the cache now
+done:
+    free(buf);
+    close(fd);
+    return entry;
+}
+
+/**
+ * @brief Write an entry to the disk tier: a temporary file renamed into place, so
+ * other shells reading the cache never see half an entry.
+ */
+void cache_disk_store(const cache_entry_t *entry) {
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    if (!cache_disk_path(path, entry->hash)) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    cache_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.expires = entry->expires;
+    header.status = entry->status;
+    header.key_len = entry->key_len;
+    header.out_len = entry->len;
+    int ok = parallel_write(fd, (const char *)&header, sizeof(header)) && parallel_write(fd, entry->key, entry->key_len) &&
+             parallel_write(fd, entry->output, entry->len);
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) unlink(tmp);
+}
+
+// Output of a command being cached, as it arrives
+typedef struct {
+    char *data; // Captured bytes (allocated; NULL once it is too large to keep)
+    size_t len; // Bytes captured (CACHE_BYTES_MAX + 1 once it is too large)
+    size_t cap; // Allocated bytes
+} cache_capture_t;
+
+/**
+ * @brief run_piped_job callback of 'cache': pass the chunk through to the built-in's
+ * stdout and keep a copy, until the output grows past CACHE_BYTES_MAX.
+ */
+static void cache_capture_chunk(void *ctx, const char *data, size_t n) {
+    cache_capture_t *out = ctx;
+    out_write(data, n);
+    if (out->len > CACHE_BYTES_MAX) return; // Too large to keep: only passed through
+    if (out->len + n > CACHE_BYTES_MAX) { free(out->data); out->data = NULL; out->len = CACHE_BYTES_MAX + 1; return; }
+    if (out->len + n > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 4096;
+        while (cap < out->len + n) cap *= 2;
+        char *grown = realloc(out->data, cap);
+        if (!grown) { perror("ca$h: cache: realloc failed"); free(out->data); out->data = NULL; out->len = CACHE_BYTES_MAX + 1; return; }
+        out->data = grown;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, n);
+    out->len += n;
+}
+
+/**
+ * @brief Run a command with its stdout captured through a pipe, copying it to the
+ * built-in's stdout as it arrives. The command is a foreground job like any other.
+ * @param args Command and arguments.
+ * @param output Set to the captured bytes (allocated; NULL if it grew past CACHE_BYTES_MAX).
+ * @param len Set to the number of bytes.
+ * @param status Set to the command's exit status.
+ * @return 1 if the command ran to completion, 0 if it did not start or was stopped.
+ */
+static int cache_run_command(char **args, char **output, size_t *len, int *status) {
+    *output = NULL;
+    *len = 0;
+    *status = 1;
+    command_t cmd;
+    command_init(&cmd, &line_arena);
+    for (int i = 0; args[i]; i++) command_add_arg(&cmd, &line_arena, args[i]);
+    cmd.builtin = find_builtin(cmd.args[0]);
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0) { perror("ca$h: cache: pipe failed"); return 0; }
+    fcntl(pipefd[READ_END], F_SETFD, FD_CLOEXEC);
+    spawn_io_t io = { .stdin_fd = -1, .stdout_fd = pipefd[WRITE_END], .close_fd = pipefd[READ_END],
+                      .pgid = shell_is_interactive ? 0 : -1, .envp = shell_envp() };
+    int in_shell = cmd.builtin || (function_count && find_function(cmd.args[0]));
+    fflush(stdout);
+    out_flush();
+    pid_t pid = in_shell ? fork_builtin(&cmd, &io, NULL) : spawn_command(cmd.args, &io, NULL);
+    close(pipefd[WRITE_END]);
+    if (pid < 0) { close(pipefd[READ_END]); *status = 127; return 0; }
+
+    cache_capture_t capture = { NULL, 0, 0 };
+    *status = run_piped_job(pid, pipefd[READ_END], join_words(args, &line_arena), args[0], cache_capture_chunk, &capture);
+    out_flush();
+    *output = capture.data;
+    *len = capture.len;
+    if (*status < 0 || *status == 128 + SIGTSTP) { // Not started, or left as a stopped job: keep nothing
+        if (*status < 0) *status = 1;
+        return 0;
+    }
+    return *len <= CACHE_BYTES_MAX;
+}
+
+/**
+ * @brief Implements 'cache [--ttl SECONDS] [--env NAME]... [--disk] command [args]':
+ * run a read-only command once and replay its stdout and exit status afterwards
+ * without forking. The key is the argv, the working directory and the values of the
+ * --env variables. Results live in an in-process LRU; --disk also keeps them under
+ * $XDG_CACHE_HOME/cash for other shells. 'cache --stats' reports hits and misses,
+ * 'cache --clear' empties the in-process cache.
+ * @return The command's (cached) exit status, or 2 on a usage error.
+ */
+int builtin_cache(char **args) {
+    long ttl = 0;
+    int disk = 0, nenv = 0, nargs = 0, i = 1;
+    while (args[nargs]) nargs++;
+    char **env_names = arena_alloc(&line_arena, nargs * sizeof(char *)); // --env names (fewer than the arguments)
+
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "--") == 0) { i++; break; }
+        if (strcmp(args[i], "--disk") == 0) { disk = 1; continue; }
+        if (strcmp(args[i], "--stats") == 0) {
+            char line[160];
+            snprintf(line, sizeof(line), "cache: %ld hits (%ld from disk), %ld misses, %d entries, %zu bytes\n",
+                     result_cache.hits, result_cache.disk_hits, result_cache.misses, result_cache.count, result_cache.bytes);
+            out_puts(line); // Through builtin_out, so $(cache --stats) captures it
+            return 0;
+        }
+        if (strcmp(args[i], "--clear") == 0) {
+            while (result_cache.lru_head) result_cache_remove(result_cache.lru_head);
+            return 0;
+        }
+        if ((strcmp(args[i], "--ttl") == 0 || strcmp(args[i], "--env") == 0) && args[i + 1] == NULL) {
+            fprintf(stderr, "ca$h: cache: %s: option requires an argument\n", args[i]);
+            return 2;
+        }
+        if (strcmp(args[i], "--ttl") == 0) {
+            char *end;
+            ttl = strtol(args[++i], &end, 10);
+            if (*args[i] == '\0' || *end != '\0' || ttl < 1) { fprintf(stderr, "ca$h: cache: --ttl: %s: invalid number of seconds\n", args[i]); return 2; }
+            continue;
+        }
+        if (strcmp(args[i], "--env") == 0) { env_names[nenv++] = args[++i]; continue; }
+        fprintf(stderr, "ca$h: cache: %s: invalid option\n", args[i]);
+        break;
+    }
+    if (args[i] == NULL || args[i][0] == '-') {
+        fprintf(stderr, "ca$h: cache: Usage: cache [--ttl SECONDS] [--env NAME]... [--disk] command [args] | --stats | --clear\n");
+        return 2;
+    }
+    char **command = args + i;
+
+    // Key: argv, cwd and the selected environment values, each NUL-terminated
+    word_buf_t key = { NULL, 0, 0, &line_arena };
+    for (char **arg = command; *arg; arg++) word_buf_append(&key, *arg, strlen(*arg) + 1);
+    word_buf_append(&key, "", 1); // End of argv
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd))) word_buf_append(&key, cwd, strlen(cwd));
+    word_buf_append(&key, "", 1);
+    for (int e = 0; e < nenv; e++) {
+        const char *value = var_get(env_names[e]);
+        word_buf_append(&key, env_names[e], strlen(env_names[e]));
+        if (value) { word_buf_append(&key, "=", 1); word_buf_append(&key, value, strlen(value)); }
+        word_buf_append(&key, "", 1);
+    }
+    unsigned long hash = hash_name(key.data, key.len);
+
+    cache_entry_t *entry = result_cache_lookup(key.data, key.len, hash);
+    if (!entry && disk && (entry = cache_disk_load(key.data, key.len, hash))) result_cache.disk_hits++;
+    if (entry) { // Hit: replay the output, no process at all
+        result_cache.hits++;
+        out_write(entry->output, entry->len);
+        return entry->status;
+    }
+
+    result_cache.misses++;
+    char *output;
+    size_t len;
+    int status;
+    // Commands that did not finish on their own (Ctrl-C, killed) are not remembered
+    if (!cache_run_command(command, &output, &len, &status) || status > 128) { free(output); return status; }
+    entry = result_cache_insert(key.data, key.len, hash, output, len, status, ttl ? time(NULL) + ttl : 0);
+    if (entry && disk) cache_disk_store(entry);
+    return status;
+}
+
+// --- Tracing Functions ---
+
+static const char *const trace_phase_names[TRACE_PHASES] = { "parse", "expand", "spawn", "terminal", "wait", "reap", "builtin" };
+
+/**
+ * @brief Monotonic clock in nanoseconds.
+ */
+long long trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Start timing a phase. With tracing off this is one load and a branch.
+ * @return Start timestamp, or 0 when tracing is off (trace_end then does nothing).
+ */
+long long trace_start() {
+    return tracer.enabled ? trace_now() : 0;
+}
+
+/**
+ * @brief Write a string as the body of a JSON string literal.
+ * @return Bytes written (at most cap - 1; out is NUL-terminated).
+ */
+static size_t trace_json_escape(char *out, size_t cap, const char *str) {
+    size_t n = 0;
+    for (; *str && n + 7 < cap; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') { out[n++] = '\\'; out[n++] = c; }
+        else if (c < 0x20) n += snprintf(out + n, cap - n, "\\u%04x", c);
+        else out[n++] = c;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/**
+ * @brief Write the events recorded since the last flush to the CASH_TRACE file as
+ * Chrome trace events ("ph":"X", microsecond timestamps). A forked child's copy of
+ * the ring is dropped instead: those events are the shell's, and already on their way.
+ */
+void trace_flush() {
+    if (tracer.fd < 0 || getpid() != tracer.owner) { tracer.flushed = tracer.head; return; }
+    static char buf[TRACE_WRITE_CHUNK];
+    size_t len = 0;
+    if (tracer.head - tracer.flushed > TRACE_RING_SIZE) tracer.flushed = tracer.head - TRACE_RING_SIZE; // Lost to the ring
+    for (; tracer.flushed < tracer.head; tracer.flushed++) {
+        const trace_event_t *ev = &tracer.ring[tracer.flushed % TRACE_RING_SIZE];
+        char what[TRACE_NAME_MAX * 6 + 1];
+        trace_json_escape(what, sizeof(what), ev->what);
+        if (len + sizeof(what) + 256 > sizeof(buf)) { parallel_write(tracer.fd, buf, len); len = 0; }
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "%s{\"name\":\"%s\",\"cat\":\"cash\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"command\":\"%s\"}}",
+                        tracer.wrote_any ? ",\n" : "", trace_phase_names[ev->phase], ev->start_ns / 1e3, ev->dur_ns / 1e3,
+                        (int)tracer.owner, (int)tracer.owner, what);
+        tracer.wrote_any = 1;
+    }
+    if (len) parallel_write(tracer.fd, buf, len);
+}
+
+/**
+ * @brief Finish timing a phase: add it to the phase's histogram and to the event ring
+ * (flushed to the CASH_TRACE file when full).
+ * @param phase The phase.
+ * @param start Value from trace_start (0: tracing was off, nothing is recorded).
+ * @param what Command or job it belongs to (may be NULL).
+ */
+void trace_end(trace_phase_t phase, long long start, const char *what) {
+    if (!start || !tracer.enabled) return;
+    long long dur = trace_now() - start;
+    trace_hist_t *hist = &tracer.hist[phase];
+    int bucket = dur > 0 ? 64 - __builtin_clzll((unsigned long long)dur) : 0; // dur < 2^bucket ns
+    if (bucket >= TRACE_HIST_BUCKETS) bucket = TRACE_HIST_BUCKETS - 1;
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->total_ns += dur;
+    if (dur > hist->max_ns) hist->max_ns = dur;
+
+    if (tracer.fd >= 0 && tracer.head - tracer.flushed == TRACE_RING_SIZE) trace_flush();
+    trace_event_t *ev = &tracer.ring[tracer.head++ % TRACE_RING_SIZE];
+    ev->phase = phase;
+    ev->start_ns = start;
+    ev->dur_ns = dur;
+    snprintf(ev->what, sizeof(ev->what), "%s", what ? what : "");
+}
+
+/**
+ * @brief Write what is left in the ring and close the JSON array (atexit, 'trace off').
+ */
+void trace_close() {
+    if (tracer.fd < 0 || getpid() != tracer.owner) return;
+    trace_flush();
+    parallel_write(tracer.fd, "\n]\n", 3);
+    close(tracer.fd);
+    tracer.fd = -1;
+    free(tracer.path);
+    tracer.path = NULL;
+}
+
+/**
+ * @brief Turn tracing on, optionally writing Chrome trace-event JSON to a file
+ * (open it in chrome://tracing or Perfetto).
+ * @param path File to (re)create, or NULL to only fill the histograms and the ring.
+ * @return 1 on success, 0 if the file could not be created (reported; tracing stays off).
+ */
+int trace_enable(const char *path) {
+    if (path) {
+        trace_close();
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) { fprintf(stderr, "ca$h: trace: %s: %s\n", path, strerror(errno)); return 0; }
+        free(tracer.path);
+        tracer.path = strdup(path);
+        tracer.fd = fd;
+        tracer.wrote_any = 0;
+        tracer.flushed = tracer.head; // Earlier events are not part of this file
+        parallel_write(fd, "[\n", 2);
+        static int registered = 0;
+        if (!registered) { atexit(trace_close); registered = 1; }
+    }
+    tracer.owner = getpid();
+    tracer.enabled = 1;
+    return 1;
+}
+
+/**
+ * @brief Format a duration for 'stats' (ns, us, ms or s).
+ */
+static void trace_format_ns(char *out, size_t cap, double ns) {
+    if (ns < 1e3) snprintf(out, cap, "%.0f ns", ns);
+    else if (ns < 1e6) snprintf(out, cap, "%.1f us", ns / 1e3);
+    else if (ns < 1e9) snprintf(out, cap, "%.2f ms", ns / 1e6);
+    else snprintf(out, cap, "%.2f s", ns / 1e9);
+}
+
+/**
+ * @brief Implements 'trace [on [FILE] | off | show [N]]': turn the phase timers on or
+ * off (FILE gets Chrome trace-event JSON, like CASH_TRACE=FILE at startup), or list
+ * the last N events of the ring (default 20). Without arguments, prints the state.
+ * @return 0 on success, 1 if FILE cannot be created, 2 on a usage error.
+ */
+int builtin_trace(char **args) {
+    if (args[1] == NULL) {
+        printf("trace: %s%s%s, %lu events recorded\n", tracer.enabled ? "on" : "off",
+               tracer.fd >= 0 ? ", writing " : "", tracer.fd >= 0 ? tracer.path : "", tracer.head);
+        return 0;
+    }
+    if (strcmp(args[1], "on") == 0 && (args[2] == NULL || args[3] == NULL)) return trace_enable(args[2]) ? 0 : 1;
+    if (strcmp(args[1], "off") == 0 && args[2] == NULL) {
+        trace_close();
+        tracer.enabled = 0;
+        return 0;
+    }
+    if (strcmp(args[1], "show") == 0 && (args[2] == NULL || args[3] == NULL)) {
+        char *end;
+        long count = args[2] ? strtol(args[2], &end, 10) : 20;
+        if (args[2] && (*args[2] == '\0' || *end != '\0' || count < 0)) { fprintf(stderr, "ca$h: trace: %s: invalid count\n", args[2]); return 2; }
+        unsigned long kept = tracer.head < TRACE_RING_SIZE ? tracer.head : TRACE_RING_SIZE;
+        if ((unsigned long)count > kept) count = kept;
+        long long base = count ? tracer.ring[(tracer.head - count) % TRACE_RING_SIZE].start_ns : 0;
+        for (unsigned long i = tracer.head - count; i < tracer.head; i++) {
+            const trace_event_t *ev = &tracer.ring[i % TRACE_RING_SIZE];
+            char dur[32];
+            trace_format_ns(dur, sizeof(dur), ev->dur_ns);
+            printf("%+10.3f ms  %-8s  %10s  %s\n", (ev->start_ns - base) / 1e6, trace_phase_names[ev->phase], dur, ev->what);
+        }
+        return 0;
+    }
+    fprintf(stderr, "ca$h: trace: Usage: trace [on [FILE] | off | show [N]]\n");
+    return 2;
+}
+
+/**
+ * @brief Implements 'stats [-v] [-r]': count, mean, p99 and max of every traced phase
+ * (-v adds the log2 histogram, -r clears them afterwards). The p99 is the upper
+ * bound of the histogram bucket it falls in.
+ * @return 0, or 2 on a usage error.
+ */
+int builtin_stats(char **args) {
+    int verbose = 0, reset = 0;
+    for (int i = 1; args[i]; i++) {
+        if (strcmp(args[i], "-v") == 0) verbose = 1;
+        else if (strcmp(args[i], "-r") == 0) reset = 1;
+        else { fprintf(stderr, "ca$h: stats: Usage: stats [-v] [-r]\n"); return 2; }
+    }
+    if (!tracer.enabled && tracer.head == 0) {
+        fprintf(stderr, "ca$h: stats: nothing recorded (turn tracing on with 'trace on' or CASH_TRACE=file)\n");
+        return 0;
+    }
+    printf("%-9s %9s %10s %10s %10s %10s\n", "phase", "count", "mean", "p99", "max", "total");
+    for (int p = 0; p < TRACE_PHASES; p++) {
+        const trace_hist_t *hist = &tracer.hist[p];
+        if (hist->count == 0) continue;
+        long seen = 0, rank = hist->count - hist->count / 100; // 99% of the samples are at or below
+        int b = 0;
+        while (b < TRACE_HIST_BUCKETS - 1 && (seen += hist->buckets[b]) < rank) b++;
+        double p99 = (double)(1ULL << b);
+        if (p99 > hist->max_ns) p99 = hist->max_ns;
+        char mean[32], p99s[32], max[32], total[32];
+        trace_format_ns(mean, sizeof(mean), (double)hist->total_ns / hist->count);
+        trace_format_ns(p99s, sizeof(p99s), p99);
+        trace_format_ns(max, sizeof(max), hist->max_ns);
+        trace_format_ns(total, sizeof(total), hist->total_ns);
+        printf("%-9s %9ld %10s %10s %10s %10s\n", trace_phase_names[p], hist->count, mean, p99s, max, total);
+        if (!verbose) continue;
+        long peak = 0;
+        for (b = 0; b < TRACE_HIST_BUCKETS; b++) if (hist->buckets[b] > peak) peak = hist->buckets[b];
+        for (b = 0; b < TRACE_HIST_BUCKETS; b++) {
+            if (!hist->buckets[b]) continue;
+            char bound[32];
+            trace_format_ns(bound, sizeof(bound), (double)(1ULL << b));
+            int width = (int)(40 * hist->buckets[b] / peak);
+            printf("  < %-9s %9ld %.*s\n", bound, hist->buckets[b], width ? width : 1, "########################################");
+        }
+    }
+    fflush(stdout);
+    if (reset) memset(tracer.hist, 0, sizeof(tracer.hist));
+    return 0;
+}
+
+// --- Resource Limit Functions ---
+
+/**
+ * @brief The cgroup v2 directory the shell was started in: the cgroup2 mount from
+ * /proc/self/mountinfo plus the "0::" line of /proc/self/cgroup. Looked up once.
+ * @param is_root Set to 1 if that is the root of the hierarchy.
+ * @return The path, or NULL if there is no cgroup v2 hierarchy.
+ */
+static const char* cgroup_home(int *is_root) {
+    static char *home;
+    static int looked_up, root;
+    if (looked_up) { *is_root = root; return home; }
+    looked_up = 1;
+
+    char line[PATH_MAX], mount[PATH_MAX] = "", own[PATH_MAX] = "";
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        // "id parent major:minor root mountpoint options... - fstype source options"
+        char *sep = strstr(line, " - ");
+        if (!sep || strncmp(sep + 3, "cgroup2 ", 8) != 0) continue;
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mount) == 1) break;
+    }
+    if (f) fclose(f);
+    f = fopen("/proc/self/cgroup", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(own, sizeof(own), "%s", line + 3);
+        break;
+    }
+    if (f) fclose(f);
+    if (!*mount) return NULL;
+    root = *own == '\0' || strcmp(own, "/") == 0;
+    size_t len = strlen(mount) + strlen(own) + 1;
+    home = malloc(len);
+    if (home) snprintf(home, len, "%s%s", mount, root ? "" : own);
+    *is_root = root;
+    return home;
+}
+
+/**
+ * @brief Directory new job cgroups go under: $CASH_CGROUP if set, else the cgroup the
+ * shell was started in (see cgroup_leave_parent).
+ * @return The path, or NULL if there is no cgroup v2 hierarchy.
+ */
+static const char* cgroup_parent() {
+    const char *configured = var_get("CASH_CGROUP");
+    if (configured && *configured) return configured;
+    int is_root;
+    return cgroup_home(&is_root);
+}
+
+/**
+ * @brief Write a value to a cgroup control file.
+ * @return 1 on success, 0 on failure (errno set).
+ */
+static int cgroup_write(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = write(fd, value, strlen(value));
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return n == (ssize_t)strlen(value);
+}
+
+/**
+ * @brief Is word one of the space-separated words of a cgroup file (cgroup.controllers,
+ * cgroup.subtree_control)?
+ */
+static int cgroup_has_word(const char *dir, const char *file, const char *word) {
+    char path[PATH_MAX], text[512] = "";
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    text[n > 0 ? n : 0] = '\0';
+    close(fd);
+    for (char *w = strtok(text, " \n"); w; w = strtok(NULL, " \n")) {
+        if (strcmp(w, word) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Move the shell out of the cgroup its job cgroups go under, into a leaf child
+ * of it (cash-PID.shell), so the job cgroups become its siblings. Done once, and
+ * only when that cgroup is the one the shell was started in and not the root.
+ * @param dir Parent of the job cgroups.
+ * @return 1 if the shell is not (or no longer) in dir, 0 if it could not move (reported).
+ */
+static int cgroup_leave_parent(const char *dir) {
+    static int moved;
+    int is_root;
+    const char *home = cgroup_home(&is_root);
+    if (moved || !home || is_root || strcmp(dir, home) != 0) return 1;
+    char leaf[PATH_MAX];
+    snprintf(leaf, sizeof(leaf), "%s/cash-%d.shell", dir, (int)getpid());
+    // OS Concept: Control Groups - "No internal processes": a non-root cgroup can hold
+    // processes or hand controllers to its children, not both. The shell becomes a leaf.
+    if ((mkdir(leaf, 0755) < 0 && errno != EEXIST) || !cgroup_write(leaf, "cgroup.procs", "0")) {
+        fprintf(stderr, "ca$h: limit: cannot move the shell into %s: %s (set CASH_CGROUP to a delegated cgroup)\n",
+                leaf, strerror(errno));
+        rmdir(leaf);
+        return 0;
+    }
+    moved = 1;
+    return 1;
+}
+
+/**
+ * @brief Make sure a controller is enabled for the children of a cgroup. When enabling
+ * it, the shell first leaves the cgroup if it is in it (cgroup_leave_parent).
+ * @return 1 if it is, 0 if it could not be enabled (reported).
+ */
+static int cgroup_enable_controller(const char *dir, const char *controller) {
+    if (cgroup_has_word(dir, "cgroup.subtree_control", controller)) return 1;
+    if (!cgroup_has_word(dir, "cgroup.controllers", controller)) {
+        fprintf(stderr, "ca$h: limit: the %s controller is not available in %s\n", controller, dir);
+        return 0;
+    }
+    if (!cgroup_leave_parent(dir)) return 0;
+    char request[32];
+    snprintf(request, sizeof(request), "+%s", controller);
+    if (cgroup_write(dir, "cgroup.subtree_control", request)) return 1;
+    const char *why = errno == EBUSY ? " (other processes are still in it; set CASH_CGROUP to a delegated cgroup)"
+                                     : " (set CASH_CGROUP to a delegated cgroup)";
+    fprintf(stderr, "ca$h: limit: cannot enable the %s controller in %s: %s%s\n", controller, dir, strerror(errno), why);
+    return 0;
+}
+
+/**
+ * @brief Get a 'limit' pipeline ready to launch: create its cgroup (cash-PID.N under
+ * cgroup_parent) with memory.max and cpu.max, and open its cgroup.procs for the
+ * children to join. rlimits need nothing here; each child sets them itself.
+ * @param limits The pipeline's limits.
+ * @param launch Output launch state (cgroup = NULL, procs_fd = -1 without a cgroup).
+ * @return 1 on success, 0 if the cgroup could not be set up (reported).
+ */
+int limits_prepare(const job_limits_t *limits, limit_launch_t *launch) {
+    static int sequence;
+    launch->limits = limits;
+    launch->cgroup = NULL;
+    launch->procs_fd = -1;
+    if (!limits->cgroup) return 1;
+
+    const char *parent = cgroup_parent();
+    if (!parent) { fprintf(stderr, "ca$h: limit: no cgroup v2 hierarchy is mounted\n"); return 0; }
+    if ((limits->memory_max && !cgroup_enable_controller(parent, "memory")) ||
+        (limits->cpu_percent && !cgroup_enable_controller(parent, "cpu"))) return 0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cash-%d.%d", parent, (int)getpid(), ++sequence);
+    // OS Concept: Control Groups - A directory in the cgroup2 filesystem is a new group;
+    // its control files limit, and account for, every process moved into it.
+    if (mkdir(path, 0755) < 0) { fprintf(stderr, "ca$h: limit: cannot create cgroup %s: %s\n", path, strerror(errno)); return 0; }
+    char value[64];
+    int ok = 1;
+    if (ok && limits->memory_max) {
+        snprintf(value, sizeof(value), "%lld", limits->memory_max);
+        ok = cgroup_write(path, "memory.max", value);
+    }
+    if (ok && limits->cpu_percent) { // Quota per period: 50 means half of one CPU, 200 two CPUs
+        snprintf(value, sizeof(value), "%lld %d", limits->cpu_percent * CGROUP_CPU_PERIOD_US / 100, CGROUP_CPU_PERIOD_US);
+        ok = cgroup_write(path, "cpu.max", value);
+    }
+    if (ok) {
+        char procs[PATH_MAX + 16];
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+        launch->procs_fd = open(procs, O_WRONLY | O_CLOEXEC);
+        ok = launch->procs_fd >= 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "ca$h: limit: cannot configure cgroup %s: %s\n", path, strerror(errno));
+        rmdir(path);
+        return 0;
+    }
+    launch->cgroup = strdup(path);
+    return 1;
+}
+
+/**
+ * @brief Hand the launched pipeline's cgroup to its job, which reads the totals from it
+ * and removes it once the job has finished.
+ */
+void limits_adopt(job_t *job) {
+    if (!active_limits || !active_limits->cgroup || job->cgroup) return;
+    job->cgroup = active_limits->cgroup;
+    active_limits->cgroup = NULL;
+}
+
+/**
+ * @brief Done launching a 'limit' pipeline: close cgroup.procs, and remove the cgroup
+ * if no job took it (the command could not be started).
+ */
+void limits_release(limit_launch_t *launch) {
+    if (launch->procs_fd >= 0) close(launch->procs_fd);
+    launch->procs_fd = -1;
+    if (launch->cgroup) { rmdir(launch->cgroup); free(launch->cgroup); }
+    launch->cgroup = NULL;
+}
+
+/**
+ * @brief In a freshly forked child, before exec: apply the rlimits and join the job's
+ * cgroup, so the program and everything it starts run limited from the first
+ * instruction. A soft limit is never raised above the hard limit already in force.
+ * @param launch The pipeline's launch state, or NULL.
+ * @return 1 on success, 0 if the child must not run (reported).
+ */
+int limits_apply_child(const limit_launch_t *launch) {
+    if (!launch) return 1;
+    const job_limits_t *limits = launch->limits;
+    const struct { int resource; long long value; const char *name; } wanted[] = {
+        { RLIMIT_CPU, limits->cpu_seconds, "CPU time" },
+        { RLIMIT_AS, limits->address_space, "address space" },
+        { RLIMIT_NOFILE, limits->open_files, "open files" },
+    };
+    for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++) {
+        if (wanted[i].value <= 0) continue;
+        struct rlimit rl;
+        if (getrlimit(wanted[i].resource, &rl) < 0) continue;
+        rlim_t value = (rlim_t)wanted[i].value;
+        if (rl.rlim_max != RLIM_INFINITY && value > rl.rlim_max) value = rl.rlim_max;
+        rl.rlim_cur = value;
+        // CPU: the hard limit a second later, so the program gets SIGXCPU before SIGKILL
+        rlim_t hard = wanted[i].resource == RLIMIT_CPU ? value + 1 : value;
+        if (rl.rlim_max == RLIM_INFINITY || hard < rl.rlim_max) rl.rlim_max = hard;
+        // OS Concept: Resource Limits - Inherited across fork and exec, enforced by the kernel
+        if (setrlimit(wanted[i].resource, &rl) < 0) { fprintf(stderr, "ca$h: limit: %s: %s\n", wanted[i].name, strerror(errno)); return 0; }
+    }
+    // Writing "0" to cgroup.procs moves the writing process
+    if (launch->procs_fd >= 0 && write(launch->procs_fd, "0", 1) != 1) {
+        fprintf(stderr, "ca$h: limit: cannot join cgroup %s: %s\n", launch->cgroup, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read one "key value" number from a cgroup file such as cpu.stat, or the whole
+ * file as a number when key is NULL (memory.peak).
+ * @return The value, or -1 if it is not there.
+ */
+static long long cgroup_read_value(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX], text[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    text[n] = '\0';
+    if (!key) return isdigit((unsigned char)text[0]) ? strtoll(text, NULL, 10) : -1;
+    size_t key_len = strlen(key);
+    for (char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ') return strtoll(line + key_len + 1, NULL, 10);
+    }
+    return -1;
+}
+
+/**
+ * @brief A job with a cgroup has finished: take its totals from the cgroup (CPU time of
+ * every process that ran in it, grandchildren included, and the peak memory of the
+ * whole group), then remove the cgroup.
+ */
+void job_cgroup_collect(job_t *job) {
+    if (!job->cgroup) return;
+    long long user = cgroup_read_value(job->cgroup, "cpu.stat", "user_usec");
+    long long system = cgroup_read_value(job->cgroup, "cpu.stat", "system_usec");
+    if (user >= 0 && system >= 0) {
+        job->usage.cgroup_user = (struct timeval){ user / 1000000, user % 1000000 };
+        job->usage.cgroup_system = (struct timeval){ system / 1000000, system % 1000000 };
+        job->usage.cgroup = 1;
+    }
+    long long peak = cgroup_read_value(job->cgroup, "memory.peak", NULL);
+    job->usage.cgroup_peak_kb = peak >= 0 ? peak / 1024 : -1;
+    if (rmdir(job->cgroup) < 0 && errno != ENOENT) {
+        fprintf(stderr, "ca$h: limit: cgroup %s left behind: %s\n", job->cgroup, strerror(errno)); // A daemon is still in it
+    }
+    free(job->cgroup);
+    job->cgroup = NULL;
+}
+
+// --- Coprocess Functions ---
+
+/**
+ * @brief Look up a running (or finished but not closed) coprocess by name.
+ * @param name Name (not NUL-terminated).
+ * @param len Length of name.
+ * @return The coprocess, or NULL.
+ */
+coproc_t* coproc_find(const char *name, size_t len) {
+    for (int i = 0; i < coprocs.count; i++) {
+        if (strlen(coprocs.items[i].name) == len && strncmp(coprocs.items[i].name, name, len) == 0) return &coprocs.items[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Close the shell's ends of a coprocess (it sees end of input), unset NAME and
+ * NAME_PID, and forget it. The process itself stays a job until it exits.
+ */
+static void coproc_close(coproc_t *co) {
+    close(co->read_fd);
+    close(co->write_fd);
+    char pid_name[256];
+    snprintf(pid_name, sizeof(pid_name), "%s_PID", co->name);
+    shell_var_t *var = var_lookup(co->name, strlen(co->name));
+    if (var) var_unset(var);
+    if ((var = var_lookup(pid_name, strlen(pid_name)))) var_unset(var);
+    free(co->name);
+    *co = coprocs.items[--coprocs.count];
+}
+
+/**
+ * @brief Implements 'coproc NAME command [args]': start the command once as a background
+ * job with its stdin and stdout on pipes that stay open in the shell, so a script can
+ * talk to one long-lived worker instead of starting a process per request.
+ * ${NAME[1]} is the descriptor that writes its input, ${NAME[0]} (also $NAME) the one
+ * that reads its output, $NAME_PID its pid:
+ *     echo query >&${NAME[1]}; read -u ${NAME[0]} answer
+ * 'coproc' lists the coprocesses, 'coproc -c NAME' closes the pipes (the worker gets
+ * end of input) and forgets it.
+ * @return 0 on success, 1 on failure, 2 on a usage error.
+ */
+int builtin_coproc(char **args) {
+    if (args[1] == NULL) {
+        for (int i = 0; i < coprocs.count; i++) {
+            const coproc_t *co = &coprocs.items[i];
+            printf("%s\tpid %d\tread %d\twrite %d\t%s\n", co->name, (int)co->pid, co->read_fd, co->write_fd,
+                   kill(co->pid, 0) == 0 ? "running" : "exited");
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-c") == 0 && args[2] && !args[3]) {
+        coproc_t *co = coproc_find(args[2], strlen(args[2]));
+        if (!co) { fprintf(stderr, "ca$h: coproc: %s: no such coprocess\n", args[2]); return 1; }
+        coproc_close(co);
+        return 0;
+    }
+    if (args[2] == NULL || args[1][0] == '-' || !is_valid_name(args[1], strlen(args[1])) || strlen(args[1]) > 200) {
+        fprintf(stderr, "ca$h: coproc: Usage: coproc NAME command [args] | coproc -c NAME | coproc\n");
+        return 2;
+    }
+    const char *name = args[1];
+    coproc_t *old = coproc_find(name, strlen(name));
+    if (old && kill(old->pid, 0) == 0) { fprintf(stderr, "ca$h: coproc: %s: already running (pid %d)\n", name, (int)old->pid); return 1; }
+    if (old) coproc_close(old);
+    if (coprocs.count == coprocs.capacity) {
+        int capacity = coprocs.capacity ? coprocs.capacity * 2 : 4;
+        coproc_t *items = realloc(coprocs.items, capacity * sizeof(coproc_t));
+        if (!items) { perror("ca$h: coproc: realloc failed"); return 1; }
+        coprocs.items = items;
+        coprocs.capacity = capacity;
+    }
+
+    command_t cmd;
+    command_init(&cmd, &line_arena);
+    for (int i = 2; args[i]; i++) command_add_arg(&cmd, &line_arena, args[i]);
+    cmd.builtin = find_builtin(cmd.args[0]);
+
+    // OS Concept: Inter-Process Communication - Two pipes: shell -> worker stdin, worker stdout -> shell.
+    // The shell's ends move to fds >= 10 with close-on-exec, so no other command inherits them.
+    int to_child[2], from_child[2];
+    if (pipe(to_child) < 0) { perror("ca$h: coproc: pipe failed"); return 1; }
+    if (pipe(from_child) < 0) { perror("ca$h: coproc: pipe failed"); close(to_child[0]); close(to_child[1]); return 1; }
+    int write_fd = move_fd_high(to_child[WRITE_END]), read_fd = move_fd_high(from_child[READ_END]);
+    if (write_fd < 0 || read_fd < 0) {
+        perror("ca$h: coproc: fcntl failed");
+        close(to_child[READ_END]); close(from_child[WRITE_END]);
+        if (write_fd >= 0) close(write_fd);
+        if (read_fd >= 0) close(read_fd);
+        return 1;
+    }
+    spawn_io_t io = { .stdin_fd = to_child[READ_END], .stdout_fd = from_child[WRITE_END], .close_fd = write_fd,
+                      .pgid = shell_is_interactive ? 0 : -1, .envp = shell_envp() };
+    int in_shell = cmd.builtin || (function_count && find_function(cmd.args[0]));
+    fflush(stdout);
+    out_flush();
+    pid_t pid = in_shell ? fork_builtin(&cmd, &io, NULL) : spawn_command(cmd.args, &io, NULL);
+    close(to_child[READ_END]);
+    close(from_child[WRITE_END]);
+    if (pid < 0) { close(write_fd); close(read_fd); return 1; }
+
+    // OS Concept: Job Tracking - The worker is a background job like `cmd &`
+    job_t *job = create_child_job(pid, join_words(args + 2, &line_arena), args[2], 1);
+    if (!job) {
+        close(write_fd);
+        close(read_fd);
+        return 1;
+    }
+    last_background_pid = pid;
+    if (shell_is_interactive) printf("[%d] %d\n", job->jid, job->pgid);
+
+    coproc_t *co = &coprocs.items[coprocs.count++];
+    co->name = strdup(name);
+    co->pid = pid;
+    co->read_fd = read_fd;
+    co->write_fd = write_fd;
+    char value[24], pid_name[256];
+    snprintf(value, sizeof(value), "%d", read_fd);
+    var_set(name, value);
+    snprintf(pid_name, sizeof(pid_name), "%s_PID", name);
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    var_set(pid_name, value);
+    return 0;
+}
+
+/**
+ * @brief Read one line for 'read' without taking more than that from the descriptor,
+ * so the next reader (or command) starts right after it. A seekable file is read in
+ * blocks and the offset moved back to just past the newline; a pipe or terminal (a
+ * coprocess's output) is read byte by byte. Without raw, backslash-newline joins lines.
+ * @param fd Descriptor to read.
+ * @param line Buffer receiving the line (without its newline).
+ * @param raw 1 for -r.
+ * @return 1 if a newline ended the line, 0 at end of input (line may hold a partial line),
+ * -1 if read() failed (errno tells why).
+ */
+static int read_line_fd(int fd, word_buf_t *line, int raw) {
+    char block[4096];
+    int seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    while (1) {
+        ssize_t n = read(fd, block, seekable ? sizeof(block) : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return 0;
+        char *newline = memchr(block, '\n', n);
+        size_t take = newline ? (size_t)(newline - block) : (size_t)n;
+        if (newline && seekable && newline + 1 < block + n) lseek(fd, (newline + 1) - (block + n), SEEK_CUR);
+        word_buf_append(line, block, take);
+        if (!newline) continue;
+        // An unescaped backslash right before the newline continues the line
+        size_t backslashes = 0;
+        while (!raw && backslashes < line->len && line->data[line->len - 1 - backslashes] == '\\') backslashes++;
+        if (backslashes % 2 == 0) return 1;
+        line->data[--line->len] = '\0';
+    }
+}
+
+/**
+ * @brief Implements 'read [-r] [-u FD] [NAME...]': read one line from stdin (or FD)
+ * and assign its fields, split at $IFS, to the names; the last name gets the rest
+ * of the line. Without names the whole line goes to REPLY. Backslash escapes the
+ * next character unless -r is given.
+ * @return 0 if a line was read, 1 at end of input, 2 on a usage error.
+ */
+int builtin_read(char **args) {
+    int raw = 0, fd = STDIN_FILENO, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        if (strcmp(args[i], "--") == 0) { i++; break; }
+        if (strcmp(args[i], "-r") == 0) { raw = 1; continue; }
+        if (strcmp(args[i], "-u") == 0 && args[i + 1]) {
+            char *end;
+            long value = strtol(args[++i], &end, 10);
+            if (*args[i] == '\0' || *end != '\0' || value < 0 || value > INT_MAX) { fprintf(stderr, "ca$h: read: %s: invalid file descriptor\n", args[i]); return 2; }
+            fd = (int)value;
+            continue;
+        }
+        fprintf(stderr, "ca$h: read: Usage: read [-r] [-u FD] [NAME...]\n");
+        return 2;
+    }
+    for (int n = i; args[n]; n++) {
+        if (!is_valid_name(args[n], strlen(args[n]))) { fprintf(stderr, "ca$h: read: `%s': not a valid identifier\n", args[n]); return 2; }
+    }
+
+    fflush(stdout);
+    out_flush(); // A prompt printed before the read shows up first
+    word_buf_t line = { NULL, 0, 0, &line_arena };
+    word_buf_append(&line, "", 0);
+    int complete = read_line_fd(fd, &line, raw);
+    if (complete < 0) {
+        fprintf(stderr, "ca$h: read: %d: %s\n", fd, strerror(errno));
+        return 1;
+    }
+
+    if (args[i] == NULL) { // REPLY: the line as read, escapes removed
+        char *out = line.data;
+        for (const char *p = line.data; *p; p++) {
+            if (!raw && *p == '\\' && p[1]) p++;
+            *out++ = *p;
+        }
+        *out = '\0';
+        var_set("REPLY", line.data);
+        return complete ? 0 : 1;
+    }
+
+    const char *ifs = var_get("IFS");
+    if (!ifs) ifs = " \t\n";
+    const char *p = line.data;
+    for (; args[i]; i++) {
+        while (*p && strchr(ifs, *p) && isspace((unsigned char)*p)) p++; // IFS whitespace before a field
+        word_buf_t field = { NULL, 0, 0, &line_arena };
+        word_buf_append(&field, "", 0);
+        size_t keep = 0; // Length up to the last character that is not trailing IFS whitespace
+        int last = args[i + 1] == NULL;
+        while (*p) {
+            if (!raw && *p == '\\' && p[1]) { word_buf_append(&field, p + 1, 1); p += 2; keep = field.len; continue; }
+            if (strchr(ifs, *p)) {
+                if (!last) { p++; break; } // A separator ends the field
+                if (!isspace((unsigned char)*p)) keep = field.len + 1;
+            } else {
+                keep = field.len + 1;
+            }
+            word_buf_append(&field, p++, 1);
+        }
+        field.data[keep] = '\0';
+        var_set(args[i], field.data);
+    }
+    return complete ? 0 : 1;
+}
+
+// --- Command List Functions ---
+
+/**
+ * @brief Append an empty pipeline to a command list, growing it in the arena.
+ * @param list The list.
+ * @param arena Arena the list lives in.
+ * @return Pointer to the new pipeline (initialized by parse_pipeline).
+ */
+pipeline_t* command_list_add(command_list_t *list, arena_t *arena) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 4;
+        pipeline_t *new_items = arena_alloc(arena, new_capacity * sizeof(pipeline_t));
+        if (list->count) memcpy(new_items, list->items, list->count * sizeof(pipeline_t));
+        list->items = new_items;
+        list->capacity = new_capacity;
+    }
+    return &list->items[list->count++];
+}
+
+/**
+ * @brief Run a parsed command list. Each && / || list (up to the next ';' or '&') runs
+ * in order, deciding from each pipeline's exit status whether the next one runs.
+ * An interactive list stops when a foreground job is killed by Ctrl+C.
+ * @param list The list (from parse_command_list).
+ * @return Exit status of the last pipeline that ran.
+ */
+int execute_command_list(command_list_t *list) {
+    int status = 0;
+    for (int first = 0; first < list->count; ) {
+        int last = first;
+        while (list->items[last].next == CONNECT_AND || list->items[last].next == CONNECT_OR) last++;
+        if (list->items[last].group_command) {
+            status = run_background_group(list, first, last);
+            pipestatus.count = 0;
+            pipestatus_push(status);
+            last_status = status;
+        } else {
+            status = execute_and_or(list, first, last);
+        }
+        if (shell_is_interactive && status == 128 + SIGINT) break;
+        if (control_pending()) break; // break / continue / return: skip the rest
+        first = last + 1;
+    }
+    return status;
+}
+
+/**
+ * @brief Run the pipelines first..last of a list joined by && / ||, left to right.
+ * @return Exit status of the last pipeline that ran.
+ */
+int execute_and_or(command_list_t *list, int first, int last) {
+    int status = 0;
+    for (int i = first; i <= last; i++) {
+        if (i > first) {
+            connector_t op = list->items[i - 1].next;
+            if ((op == CONNECT_AND && status != 0) || (op == CONNECT_OR && status == 0)) continue;
+        }
+        // Scripts have no event loop: collect finished background jobs between commands
+        if (!shell_is_interactive && job_table.count > 0) reap_children();
+        status = execute_pipeline(&list->items[i]);
+        if (shell_is_interactive && status == 128 + SIGINT) break;
+        if (control_pending()) break;
+    }
+    return status;
+}
+
+/**
+ * @brief Run an && / || list in the background ('a && b &'). The list decides what
+ * runs next from exit statuses, so it needs a process of its own: a forked copy of
+ * the shell evaluates it non-interactively and becomes a single job here.
+ * @return 0, or 1 if the subshell could not be started.
+ */
+int run_background_group(command_list_t *list, int first, int last) {
+    const char *title = list->items[last].group_command;
+    fflush(stdout);
+    // OS Concept: Process Creation - A subshell is a fork of the shell itself.
+    pid_t pid = fork();
+    if (pid < 0) { perror("ca$h: fork failed for background list"); return 1; }
+    if (pid == 0) {
+        if (shell_is_interactive && setpgid(0, 0) < 0) { perror("ca$h: child setpgid failed"); _exit(EXIT_FAILURE); }
+        reset_child_signals();
+        shell_is_interactive = 0; // Its commands stay in its process group
+        int status = execute_and_or(list, first, last);
+        fflush(stdout);
+        out_flush();
+        _exit(status);
+    }
+    if (shell_is_interactive) setpgid(pid, pid); // Avoid racing the child's own setpgid
+    last_background_pid = pid;
+
+    const command_t *lead = &list->items[first].stages[0];
+    job_t *job = create_job(title, 1);
+    if (!job || !job_add_process(job, pid, lead->argc ? lead->args[0] : "")) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if (job) { job->foreground = 1; wait_for_job(job); } // Drops the job
+        return 1;
+    }
+    if (shell_is_interactive) printf("[%d] %d\n", job->jid, job->pgid);
+    return 0;
 }
 
 //compiling the shell on mac: gcc cash.c -o cash -I/opt/homebrew/include -L/opt/homebrew/lib -lreadline -Wall
-//then execute with ./cash
\ No newline at end of file
+//then execute with ./cash
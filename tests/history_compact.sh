@@ -0,0 +1,45 @@
+#!/bin/sh
+# Lines typed while a history compaction is running must survive the compaction.
+# A history file past HISTORY_COMPACT_BYTES makes the shell start a compactor at
+# startup; the commands below are typed while it copies the file.
+CASH=${CASH:-./cash}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+HOME=$dir python3 - "$CASH" "$dir/.cash_history" <<'PY' || exit 1
+import os, pty, select, sys, time
+cash, history = sys.argv[1], sys.argv[2]
+with open(history, "w") as f:
+    f.write(("echo " + "x" * 190 + "\n") * 200000) # ~38 MB, 200000 entries
+
+def drain(fd, seconds):
+    end = time.time() + seconds
+    while time.time() < end:
+        if select.select([fd], [], [], 0.05)[0]:
+            try: os.read(fd, 65536)
+            except OSError: return
+pid, fd = pty.fork()
+if pid == 0:
+    os.environ["TERM"] = "dumb"
+    os.execv(cash, [cash])
+for i in range(1, 6):
+    os.write(fd, b"echo typed-during-compaction-%d\r" % i)
+    drain(fd, 0.01)
+os.write(fd, b"exit\r")
+drain(fd, 10)
+os.waitpid(pid, 0)
+PY
+
+# The compactor may outlive the shell: wait until the file has been replaced
+for i in $(seq 50); do
+    [ "$(wc -l < "$dir/.cash_history")" -le 100010 ] && break
+    sleep 0.2
+done
+fail=0
+for i in 1 2 3 4 5; do
+    grep -qx "echo typed-during-compaction-$i" "$dir/.cash_history" || { echo "FAIL: line $i was lost"; fail=1; }
+done
+lines=$(wc -l < "$dir/.cash_history")
+[ "$lines" -le 100010 ] || { echo "FAIL: history was not compacted ($lines lines)"; fail=1; }
+[ $fail -eq 0 ] && echo "PASS: history_compact"
+exit $fail
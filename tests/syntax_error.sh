@@ -0,0 +1,24 @@
+#!/bin/sh
+# A non-interactive shell stops at the first syntax error with status 2, whether the
+# script comes from stdin, a file or -c, and whether the error is a stray word or an
+# unfinished construct.
+CASH=${CASH:-./cash}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+check() { # name expected-output status
+    if [ "$2" != "a" ] || [ "$3" -ne 2 ]; then echo "FAIL: $1: output '$2', status $3"; fail=1; fi
+}
+
+printf 'echo a\nfi\necho c\n' > "$dir/stray.sh"
+printf 'echo a\nif true; then\n  echo b\necho c\n' > "$dir/open.sh"
+for script in stray open; do
+    out=$("$CASH" < "$dir/$script.sh" 2>/dev/null); check "$script (stdin)" "$out" $?
+    out=$("$CASH" "$dir/$script.sh" < /dev/null 2>/dev/null); check "$script (file)" "$out" $?
+    out=$("$CASH" -c "$(cat "$dir/$script.sh")" < /dev/null 2>/dev/null); check "$script (-c)" "$out" $?
+done
+out=$("$CASH" -c "echo a; source $dir/stray.sh > /dev/null; echo c" < /dev/null 2>/dev/null); check "source" "$out" $?
+
+[ $fail -eq 0 ] && echo "PASS: syntax_error"
+exit $fail